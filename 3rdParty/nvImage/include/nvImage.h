@@ -20,12 +20,19 @@
 #else
 #define NVSDKENTRY __declspec(dllimport)
 #endif
+#else
+#define NVSDKENTRY
 #endif
 
 #include <vector>
 #include <assert.h>
 
+#ifdef _WIN32
 #include <GL/glew.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
 
 namespace nv {
 
@@ -14,6 +14,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
+#include <string.h>
 
 #include "nvImage.h"
 
@@ -28,97 +29,97 @@ namespace nv {
 //////////////////////////////////////////////////////////////////////
 
 // surface description flags
-const unsigned long DDSF_CAPS           = 0x00000001l;
-const unsigned long DDSF_HEIGHT         = 0x00000002l;
-const unsigned long DDSF_WIDTH          = 0x00000004l;
-const unsigned long DDSF_PITCH          = 0x00000008l;
-const unsigned long DDSF_PIXELFORMAT    = 0x00001000l;
-const unsigned long DDSF_MIPMAPCOUNT    = 0x00020000l;
-const unsigned long DDSF_LINEARSIZE     = 0x00080000l;
-const unsigned long DDSF_DEPTH          = 0x00800000l;
+const unsigned int DDSF_CAPS           = 0x00000001l;
+const unsigned int DDSF_HEIGHT         = 0x00000002l;
+const unsigned int DDSF_WIDTH          = 0x00000004l;
+const unsigned int DDSF_PITCH          = 0x00000008l;
+const unsigned int DDSF_PIXELFORMAT    = 0x00001000l;
+const unsigned int DDSF_MIPMAPCOUNT    = 0x00020000l;
+const unsigned int DDSF_LINEARSIZE     = 0x00080000l;
+const unsigned int DDSF_DEPTH          = 0x00800000l;
 
 // pixel format flags
-const unsigned long DDSF_ALPHAPIXELS    = 0x00000001l;
-const unsigned long DDSF_FOURCC         = 0x00000004l;
-const unsigned long DDSF_RGB            = 0x00000040l;
-const unsigned long DDSF_RGBA           = 0x00000041l;
+const unsigned int DDSF_ALPHAPIXELS    = 0x00000001l;
+const unsigned int DDSF_FOURCC         = 0x00000004l;
+const unsigned int DDSF_RGB            = 0x00000040l;
+const unsigned int DDSF_RGBA           = 0x00000041l;
 
 // dwCaps1 flags
-const unsigned long DDSF_COMPLEX         = 0x00000008l;
-const unsigned long DDSF_TEXTURE         = 0x00001000l;
-const unsigned long DDSF_MIPMAP          = 0x00400000l;
+const unsigned int DDSF_COMPLEX         = 0x00000008l;
+const unsigned int DDSF_TEXTURE         = 0x00001000l;
+const unsigned int DDSF_MIPMAP          = 0x00400000l;
 
 // dwCaps2 flags
-const unsigned long DDSF_CUBEMAP         = 0x00000200l;
-const unsigned long DDSF_CUBEMAP_POSITIVEX  = 0x00000400l;
-const unsigned long DDSF_CUBEMAP_NEGATIVEX  = 0x00000800l;
-const unsigned long DDSF_CUBEMAP_POSITIVEY  = 0x00001000l;
-const unsigned long DDSF_CUBEMAP_NEGATIVEY  = 0x00002000l;
-const unsigned long DDSF_CUBEMAP_POSITIVEZ  = 0x00004000l;
-const unsigned long DDSF_CUBEMAP_NEGATIVEZ  = 0x00008000l;
-const unsigned long DDSF_CUBEMAP_ALL_FACES  = 0x0000FC00l;
-const unsigned long DDSF_VOLUME          = 0x00200000l;
+const unsigned int DDSF_CUBEMAP         = 0x00000200l;
+const unsigned int DDSF_CUBEMAP_POSITIVEX  = 0x00000400l;
+const unsigned int DDSF_CUBEMAP_NEGATIVEX  = 0x00000800l;
+const unsigned int DDSF_CUBEMAP_POSITIVEY  = 0x00001000l;
+const unsigned int DDSF_CUBEMAP_NEGATIVEY  = 0x00002000l;
+const unsigned int DDSF_CUBEMAP_POSITIVEZ  = 0x00004000l;
+const unsigned int DDSF_CUBEMAP_NEGATIVEZ  = 0x00008000l;
+const unsigned int DDSF_CUBEMAP_ALL_FACES  = 0x0000FC00l;
+const unsigned int DDSF_VOLUME          = 0x00200000l;
 
 // compressed texture types
-const unsigned long FOURCC_UNKNOWN       = 0;
+const unsigned int FOURCC_UNKNOWN       = 0;
 
 #ifndef MAKEFOURCC
 #define MAKEFOURCC(c0,c1,c2,c3) \
-	((unsigned long)(unsigned char)(c0)| \
-	((unsigned long)(unsigned char)(c1) << 8)| \
-	((unsigned long)(unsigned char)(c2) << 16)| \
-	((unsigned long)(unsigned char)(c3) << 24))
+	((unsigned int)(unsigned char)(c0)| \
+	((unsigned int)(unsigned char)(c1) << 8)| \
+	((unsigned int)(unsigned char)(c2) << 16)| \
+	((unsigned int)(unsigned char)(c3) << 24))
 #endif
 
-const unsigned long FOURCC_R8G8B8        = 20;
-const unsigned long FOURCC_A8R8G8B8      = 21;
-const unsigned long FOURCC_X8R8G8B8      = 22;
-const unsigned long FOURCC_R5G6B5        = 23;
-const unsigned long FOURCC_X1R5G5B5      = 24;
-const unsigned long FOURCC_A1R5G5B5      = 25;
-const unsigned long FOURCC_A4R4G4B4      = 26;
-const unsigned long FOURCC_R3G3B2        = 27;
-const unsigned long FOURCC_A8            = 28;
-const unsigned long FOURCC_A8R3G3B2      = 29;
-const unsigned long FOURCC_X4R4G4B4      = 30;
-const unsigned long FOURCC_A2B10G10R10   = 31;
-const unsigned long FOURCC_A8B8G8R8      = 32;
-const unsigned long FOURCC_X8B8G8R8      = 33;
-const unsigned long FOURCC_G16R16        = 34;
-const unsigned long FOURCC_A2R10G10B10   = 35;
-const unsigned long FOURCC_A16B16G16R16  = 36;
-
-const unsigned long FOURCC_L8            = 50;
-const unsigned long FOURCC_A8L8          = 51;
-const unsigned long FOURCC_A4L4          = 52;
-const unsigned long FOURCC_DXT1          = 0x31545844l; //(MAKEFOURCC('D','X','T','1'))
-const unsigned long FOURCC_DXT2          = 0x32545844l; //(MAKEFOURCC('D','X','T','1'))
-const unsigned long FOURCC_DXT3          = 0x33545844l; //(MAKEFOURCC('D','X','T','3'))
-const unsigned long FOURCC_DXT4          = 0x34545844l; //(MAKEFOURCC('D','X','T','3'))
-const unsigned long FOURCC_DXT5          = 0x35545844l; //(MAKEFOURCC('D','X','T','5'))
-const unsigned long FOURCC_ATI1          = MAKEFOURCC('A','T','I','1');
-const unsigned long FOURCC_ATI2          = MAKEFOURCC('A','T','I','2');
-
-const unsigned long FOURCC_D16_LOCKABLE  = 70;
-const unsigned long FOURCC_D32           = 71;
-const unsigned long FOURCC_D24X8         = 77;
-const unsigned long FOURCC_D16           = 80;
-
-const unsigned long FOURCC_D32F_LOCKABLE = 82;
-
-const unsigned long FOURCC_L16           = 81;
+const unsigned int FOURCC_R8G8B8        = 20;
+const unsigned int FOURCC_A8R8G8B8      = 21;
+const unsigned int FOURCC_X8R8G8B8      = 22;
+const unsigned int FOURCC_R5G6B5        = 23;
+const unsigned int FOURCC_X1R5G5B5      = 24;
+const unsigned int FOURCC_A1R5G5B5      = 25;
+const unsigned int FOURCC_A4R4G4B4      = 26;
+const unsigned int FOURCC_R3G3B2        = 27;
+const unsigned int FOURCC_A8            = 28;
+const unsigned int FOURCC_A8R3G3B2      = 29;
+const unsigned int FOURCC_X4R4G4B4      = 30;
+const unsigned int FOURCC_A2B10G10R10   = 31;
+const unsigned int FOURCC_A8B8G8R8      = 32;
+const unsigned int FOURCC_X8B8G8R8      = 33;
+const unsigned int FOURCC_G16R16        = 34;
+const unsigned int FOURCC_A2R10G10B10   = 35;
+const unsigned int FOURCC_A16B16G16R16  = 36;
+
+const unsigned int FOURCC_L8            = 50;
+const unsigned int FOURCC_A8L8          = 51;
+const unsigned int FOURCC_A4L4          = 52;
+const unsigned int FOURCC_DXT1          = 0x31545844l; //(MAKEFOURCC('D','X','T','1'))
+const unsigned int FOURCC_DXT2          = 0x32545844l; //(MAKEFOURCC('D','X','T','1'))
+const unsigned int FOURCC_DXT3          = 0x33545844l; //(MAKEFOURCC('D','X','T','3'))
+const unsigned int FOURCC_DXT4          = 0x34545844l; //(MAKEFOURCC('D','X','T','3'))
+const unsigned int FOURCC_DXT5          = 0x35545844l; //(MAKEFOURCC('D','X','T','5'))
+const unsigned int FOURCC_ATI1          = MAKEFOURCC('A','T','I','1');
+const unsigned int FOURCC_ATI2          = MAKEFOURCC('A','T','I','2');
+
+const unsigned int FOURCC_D16_LOCKABLE  = 70;
+const unsigned int FOURCC_D32           = 71;
+const unsigned int FOURCC_D24X8         = 77;
+const unsigned int FOURCC_D16           = 80;
+
+const unsigned int FOURCC_D32F_LOCKABLE = 82;
+
+const unsigned int FOURCC_L16           = 81;
 
 // Floating point surface formats
 
 // s10e5 formats (16-bits per channel)
-const unsigned long FOURCC_R16F          = 111;
-const unsigned long FOURCC_G16R16F       = 112;
-const unsigned long FOURCC_A16B16G16R16F = 113;
+const unsigned int FOURCC_R16F          = 111;
+const unsigned int FOURCC_G16R16F       = 112;
+const unsigned int FOURCC_A16B16G16R16F = 113;
 
 // IEEE s23e8 formats (32-bits per channel)
-const unsigned long FOURCC_R32F          = 114;
-const unsigned long FOURCC_G32R32F       = 115;
-const unsigned long FOURCC_A32B32G32R32F = 116;
+const unsigned int FOURCC_R32F          = 114;
+const unsigned int FOURCC_G32R32F       = 115;
+const unsigned int FOURCC_A32B32G32R32F = 116;
 
 struct DXTColBlock
 {
@@ -143,30 +144,30 @@ struct DXT5AlphaBlock
 
 struct DDS_PIXELFORMAT
 {
-    unsigned long dwSize;
-    unsigned long dwFlags;
-    unsigned long dwFourCC;
-    unsigned long dwRGBBitCount;
-    unsigned long dwRBitMask;
-    unsigned long dwGBitMask;
-    unsigned long dwBBitMask;
-    unsigned long dwABitMask;
+    unsigned int dwSize;
+    unsigned int dwFlags;
+    unsigned int dwFourCC;
+    unsigned int dwRGBBitCount;
+    unsigned int dwRBitMask;
+    unsigned int dwGBitMask;
+    unsigned int dwBBitMask;
+    unsigned int dwABitMask;
 };
 
 struct DDS_HEADER
 {
-    unsigned long dwSize;
-    unsigned long dwFlags;
-    unsigned long dwHeight;
-    unsigned long dwWidth;
-    unsigned long dwPitchOrLinearSize;
-    unsigned long dwDepth;
-    unsigned long dwMipMapCount;
-    unsigned long dwReserved1[11];
+    unsigned int dwSize;
+    unsigned int dwFlags;
+    unsigned int dwHeight;
+    unsigned int dwWidth;
+    unsigned int dwPitchOrLinearSize;
+    unsigned int dwDepth;
+    unsigned int dwMipMapCount;
+    unsigned int dwReserved1[11];
     DDS_PIXELFORMAT ddspf;
-    unsigned long dwCaps1;
-    unsigned long dwCaps2;
-    unsigned long dwReserved2[3];
+    unsigned int dwCaps1;
+    unsigned int dwCaps2;
+    unsigned int dwReserved2[3];
 };
 
 //
@@ -555,8 +556,8 @@ void flip_dxt5_alpha(DXT5AlphaBlock *block)
 {
     GLubyte gBits[4][4];
     
-    const unsigned long mask = 0x00000007;          // bits = 00 00 01 11
-    unsigned long bits = 0;
+    const unsigned int mask = 0x00000007;          // bits = 00 00 01 11
+    unsigned int bits = 0;
     memcpy(&bits, &block->row[0], sizeof(unsigned char) * 3);
 
     gBits[0][0] = (GLubyte)(bits & mask);
@@ -597,7 +598,7 @@ void flip_dxt5_alpha(DXT5AlphaBlock *block)
     // clear existing alpha bits
     memset(block->row, 0, sizeof(GLubyte) * 6);
 
-    unsigned long *pBits = ((unsigned long*) &(block->row[0]));
+    unsigned int *pBits = ((unsigned int*) &(block->row[0]));
 
     *pBits = *pBits | (gBits[3][0] << 0);
     *pBits = *pBits | (gBits[3][1] << 3);
@@ -609,7 +610,7 @@ void flip_dxt5_alpha(DXT5AlphaBlock *block)
     *pBits = *pBits | (gBits[2][2] << 18);
     *pBits = *pBits | (gBits[2][3] << 21);
 
-    pBits = ((unsigned long*) &(block->row[3]));
+    pBits = ((unsigned int*) &(block->row[3]));
 
     *pBits = *pBits | (gBits[1][0] << 0);
     *pBits = *pBits | (gBits[1][1] << 3);
@@ -125,7 +125,11 @@ bool Image::readPng( const char *file, Image& i) {
         png_set_palette_to_rgb(png_ptr);
     }
     if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
+#if PNG_LIBPNG_VER >= 10400
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+#else
         png_set_gray_1_2_4_to_8(png_ptr);
+#endif
     }
     if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
         png_set_tRNS_to_alpha(png_ptr);
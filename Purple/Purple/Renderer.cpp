@@ -19,6 +19,7 @@ namespace Purple {
 
 GLuint SamplerRenderer::mTexture;
 std::mutex SamplerRenderer::mMutex;
+Job* SamplerRenderer::mRenderJob = nullptr;
 SamplerRenderer* SamplerRenderer::msRenderer;
 std::vector<ColorRGB> SamplerRenderer::mColorBuffer;
 
@@ -81,17 +82,22 @@ void SamplerRenderer::Render( const Scene *scene )
 	
 	//const uint32_t CpuCores = std::thread::hardware_concurrency();
 
-	pool& tp = GlobalThreadPool();
-	//for (size_t iCore = 0; iCore < tp.size(); ++iCore)
+	// main thread runs preview window, other workers pull blocks from block generator
+	JobSystem& jobSystem = GlobalJobSystem();
+	const uint32_t numRenderJobs = (std::max)(GetNumWorkThreads(), 2U) - 1;
+
+	mRenderJob = jobSystem.CreateJob();
+	for (uint32_t iJob = 0; iJob < numRenderJobs; ++iJob)
 	{
-		tp.schedule(std::bind(&SamplerRenderer::BlockRender, this, scene, sampleTemplate, film, std::ref(blockGenerator)));
+		jobSystem.Run(jobSystem.CreateChildJob(mRenderJob, std::bind(&SamplerRenderer::BlockRender, this, scene, sampleTemplate, film, std::ref(blockGenerator))));
 		//std::bind(&SamplerRenderer::BlockRender, this, scene, sampleTemplate, film, std::ref(blockGenerator))();
 	}	
+	jobSystem.Run(mRenderJob);
 
 	// Show preview window
 	glutMainLoop();
 
-	//tp.wait();
+	//jobSystem.Wait(mRenderJob);
 
 	//std::vector<std::thread*> workers;
 	//for (size_t iCore = 0; iCore < CpuCores; ++iCore)
@@ -308,7 +314,9 @@ void SamplerRenderer::Close()
 	sss <<  std::put_time(std::localtime(&now_c), "%m-%d-%H-%M-%S ")  <<
 		Instance().mSurfaceIntegrator->GetIntegratorName() << "-" << spp << "spp.pfm";
 
-	GlobalThreadPool().wait();
+	if (mRenderJob)
+		GlobalJobSystem().Wait(mRenderJob);
+
 	Instance().GetCamera()->GetFilm()->WriteImage(sss.str().c_str());
 }
 
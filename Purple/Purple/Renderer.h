@@ -9,9 +9,12 @@
 #include <GL/glew.h>
 #include <GL/glut.h>
 
+namespace RxLib { class Job; }
+
 namespace Purple {
 
 using RxLib::ColorRGB;
+using RxLib::Job;
 
 class Renderer
 {
@@ -72,6 +75,9 @@ protected:
 
 	static std::mutex mMutex;
 
+	// parent of all block render jobs
+	static Job* mRenderJob;
+
 	static GLuint mTexture;
 	static std::vector<ColorRGB> mColorBuffer;
 };
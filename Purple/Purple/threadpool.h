@@ -1,19 +1,19 @@
 #ifndef threadpool_h__
 #define threadpool_h__
 
-#include <boost/threadpool.hpp>
+#include <JobSystem.h>
 
-using namespace boost::threadpool;
+using RxLib::Job;
+using RxLib::JobSystem;
 
-inline pool& GlobalThreadPool()
+inline JobSystem& GlobalJobSystem()
 {
-	static pool tp(boost::thread::hardware_concurrency()-1);
-	return tp;
+	return JobSystem::Instance();
 }
 
 inline uint32_t GetNumWorkThreads()
 {
-	return boost::thread::hardware_concurrency();
+	return JobSystem::Instance().GetNumWorkers();
 }
 
 #endif // threadpool_h__
@@ -1,4 +1,5 @@
 #include "Applicaton.h"
+#include "Profiler.h"
 #include <GL/GL.h>
 
 #pragma comment(lib, "opengl32")
@@ -28,6 +29,9 @@ Applicaton::Applicaton(void)
 
 	Context::GetSingleton().SetRenderDevice(mRenderDevice);
 	Context::GetSingleton().SetRenderFactory(mRenderFactory);
+
+	// set up next frame while tiles of current frame are shaded, 1 waits for previous frame in BeginFrame
+	mRenderDevice->SetFramesInFlight(2);
 }
 
 
@@ -448,8 +452,11 @@ void Applicaton::Tick()
 	{
 		Update(mTimer.GetDeltaTime());
 
+		mRenderDevice->BeginFrame();
 		Render();
+		mRenderDevice->EndFrame();
 
+		// present previous frame while tiles of this frame are shaded
 		Present();
 	}
 	else
@@ -458,19 +465,25 @@ void Applicaton::Tick()
 
 void Applicaton::Present()
 {
+	PROFILE_SCOPE("Present");
+
 	static bool first = true;
 
+	// oldest frame in flight, none until frames in flight limit is reached
+	shared_ptr<FrameBuffer> frameBuffer = mRenderDevice->AcquirePresentFrame();
+	if (!frameBuffer)
+		return;
+
 	// Present
 	glClearColor(0, 0, 0, 1);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	const shared_ptr<Texture2D>& target = mRenderDevice->GetCurrentFrameBuffer()->GetRenderTarget(ATT_Color0);
+	const shared_ptr<Texture2D>& target = frameBuffer->GetRenderTarget(ATT_Color0);
 	const uint32_t targetWidth = target->GetWidth(0);
-	const uint32_t targetHeight = target->GetWidth(0);
+	const uint32_t targetHeight = target->GetHeight(0);
 
-	void* pBufferData;
-	uint32_t pitch;
-	target->Map2D(0, TMA_Read_Only, 0, 0, targetWidth, targetHeight, pBufferData, pitch);
+	// upload 8 bit sRGB, a quarter of the bytes of the float target
+	const uint32_t* pBufferData = mRenderDevice->ResolveColor(*frameBuffer);
 
 	glBindTexture(GL_TEXTURE_2D, mPresentTexture);	
 
@@ -483,11 +496,11 @@ void Applicaton::Present()
 
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mWidth, mHeight, 0, GL_RGBA, GL_FLOAT, pBufferData);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, mWidth, mHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pBufferData);
 	}
 	else
 	{
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, targetWidth, targetHeight, GL_RGBA, GL_FLOAT, pBufferData);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, targetWidth, targetHeight, GL_RGBA, GL_UNSIGNED_BYTE, pBufferData);
 	}
 
 	float fw = static_cast<float>(targetWidth) / mWidth;
@@ -0,0 +1,55 @@
+#ifndef AsyncResource_h__
+#define AsyncResource_h__
+
+#include "Prerequisite.h"
+#include <thread>
+
+/**
+ * Handle of a resource loaded by the loader thread, created by RenderFactory::LoadAsync. Get returns
+ * the placeholder until the resource is loaded, and keeps returning it if loading failed.
+ */
+template <typename T>
+class AsyncResource
+{
+public:
+	enum State { AS_Loading, AS_Ready, AS_Failed };
+
+public:
+	AsyncResource(const shared_ptr<T>& placeholder)
+		: mPlaceholder(placeholder), mState(AS_Loading) { }
+
+	State GetState() const			{ return static_cast<State>(mState.load(std::memory_order_acquire)); }
+	bool IsReady() const			{ return GetState() == AS_Ready; }
+
+	// loaded resource once ready, placeholder before
+	const shared_ptr<T>& Get() const	{ return IsReady() ? mResource : mPlaceholder; }
+
+	// block until loading finished, like a future's get
+	const shared_ptr<T>& Wait() const
+	{
+		while (!IsDone())
+			std::this_thread::yield();
+
+		return Get();
+	}
+
+	// called by loader thread, null resource means loading failed
+	void Complete(const shared_ptr<T>& resource)
+	{
+		mResource = resource;
+		mState.store(resource ? AS_Ready : AS_Failed, std::memory_order_release);
+	}
+
+private:
+	AsyncResource(const AsyncResource&);
+	AsyncResource& operator= (const AsyncResource&);
+
+	bool IsDone() const				{ return GetState() != AS_Loading; }
+
+private:
+	shared_ptr<T> mPlaceholder;
+	shared_ptr<T> mResource;
+	std::atomic<int32_t> mState;
+};
+
+#endif // AsyncResource_h__
@@ -0,0 +1,70 @@
+#include "ColorResolve.h"
+#include <cmath>
+#include <emmintrin.h>
+
+namespace {
+
+/**
+ * Tables are indexed by sqrt of the clamped value, which spends entries on dark values the
+ * way sRGB does, so every 8 bit sRGB value near black is still reachable.
+ */
+const uint32_t ResolveTableSize = 4096;
+
+struct ResolveTable
+{
+	ResolveTable()
+	{
+		for (uint32_t i = 0; i < ResolveTableSize; ++i)
+		{
+			const float s = static_cast<float>(i) / (ResolveTableSize - 1);
+			const float linear = s * s;
+			const float srgb = (linear <= 0.0031308f) ? linear * 12.92f : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+
+			SRGB[i] = static_cast<uint8_t>(srgb * 255.0f + 0.5f);
+			Linear[i] = static_cast<uint8_t>(linear * 255.0f + 0.5f);
+		}
+	}
+
+	uint8_t SRGB[ResolveTableSize];
+	uint8_t Linear[ResolveTableSize];
+};
+
+// built during static initialization, before any resolve job runs
+const ResolveTable gResolveTable;
+
+}
+
+void ResolveColorSRGB8( const void* src, uint32_t srcPitch, void* dst, uint32_t dstPitch, uint32_t width, uint32_t height, const ColorResolveDesc& desc )
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 tableScale = _mm_set1_ps(static_cast<float>(ResolveTableSize - 1));
+
+	// alpha is neither exposed nor tone mapped
+	const __m128 exposure = _mm_set_ps(1.0f, desc.Exposure, desc.Exposure, desc.Exposure);
+	const __m128 toneMap = (desc.ToneMap == TMO_Reinhard) ? _mm_set_ps(0.0f, 1.0f, 1.0f, 1.0f) : zero;
+
+	const uint8_t* srgb = gResolveTable.SRGB;
+	const uint8_t* linear = gResolveTable.Linear;
+
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		const float* pSrc = reinterpret_cast<const float*>(static_cast<const uint8_t*>(src) + y * srcPitch);
+		uint32_t* pDst = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(dst) + y * dstPitch);
+
+		for (uint32_t x = 0; x < width; ++x, pSrc += 4)
+		{
+			__m128 color = _mm_mul_ps(_mm_loadu_ps(pSrc), exposure);
+			color = _mm_div_ps(color, _mm_add_ps(one, _mm_mul_ps(color, toneMap)));
+
+			// max returns its second operand for NaN, so NaN resolves to black
+			color = _mm_min_ps(_mm_max_ps(color, zero), one);
+
+			union { __m128i v; int32_t i[4]; } index;
+			index.v = _mm_cvtps_epi32(_mm_mul_ps(_mm_sqrt_ps(color), tableScale));
+
+			pDst[x] = uint32_t(srgb[index.i[0]]) | (uint32_t(srgb[index.i[1]]) << 8) |
+				(uint32_t(srgb[index.i[2]]) << 16) | (uint32_t(linear[index.i[3]]) << 24);
+		}
+	}
+}
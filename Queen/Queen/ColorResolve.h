@@ -0,0 +1,33 @@
+#ifndef ColorResolve_h__
+#define ColorResolve_h__
+
+#include "Prerequisite.h"
+
+enum ToneMapOperator
+{
+	TMO_None,
+
+	// c / (1 + c)
+	TMO_Reinhard
+};
+
+/**
+ * Conversion of float color to 8 bit: color is scaled by Exposure, tone mapped, clamped to
+ * [0, 1] and sRGB encoded. Alpha is only clamped and stays linear.
+ */
+struct ColorResolveDesc
+{
+	ColorResolveDesc() : Exposure(1.0f), ToneMap(TMO_None) { }
+
+	float Exposure;
+	ToneMapOperator ToneMap;
+};
+
+/**
+ * Resolve rows of PF_A32B32G32R32F pixels to 8 bit RGBA with red in the lowest byte, the
+ * layout of GL_RGBA GL_UNSIGNED_BYTE. Each pixel is converted in one SSE register, sRGB
+ * encoding is a table lookup. Pitches are in bytes.
+ */
+void ResolveColorSRGB8(const void* src, uint32_t srcPitch, void* dst, uint32_t dstPitch, uint32_t width, uint32_t height, const ColorResolveDesc& desc);
+
+#endif // ColorResolve_h__
@@ -0,0 +1,126 @@
+#include "DeferredLighting.h"
+#include "FrameBuffer.h"
+#include "RenderDevice.h"
+#include <cmath>
+#include <cfloat>
+
+namespace {
+
+inline const float* GetTargetPixel(const FrameBuffer& gbuffer, Attachment att, uint32_t x, uint32_t y)
+{
+	return reinterpret_cast<const float*>(static_cast<const uint8_t*>(gbuffer.GetTargetData(att)) + y * gbuffer.GetTargetPitch(att)) + x * 4;
+}
+
+// true if sphere touches box, box is empty if min > max
+inline bool SphereTouchesBox(const float3& center, float radius, const float* boxMin, const float* boxMax)
+{
+	float distSq = 0.0f;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (boxMin[i] > boxMax[i])
+			return false;
+
+		const float d = (center[i] < boxMin[i]) ? (boxMin[i] - center[i]) : ((center[i] > boxMax[i]) ? (center[i] - boxMax[i]) : 0.0f);
+		distSq += d * d;
+	}
+	return distSq <= radius * radius;
+}
+
+}
+
+void ShadeDeferredTile( FrameBuffer& gbuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height, 
+	const PointLight* lights, uint32_t numLights, const ColorRGBA& ambient )
+{
+	// bound of lit pixels, this pass also brings the tile's normals and positions into cache
+	float boxMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float boxMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (uint32_t iY = y; iY < y + height; ++iY)
+	{
+		const float* pNormal = GetTargetPixel(gbuffer, ATT_Color2, x, iY);
+		const float* pPosition = GetTargetPixel(gbuffer, ATT_Color3, x, iY);
+		for (uint32_t iX = 0; iX < width; ++iX, pNormal += 4, pPosition += 4)
+		{
+			if (pNormal[3] == 0.0f)
+				continue;
+
+			for (int i = 0; i < 3; ++i)
+			{
+				boxMin[i] = std::min(boxMin[i], pPosition[i]);
+				boxMax[i] = std::max(boxMax[i], pPosition[i]);
+			}
+		}
+	}
+
+	uint32_t tileLights[MaxTileLights];
+	uint32_t iLight = 0;
+	bool first = true;
+	do 
+	{
+		uint32_t numTileLights = 0;
+		for (; iLight < numLights && numTileLights < MaxTileLights; ++iLight)
+		{
+			if (SphereTouchesBox(lights[iLight].Position, lights[iLight].Range, boxMin, boxMax))
+				tileLights[numTileLights++] = iLight;
+		}
+
+		// first pass writes ambient even if no light touches tile, later passes add
+		if (!first && numTileLights == 0)
+			break;
+
+		for (uint32_t iY = y; iY < y + height; ++iY)
+		{
+			float* pLit = const_cast<float*>(GetTargetPixel(gbuffer, ATT_Color0, x, iY));
+			const float* pAlbedo = GetTargetPixel(gbuffer, ATT_Color1, x, iY);
+			const float* pNormal = GetTargetPixel(gbuffer, ATT_Color2, x, iY);
+			const float* pPosition = GetTargetPixel(gbuffer, ATT_Color3, x, iY);
+
+			for (uint32_t iX = 0; iX < width; ++iX, pLit += 4, pAlbedo += 4, pNormal += 4, pPosition += 4)
+			{
+				if (pNormal[3] == 0.0f)
+					continue;
+
+				float diffuse[3];
+				for (int i = 0; i < 3; ++i)
+					diffuse[i] = first ? ambient.Tuple[i] : 0.0f;
+
+				for (uint32_t t = 0; t < numTileLights; ++t)
+				{
+					const PointLight& light = lights[tileLights[t]];
+
+					const float L[3] = { light.Position[0] - pPosition[0], light.Position[1] - pPosition[1], light.Position[2] - pPosition[2] };
+					const float distSq = L[0] * L[0] + L[1] * L[1] + L[2] * L[2];
+					if (distSq >= light.Range * light.Range)
+						continue;
+
+					const float NdotL = pNormal[0] * L[0] + pNormal[1] * L[1] + pNormal[2] * L[2];
+					if (NdotL <= 0.0f)
+						continue;
+
+					const float dist = sqrtf(distSq);
+					const float falloff = 1.0f - dist / light.Range;
+					const float intensity = NdotL / std::max(dist, FLT_MIN) * falloff * falloff;
+
+					for (int i = 0; i < 3; ++i)
+						diffuse[i] += light.Color.Tuple[i] * intensity;
+				}
+
+				for (int i = 0; i < 3; ++i)
+					pLit[i] = (first ? 0.0f : pLit[i]) + pAlbedo[i] * diffuse[i];
+				pLit[3] = 1.0f;
+			}
+		}
+
+		first = false;
+	} while (iLight < numLights);
+}
+
+void DrawDeferredLighting( RenderDevice& device, const std::vector<PointLight>& lights, const ColorRGBA& ambient )
+{
+	// tiles are lit after this returns
+	shared_ptr< std::vector<PointLight> > tileLights = std::make_shared< std::vector<PointLight> >(lights);
+
+	device.DrawTilePass([tileLights, ambient](FrameBuffer& gbuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+		const uint32_t numLights = static_cast<uint32_t>(tileLights->size());
+		ShadeDeferredTile(gbuffer, x, y, width, height, numLights ? &(*tileLights)[0] : nullptr, numLights, ambient);
+	});
+}
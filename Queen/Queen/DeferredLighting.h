@@ -0,0 +1,43 @@
+#ifndef DeferredLighting_h__
+#define DeferredLighting_h__
+
+#include "Prerequisite.h"
+#include <Vector.hpp>
+#include <ColorRGBA.hpp>
+
+using RxLib::float3;
+using RxLib::ColorRGBA;
+
+class FrameBuffer;
+class RenderDevice;
+
+// lights culled against one tile at a time, more lights are shaded in several passes over the tile
+#define MaxTileLights 64
+
+/**
+ * Point light in view space, the space G-buffer positions and normals are in. Attenuation is
+ * (1 - d / Range)^2, so the light has no effect beyond Range.
+ */
+struct PointLight
+{
+	float3 Position;
+	float Range;
+	ColorRGBA Color;
+};
+
+/**
+ * Light pixels in rect of gbuffer, whose targets are all PF_A32B32G32R32F:
+ *   Color0  lit color, output of lighting
+ *   Color1  albedo in rgb
+ *   Color2  view space normal in xyz, w is 1 for geometry, pixels with w 0 are not lit
+ *   Color3  view space position in xyz
+ * Bound of the tile's view space positions is computed first, then each pixel is shaded by
+ * the lights whose sphere touches the bound.
+ */
+void ShadeDeferredTile(FrameBuffer& gbuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+	const PointLight* lights, uint32_t numLights, const ColorRGBA& ambient);
+
+// light bound frame buffer as G-buffer, one DrawTilePass, lights are copied
+void DrawDeferredLighting(RenderDevice& device, const std::vector<PointLight>& lights, const ColorRGBA& ambient);
+
+#endif // DeferredLighting_h__
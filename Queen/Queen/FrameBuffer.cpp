@@ -5,123 +5,162 @@
 #include "Context.h"
 #include "Shader.h"
 #include "threadpool.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
 #include <MathUtil.hpp>
 
 namespace {
 
-inline void BlendOp(ColorRGBA* pOut, const ColorRGBA* pSrc, const ColorRGBA* pDest, const ColorRGBA* pCurrFactor, const BlendState::RenderTargetBlend& state)
+// lane 3 holds alpha
+const union { uint32_t U[4]; float F[4]; } AlphaLaneMask = { { 0, 0, 0, 0xFFFFFFFF } };
+
+// lanes of channels set in ColorWriteMask
+const union { uint32_t U[4]; float F[4]; } WriteMaskLanes[16] =
 {
-	float srcAlpha, destAlpha;
-	ColorRGBA srcColor, destColor;
+	{ { 0, 0, 0, 0 } }, { { ~0U, 0, 0, 0 } }, { { 0, ~0U, 0, 0 } }, { { ~0U, ~0U, 0, 0 } },
+	{ { 0, 0, ~0U, 0 } }, { { ~0U, 0, ~0U, 0 } }, { { 0, ~0U, ~0U, 0 } }, { { ~0U, ~0U, ~0U, 0 } },
+	{ { 0, 0, 0, ~0U } }, { { ~0U, 0, 0, ~0U } }, { { 0, ~0U, 0, ~0U } }, { { ~0U, ~0U, 0, ~0U } },
+	{ { 0, 0, ~0U, ~0U } }, { { ~0U, 0, ~0U, ~0U } }, { { 0, ~0U, ~0U, ~0U } }, { { ~0U, ~0U, ~0U, ~0U } }
+};
 
-	switch (state.SrcBlendAlpha)
-	{
-	case ABF_Src_Alpha: srcAlpha =  pSrc->A; break;
-	case ABF_Dst_Alpha: srcAlpha = pDest->A; break;
-	case ABF_Inv_Src_Alpha: srcAlpha = 1.0f - pSrc->A; break;
-	case ABF_Inv_Dst_Alpha: srcAlpha = 1.0f - pDest->A; break;
-	case ABF_Src_Alpha_Sat: srcAlpha = (std::min)(1.0f, pSrc->A);
-	}
+inline __m128 MergeAlpha(const __m128& color, const __m128& alpha)
+{
+	const __m128 mask = _mm_loadu_ps(AlphaLaneMask.F);
+	return _mm_or_ps(_mm_andnot_ps(mask, color), _mm_and_ps(mask, alpha));
+}
 
-	switch (state.DestBlendAlpha)
-	{
-	case ABF_Src_Alpha: destAlpha = pSrc->A; break;
-	case ABF_Dst_Alpha: destAlpha =  pDest->A; break;
-	case ABF_Inv_Src_Alpha: destAlpha =  1.0f - pSrc->A; break;
-	case ABF_Inv_Dst_Alpha: destAlpha =  1.0f - pDest->A; break;
-	case ABF_Src_Alpha_Sat: destAlpha =  (std::min)(1.0f, pSrc->A); break;
-	}
+// channels outside write mask keep dest
+inline __m128 MaskColor(const __m128& color, const __m128& dest, uint8_t writeMask)
+{
+	const __m128 lanes = _mm_loadu_ps(WriteMaskLanes[writeMask & CWM_All].F);
+	return _mm_or_ps(_mm_and_ps(lanes, color), _mm_andnot_ps(lanes, dest));
+}
 
-	switch (state.SrcBlend)
-	{
-	case ABF_Zero: srcColor = ColorRGBA(0, 0, 0, 0); break;
-	case ABF_One: srcColor = ColorRGBA(1, 1, 1, 1); break;
-	case ABF_Src_Color: srcColor = *pSrc; break;
-	case ABF_Dst_Color: srcColor = *pDest; break;
-	case ABF_Blend_Factor: srcColor = *pCurrFactor; break;
-	case ABF_Inv_Src_Color:
-		srcColor.R = 1.0f - pSrc->R;
-		srcColor.G = 1.0f - pSrc->G;
-		srcColor.B = 1.0f - pSrc->B;
-		break;
-	case ABF_Inv_Dst_Color:
-		srcColor.R = 1.0f - pDest->R;
-		srcColor.G = 1.0f - pDest->G;
-		srcColor.B = 1.0f - pDest->B;
-		break;
-	case ABF_Inv_Blend_Factor:
-		srcColor.R = 1.0f - pCurrFactor->R;
-		srcColor.G = 1.0f - pCurrFactor->G;
-		srcColor.B = 1.0f - pCurrFactor->B;
-		break;
-	}
+inline __m128 BroadcastAlpha(const __m128& color)
+{
+	return _mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 3, 3, 3));
+}
 
-	switch (state.DestBlend)
-	{
-	case ABF_Zero: destColor = ColorRGBA(0, 0, 0, 0); break;
-	case ABF_One: destColor = ColorRGBA(1, 1, 1, 1); break;
-	case ABF_Src_Color: destColor = *pSrc; break;
-	case ABF_Dst_Color: destColor = *pDest; break;
-	case ABF_Blend_Factor: destColor = *pCurrFactor; break;
-	case ABF_Inv_Src_Color:
-		destColor.R = 1.0f - pSrc->R;
-		destColor.G = 1.0f - pSrc->G;
-		destColor.B = 1.0f - pSrc->B;
-		break;
-	case ABF_Inv_Dst_Color:
-		destColor.R = 1.0f - pDest->R;
-		destColor.G = 1.0f - pDest->G;
-		destColor.B = 1.0f - pDest->B;
-		break;
-	case ABF_Inv_Blend_Factor:
-		destColor.R = 1.0f - pCurrFactor->R;
-		destColor.G = 1.0f - pCurrFactor->G;
-		destColor.B = 1.0f - pCurrFactor->B;
-		break;
-	}
+/**
+ * Factor in all four lanes, so the same factor serves as color and as alpha factor. Color
+ * factors used for alpha take the alpha lane, which is what D3D defines for them.
+ */
+inline __m128 EvaluateBlendFactor(AlphaBlendFactor factor, const __m128& src, const __m128& dest, const __m128& blendFactor)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
 
-	switch (state.BlendOp)
+	switch (factor)
 	{
-	case BOP_Add:
-		*pOut = srcColor + destColor;
-		break;
-	case BOP_Sub:
-		*pOut = srcColor - destColor;
-		break;
-	case BOP_Rev_Sub:
-		*pOut = destColor - srcColor;
-		break;
-	case BOP_Min:
-		break;
-	case BOP_Max:
-		break;
+	case ABF_Zero: return _mm_setzero_ps();
+	case ABF_Src_Alpha: return BroadcastAlpha(src);
+	case ABF_Dst_Alpha: return BroadcastAlpha(dest);
+	case ABF_Inv_Src_Alpha: return _mm_sub_ps(one, BroadcastAlpha(src));
+	case ABF_Inv_Dst_Alpha: return _mm_sub_ps(one, BroadcastAlpha(dest));
+	case ABF_Src_Color: return src;
+	case ABF_Dst_Color: return dest;
+	case ABF_Inv_Src_Color: return _mm_sub_ps(one, src);
+	case ABF_Inv_Dst_Color: return _mm_sub_ps(one, dest);
+	case ABF_Blend_Factor: return blendFactor;
+	case ABF_Inv_Blend_Factor: return _mm_sub_ps(one, blendFactor);
+
+	// (f, f, f, 1) with f = min(As, 1 - Ad)
+	case ABF_Src_Alpha_Sat: return MergeAlpha(_mm_min_ps(BroadcastAlpha(src), _mm_sub_ps(one, BroadcastAlpha(dest))), one);
+	default: return one;
 	}
+}
 
-	switch (state.BlendOpAlpha)
+// min and max ignore blend factors
+inline __m128 EvaluateBlendOp(BlendOperation op, const __m128& srcTerm, const __m128& destTerm, const __m128& src, const __m128& dest)
+{
+	switch (op)
 	{
-	case BOP_Add:
-		pOut->A = srcAlpha + destAlpha;
-		break;
-	case BOP_Sub:
-		pOut->A = srcAlpha - destAlpha;
-		break;
-	case BOP_Rev_Sub:
-		pOut->A = destAlpha - srcAlpha;
-		break;
-	case BOP_Min:
-		pOut->A  = (std::min)(destAlpha, srcAlpha);
-		break;
-	case BOP_Max:
-		pOut->A  = (std::max)(destAlpha, srcAlpha);
-		break;
+	case BOP_Sub: return _mm_sub_ps(srcTerm, destTerm);
+	case BOP_Rev_Sub: return _mm_sub_ps(destTerm, srcTerm);
+	case BOP_Min: return _mm_min_ps(src, dest);
+	case BOP_Max: return _mm_max_ps(src, dest);
+	default: return _mm_add_ps(srcTerm, destTerm);
 	}
 }
 
+/**
+ * Blend one RGBA pixel, color in lanes 0-2 and alpha in lane 3 of one register. Alpha only
+ * costs extra work when its factors or operation differ from color's. Called with constant
+ * arguments by the specialized blend functions, so the switches fold away there.
+ */
+inline __m128 Blend(AlphaBlendFactor srcBlend, AlphaBlendFactor destBlend, BlendOperation blendOp,
+					AlphaBlendFactor srcBlendAlpha, AlphaBlendFactor destBlendAlpha, BlendOperation blendOpAlpha,
+					const __m128& src, const __m128& dest, const __m128& blendFactor)
+{
+	__m128 srcFactor = EvaluateBlendFactor(srcBlend, src, dest, blendFactor);
+	if (srcBlendAlpha != srcBlend)
+		srcFactor = MergeAlpha(srcFactor, EvaluateBlendFactor(srcBlendAlpha, src, dest, blendFactor));
+
+	__m128 destFactor = EvaluateBlendFactor(destBlend, src, dest, blendFactor);
+	if (destBlendAlpha != destBlend)
+		destFactor = MergeAlpha(destFactor, EvaluateBlendFactor(destBlendAlpha, src, dest, blendFactor));
+
+	const __m128 srcTerm = _mm_mul_ps(src, srcFactor);
+	const __m128 destTerm = _mm_mul_ps(dest, destFactor);
+
+	__m128 result = EvaluateBlendOp(blendOp, srcTerm, destTerm, src, dest);
+	if (blendOpAlpha != blendOp)
+		result = MergeAlpha(result, EvaluateBlendOp(blendOpAlpha, srcTerm, destTerm, src, dest));
+
+	return result;
+}
+
+template <AlphaBlendFactor SrcBlend, AlphaBlendFactor DestBlend, BlendOperation Op,
+		  AlphaBlendFactor SrcBlendAlpha, AlphaBlendFactor DestBlendAlpha, BlendOperation OpAlpha>
+__m128 BlendSpecialized(const __m128& src, const __m128& dest, const __m128& blendFactor, const BlendState::RenderTargetBlend& /*state*/)
+{
+	return Blend(SrcBlend, DestBlend, Op, SrcBlendAlpha, DestBlendAlpha, OpAlpha, src, dest, blendFactor);
+}
 
+__m128 BlendGeneric(const __m128& src, const __m128& dest, const __m128& blendFactor, const BlendState::RenderTargetBlend& state)
+{
+	return Blend(state.SrcBlend, state.DestBlend, state.BlendOp, state.SrcBlendAlpha, state.DestBlendAlpha, state.BlendOpAlpha,
+		src, dest, blendFactor);
 }
 
-FrameBuffer::FrameBuffer( int32_t width, int32_t height )
-	:mDepthStencilTarget(0), mActice(false), mDirty(false)
+#define BLEND_STATE(src, dest, op, srcAlpha, destAlpha, opAlpha) \
+	{ src, dest, op, srcAlpha, destAlpha, opAlpha, &BlendSpecialized<src, dest, op, srcAlpha, destAlpha, opAlpha> }
+
+// blend states of particle, UI and decal passes, others use BlendGeneric
+const struct SpecializedBlend
+{
+	AlphaBlendFactor SrcBlend, DestBlend;
+	BlendOperation BlendOp;
+	AlphaBlendFactor SrcBlendAlpha, DestBlendAlpha;
+	BlendOperation BlendOpAlpha;
+	FrameBuffer::BlendFunc Func;
+} SpecializedBlends[] =
+{
+	// alpha blend
+	BLEND_STATE(ABF_Src_Alpha, ABF_Inv_Src_Alpha, BOP_Add, ABF_Src_Alpha, ABF_Inv_Src_Alpha, BOP_Add),
+	BLEND_STATE(ABF_Src_Alpha, ABF_Inv_Src_Alpha, BOP_Add, ABF_One, ABF_Inv_Src_Alpha, BOP_Add),
+	BLEND_STATE(ABF_Src_Alpha, ABF_Inv_Src_Alpha, BOP_Add, ABF_One, ABF_Zero, BOP_Add),
+
+	// premultiplied alpha
+	BLEND_STATE(ABF_One, ABF_Inv_Src_Alpha, BOP_Add, ABF_One, ABF_Inv_Src_Alpha, BOP_Add),
+
+	// additive
+	BLEND_STATE(ABF_One, ABF_One, BOP_Add, ABF_One, ABF_One, BOP_Add),
+	BLEND_STATE(ABF_Src_Alpha, ABF_One, BOP_Add, ABF_Src_Alpha, ABF_One, BOP_Add),
+	BLEND_STATE(ABF_Src_Alpha, ABF_One, BOP_Add, ABF_One, ABF_One, BOP_Add),
+
+	// modulate
+	BLEND_STATE(ABF_Dst_Color, ABF_Zero, BOP_Add, ABF_Dst_Alpha, ABF_Zero, BOP_Add),
+	BLEND_STATE(ABF_Zero, ABF_Src_Color, BOP_Add, ABF_Zero, ABF_Src_Alpha, BOP_Add),
+};
+
+#undef BLEND_STATE
+
+
+}
+
+FrameBuffer::FrameBuffer( int32_t width, int32_t height, uint32_t sampleCount )
+	:mDepthStencilTarget(0), mActice(false), mDirty(false), mNumColorTargets(0), mSampleCount((sampleCount >= MultisampleCount) ? MultisampleCount : 1),
+	 mNumSampleTilesX(0), mNumSampleTilesY(0), mResolvePending(false)
 {
 	mViewport.Left = 0;
 	mViewport.Width = width;
@@ -230,11 +269,13 @@ void FrameBuffer::DetachAll()
 
 void FrameBuffer::OnBind()
 {
+	mNumColorTargets = 0;
 	for (size_t i = 0; i < mRenderTargets.size(); ++i)
 	{
 		if(mRenderTargets[i])
 		{
 			mRenderTargets[i]->Map2D(0, TMA_Read_Write, 0, 0, 0, 0, mRTBuffer[ATT_Color0+i], mRTBufferPitch[ATT_Color0+i]);
+			mColorTargets[mNumColorTargets++] = static_cast<uint32_t>(i);
 		}
 	}
 
@@ -243,6 +284,8 @@ void FrameBuffer::OnBind()
 		mDepthStencilTarget->Map2D(0, TMA_Read_Write, 0, 0, 0, 0, mRTBuffer[ATT_DepthStencil], mRTBufferPitch[ATT_DepthStencil]);
 	}
 
+	AllocateSamples();
+
 	mDirty = false;
 	mActice = true;
 }
@@ -275,94 +318,391 @@ void FrameBuffer::ReadPixel( int32_t x, int32_t y, PS_Output* oPixel, float* oDe
 	}
 }
 
-void FrameBuffer::WritePixel( int32_t x, int32_t y, const PS_Output* psOutput, float* pDepth )
+FrameBuffer::BlendFunc FrameBuffer::GetBlendFunc( const BlendState::RenderTargetBlend& state )
 {
-	RenderDevice& device = Context::GetSingleton().GetRenderDevice();
+	if (!state.BlendEnable)
+		return NULL;
 
-	const BlendState& blendState = device.BlendState;
-	ColorRGBA dest;
+	for (size_t i = 0; i < sizeof(SpecializedBlends) / sizeof(SpecializedBlends[0]); ++i)
+	{
+		const SpecializedBlend& blend = SpecializedBlends[i];
+		if (blend.SrcBlend == state.SrcBlend && blend.DestBlend == state.DestBlend && blend.BlendOp == state.BlendOp &&
+			blend.SrcBlendAlpha == state.SrcBlendAlpha && blend.DestBlendAlpha == state.DestBlendAlpha && blend.BlendOpAlpha == state.BlendOpAlpha)
+			return blend.Func;
+	}
 
-	
+	return &BlendGeneric;
+}
 
-	for (size_t i = 0; i < mRenderTargets.size(); ++i)
+__m128 FrameBuffer::ReadColor( uint32_t index, int32_t x, int32_t y ) const
+{
+	const PixelFormat fmt = mRenderTargets[index]->GetTextureFormat();
+	if (fmt == PF_A32B32G32R32F)
+		return _mm_loadu_ps(reinterpret_cast<const float*>(static_cast<const uint8_t*>(mRTBuffer[ATT_Color0+index]) + y * mRTBufferPitch[ATT_Color0+index]) + x * 4);
+
+	ColorRGBA color(0, 0, 0, 1);
+	TextureFetch::ReadPixelFuncs[fmt](x, y, color, mRTBuffer[ATT_Color0+index], mRTBufferPitch[ATT_Color0+index]);
+	return _mm_loadu_ps(color.Tuple);
+}
+
+void FrameBuffer::WriteColor( uint32_t index, int32_t x, int32_t y, const __m128& color )
+{
+	const PixelFormat fmt = mRenderTargets[index]->GetTextureFormat();
+	if (fmt == PF_A32B32G32R32F)
 	{
-		if (mRenderTargets[i])
-		{
-			if (blendState.RenderTarget[i].ColorWriteMask)
-			{
-				const ColorRGBA& src = psOutput->Color[i];	
-				const PixelFormat& fmt = mRenderTargets[i]->GetTextureFormat();
-		
-				// do alpha blend
-				if (blendState.RenderTarget[i].BlendEnable)
-				{
-					// read dest pixel
-					TextureFetch::ReadPixelFuncs[fmt](x, y, dest, mRTBuffer[ATT_Color0+i], mRTBufferPitch[ATT_Color0+i]);
-					BlendOp(&dest, &src, &dest, &device.CurrentBlendFactor, blendState.RenderTarget[ATT_Color0+i]);
+		_mm_storeu_ps(reinterpret_cast<float*>(static_cast<uint8_t*>(mRTBuffer[ATT_Color0+index]) + y * mRTBufferPitch[ATT_Color0+index]) + x * 4, color);
+		return;
+	}
 
-					// upadte pixel
-					TextureFetch::WritePixelFuncs[fmt](x, y, dest, mRTBuffer[ATT_Color0+i], mRTBufferPitch[ATT_Color0+i]);
-				}
-				else
-				{
-					// upadte pixel
-					TextureFetch::WritePixelFuncs[fmt](x, y, src, mRTBuffer[ATT_Color0+i], mRTBufferPitch[ATT_Color0+i]);
-				}
-			}
+	ColorRGBA pixel;
+	_mm_storeu_ps(pixel.Tuple, color);
+	TextureFetch::WritePixelFuncs[fmt](x, y, pixel, mRTBuffer[ATT_Color0+index], mRTBufferPitch[ATT_Color0+index]);
+}
+
+FrameBuffer::ColorWriteFunc FrameBuffer::GetColorWriteFunc( const BlendState& blendState ) const
+{
+	static const ColorWriteFunc floatWrites[MaxUnrolledTargets] = {
+		&FrameBuffer::WriteFloatColors<1>, &FrameBuffer::WriteFloatColors<2>, &FrameBuffer::WriteFloatColors<3>, &FrameBuffer::WriteFloatColors<4> };
+
+	// bound targets must be 0 to n-1
+	const uint32_t numTargets = static_cast<uint32_t>(mRenderTargets.size());
+	if (mSampleCount > 1 || numTargets == 0 || numTargets > MaxUnrolledTargets)
+		return &FrameBuffer::WriteBlendedColors;
+
+	for (uint32_t i = 0; i < numTargets; ++i)
+	{
+		const BlendState::RenderTargetBlend& targetBlend = blendState.RenderTarget[i];
+		if (!mRenderTargets[i] || mRenderTargets[i]->GetTextureFormat() != PF_A32B32G32R32F ||
+			targetBlend.BlendEnable || targetBlend.ColorWriteMask != CWM_All)
+			return &FrameBuffer::WriteBlendedColors;
+	}
+
+	return floatWrites[numTargets - 1];
+}
+
+template <uint32_t NumTargets>
+void FrameBuffer::WriteFloatColors( int32_t x, int32_t y, const PS_Output* psOutput, const ShadingState& /*state*/ )
+{
+	// constant trip count, compiler unrolls it
+	for (uint32_t i = 0; i < NumTargets; ++i)
+	{
+		float* pColor = reinterpret_cast<float*>(static_cast<uint8_t*>(mRTBuffer[ATT_Color0+i]) + y * mRTBufferPitch[ATT_Color0+i]) + x * 4;
+		_mm_storeu_ps(pColor, _mm_loadu_ps(psOutput->Color[i].Tuple));
+	}
+}
+
+void FrameBuffer::WriteBlendedColors( int32_t x, int32_t y, const PS_Output* psOutput, const ShadingState& state )
+{
+	const __m128 blendFactor = _mm_loadu_ps(state.BlendFactor.Tuple);
+
+	for (uint32_t t = 0; t < mNumColorTargets; ++t)
+	{
+		const uint32_t i = mColorTargets[t];
+		const BlendState::RenderTargetBlend& targetBlend = state.BlendState.RenderTarget[i];
+		if (!targetBlend.ColorWriteMask)
+			continue;
+
+		__m128 color = _mm_loadu_ps(psOutput->Color[i].Tuple);
+
+		// destination is only read for blending and partial write masks
+		const BlendFunc blend = state.BlendFuncs[i];
+		if (blend || targetBlend.ColorWriteMask != CWM_All)
+		{
+			const __m128 dest = ReadColor(i, x, y);
+			if (blend)
+				color = blend(color, dest, blendFactor, targetBlend);
+			color = MaskColor(color, dest, targetBlend.ColorWriteMask);
 		}
+
+		WriteColor(i, x, y, color);
 	}
+}
+
+void FrameBuffer::WritePixel( int32_t x, int32_t y, const PS_Output* psOutput, float* pDepth, const ShadingState& state )
+{
+	(this->*state.ColorWrite)(x, y, psOutput, state);
 
 	if (pDepth)
 	{
-		ColorRGBA depth(*pDepth, 0, 0, 0);
-		const PixelFormat& fmt = mDepthStencilTarget->GetTextureFormat();
-		TextureFetch::WritePixelFuncs[fmt](x, y, depth, mRTBuffer[ATT_DepthStencil], mRTBufferPitch[ATT_DepthStencil]);
+		if (mStencilBits)
+		{
+			// depth write keeps stencil
+			uint32_t* pTexel = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(mRTBuffer[ATT_DepthStencil]) + y * mRTBufferPitch[ATT_DepthStencil] + x * 4);
+			*pTexel = (*pTexel & ~Depth24Mask) | EncodeDepth24(*pDepth);
+		}
+		else
+		{
+			ColorRGBA depth(*pDepth, 0, 0, 0);
+			const PixelFormat& fmt = mDepthStencilTarget->GetTextureFormat();
+			TextureFetch::WritePixelFuncs[fmt](x, y, depth, mRTBuffer[ATT_DepthStencil], mRTBufferPitch[ATT_DepthStencil]);
+		}
 	}
 }
 
 void FrameBuffer::Clear( uint32_t flags, const ColorRGBA& clr, float depth, uint32_t stencil )
 {
+#define NumClearRowPerPackage 64
+
+	PROFILE_SCOPE("Clear");
+
+	// tiles of draws in flight may still be shaded into this frame buffer
+	Context::GetSingleton().GetRenderDevice().WaitFrameBuffer(this);
+
+	// samples and render targets are cleared to the same values
+	mResolvePending = false;
+
 	// only clear color0 and depth
 	const uint32_t width = mRenderTargets[0]->GetWidth(0);
 	const uint32_t height = mRenderTargets[0]->GetHeight(0);
 
-	std::atomic<uint32_t> workingPackage(0);
+	JobSystem& jobSystem = GlobalJobSystem();
+
+	// color and depth row packages are children of one job, so both clear in parallel with one join
+	Job* clearJob = jobSystem.CreateJob();
+
+	// Clear color0, pixels of a multisampled frame buffer share one uniform flag so all color targets are cleared
+	const size_t numColorCleared = (mSampleCount > 1) ? mRenderTargets.size() : 1;
+	for (size_t i = 0; i < numColorCleared; ++i)
+	{
+		if (!mRenderTargets[i])
+			continue;
+
+		const PixelFormat colorFmt = mRenderTargets[i]->GetTextureFormat();
+		for (uint32_t start = 0; start < height; start += NumClearRowPerPackage)
+		{
+			const uint32_t end = (std::min)(height, start + NumClearRowPerPackage);
+			jobSystem.Run(jobSystem.CreateChildJob(clearJob, std::bind(&FrameBuffer::ClearColor, this, uint32_t(ATT_Color0 + i), 
+				colorFmt, clr, width, start, end)));
+		}
+	}
 
-	// Clear color0
-	ScheduleAndJoin(GlobalThreadPool(), std::bind(&FrameBuffer::ClearColor, this, ATT_Color0, 
-		mRenderTargets[0]->GetTextureFormat(), clr, std::ref(workingPackage), width, height));
+	// one sample package per row of tiles, pixels of a tile row are contiguous
+	if (mSampleCount > 1)
+	{
+		for (uint32_t tileRow = 0; tileRow < mNumSampleTilesY; ++tileRow)
+		{
+			jobSystem.Run(jobSystem.CreateChildJob(clearJob, std::bind(&FrameBuffer::ClearSamples, this, clr, depth, uint8_t(stencil), tileRow, tileRow + 1)));
+		}
+	}
 
-	// clear depth
+	// clear depth, and stencil of formats having it
 	if (mDepthStencilTarget)
 	{
-		workingPackage = 0;
-		ColorRGBA depthColor(depth, 0, 0, 0);
-		ScheduleAndJoin(GlobalThreadPool(), std::bind(&FrameBuffer::ClearColor, this, ATT_DepthStencil, 
-			mDepthStencilTarget->GetTextureFormat(), depthColor, std::ref(workingPackage), width, height));
+		const ColorRGBA depthColor(depth, static_cast<float>(stencil & 0xFF), 0, 0);
+		const PixelFormat depthFmt = mDepthStencilTarget->GetTextureFormat();
+		for (uint32_t start = 0; start < height; start += NumClearRowPerPackage)
+		{
+			const uint32_t end = (std::min)(height, start + NumClearRowPerPackage);
+			jobSystem.Run(jobSystem.CreateChildJob(clearJob, std::bind(&FrameBuffer::ClearColor, this, ATT_DepthStencil, 
+				depthFmt, depthColor, width, start, end)));
+		}
 	}
+
+	jobSystem.Run(clearJob);
+	jobSystem.Wait(clearJob);
 }
 
-void FrameBuffer::ClearColor(uint32_t index, PixelFormat fmt, const ColorRGBA& clr, std::atomic<uint32_t>& workingPackage, uint32_t width, uint32_t height)
+void FrameBuffer::ClearColor(uint32_t index, PixelFormat fmt, const ColorRGBA& clr, uint32_t width, uint32_t startRow, uint32_t endRow)
 {
-#define NumClearRowPerPackage 64
+	for (uint32_t y = startRow; y < endRow; ++y)
+	{
+		for (uint32_t x = 0; x < width; ++x)
+		{
+			TextureFetch::WritePixelFuncs[fmt](x, y, clr, mRTBuffer[index], mRTBufferPitch[index]);
+		}
+	}
+}
+
+uint32_t FrameBuffer::GetSampleIndex( int32_t x, int32_t y ) const
+{
+	const uint32_t tile = (y >> TileSizeShift) * mNumSampleTilesX + (x >> TileSizeShift);
+	return (tile << (2 * TileSizeShift)) | ((y & (TileSize - 1)) << TileSizeShift) | (x & (TileSize - 1));
+}
+
+void FrameBuffer::AllocateSamples()
+{
+	if (mSampleCount == 1)
+	{
+		for (uint32_t i = 0; i < MaxRenderTarget; ++i)
+			std::vector<ColorRGBA>().swap(mColorSamples[i]);
+		std::vector<float>().swap(mDepthSamples);
+		std::vector<uint8_t>().swap(mStencilSamples);
+		std::vector<uint8_t>().swap(mUniformSamples);
+
+		mNumSampleTilesX = mNumSampleTilesY = 0;
+		return;
+	}
+
+	// whole tiles, so tile rows are contiguous
+	mNumSampleTilesX = (mWidth + TileSize - 1) >> TileSizeShift;
+	mNumSampleTilesY = (mHeight + TileSize - 1) >> TileSizeShift;
+	const uint32_t numPixels = (mNumSampleTilesX * mNumSampleTilesY) << (2 * TileSizeShift);
+
+	for (size_t i = 0; i < mRenderTargets.size(); ++i)
+	{
+		if (mRenderTargets[i])
+			mColorSamples[i].resize(numPixels * MultisampleCount);
+	}
+
+	mDepthSamples.resize(numPixels * MultisampleCount, 1.0f);
+	if (mStencilBits)
+		mStencilSamples.resize(numPixels * MultisampleCount, 0);
+	else
+		std::vector<uint8_t>().swap(mStencilSamples);
+	mUniformSamples.resize(numPixels, 1);
+}
+
+void FrameBuffer::ClearSamples( const ColorRGBA& clr, float depth, uint8_t stencil, uint32_t startTileRow, uint32_t endTileRow )
+{
+	const uint32_t pixelsPerTileRow = mNumSampleTilesX << (2 * TileSizeShift);
+	const uint32_t start = startTileRow * pixelsPerTileRow;
+	const uint32_t end = endTileRow * pixelsPerTileRow;
+
+	// cleared pixels are uniform, only sample 0 is written
+	memset(&mUniformSamples[start], 1, end - start);
+
+	for (size_t i = 0; i < mRenderTargets.size(); ++i)
+	{
+		if (!mRenderTargets[i])
+			continue;
+
+		ColorRGBA* pSamples = &mColorSamples[i][0];
+		for (uint32_t pixel = start; pixel < end; ++pixel)
+			pSamples[pixel * MultisampleCount] = clr;
+	}
 
-	uint32_t num_packages = (height + NumClearRowPerPackage - 1) / NumClearRowPerPackage;
-	uint32_t localWorkingPackage  = workingPackage ++;
+	std::fill(mDepthSamples.begin() + start * MultisampleCount, mDepthSamples.begin() + end * MultisampleCount, depth);
 
-	while (localWorkingPackage < num_packages)
+	if (!mStencilSamples.empty())
+		memset(&mStencilSamples[start * MultisampleCount], stencil, (end - start) * MultisampleCount);
+}
+
+void FrameBuffer::WriteSamples( int32_t x, int32_t y, uint32_t mask, const PS_Output* psOutput, const float* pDepths, const ShadingState& state )
+{
+	const uint32_t pixel = GetSampleIndex(x, y);
+	const bool fullMask = (mask == (1UL << MultisampleCount) - 1);
+
+	// fully covered pixel written without blending to all channels of every target has one color again
+	bool overwrite = fullMask;
+	for (size_t i = 0; i < mRenderTargets.size(); ++i)
+	{
+		if (mRenderTargets[i] && (state.BlendState.RenderTarget[i].ColorWriteMask != CWM_All || state.BlendFuncs[i]))
+			overwrite = false;
+	}
+
+	uint8_t& uniform = mUniformSamples[pixel];
+	if (uniform && !fullMask)
+	{
+		// partially covered, every sample gets its own color
+		for (size_t i = 0; i < mRenderTargets.size(); ++i)
+		{
+			if (!mRenderTargets[i])
+				continue;
+
+			ColorRGBA* pSamples = &mColorSamples[i][pixel * MultisampleCount];
+			for (uint32_t s = 1; s < MultisampleCount; ++s)
+				pSamples[s] = pSamples[0];
+		}
+
+		uniform = 0;
+	}
+	else if (overwrite)
+	{
+		uniform = 1;
+	}
+
+	// uniform pixel is fully covered here, writing sample 0 writes all samples
+	const uint32_t sampleMask = uniform ? 0x1 : mask;
+	const __m128 blendFactor = _mm_loadu_ps(state.BlendFactor.Tuple);
+
+	for (size_t i = 0; i < mRenderTargets.size(); ++i)
 	{
-		const uint32_t start = localWorkingPackage * NumClearRowPerPackage;
-		const uint32_t end = (std::min)(height, start + NumClearRowPerPackage);
+		const BlendState::RenderTargetBlend& targetBlend = state.BlendState.RenderTarget[i];
+		if (!mRenderTargets[i] || !targetBlend.ColorWriteMask)
+			continue;
 
-		for (uint32_t y = start; y < end; ++y)
+		const __m128 src = _mm_loadu_ps(psOutput->Color[i].Tuple);
+		const BlendFunc blend = state.BlendFuncs[i];
+		const bool readDest = blend || targetBlend.ColorWriteMask != CWM_All;
+		float* pSamples = mColorSamples[i][pixel * MultisampleCount].Tuple;
+
+		for (uint32_t s = 0; s < MultisampleCount; ++s)
 		{
-			for (uint32_t x = 0; x < width; ++x)
+			if (!(sampleMask & (1UL << s)))
+				continue;
+
+			__m128 color = src;
+			if (readDest)
 			{
-				TextureFetch::WritePixelFuncs[fmt](x, y, clr, mRTBuffer[index], mRTBufferPitch[index]);
+				const __m128 dest = _mm_loadu_ps(pSamples + s * 4);
+				if (blend)
+					color = blend(color, dest, blendFactor, targetBlend);
+				color = MaskColor(color, dest, targetBlend.ColorWriteMask);
 			}
+
+			_mm_storeu_ps(pSamples + s * 4, color);
 		}
+	}
 
-		localWorkingPackage = workingPackage++;
+	if (pDepths)
+	{
+		float* pSampleDepths = &mDepthSamples[pixel * MultisampleCount];
+		for (uint32_t s = 0; s < MultisampleCount; ++s)
+		{
+			if (mask & (1UL << s))
+				pSampleDepths[s] = pDepths[s];
+		}
+	}
+}
+
+void FrameBuffer::ResolveTile( int32_t x, int32_t y, int32_t width, int32_t height )
+{
+	const __m128 scale = _mm_set1_ps(1.0f / MultisampleCount);
+
+	// rect comes from the rasterizer's tile grid, keep it inside this frame buffer
+	width = (std::min)(width, mWidth - x);
+	height = (std::min)(height, mHeight - y);
+	if (width <= 0 || height <= 0)
+		return;
+
+	for (size_t i = 0; i < mRenderTargets.size(); ++i)
+	{
+		if (!mRenderTargets[i])
+			continue;
+
+		const PixelFormat fmt = mRenderTargets[i]->GetTextureFormat();
+		const ColorRGBA* pSamples = &mColorSamples[i][0];
+
+		for (int32_t iY = y; iY < y + height; ++iY)
+		{
+			// pixels of a tile row are contiguous in sample storage
+			const uint32_t rowPixel = GetSampleIndex(x, iY);
+			uint8_t* pRow = static_cast<uint8_t*>(mRTBuffer[ATT_Color0+i]) + iY * mRTBufferPitch[ATT_Color0+i];
+
+			for (int32_t iX = 0; iX < width; ++iX)
+			{
+				const uint32_t pixel = rowPixel + iX;
+				const float* pSample = pSamples[pixel * MultisampleCount].Tuple;
+
+				__m128 color = _mm_loadu_ps(pSample);
+				if (!mUniformSamples[pixel])
+				{
+					color = _mm_add_ps(_mm_add_ps(color, _mm_loadu_ps(pSample + 4)), _mm_add_ps(_mm_loadu_ps(pSample + 8), _mm_loadu_ps(pSample + 12)));
+					color = _mm_mul_ps(color, scale);
+				}
+
+				if (fmt == PF_A32B32G32R32F)
+				{
+					_mm_storeu_ps(reinterpret_cast<float*>(pRow) + (x + iX) * 4, color);
+				}
+				else
+				{
+					ColorRGBA resolved;
+					_mm_storeu_ps(resolved.Tuple, color);
+					TextureFetch::WritePixelFuncs[fmt](x + iX, iY, resolved, mRTBuffer[ATT_Color0+i], mRTBufferPitch[ATT_Color0+i]);
+				}
+			}
+		}
 	}
 }
 
@@ -4,6 +4,9 @@
 #include "Prerequisite.h"
 #include "GraphicCommon.h"
 #include "PixelFormat.h"
+#include "Texture.h"
+#include "RenderState.h"
+#include <emmintrin.h>
 #include <Matrix.hpp>
 #include <ColorRGBA.hpp>
 
@@ -11,14 +14,21 @@ using RxLib::float44;
 using RxLib::ColorRGBA;
 
 struct PS_Output;
-struct BlendState;
+struct ShadingState;
 
 #define MaxRenderTarget 8
 
+// largest target count with an unrolled color write
+#define MaxUnrolledTargets 4
+
+// samples per pixel of a multisampled frame buffer
+#define MultisampleCount 4
+
 class FrameBuffer
 {
 public:
-	FrameBuffer(int32_t width, int32_t height);
+	// sampleCount of MultisampleCount makes frame buffer multisampled, others are single sampled
+	FrameBuffer(int32_t width, int32_t height, uint32_t sampleCount = 1);
 	virtual ~FrameBuffer(void);
 
 	uint32_t GetWidth() const			{ return mWidth; }
@@ -31,8 +41,36 @@ public:
 	uint32_t GetDepthBits() const		{ return mDepthBits; }
 	uint32_t GetStencilBits() const		{ return mStencilBits;}
 
+	/**
+	 * Frame buffer is multisampled when created with MultisampleCount samples. Samples
+	 * of each raster tile are stored together, a pixel whose samples have one color writes
+	 * only sample 0. Tiled draws write samples only, RenderDevice resolves them into the
+	 * render targets once per frame in EndFrame, or before a screenshot or when unbound.
+	 */
+	uint32_t GetSampleCount() const		{ return mSampleCount; }
+
 	const shared_ptr<Texture2D>& GetRenderTarget(Attachment att) const;
 
+	/**
+	 * Blend of one RGBA pixel held in one SSE register. Common blend states have functions
+	 * specialized at compile time, a generic one covers the others. Null if blending is
+	 * disabled. Picked once per draw when shading state is captured.
+	 */
+	typedef __m128 (*BlendFunc)(const __m128& src, const __m128& dest, const __m128& blendFactor, const BlendState::RenderTargetBlend& state);
+	static BlendFunc GetBlendFunc(const BlendState::RenderTargetBlend& state);
+
+	/**
+	 * Color write of a pixel, picked once per draw. Targets 0 to n-1 all float, unblended and
+	 * fully write masked, the G-buffer pass case, get a write unrolled for n of at most
+	 * MaxUnrolledTargets. Other states write each bound target through its blend function.
+	 */
+	typedef void (FrameBuffer::*ColorWriteFunc)(int32_t x, int32_t y, const PS_Output* psOutput, const ShadingState& state);
+	ColorWriteFunc GetColorWriteFunc(const BlendState& blendState) const;
+
+	// mapped storage of attachment, tile passes read and write targets in place through it
+	void* GetTargetData(Attachment att) const			{ return mRTBuffer[att]; }
+	uint32_t GetTargetPitch(Attachment att) const		{ return mRTBufferPitch[att]; }
+
 	const float44& GetViewportMatrix() const { return mViewportMatrix; }
 
 	bool IsDepthBuffered() const			{ return mIsDepthBuffered; }
@@ -49,9 +87,37 @@ public:
 	void Clear(uint32_t flags, const ColorRGBA& clr, float depth, uint32_t stencil);
 
 private:
-	void WritePixel(int32_t x, int32_t y, const PS_Output* psOutput, float* depth);
+	void WritePixel(int32_t x, int32_t y, const PS_Output* psOutput, float* depth, const ShadingState& state);
 	void ReadPixel(int32_t x, int32_t y, PS_Output* oPixel, float* oDepth);
-	void ClearColor(uint32_t index, PixelFormat fmt, const ColorRGBA& clr, std::atomic<uint32_t>& workingPackage, uint32_t width, uint32_t height);
+	// float targets are accessed in place, other formats through their pixel funcs
+	__m128 ReadColor(uint32_t index, int32_t x, int32_t y) const;
+	void WriteColor(uint32_t index, int32_t x, int32_t y, const __m128& color);
+
+	template <uint32_t NumTargets>
+	void WriteFloatColors(int32_t x, int32_t y, const PS_Output* psOutput, const ShadingState& state);
+	void WriteBlendedColors(int32_t x, int32_t y, const PS_Output* psOutput, const ShadingState& state);
+
+	void ClearColor(uint32_t index, PixelFormat fmt, const ColorRGBA& clr, uint32_t width, uint32_t startRow, uint32_t endRow);
+
+	// pixel index in sample storage, pixels of a raster tile are contiguous
+	uint32_t GetSampleIndex(int32_t x, int32_t y) const;
+	float* GetSampleDepths(int32_t x, int32_t y)		{ return &mDepthSamples[GetSampleIndex(x, y) * MultisampleCount]; }
+	uint8_t* GetSampleStencils(int32_t x, int32_t y)	{ return &mStencilSamples[GetSampleIndex(x, y) * MultisampleCount]; }
+
+	// stencil byte of PF_Depth24Stencil8 texel, frame buffer must have stencil bits
+	uint8_t* GetStencil(int32_t x, int32_t y)
+	{
+		return static_cast<uint8_t*>(mRTBuffer[ATT_DepthStencil]) + y * mRTBufferPitch[ATT_DepthStencil] + x * 4 + (StencilShift / 8);
+	}
+
+	// write samples in mask, pDepths has a depth per sample and is null if depth isn't written
+	void WriteSamples(int32_t x, int32_t y, uint32_t mask, const PS_Output* psOutput, const float* pDepths, const ShadingState& state);
+
+	// average samples of pixels in rect into render targets
+	void ResolveTile(int32_t x, int32_t y, int32_t width, int32_t height);
+
+	void AllocateSamples();
+	void ClearSamples(const ColorRGBA& clr, float depth, uint8_t stencil, uint32_t startTileRow, uint32_t endTileRow);
 
 protected:
 
@@ -78,6 +144,27 @@ private:
 	void* mRTBuffer[MaxRenderTarget];
 	uint32_t mRTBufferPitch[MaxRenderTarget];
 
+	// indices of bound color targets, set when bound
+	uint32_t mColorTargets[MaxRenderTarget];
+	uint32_t mNumColorTargets;
+
+	uint32_t mSampleCount;
+	uint32_t mNumSampleTilesX, mNumSampleTilesY;
+
+	// MultisampleCount colors of each pixel, per render target
+	std::vector<ColorRGBA> mColorSamples[MaxRenderTarget];
+	std::vector<float> mDepthSamples;
+
+	// stencil of each sample, only allocated if depth stencil target has stencil bits
+	std::vector<uint8_t> mStencilSamples;
+
+	// 1 if all color samples of pixel equal sample 0. Storage for every sample is always allocated,
+	// the flag only lets writes and resolve skip samples 1-3 of uniform pixels.
+	std::vector<uint8_t> mUniformSamples;
+
+	// tiled draws wrote samples since last resolve, issuing thread only
+	bool mResolvePending;
+
 	friend class Rasterizer;
 };
 
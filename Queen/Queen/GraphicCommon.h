@@ -251,6 +251,22 @@ enum ElementAccessHint
 	EAH_CPU_Write = 1UL << 1,
 	EAH_GPU_Read = 1UL << 2,
 	EAH_GPU_Write = 1UL << 3,
+
+	/** Store texels in a tiled layout for cache friendly sampling, only
+	 *  honored for read-only textures.
+	 */
+	EAH_Tiled = 1UL << 4,
+};
+
+enum TextureLayout
+{
+	/** Texels are stored row by row.
+	*/
+	TL_Linear,
+
+	/** Texels are stored in 4x4 tiles, tiles are stored row by row.
+	*/
+	TL_Tiled,
 };
 
 enum Attachment
@@ -312,6 +328,14 @@ struct Viewport
 	int32_t Left, Top, Width, Height;
 };
 
+/**
+ * Scissor rectangle in pixels, Right and Bottom are exclusive.
+ */
+struct ScissorRect
+{
+	int32_t Left, Top, Right, Bottom;
+};
+
 struct ElementInitData
 {
 	const void* pData;
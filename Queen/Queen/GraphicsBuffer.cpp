@@ -1,9 +1,19 @@
 #include "GraphicsBuffer.h"
+#include "MeshCache.h"
 
 
 GraphicsBuffer::GraphicsBuffer(uint32_t bufferSize)
+	: mBufferSize(bufferSize)
 {
 	mBufferData.resize(bufferSize);
+	mData = bufferSize ? &mBufferData[0] : NULL;
+}
+
+GraphicsBuffer::GraphicsBuffer( const shared_ptr<MappedFile>& file, uint64_t offset, uint32_t bufferSize )
+	: mMappedFile(file), mBufferSize(bufferSize)
+{
+	ASSERT(offset + bufferSize <= file->GetSize());
+	mData = file->GetData() + offset;
 }
 
 
@@ -13,7 +23,7 @@ GraphicsBuffer::~GraphicsBuffer(void)
 
 void* GraphicsBuffer::Map( uint32_t offset, uint32_t length, BufferAccess options )
 {
-	const size_t bufferLength = mBufferData.size();
+	const size_t bufferLength = mBufferSize;
 
 	if (offset > bufferLength)
 		return NULL;
@@ -21,7 +31,7 @@ void* GraphicsBuffer::Map( uint32_t offset, uint32_t length, BufferAccess option
 	if (offset + length > bufferLength)
 		return NULL;
 
-	return (void*)(&mBufferData[offset]);
+	return (void*)(mData + offset);
 }
 
 void GraphicsBuffer::UnMap()
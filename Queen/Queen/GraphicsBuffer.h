@@ -4,19 +4,33 @@
 #include "Prerequisite.h"
 #include "GraphicCommon.h"
 
+class MappedFile;
+
 class GraphicsBuffer
 {
 public:
 	GraphicsBuffer(uint32_t bufferSize);
+
+	/**
+	 * Buffer over bufferSize bytes of a file mapping at offset, the data is not copied and
+	 * pages are only made resident when read. Keeps the mapping alive.
+	 */
+	GraphicsBuffer(const shared_ptr<MappedFile>& file, uint64_t offset, uint32_t bufferSize);
+
 	~GraphicsBuffer(void);
 
-	uint32_t GetBufferSize() const { return mBufferData.size(); }
+	uint32_t GetBufferSize() const { return mBufferSize; }
 
 	void* Map(uint32_t offset, uint32_t length, BufferAccess options);
 	void UnMap();
 
 private:
 	std::vector<uint8_t> mBufferData;
+	shared_ptr<MappedFile> mMappedFile;
+
+	// mBufferData or file mapping
+	uint8_t* mData;
+	uint32_t mBufferSize;
 };
 
 #endif // GraphicBuffer_h__
@@ -17,8 +17,9 @@
 //nv::SDKPath gAppPath;
 
 //#define CubeDemo
+//#define GroundPlaneDemo
 
-#ifdef CubeDemo
+#if defined(CubeDemo)
 
 class SimpleVertexShader : public VertexShader
 {
@@ -96,6 +97,11 @@ public:
 	{
 		return 1;
 	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<SimplePixelShader>(*this);
+	}
 };
 
 class TestApp : public Applicaton
@@ -255,6 +261,193 @@ private:
 	nv::Model mModel;
 };
 
+#elif defined(GroundPlaneDemo)
+
+// Huge ground planes stretching far beyond the guard band, exercises guard band clipping
+class SimpleVertexShader : public VertexShader
+{
+public:
+
+	void Bind()
+	{
+		DeclareVarying(InterpolationModifier::Linear, float4, oPosW, 0);
+		DeclareVarying(InterpolationModifier::Linear, float4, oColor, 1);
+	}
+
+	void Execute(const VS_Input* input, VS_Output* output)
+	{
+		DefineAttribute(float4, iPos, 0);
+		DefineAttribute(float4, iColor, 1);
+
+		DefineVaryingOutput(float4, oPosW, 0);
+		DefineVaryingOutput(float4, oColor, 1);
+
+		oPosW = iPos * World;
+		oColor = iColor;
+
+		output->Position = oPosW * View * Projection;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 2;
+	}
+
+public:
+	float44 World;
+	float44 View;
+	float44 Projection;
+};
+
+class SimplePixelShader : public PixelShader
+{
+public:
+
+	bool Execute(const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		DefineVaryingInput(float3, iPosW, 0);
+		DefineVaryingInput(float4, iColor, 1);
+
+		// checker board in world space, cracks or missing triangles are easy to spot
+		int32_t checker = ((int32_t)floorf(iPosW.X()) + (int32_t)floorf(iPosW.Z())) & 1;
+		float shade = checker ? 1.0f : 0.4f;
+
+		output->Color[0] = Saturate(ColorRGBA((float*)&iColor) * shade);
+
+		return true;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 1;
+	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<SimplePixelShader>(*this);
+	}
+};
+
+class TestApp : public Applicaton
+{
+public:
+	TestApp() 
+		: Applicaton()
+	{
+
+	}
+
+	struct SimpleVertex
+	{
+		float3 Pos;
+		ColorRGBA Color;
+	};
+
+	void LoadContent()
+	{
+		// three ground planes, each side is 100000 units, camera stands 1 unit above the lowest one
+		const float Extent = 50000.0f;
+
+		SimpleVertex vertices[] =
+		{
+			{ float3( -Extent, 0.0f, -Extent ), ColorRGBA(1, 1, 1, 1) },
+			{ float3( -Extent, 0.0f,  Extent ), ColorRGBA(1, 1, 1, 1) },
+			{ float3(  Extent, 0.0f,  Extent ), ColorRGBA(1, 1, 1, 1) },
+			{ float3(  Extent, 0.0f, -Extent ), ColorRGBA(1, 1, 1, 1) },
+
+			{ float3( -Extent, 4.0f, -Extent ), ColorRGBA(0.2f, 0.6f, 1, 1) },
+			{ float3( -Extent, 4.0f,  Extent ), ColorRGBA(0.2f, 0.6f, 1, 1) },
+			{ float3(  Extent, 4.0f,  Extent ), ColorRGBA(0.2f, 0.6f, 1, 1) },
+			{ float3(  Extent, 4.0f, -Extent ), ColorRGBA(0.2f, 0.6f, 1, 1) },
+
+			// tilted plane crossing the other two
+			{ float3( -Extent, -2000.0f, -Extent ), ColorRGBA(1, 0.5f, 0.2f, 1) },
+			{ float3( -Extent,  2000.0f,  Extent ), ColorRGBA(1, 0.5f, 0.2f, 1) },
+			{ float3(  Extent,  2000.0f,  Extent ), ColorRGBA(1, 0.5f, 0.2f, 1) },
+			{ float3(  Extent, -2000.0f, -Extent ), ColorRGBA(1, 0.5f, 0.2f, 1) },
+		};
+
+		// both windings, so each plane is visible from above and below
+		uint32_t indices[] =
+		{
+			0,1,2, 0,2,3, 0,2,1, 0,3,2,
+			4,5,6, 4,6,7, 4,6,5, 4,7,6,
+			8,9,10, 8,10,11, 8,10,9, 8,11,10,
+		};
+		mIndexCount = sizeof(indices) / sizeof(uint32_t);
+
+		VertexElement ve[2] = 
+		{
+			VertexElement(0, 0, VEF_Float3, VEU_Position, 0),
+			VertexElement(0, 12, VEF_Float4, VEU_Color, 0),
+		};
+		mVertexDecl = mRenderFactory->CreateVertexDeclaration(ve, 2);
+
+		ElementInitData initData;
+		initData.pData = vertices;
+		initData.RowPitch = sizeof(vertices);
+		mVertexBuffer = mRenderFactory->CreateVertexBuffer(&initData);
+
+		initData.pData = indices;
+		initData.RowPitch = sizeof(indices);
+		mIndexBuffer = mRenderFactory->CreateIndexBuffer(&initData);
+
+		mVertexShader = std::make_shared<SimpleVertexShader>();
+		mVertexShader->View = CreateLookAtMatrixLH(float3(0, 1, 0), float3(0, 0.8f, 10), float3(0, 1, 0));
+		mVertexShader->Projection =  CreatePerspectiveFovLH<float>(Queue_PI * 0.5f, 1.0f, 0.1f, 100000.0f ); 
+		mVertexShader->World.MakeIdentity();
+
+		mPixelShader = std::make_shared<SimplePixelShader>();
+	}
+
+	void Update(float deltaTime)
+	{
+		CalculateFrameRate();
+
+		mVertexShader->World = mVertexShader->World * CreateRotationY(deltaTime * RxLib::ToRadian(10.f));
+	}
+
+	void Render()
+	{
+		mRenderDevice->GetCurrentFrameBuffer()->Clear(CF_Color | CF_Depth,
+			ColorRGBA(0.5f, 0.5f, 0.5f, 1.0f), 1.0f, 0);
+
+		mRenderDevice->SetVertexStream(0, mVertexBuffer, 0, mVertexDecl->GetVertexSize());
+		mRenderDevice->SetInputLayout(mVertexDecl);
+
+		mRenderDevice->SetIndexBuffer(mIndexBuffer, IBT_Bit32, 0);
+
+		mRenderDevice->SetVertexShader(mVertexShader);
+		mRenderDevice->SetPixelShader(mPixelShader);
+
+		mRenderDevice->DrawIndexed(PT_Triangle_List, mIndexCount, 0, 0); 	
+
+		std::stringstream sss; 
+		sss << "Ground Planes  FPS: " << mFramePerSecond;
+
+		DrawText(sss.str(), 10, 10, ColorRGBA(1, 0, 0, 1));
+
+		// min/max worker busy time shows tile load balance
+		const std::vector<long long>& busyTime = mRenderDevice->GetTileBusyTime();
+		if (!busyTime.empty())
+		{
+			std::stringstream busy;
+			busy << "Tile Busy(us) Min: " << *std::min_element(busyTime.begin(), busyTime.end())
+				<< "  Max: " << *std::max_element(busyTime.begin(), busyTime.end());
+
+			DrawText(busy.str(), 10, 30, ColorRGBA(1, 0, 0, 1));
+		}
+	}
+
+private:
+	shared_ptr<SimpleVertexShader> mVertexShader;
+	shared_ptr<SimplePixelShader> mPixelShader;
+	shared_ptr<GraphicsBuffer> mVertexBuffer;
+	shared_ptr<GraphicsBuffer> mIndexBuffer;
+	shared_ptr<VertexDeclaration> mVertexDecl;
+	uint32_t mIndexCount;
+};
+
 #else
 
 class SimpleVertexShader : public VertexShader
@@ -332,6 +525,11 @@ public:
 	{
 		return 1;
 	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<SimplePixelShader>(*this);
+	}
 };
 
 class TestApp : public Applicaton
@@ -354,23 +552,20 @@ public:
 
 	void LoadContent()
 	{
-		mDiffuseTexture = mRenderFactory->CreateTextureFromFile("../../Media/Map-COL.png");
-		bool loaded = mModel.loadModelFromFile("../../Media/Infinite-Level_02.OBJ");
-
-		//mDiffuseTexture = mRenderFactory->CreateTextureFromFile("./Media/Map-COL.png");
-		//bool loaded = mModel.loadModelFromFile("./Media/Infinite-Level_02.OBJ");
-
-		if(!loaded )
-			ASSERT(false);
+		// placeholder is drawn until texture is decoded
+		mDiffuseTexture = mRenderFactory->CreateTextureFromFileAsync("../../Media/Map-COL.png");
+		const std::string modelFile = "../../Media/Infinite-Level_02.OBJ";
+		const std::string cacheFile = "../../Media/Infinite-Level_02.qmesh";
 
-		if(!mModel.hasNormals())
-			mModel.computeNormals();
+		//mDiffuseTexture = mRenderFactory->CreateTextureFromFileAsync("./Media/Map-COL.png");
+		//const std::string modelFile = "./Media/Infinite-Level_02.OBJ";
+		//const std::string cacheFile = "./Media/Infinite-Level_02.qmesh";
 
-		mModel.compileModel( nv::Model::eptTriangles);
+		// obj is only parsed and compiled when mesh cache is missing or stale
+		if (!mRenderFactory->CreateMeshFromCache(cacheFile, modelFile, &mMesh))
+			LoadModel(modelFile, cacheFile);
 
-		nv::vec3f min, max, center;
-		mModel.computeBoundingBox(min, max);
-		center = (min + max) / 2;
+		const float3 center = mMesh.Bound.Center();
 
 		// Create buffers
 		VertexElement ve[3];
@@ -385,28 +580,16 @@ public:
 		ve[1].Type = VEF_Float3;
 		ve[1].Usage = VEU_Normal;
 		ve[1].UsageIndex = 0;
-		ve[1].Offset = mModel.getCompiledNormalOffset() * sizeof(float);
+		ve[1].Offset = mMesh.NormalOffset;
 
 		ve[2].Stream = 0;
 		ve[2].Type = VEF_Float2;
 		ve[2].Usage = VEU_TextureCoordinate;
 		ve[2].UsageIndex = 0;
-		ve[2].Offset = mModel.getCompiledTexCoordOffset() * sizeof(float);
+		ve[2].Offset = mMesh.TexCoordOffset;
 
 		mVertexDecl = mRenderFactory->CreateVertexDeclaration(ve, 3);
 
-		auto vc = mModel.getCompiledVertexCount();
-		auto vs = mModel.getCompiledVertexSize();
-
-		ElementInitData initData;
-		initData.pData = mModel.getCompiledVertices();
-		initData.RowPitch = static_cast<uint32_t>(mModel.getCompiledVertexCount() * mModel.getCompiledVertexSize() * sizeof(float));
-		mVertexBuffer = mRenderFactory->CreateVertexBuffer(&initData);
-
-		initData.pData = mModel.getCompiledIndices();
-		initData.RowPitch = mModel.getCompiledIndexCount() * sizeof(uint32_t);
-		mIndexBuffer = mRenderFactory->CreateIndexBuffer(&initData);
-
 		mVertexShader = std::make_shared<SimpleVertexShader>();
 		mVertexShader->View = CreateLookAtMatrixLH(float3(0, 0, 1.6f), float3(0, 0, 0), float3(0, 1, 0));
 		mVertexShader->Projection =  CreatePerspectiveFovLH<float>(Queue_PI / 9, 1.0f, 0.1f, 100.0f ); 
@@ -414,10 +597,56 @@ public:
 		mPixelShader = std::make_shared<SimplePixelShader>();
 		mPixelShader->LightPos = float3(10, 10, 10);
 
-		Center = CreateTranslation(float3(-center.x, -center.y, -center.z));
+		Center = CreateTranslation(-center);
 		mVertexShader->World = Center;
 	}
 
+	void LoadModel(const std::string& modelFile, const std::string& cacheFile)
+	{
+		nv::Model model;
+		bool loaded = model.loadModelFromFile(modelFile.c_str());
+
+		if(!loaded )
+			ASSERT(false);
+
+		if(!model.hasNormals())
+			model.computeNormals();
+
+		model.compileModel( nv::Model::eptTriangles);
+
+		MeshCacheDesc desc;
+		desc.Vertices = model.getCompiledVertices();
+		desc.NumVertices = model.getCompiledVertexCount();
+		desc.VertexStride = model.getCompiledVertexSize() * sizeof(float);
+		desc.NormalOffset = model.getCompiledNormalOffset() * sizeof(float);
+		desc.TexCoordOffset = model.getCompiledTexCoordOffset() * sizeof(float);
+		desc.Indices = model.getCompiledIndices();
+		desc.NumIndices = model.getCompiledIndexCount();
+
+		if (WriteMeshCache(cacheFile, modelFile, desc, true) && mRenderFactory->CreateMeshFromCache(cacheFile, modelFile, &mMesh))
+			return;
+
+		// cache not writable, keep compiled model in memory
+		ElementInitData initData;
+		initData.pData = desc.Vertices;
+		initData.RowPitch = desc.NumVertices * desc.VertexStride;
+		mMesh.VertexBuffer = mRenderFactory->CreateVertexBuffer(&initData);
+
+		initData.pData = desc.Indices;
+		initData.RowPitch = desc.NumIndices * sizeof(uint32_t);
+		mMesh.IndexBuffer = mRenderFactory->CreateIndexBuffer(&initData);
+
+		mMesh.NumVertices = desc.NumVertices;
+		mMesh.NumIndices = desc.NumIndices;
+		mMesh.VertexStride = desc.VertexStride;
+		mMesh.NormalOffset = desc.NormalOffset;
+		mMesh.TexCoordOffset = desc.TexCoordOffset;
+
+		nv::vec3f min, max;
+		model.computeBoundingBox(min, max);
+		mMesh.Bound = BoundingBoxf(float3(min.x, min.y, min.z), float3(max.x, max.y, max.z));
+	}
+
 	void Update(float deltaTime)
 	{
 		CalculateFrameRate();
@@ -429,10 +658,10 @@ public:
 		mRenderDevice->GetCurrentFrameBuffer()->Clear(CF_Color | CF_Depth,
 			ColorRGBA(0.0f, 0.0f, 0.0f, 1.0f), 1.0f, 0);
 
-		mRenderDevice->SetVertexStream(0, mVertexBuffer, 0, mVertexDecl->GetVertexSize());
+		mRenderDevice->SetVertexStream(0, mMesh.VertexBuffer, 0, mMesh.VertexStride);
 		mRenderDevice->SetInputLayout(mVertexDecl);
 
-		mRenderDevice->SetIndexBuffer(mIndexBuffer, IBT_Bit32, 0);
+		mRenderDevice->SetIndexBuffer(mMesh.IndexBuffer, IBT_Bit32, 0);
 
 		mRenderDevice->SetVertexShader(mVertexShader);
 		mRenderDevice->SetPixelShader(mPixelShader);
@@ -442,12 +671,12 @@ public:
 		mRenderDevice->SampleStates[0].BindStage = ST_Pixel;
 		mRenderDevice->SampleStates[0].Filter = TF_Min_Mag_Linear_Mip_Point;
 
-		mRenderDevice->TextureUnits[0] = mDiffuseTexture;
+		mRenderDevice->TextureUnits[0] = mDiffuseTexture->Get();
 
-		mRenderDevice->DrawIndexed(PT_Triangle_List, mModel.getCompiledIndexCount(), 0, 0);
+		mRenderDevice->DrawIndexed(PT_Triangle_List, mMesh.NumIndices, 0, 0);
 
 		std::stringstream sss; 
-		sss << "Vertics: " << mModel.getPositionCount() << "  Face: " << mModel.getIndexCount() / 3 << "  FPS: " << mFramePerSecond;
+		sss << "Vertics: " << mMesh.NumVertices << "  Face: " << mMesh.NumIndices / 3 << "  FPS: " << mFramePerSecond;
 
 		DrawText(sss.str(), 10, 10, ColorRGBA(1, 0, 0, 1));
 	}
@@ -455,11 +684,9 @@ public:
 private:
 	shared_ptr<SimpleVertexShader> mVertexShader;
 	shared_ptr<SimplePixelShader> mPixelShader;
-	shared_ptr<GraphicsBuffer> mVertexBuffer;
-	shared_ptr<GraphicsBuffer> mIndexBuffer;
 	shared_ptr<VertexDeclaration> mVertexDecl;
-	shared_ptr<Texture> mDiffuseTexture;
-	nv::Model mModel;
+	shared_ptr<AsyncResource<Texture> > mDiffuseTexture;
+	CachedMesh mMesh;
 };
 
 #endif
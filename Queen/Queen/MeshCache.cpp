@@ -0,0 +1,355 @@
+#include "MeshCache.h"
+#include <cfloat>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32)
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+namespace {
+
+const uint32_t MeshCacheMagic = 'Q' | ('M' << 8) | ('S' << 16) | ('H' << 24);
+
+// direct mapped post transform cache of Rasterizer
+const uint32_t PostTransformCacheSize = 16;
+
+inline uint64_t AlignUp(uint64_t offset)
+{
+	return (offset + MeshCacheAlignment - 1) & ~uint64_t(MeshCacheAlignment - 1);
+}
+
+bool GetSourceStamp(const std::string& filename, uint64_t* oSize, uint64_t* oTime)
+{
+#if defined(_WIN32)
+	struct _stat64 st;
+	if (_stat64(filename.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+#endif
+
+	*oSize = static_cast<uint64_t>(st.st_size);
+	*oTime = static_cast<uint64_t>(st.st_mtime);
+	return true;
+}
+
+}
+
+MappedFile::MappedFile()
+	: mData(NULL), mSize(0)
+#if defined(_WIN32)
+	, mFile(INVALID_HANDLE_VALUE), mMapping(NULL)
+#endif
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open( const std::string& filename )
+{
+	Close();
+
+#if defined(_WIN32)
+	mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	mMapping = CreateFileMappingA(mFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mMapping == NULL)
+	{
+		Close();
+		return false;
+	}
+
+	mData = static_cast<uint8_t*>(MapViewOfFile(mMapping, FILE_MAP_COPY, 0, 0, 0));
+	if (mData == NULL)
+	{
+		Close();
+		return false;
+	}
+
+	mSize = static_cast<uint64_t>(size.QuadPart);
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// mapping keeps its own reference to the file
+	void* data = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	mData = static_cast<uint8_t*>(data);
+	mSize = static_cast<uint64_t>(st.st_size);
+#endif
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+	if (mData)
+		UnmapViewOfFile(mData);
+
+	if (mMapping != NULL)
+		CloseHandle(mMapping);
+
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = NULL;
+#else
+	if (mData)
+		munmap(mData, static_cast<size_t>(mSize));
+#endif
+
+	mData = NULL;
+	mSize = 0;
+}
+
+bool WriteMeshCache( const std::string& cacheFile, const std::string& sourceFile, const MeshCacheDesc& desc, bool optimizeIndices )
+{
+	ASSERT(desc.VertexStride >= sizeof(float) * 3);
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+
+	if (!GetSourceStamp(sourceFile, &header.SourceSize, &header.SourceTime))
+		return false;
+
+	const uint8_t* srcVertices = static_cast<const uint8_t*>(desc.Vertices);
+	std::vector<uint8_t> vertices(srcVertices, srcVertices + desc.NumVertices * desc.VertexStride);
+	std::vector<uint32_t> indices(desc.Indices, desc.Indices + desc.NumIndices);
+
+	if (optimizeIndices && !indices.empty())
+	{
+		OptimizeVertexCache(&indices[0], desc.NumIndices, desc.NumVertices, PostTransformCacheSize);
+
+		// renumber vertices in first use order, nearby triangles then use distinct cache slots
+		std::vector<uint32_t> remap(desc.NumVertices, UINT32_MAX);
+		uint32_t numRemapped = 0;
+		for (uint32_t& index : indices)
+		{
+			if (remap[index] == UINT32_MAX)
+				remap[index] = numRemapped++;
+			index = remap[index];
+		}
+
+		// unreferenced vertices are kept after referenced ones
+		for (uint32_t v = 0; v < desc.NumVertices; ++v)
+		{
+			if (remap[v] == UINT32_MAX)
+				remap[v] = numRemapped++;
+			memcpy(&vertices[remap[v] * desc.VertexStride], srcVertices + v * desc.VertexStride, desc.VertexStride);
+		}
+
+		header.Flags |= MCF_OptimizedIndices;
+	}
+
+	for (uint32_t k = 0; k < 3; ++k)
+	{
+		header.BoundMin[k] = FLT_MAX;
+		header.BoundMax[k] = -FLT_MAX;
+	}
+
+	for (uint32_t v = 0; v < desc.NumVertices; ++v)
+	{
+		float position[3];
+		memcpy(position, &vertices[v * desc.VertexStride], sizeof(position));
+
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			header.BoundMin[k] = (std::min)(header.BoundMin[k], position[k]);
+			header.BoundMax[k] = (std::max)(header.BoundMax[k], position[k]);
+		}
+	}
+
+	header.Magic = MeshCacheMagic;
+	header.Version = MeshCacheVersion;
+	header.VertexStride = desc.VertexStride;
+	header.NormalOffset = desc.NormalOffset;
+	header.TexCoordOffset = desc.TexCoordOffset;
+	header.NumVertices = desc.NumVertices;
+	header.NumIndices = desc.NumIndices;
+	header.VertexDataOffset = AlignUp(sizeof(MeshCacheHeader));
+	header.IndexDataOffset = AlignUp(header.VertexDataOffset + vertices.size());
+
+	std::ofstream file(cacheFile.c_str(), std::ios::binary);
+	if (!file)
+		return false;
+
+	const char padding[MeshCacheAlignment] = { 0 };
+
+	file.write((const char*)&header, sizeof(header));
+	file.write(padding, header.VertexDataOffset - sizeof(header));
+	if (!vertices.empty())
+		file.write((const char*)&vertices[0], vertices.size());
+	file.write(padding, header.IndexDataOffset - header.VertexDataOffset - vertices.size());
+	if (!indices.empty())
+		file.write((const char*)&indices[0], indices.size() * sizeof(uint32_t));
+
+	if (!file)
+	{
+		file.close();
+		remove(cacheFile.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool OpenMeshCache( const std::string& cacheFile, const std::string& sourceFile, shared_ptr<MappedFile>* oFile, const MeshCacheHeader** oHeader )
+{
+	shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+	if (!file->Open(cacheFile) || file->GetSize() < sizeof(MeshCacheHeader))
+		return false;
+
+	const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file->GetData());
+	if (header->Magic != MeshCacheMagic || header->Version != MeshCacheVersion)
+		return false;
+
+	// a cache shipped without its source is used as is
+	uint64_t sourceSize, sourceTime;
+	if (GetSourceStamp(sourceFile, &sourceSize, &sourceTime) && (sourceSize != header->SourceSize || sourceTime != header->SourceTime))
+		return false;
+
+	// truncated write
+	if (header->VertexDataOffset + uint64_t(header->NumVertices) * header->VertexStride > file->GetSize() ||
+		header->IndexDataOffset + uint64_t(header->NumIndices) * sizeof(uint32_t) > file->GetSize())
+		return false;
+
+	*oFile = file;
+	*oHeader = header;
+	return true;
+}
+
+void OptimizeVertexCache( uint32_t* indices, uint32_t numIndices, uint32_t numVertices, uint32_t cacheSize )
+{
+	const uint32_t numTriangles = numIndices / 3;
+
+	// triangles around each vertex
+	std::vector<uint32_t> triangleOffsets(numVertices + 1, 0);
+	for (uint32_t i = 0; i < numIndices; ++i)
+		triangleOffsets[indices[i] + 1]++;
+	for (uint32_t v = 0; v < numVertices; ++v)
+		triangleOffsets[v + 1] += triangleOffsets[v];
+
+	std::vector<uint32_t> vertexTriangles(numIndices);
+	std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+	for (uint32_t i = 0; i < numIndices; ++i)
+		vertexTriangles[fill[indices[i]]++] = i / 3;
+
+	// triangles left to emit around each vertex
+	std::vector<uint32_t> liveTriangles(numVertices);
+	for (uint32_t v = 0; v < numVertices; ++v)
+		liveTriangles[v] = triangleOffsets[v + 1] - triangleOffsets[v];
+
+	// time stamp a vertex entered cache, it is still cached while time - cacheTime <= cacheSize
+	std::vector<uint32_t> cacheTime(numVertices, 0);
+	std::vector<bool> emitted(numTriangles, false);
+
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> result;
+	result.reserve(numIndices);
+
+	uint32_t time = cacheSize + 1;
+	uint32_t cursor = 0;
+	int64_t fanning = numVertices ? 0 : -1;
+
+	while (fanning >= 0)
+	{
+		const uint32_t f = static_cast<uint32_t>(fanning);
+
+		// emit all triangles around fanning vertex
+		candidates.clear();
+		for (uint32_t t = triangleOffsets[f]; t < triangleOffsets[f + 1]; ++t)
+		{
+			const uint32_t tri = vertexTriangles[t];
+			if (emitted[tri])
+				continue;
+
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				const uint32_t v = indices[tri * 3 + k];
+				result.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				liveTriangles[v]--;
+
+				if (time - cacheTime[v] > cacheSize)
+					cacheTime[v] = time++;
+			}
+
+			emitted[tri] = true;
+		}
+
+		// next fanning vertex is the oldest candidate that stays cached while its triangles are emitted
+		fanning = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t v : candidates)
+		{
+			if (liveTriangles[v] == 0)
+				continue;
+
+			int64_t priority = 0;
+			if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+				priority = time - cacheTime[v];
+
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanning = v;
+			}
+		}
+
+		if (fanning >= 0)
+			continue;
+
+		// dead end, restart at a recently used vertex or else the next vertex in input order
+		while (!deadEnd.empty() && fanning < 0)
+		{
+			const uint32_t v = deadEnd.back();
+			deadEnd.pop_back();
+			if (liveTriangles[v] > 0)
+				fanning = v;
+		}
+
+		while (cursor < numVertices && fanning < 0)
+		{
+			if (liveTriangles[cursor] > 0)
+				fanning = cursor;
+			cursor++;
+		}
+	}
+
+	ASSERT(result.size() == numTriangles * 3);
+	std::copy(result.begin(), result.end(), indices);
+}
@@ -0,0 +1,127 @@
+#ifndef MeshCache_h__
+#define MeshCache_h__
+
+#include "Prerequisite.h"
+#include <BoundingBox.hpp>
+
+using RxLib::BoundingBoxf;
+
+// bump when MeshCacheHeader or data layout changes, caches of other versions are rebuilt
+#define MeshCacheVersion 1
+
+// vertex and index data start at this alignment in the file, and so in the file mapping
+#define MeshCacheAlignment 64
+
+enum MeshCacheFlags
+{
+	// triangles reordered for post transform cache, vertices renumbered in first use order
+	MCF_OptimizedIndices = 1UL << 0
+};
+
+/**
+ * Layout of a mesh cache file: header, vertex data, index data. Size and modification time
+ * of the source the cache was built from invalidate it when the source changes.
+ */
+struct MeshCacheHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t Flags;
+
+	// in bytes, position is float3 at offset 0 of each vertex
+	uint32_t VertexStride;
+	uint32_t NormalOffset;
+	uint32_t TexCoordOffset;
+
+	uint32_t NumVertices;
+	uint32_t NumIndices;
+
+	// from start of file
+	uint64_t VertexDataOffset;
+	uint64_t IndexDataOffset;
+
+	uint64_t SourceSize;
+	uint64_t SourceTime;
+
+	float BoundMin[3];
+	float BoundMax[3];
+};
+
+/**
+ * Interleaved vertices and 32 bit triangle list indices written to a mesh cache.
+ */
+struct MeshCacheDesc
+{
+	const void* Vertices;
+	uint32_t NumVertices;
+	uint32_t VertexStride;
+	uint32_t NormalOffset;
+	uint32_t TexCoordOffset;
+
+	const uint32_t* Indices;
+	uint32_t NumIndices;
+};
+
+/**
+ * Buffers over the mapping of a mesh cache, created by RenderFactory::CreateMeshFromCache.
+ */
+struct CachedMesh
+{
+	shared_ptr<GraphicsBuffer> VertexBuffer;
+	shared_ptr<GraphicsBuffer> IndexBuffer;
+
+	uint32_t NumVertices, NumIndices;
+	uint32_t VertexStride, NormalOffset, TexCoordOffset;
+
+	BoundingBoxf Bound;
+};
+
+/**
+ * Whole file mapped for reading. Pages are copy on write, so a buffer over the mapping may
+ * be mapped for writing without changing the file.
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	uint8_t* GetData() const		{ return mData; }
+	uint64_t GetSize() const		{ return mSize; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator= (const MappedFile&);
+
+private:
+	uint8_t* mData;
+	uint64_t mSize;
+
+#if defined(_WIN32)
+	HANDLE mFile;
+	HANDLE mMapping;
+#endif
+};
+
+/**
+ * Write mesh cache of sourceFile. With optimizeIndices triangles are reordered for the
+ * post transform cache, which takes a while but is only done once per source.
+ */
+bool WriteMeshCache(const std::string& cacheFile, const std::string& sourceFile, const MeshCacheDesc& desc, bool optimizeIndices);
+
+/**
+ * Map mesh cache, fails if it is missing, of another version or older than sourceFile.
+ * oHeader points into oFile.
+ */
+bool OpenMeshCache(const std::string& cacheFile, const std::string& sourceFile, shared_ptr<MappedFile>* oFile, const MeshCacheHeader** oHeader);
+
+/**
+ * Reorder triangles so consecutive triangles share vertices of a cache of cacheSize
+ * vertices, Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw".
+ */
+void OptimizeVertexCache(uint32_t* indices, uint32_t numIndices, uint32_t numVertices, uint32_t cacheSize);
+
+#endif // MeshCache_h__
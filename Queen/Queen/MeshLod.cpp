@@ -0,0 +1,278 @@
+#include "MeshLod.h"
+#include <cfloat>
+
+using namespace RxLib;
+
+namespace {
+
+/**
+ * Sum of squared distances to planes, p^T A p + 2 B.p + C with symmetric A. Weight counts
+ * the planes, so Evaluate / Weight is mean squared distance.
+ */
+struct Quadric
+{
+	Quadric() { memset(this, 0, sizeof(Quadric)); }
+
+	void AddPlane(double a, double b, double c, double d)
+	{
+		A00 += a*a; A01 += a*b; A02 += a*c;
+		A11 += b*b; A12 += b*c; A22 += c*c;
+		B0 += a*d; B1 += b*d; B2 += c*d;
+		C += d*d;
+		Weight += 1.0;
+	}
+
+	Quadric& operator+= (const Quadric& rhs)
+	{
+		A00 += rhs.A00; A01 += rhs.A01; A02 += rhs.A02;
+		A11 += rhs.A11; A12 += rhs.A12; A22 += rhs.A22;
+		B0 += rhs.B0; B1 += rhs.B1; B2 += rhs.B2;
+		C += rhs.C;
+		Weight += rhs.Weight;
+		return *this;
+	}
+
+	double Evaluate(const float3& p) const
+	{
+		const double x = p.X(), y = p.Y(), z = p.Z();
+		return A00*x*x + A11*y*y + A22*z*z + 2.0 * (A01*x*y + A02*x*z + A12*y*z) + 2.0 * (B0*x + B1*y + B2*z) + C;
+	}
+
+	double MeanError(const float3& p) const
+	{
+		return (Weight > 0.0) ? Evaluate(p) / Weight : 0.0;
+	}
+
+	double A00, A01, A02, A11, A12, A22;
+	double B0, B1, B2;
+	double C;
+	double Weight;
+};
+
+struct PositionKey
+{
+	uint32_t Bits[3];
+
+	bool operator== (const PositionKey& rhs) const
+	{
+		return Bits[0] == rhs.Bits[0] && Bits[1] == rhs.Bits[1] && Bits[2] == rhs.Bits[2];
+	}
+};
+
+struct PositionKeyHash
+{
+	size_t operator() (const PositionKey& key) const
+	{
+		return (key.Bits[0] * 73856093u) ^ (key.Bits[1] * 19349663u) ^ (key.Bits[2] * 83492791u);
+	}
+};
+
+struct Collapse
+{
+	double Cost;
+	uint32_t From, To;
+};
+
+inline uint64_t EdgeKey(uint32_t a, uint32_t b)
+{
+	return (a < b) ? (uint64_t(a) << 32 | b) : (uint64_t(b) << 32 | a);
+}
+
+}
+
+std::vector<uint32_t> SimplifyMesh( const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices,
+	uint32_t targetIndexCount, float* oError )
+{
+	std::vector<uint32_t> result(indices, indices + numIndices);
+	*oError = 0.0f;
+
+	if (numIndices <= targetIndexCount)
+		return result;
+
+	std::vector<bool> locked(numVertices, false);
+
+	// vertices sharing a position with another vertex are on an attribute seam
+	std::unordered_map<PositionKey, uint32_t, PositionKeyHash> positionVertex;
+	for (uint32_t v = 0; v < numVertices; ++v)
+	{
+		PositionKey key;
+		memcpy(key.Bits, &positions[v], sizeof(key.Bits));
+
+		auto it = positionVertex.find(key);
+		if (it != positionVertex.end())
+			locked[v] = locked[it->second] = true;
+		else
+			positionVertex[key] = v;
+	}
+
+	// open border edges are used by one triangle
+	std::unordered_map<uint64_t, uint32_t> edgeUse;
+	for (uint32_t i = 0; i < numIndices; i += 3)
+	{
+		for (uint32_t k = 0; k < 3; ++k)
+			edgeUse[EdgeKey(indices[i + k], indices[i + (k + 1) % 3])]++;
+	}
+
+	for (auto it = edgeUse.begin(); it != edgeUse.end(); ++it)
+	{
+		if (it->second == 1)
+			locked[uint32_t(it->first >> 32)] = locked[uint32_t(it->first)] = true;
+	}
+
+	// planes of original triangles
+	std::vector<Quadric> quadrics(numVertices);
+	for (uint32_t i = 0; i < numIndices; i += 3)
+	{
+		const float3& p0 = positions[indices[i + 0]];
+		const float3& p1 = positions[indices[i + 1]];
+		const float3& p2 = positions[indices[i + 2]];
+
+		float3 normal = Cross(p1 - p0, p2 - p0);
+		const float area = Length(normal);
+		if (area <= 0.0f)
+			continue;
+
+		normal = normal / area;
+		const float d = -Dot(normal, p0);
+		for (uint32_t k = 0; k < 3; ++k)
+			quadrics[indices[i + k]].AddPlane(normal.X(), normal.Y(), normal.Z(), d);
+	}
+
+	std::vector<uint32_t> triangleOffsets(numVertices + 1);
+	std::vector<uint32_t> vertexTriangles;
+	std::vector<Collapse> collapses;
+	std::vector<bool> touched(numVertices);
+	std::vector<uint32_t> remap(numVertices);
+
+	double maxCost = 0.0;
+
+	while (result.size() > targetIndexCount)
+	{
+		const uint32_t numTriangles = static_cast<uint32_t>(result.size() / 3);
+
+		// triangles around each vertex of current index list
+		std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+		for (uint32_t i = 0; i < result.size(); ++i)
+			triangleOffsets[result[i] + 1]++;
+		for (uint32_t v = 0; v < numVertices; ++v)
+			triangleOffsets[v + 1] += triangleOffsets[v];
+
+		vertexTriangles.resize(result.size());
+		std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+		for (uint32_t i = 0; i < result.size(); ++i)
+			vertexTriangles[fill[result[i]]++] = i / 3;
+
+		// interior edges appear once in each direction, take the cheaper collapse of each edge
+		collapses.clear();
+		for (uint32_t i = 0; i < result.size(); i += 3)
+		{
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				const uint32_t a = result[i + k];
+				const uint32_t b = result[i + (k + 1) % 3];
+				if (a > b || (locked[a] && locked[b]))
+					continue;
+
+				const double costAB = locked[a] ? DBL_MAX : quadrics[a].MeanError(positions[b]);
+				const double costBA = locked[b] ? DBL_MAX : quadrics[b].MeanError(positions[a]);
+
+				Collapse collapse;
+				collapse.Cost = (std::min)(costAB, costBA);
+				collapse.From = (costAB <= costBA) ? a : b;
+				collapse.To = (costAB <= costBA) ? b : a;
+				collapses.push_back(collapse);
+			}
+		}
+
+		if (collapses.empty())
+			break;
+
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& lhs, const Collapse& rhs) { return lhs.Cost < rhs.Cost; });
+
+		// vertices around a collapse are not changed again in this pass, so costs and flip tests stay valid
+		std::fill(touched.begin(), touched.end(), false);
+		for (uint32_t v = 0; v < numVertices; ++v)
+			remap[v] = v;
+
+		uint32_t trianglesLeft = numTriangles;
+		uint32_t numCollapsed = 0;
+
+		for (const Collapse& collapse : collapses)
+		{
+			if (trianglesLeft * 3 <= targetIndexCount)
+				break;
+
+			if (touched[collapse.From] || touched[collapse.To])
+				continue;
+
+			const float3& target = positions[collapse.To];
+
+			// reject collapse if any remaining triangle around From flips
+			bool flips = false;
+			uint32_t numRemoved = 0;
+			for (uint32_t t = triangleOffsets[collapse.From]; t < triangleOffsets[collapse.From + 1] && !flips; ++t)
+			{
+				const uint32_t* tri = &result[vertexTriangles[t] * 3];
+				if (tri[0] == collapse.To || tri[1] == collapse.To || tri[2] == collapse.To)
+				{
+					numRemoved++;
+					continue;
+				}
+
+				const float3& p0 = positions[tri[0]];
+				const float3& p1 = positions[tri[1]];
+				const float3& p2 = positions[tri[2]];
+				const float3 before = Cross(p1 - p0, p2 - p0);
+
+				const float3& q0 = (tri[0] == collapse.From) ? target : p0;
+				const float3& q1 = (tri[1] == collapse.From) ? target : p1;
+				const float3& q2 = (tri[2] == collapse.From) ? target : p2;
+				const float3 after = Cross(q1 - q0, q2 - q0);
+
+				flips = (Dot(before, after) <= 0.0f);
+			}
+
+			if (flips)
+				continue;
+
+			for (uint32_t t = triangleOffsets[collapse.From]; t < triangleOffsets[collapse.From + 1]; ++t)
+			{
+				const uint32_t* tri = &result[vertexTriangles[t] * 3];
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = true;
+			}
+			touched[collapse.To] = true;
+
+			remap[collapse.From] = collapse.To;
+			quadrics[collapse.To] += quadrics[collapse.From];
+
+			trianglesLeft -= numRemoved;
+			maxCost = (std::max)(maxCost, collapse.Cost);
+			numCollapsed++;
+		}
+
+		if (numCollapsed == 0)
+			break;
+
+		// remove triangles degenerated by collapses
+		uint32_t numWritten = 0;
+		for (uint32_t i = 0; i < result.size(); i += 3)
+		{
+			const uint32_t a = remap[result[i + 0]];
+			const uint32_t b = remap[result[i + 1]];
+			const uint32_t c = remap[result[i + 2]];
+
+			if (a == b || b == c || a == c)
+				continue;
+
+			result[numWritten++] = a;
+			result[numWritten++] = b;
+			result[numWritten++] = c;
+		}
+		result.resize(numWritten);
+	}
+
+	// root mean squared distance to planes of original triangles around collapsed vertices
+	*oError = static_cast<float>(sqrt((std::max)(maxCost, 0.0)));
+
+	return result;
+}
@@ -0,0 +1,45 @@
+#ifndef MeshLod_h__
+#define MeshLod_h__
+
+#include "Prerequisite.h"
+#include <Vector.hpp>
+
+using RxLib::float3;
+
+// upper limit of LODs generated by RenderFactory::CreateLodChain
+#define MaxMeshLods 8
+
+// a draw switches to a coarser LOD once its projected error is this fraction below the limit
+#define LodHysteresis 0.25f
+
+/**
+ * Index buffer of one detail level, all LODs of a chain share the vertex buffer.
+ * Error is object space distance the simplified surface may deviate from LOD 0.
+ */
+struct MeshLod
+{
+	shared_ptr<GraphicsBuffer> IndexBuffer;
+	uint32_t NumIndices;
+	float Error;
+};
+
+struct MeshLodChain
+{
+	// finest first
+	std::vector<MeshLod> Lods;
+
+	// object space bounding sphere, projected error is measured at its nearest point
+	float3 Center;
+	float Radius;
+};
+
+/**
+ * Quadric error edge collapse on index buffer, vertices collapse onto existing vertices so
+ * the vertex buffer is kept. Vertices on open borders and attribute seams are locked.
+ * Returns simplified index list with at most targetIndexCount indices if reachable, and
+ * object space error in oError.
+ */
+std::vector<uint32_t> SimplifyMesh(const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices,
+	uint32_t targetIndexCount, float* oError);
+
+#endif // MeshLod_h__
@@ -0,0 +1,52 @@
+#ifndef Meshlet_h__
+#define Meshlet_h__
+
+#include "Prerequisite.h"
+#include <Vector.hpp>
+
+using RxLib::float3;
+
+// cluster limits, 126 triangles keep local index list of a cluster under 384 bytes
+#define MaxMeshletVertices 64
+#define MaxMeshletTriangles 126
+
+/**
+ * Cluster of triangles sharing at most MaxMeshletVertices vertices. Triangles index
+ * the cluster vertex list, which indexes the vertex stream.
+ */
+struct Meshlet
+{
+	// first vertex in MeshletBuffer::Vertices, first triangle in MeshletBuffer::Triangles
+	uint32_t VertexOffset;
+	uint32_t TriangleOffset;
+
+	uint32_t VertexCount;
+	uint32_t TriangleCount;
+
+	// object space bounding sphere
+	float3 Center;
+	float Radius;
+
+	/**
+	 * Normal cone of cross(v1 - v0, v2 - v0). All triangles face away from a viewer at
+	 * eye if dot(Center - eye, ConeAxis) >= ConeCutoff * |Center - eye| + Radius.
+	 * ConeCutoff is above 1 when normals spread over a hemisphere.
+	 */
+	float3 ConeAxis;
+	float ConeCutoff;
+};
+
+struct MeshletBuffer
+{
+	std::vector<Meshlet> Meshlets;
+
+	// vertex stream indices of all clusters
+	std::vector<uint32_t> Vertices;
+
+	// three cluster local vertex indices per triangle, triangle i starts at Triangles[i * 3]
+	std::vector<uint8_t> Triangles;
+
+	uint32_t NumTriangles;
+};
+
+#endif // Meshlet_h__
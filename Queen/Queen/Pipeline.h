@@ -0,0 +1,78 @@
+#ifndef Pipeline_h__
+#define Pipeline_h__
+
+#include "Prerequisite.h"
+#include "Shader.h"
+#include "Rasterizer.h"
+
+/**
+ * Pixel shader call of the tile loops. The generic policy calls Execute through the vtable,
+ * it is used by draws without a pipeline.
+ */
+struct VirtualPixelShading
+{
+	static bool Execute(PixelShader& shader, const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		return shader.Execute(input, output, pDepthIO);
+	}
+};
+
+// calls Execute of PS by name, so it is inlined into tile loops instantiated for PS
+template <typename PS>
+struct StaticPixelShading
+{
+	static bool Execute(PixelShader& shader, const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		return static_cast<PS&>(shader).PS::Execute(input, output, pDepthIO);
+	}
+};
+
+/**
+ * Vertex and pixel shader bound together with RenderDevice::SetPipeline. Tiled draws rasterize
+ * their tiles through the pipeline with one virtual call per tile.
+ */
+class ShaderPipeline
+{
+public:
+	virtual ~ShaderPipeline() {}
+
+	const shared_ptr<VertexShader>& GetVertexShader() const	{ return mVertexShader; }
+	const shared_ptr<PixelShader>& GetPixelShader() const		{ return mPixelShader; }
+
+	virtual void RasterizeTile(Rasterizer& rasterizer, Rasterizer::RasterBatch& batch, Rasterizer::Tile& tile) const = 0;
+
+protected:
+	ShaderPipeline(const shared_ptr<VertexShader>& vs, const shared_ptr<PixelShader>& ps)
+		: mVertexShader(vs), mPixelShader(ps) {}
+
+protected:
+	shared_ptr<VertexShader> mVertexShader;
+	shared_ptr<PixelShader> mPixelShader;
+};
+
+/**
+ * Pipeline of concrete shader types. Tile loops, attribute interpolation and depth, stencil
+ * and color writes are instantiated for PS, so the compiler can inline its Execute and keep
+ * its uniforms in registers across pixels. Uniforms are set through the shared shaders as
+ * with the virtual API.
+ *
+ *   shared_ptr< Pipeline<MyVS, MyPS> > pipeline = std::make_shared< Pipeline<MyVS, MyPS> >(vs, ps);
+ *   device.SetPipeline(pipeline);
+ */
+template <typename VS, typename PS>
+class Pipeline : public ShaderPipeline
+{
+public:
+	Pipeline(const shared_ptr<VS>& vs, const shared_ptr<PS>& ps)
+		: ShaderPipeline(vs, ps) {}
+
+	VS& GetVS() const	{ return static_cast<VS&>(*mVertexShader); }
+	PS& GetPS() const	{ return static_cast<PS&>(*mPixelShader); }
+
+	virtual void RasterizeTile(Rasterizer& rasterizer, Rasterizer::RasterBatch& batch, Rasterizer::Tile& tile) const
+	{
+		rasterizer.RasterizeTile< StaticPixelShading<PS> >(batch, tile);
+	}
+};
+
+#endif // Pipeline_h__
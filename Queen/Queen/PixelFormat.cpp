@@ -608,7 +608,7 @@ uint32_t PixelFormatUtils::GetMemorySize( uint32_t width, uint32_t height, uint3
 			return ((width+3)/4)*((height+3)/4)*16 * depth;
 
 		default:
-			throw std::exception("Invalid compressed pixel format") ;
+			throw std::runtime_error("Invalid compressed pixel format") ;
 		}
 	}
 	else
@@ -712,5 +712,5 @@ PixelFormat PixelFormatUtils::GetPixelFormat( const String& value )
 		}
 	}
 	
-	throw std::exception("Unsupported pixel format") ;
+	throw std::runtime_error("Unsupported pixel format") ;
 }
\ No newline at end of file
@@ -22,8 +22,14 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cassert>
+#include <stdexcept>
 
-#include <windows.h>
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
 
 using std::vector;
 using std::shared_ptr;
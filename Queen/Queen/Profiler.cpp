@@ -1,37 +1,180 @@
 #include "Profiler.h"
-#include <cassert>
+#include <JobSystem.h>
+#include <fstream>
+#include <iomanip>
+#include <map>
 
-using std::chrono::duration_cast;
-using std::chrono::milliseconds;
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <chrono>
+#endif
 
-Profiler::Profiler(void)
+std::atomic<Profiler::ThreadLog*> Profiler::msThreadLogs[MaxThreads];
+std::atomic<uint32_t> Profiler::msNumThreadLogs(0);
+std::atomic<uint32_t> Profiler::msNumFrames(0);
+
+namespace {
+
+// Profiler::ThreadLog of this thread, allocated on first marker
+RX_THREAD_LOCAL void* tlsThreadLog = nullptr;
+
+}
+
+int64_t Profiler::Now()
 {
+#if defined(_WIN32)
+	// high_resolution_clock of VC110 is system_clock, use performance counter
+	static LARGE_INTEGER frequency = { 0 };
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+
+	// split to avoid overflow of counter * 1e9
+	const int64_t seconds = counter.QuadPart / frequency.QuadPart;
+	const int64_t remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * 1000000000LL + remainder * 1000000000LL / frequency.QuadPart;
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
 }
 
+Profiler::ThreadLog* Profiler::GetThreadLog()
+{
+	ThreadLog* log = static_cast<ThreadLog*>(tlsThreadLog);
+	if (log)
+		return log;
+
+	// too many threads, markers of this thread are dropped
+	if (msNumThreadLogs.load() >= MaxThreads)
+		return nullptr;
 
-Profiler::~Profiler(void)
+	const uint32_t slot = msNumThreadLogs.fetch_add(1);
+	if (slot >= MaxThreads)
+		return nullptr;
+
+	// logs live until process exit
+	log = new ThreadLog;
+	log->Head.store(0);
+
+	msThreadLogs[slot].store(log);
+	tlsThreadLog = log;
+	return log;
+}
+
+template <typename Function>
+void Profiler::ForEachEvent( const Function& func )
 {
+	const uint32_t numLogs = (std::min)(msNumThreadLogs.load(), (uint32_t)MaxThreads);
+	for (uint32_t i = 0; i < numLogs; ++i)
+	{
+		// slot is reserved before its log is published
+		const ThreadLog* log = msThreadLogs[i].load();
+		if (!log)
+			continue;
+
+		const uint64_t head = log->Head.load(std::memory_order_acquire);
+		const uint64_t first = (head > MaxEventsPerThread) ? head - MaxEventsPerThread : 0;
+
+		for (uint64_t e = first; e < head; ++e)
+			func(i, log->Events[e & (MaxEventsPerThread - 1)]);
+	}
 }
 
-void Profiler::StartTimer( const std::string& name, const std::string& desc /*= ""*/ )
+void Profiler::Record( const char* name, int64_t begin, int64_t end )
 {
-	ProfierElement& profiler = mElements[name];
-	profiler.Description = desc;
-	profiler.StartTime = std::chrono::system_clock::now();
+	ThreadLog* log = GetThreadLog();
+	if (!log)
+		return;
+
+	const uint64_t head = log->Head.load(std::memory_order_relaxed);
+
+	Event& evt = log->Events[head & (MaxEventsPerThread - 1)];
+	evt.Name = name;
+	evt.Begin = begin;
+	evt.End = end;
+
+	log->Head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::NextFrame()
+{
+	msNumFrames.fetch_add(1);
+}
+
+void Profiler::Reset()
+{
+	const uint32_t numLogs = (std::min)(msNumThreadLogs.load(), (uint32_t)MaxThreads);
+	for (uint32_t i = 0; i < numLogs; ++i)
+	{
+		ThreadLog* log = msThreadLogs[i].load();
+		if (log)
+			log->Head.store(0);
+	}
+
+	msNumFrames.store(0);
 }
 
-void Profiler::EndTimer(const std::string& name)
+bool Profiler::ExportChromeTrace( const std::string& filename )
 {
-	auto profiler = mElements.find(name);
-	assert(profiler != mElements.end());
+	std::ofstream file(filename.c_str());
+	if (!file)
+		return false;
 
-	profiler->second.EndTime = std::chrono::system_clock::now();
+	// timestamps relative to earliest event, in microseconds
+	int64_t origin = INT64_MAX;
+	ForEachEvent([&origin](uint32_t, const Event& evt) {
+		origin = (std::min)(origin, evt.Begin); });
+
+	file << "{\"traceEvents\":[";
+	file << std::fixed << std::setprecision(3);
+
+	bool first = true;
+	ForEachEvent([&](uint32_t thread, const Event& evt) {
+		file << (first ? "\n" : ",\n");
+		file << "{\"name\":\"" << evt.Name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread
+			 << ",\"ts\":" << (evt.Begin - origin) / 1000.0 << ",\"dur\":" << (evt.End - evt.Begin) / 1000.0 << "}";
+		first = false;
+	});
+
+	file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+	return !!file;
 }
 
-long long Profiler::GetElapsedTime( const std::string& name )
+void Profiler::PrintSummary( std::ostream& os )
 {
-	auto profiler = mElements.find(name);
-	assert(profiler != mElements.end());
+	struct Stage
+	{
+		Stage() : Count(0), Total(0), Max(0) {}
+
+		uint64_t Count;
+		int64_t Total, Max;
+	};
+
+	// same literal may have different addresses in different translation units, group by content
+	std::map<std::string, Stage> stages;
+	ForEachEvent([&stages](uint32_t, const Event& evt) {
+		Stage& stage = stages[evt.Name];
+		stage.Count++;
+		stage.Total += evt.End - evt.Begin;
+		stage.Max = (std::max)(stage.Max, evt.End - evt.Begin);
+	});
+
+	const uint32_t numFrames = msNumFrames.load();
+	const double perFrame = 1.0 / (std::max)(numFrames, 1U);
+
+	os << std::fixed << std::setprecision(3);
+	os << std::left << std::setw(32) << "Stage" << std::right << std::setw(10) << "Count" << std::setw(14) << "Total ms"
+	   << std::setw(14) << "ms/frame" << std::setw(12) << "Max ms" << "  (" << numFrames << " frames)" << std::endl;
 
-	return duration_cast<milliseconds>(profiler->second.EndTime - profiler->second.StartTime).count();
+	for (auto it = stages.begin(); it != stages.end(); ++it)
+	{
+		const Stage& stage = it->second;
+		os << std::left << std::setw(32) << it->first << std::right << std::setw(10) << stage.Count
+		   << std::setw(14) << stage.Total / 1e6 << std::setw(14) << stage.Total / 1e6 * perFrame
+		   << std::setw(12) << stage.Max / 1e6 << std::endl;
+	}
 }
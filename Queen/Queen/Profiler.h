@@ -2,36 +2,91 @@
 #define Profiler_h__
 
 #include <string>
-#include <unordered_map>
-#include <chrono>
-#include <vector>
+#include <ostream>
+#include <atomic>
+#include <cstdint>
 
-using std::chrono::system_clock;
+// set to 0 to compile out all profile markers
+#ifndef QUEEN_PROFILE
+	#define QUEEN_PROFILE 1
+#endif
 
+/**
+ * Tracing profiler. Each thread records markers into its own ring buffer without locks,
+ * oldest markers are overwritten when a ring is full. Marker names must be string literals.
+ * Export and summary read all rings, call them when no thread is recording.
+ */
 class Profiler
 {
-private:
-	struct ProfierElement
+public:
+	enum { MaxThreads = 64, MaxEventsPerThread = 1 << 16 };
+
+	struct Event
 	{
-		std::string Description;
-		system_clock::time_point StartTime;
-		system_clock::time_point EndTime;
+		const char* Name;
+		int64_t Begin, End;		// in nanoseconds
 	};
 
 public:
-	Profiler(void);
-	~Profiler(void);
+	// monotonic high resolution time in nanoseconds
+	static int64_t Now();
+
+	static void Record(const char* name, int64_t begin, int64_t end);
+
+	// frame boundary, summary averages stage time over frames recorded
+	static void NextFrame();
 
+	// drop all recorded markers and frames
+	static void Reset();
 
-	void StartTimer(const std::string& name, const std::string& desc = "");
-	void EndTimer(const std::string& name);
-	long long GetElapsedTime(const std::string& name);
+	// chrome://tracing JSON, one row per thread
+	static bool ExportChromeTrace(const std::string& filename);
+
+	// per marker name count, total and per frame time
+	static void PrintSummary(std::ostream& os);
+
+private:
+	struct ThreadLog
+	{
+		// only the owner thread writes events and advances head
+		std::atomic<uint64_t> Head;
+		Event Events[MaxEventsPerThread];
+	};
 
-protected:
-	
-	std::unordered_map<std::string, ProfierElement> mElements;
+	static ThreadLog* GetThreadLog();
 
+	// call func(threadIndex, event) for each event still in the rings
+	template <typename Function>
+	static void ForEachEvent(const Function& func);
+
+private:
+	static std::atomic<ThreadLog*> msThreadLogs[MaxThreads];
+	static std::atomic<uint32_t> msNumThreadLogs;
+	static std::atomic<uint32_t> msNumFrames;
 };
 
+class ProfileScope
+{
+public:
+	ProfileScope(const char* name) : mName(name), mBegin(Profiler::Now()) {}
+	~ProfileScope() { Profiler::Record(mName, mBegin, Profiler::Now()); }
+
+private:
+	const char* mName;
+	int64_t mBegin;
+};
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+
+#if QUEEN_PROFILE
+	#define PROFILE_SCOPE(name)					ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+	#define PROFILE_RECORD(name, begin, end)	Profiler::Record(name, begin, end)
+	#define PROFILE_NEXT_FRAME()				Profiler::NextFrame()
+#else
+	#define PROFILE_SCOPE(name)
+	#define PROFILE_RECORD(name, begin, end)
+	#define PROFILE_NEXT_FRAME()
+#endif
 
 #endif // Profiler_h__
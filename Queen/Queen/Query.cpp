@@ -0,0 +1,43 @@
+#include "Query.h"
+
+PipelineStatistics& PipelineStatistics::operator+=( const PipelineStatistics& rhs )
+{
+	IAVertices += rhs.IAVertices;
+	IAPrimitives += rhs.IAPrimitives;
+	VSInvocations += rhs.VSInvocations;
+	CulledPrimitives += rhs.CulledPrimitives;
+	CInvocations += rhs.CInvocations;
+	ClippedPrimitives += rhs.ClippedPrimitives;
+	CPrimitives += rhs.CPrimitives;
+	PSInvocations += rhs.PSInvocations;
+	PSKilledPixels += rhs.PSKilledPixels;
+	DepthKilledPixels += rhs.DepthKilledPixels;
+	StencilKilledPixels += rhs.StencilKilledPixels;
+	TexelFetches += rhs.TexelFetches;
+	TexelCacheMisses += rhs.TexelCacheMisses;
+	return *this;
+}
+
+PipelineStatistics& PipelineStatistics::operator-=( const PipelineStatistics& rhs )
+{
+	IAVertices -= rhs.IAVertices;
+	IAPrimitives -= rhs.IAPrimitives;
+	VSInvocations -= rhs.VSInvocations;
+	CulledPrimitives -= rhs.CulledPrimitives;
+	CInvocations -= rhs.CInvocations;
+	ClippedPrimitives -= rhs.ClippedPrimitives;
+	CPrimitives -= rhs.CPrimitives;
+	PSInvocations -= rhs.PSInvocations;
+	PSKilledPixels -= rhs.PSKilledPixels;
+	DepthKilledPixels -= rhs.DepthKilledPixels;
+	StencilKilledPixels -= rhs.StencilKilledPixels;
+	TexelFetches -= rhs.TexelFetches;
+	TexelCacheMisses -= rhs.TexelCacheMisses;
+	return *this;
+}
+
+Query::Query( QueryType type )
+	: mType(type), mBeginBatch(0), mEndBatch(0), mActive(false), mPixelBegun(false), mPixelEnded(false)
+{
+
+}
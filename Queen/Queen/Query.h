@@ -0,0 +1,77 @@
+#ifndef Query_h__
+#define Query_h__
+
+#include "Prerequisite.h"
+#include <cstring>
+
+enum QueryType
+{
+	QT_PipelineStatistics,
+
+	// samples passing depth test, D3D11_QUERY_OCCLUSION
+	QT_Occlusion
+};
+
+/**
+ * Pipeline counters in the spirit of D3D11_QUERY_DATA_PIPELINE_STATISTICS.
+ */
+struct PipelineStatistics
+{
+	PipelineStatistics() { memset(this, 0, sizeof(PipelineStatistics)); }
+
+	PipelineStatistics& operator+= (const PipelineStatistics& rhs);
+	PipelineStatistics& operator-= (const PipelineStatistics& rhs);
+
+	// vertices missed in post transform cache are shaded, the others are cache hits
+	uint64_t GetVertexCacheHits() const { return IAVertices - VSInvocations; }
+
+	// shaded pixels which are neither killed nor fail depth test
+	uint64_t GetSamplesPassed() const { return PSInvocations - PSKilledPixels - DepthKilledPixels; }
+
+	uint64_t IAVertices;			// indices read by input assembler
+	uint64_t IAPrimitives;
+	uint64_t VSInvocations;
+
+	uint64_t CulledPrimitives;		// back facing or outside frustum, culled before clipping
+	uint64_t CInvocations;			// primitives reaching the clipper
+	uint64_t ClippedPrimitives;		// primitives crossing near, far or guard band planes
+	uint64_t CPrimitives;			// triangles leaving the clipper
+
+	uint64_t PSInvocations;
+	uint64_t PSKilledPixels;		// pixel shader returned false
+	uint64_t DepthKilledPixels;		// failed depth test after shading
+	uint64_t StencilKilledPixels;	// failed stencil test before shading, not counted as invocations
+
+	// only counted with RenderDevice::SetTexelCacheSimulationEnable
+	uint64_t TexelFetches;			// texels read by sampling
+	uint64_t TexelCacheMisses;		// fetches missing the simulated texel cache of their worker
+};
+
+/**
+ * Counts work of draws issued between RenderDevice::BeginQuery and EndQuery. Tiled draws are
+ * shaded asynchronously, so pixel counters are only available once those draws are shaded.
+ */
+class Query
+{
+	friend class Rasterizer;
+
+public:
+	Query(QueryType type);
+
+	QueryType GetType() const	{ return mType; }
+
+private:
+	QueryType mType;
+
+	// issued tiled draws at begin and end, pixel counters are sampled when these are shaded
+	uint64_t mBeginBatch, mEndBatch;
+
+	bool mActive;
+
+	// pixel counters sampled at begin and end
+	bool mPixelBegun, mPixelEnded;
+
+	PipelineStatistics mBegin, mEnd;
+};
+
+#endif // Query_h__
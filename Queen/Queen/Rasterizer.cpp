@@ -1,9 +1,14 @@
 #include "Rasterizer.h"
 #include "RenderDevice.h"
+#include "Pipeline.h"
 #include "FrameBuffer.h"
+#include "Texture.h"
 #include "Cache.hpp"
 #include "threadpool.h"
 #include "stack_pool.h"
+#include <MathUtil.hpp>
+#include <algorithm>
+#include <chrono>
 
 using namespace RxLib;
 
@@ -26,7 +31,7 @@ inline bool FCMP(float a, float b, float epsilon = FLOAT_EQUAL_PRECISION)
 
 inline int32_t iround(float x)
 {
-	return _mm_cvt_ss2si( _mm_load_ps( &x ) ); 
+	return _mm_cvt_ss2si( _mm_set_ss( x ) );
 }
 
 inline void VS_Output_Copy(VS_Output* dest, const VS_Output* src, uint32_t numAttri)
@@ -56,15 +61,6 @@ inline void VS_Output_Add(VS_Output* out, const VS_Output* a, const VS_Output* b
 	}
 }
 
-inline void VS_Output_Mul(VS_Output* out, const VS_Output* in, float val, uint32_t numAttri)
-{
-	out->Position = in->Position * val;
-	for (uint32_t i = 0; i < numAttri; ++i)
-	{
-		out->ShaderOutputs[i]  = in->ShaderOutputs[i] * val;
-	}
-}
-
 inline void VS_Output_Difference(VS_Output* ddx, VS_Output* ddy, const VS_Output* v01, const VS_Output* v02, float invArea, uint32_t numAttri)
 {
 	const float v01XInvArea = v01->Position.X() * invArea;
@@ -85,16 +81,6 @@ inline void VS_Output_Difference(VS_Output* ddx, VS_Output* ddy, const VS_Output
 	}
 }
 
-inline void VS_Output_BaryCentric(VS_Output* out, const VS_Output* base, const VS_Output* ddx, const VS_Output* ddy,
-								 float offsetX, float offsetY, uint32_t numAttri)
-{
-	out->Position = base->Position + ddx->Position * offsetX + ddy->Position * offsetY;
-	for (uint32_t i = 0; i < numAttri; ++i)
-	{
-		out->ShaderOutputs[i]  = base->ShaderOutputs[i] + ddx->ShaderOutputs[i] * offsetX + ddy->ShaderOutputs[i] * offsetY;
-	}
-}
-
 inline void VS_Output_ProjectAttrib(VS_Output* out, float val, uint32_t numAttri)
 {
 	for (uint32_t i = 0; i < numAttri; ++i)
@@ -112,28 +98,87 @@ void VS_Output_Interpolate(VS_Output* out, const VS_Output* a, const VS_Output*
 	}
 }
 
+// bits of x in even bits, y in odd bits
+inline uint32_t MortonIndex(uint32_t x, uint32_t y)
+{
+	uint32_t index = 0;
+	for (uint32_t bit = 0; bit < 16; ++bit)
+		index |= (((x >> bit) & 1) << (2 * bit)) | (((y >> bit) & 1) << (2 * bit + 1));
+	return index;
+}
+
+// distance of (x, y) along Hilbert curve filling n x n grid, n is a power of two
+inline uint32_t HilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t index = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		const uint32_t rx = (x & s) ? 1 : 0;
+		const uint32_t ry = (y & s) ? 1 : 0;
+		index += s * s * ((3 * rx) ^ ry);
+
+		// rotate quadrant so sub curve starts and ends at the right corners
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return index;
+}
+
+inline uint64_t PackTileRange(uint32_t begin, uint32_t end)
+{
+	return (uint64_t(end) << 32) | begin;
+}
+
 }
 
 //--------------------------------------------------------------------------------------------
 Rasterizer::Rasterizer( RenderDevice& device )
-	: RenderStage(device), mCurrFrameBuffer(nullptr), mNumTileX(0), mNumTileY(0), mCurrVSOutputCount(0)
+	: RenderStage(device), mCurrFrameBuffer(nullptr), mNumTileX(0), mNumTileY(0), mCurrVSOutputCount(0),
+	  mFrontEndBatch(nullptr), mShadingState(nullptr), mNextTile(0), mPendingTileJobs(0), mIssuedBatches(0), mCompletedBatches(0),
+	  mShadeTime(0), mOverdrawMap(nullptr), mOverdrawPitch(0), mOverdrawHeight(0), mOverdrawEnable(false),
+	  mTileOrder(TO_Cost), mTexelCacheEnable(false)
 {
+	ResetStats();
+
 	// Near and Far plane
 	mClipPlanes[0] = float4(0, 0, 1, 0);
 	mClipPlanes[1] = float4(0, 0, -1, 1);
 
+	// Guard band planes, set in PreDraw
+	mClipPlanes[2] = float4(1, 0, 0, 1);
+	mClipPlanes[3] = float4(-1, 0, 0, 1);
+	mClipPlanes[4] = float4(0, 1, 0, 1);
+	mClipPlanes[5] = float4(0, -1, 0, 1);
+
 	const uint32_t nunWorkThreads = GetNumWorkThreads();
 
 	mThreadPackage.resize(nunWorkThreads);
 	mVertexCaches.resize(nunWorkThreads);
-	mFacesThreads.resize(nunWorkThreads);
-	mVerticesThreads.resize(nunWorkThreads);
-	mNumVerticesThreads.resize(nunWorkThreads);
-	mThreadPackage.resize(nunWorkThreads);
+	mFrontCounters.resize(nunWorkThreads);
+	mPixelCounters.resize(nunWorkThreads);
+	mTileRanges.reset(new TileRange[nunWorkThreads]);
+
+	for (RasterBatch& batch : mBatches)
+	{
+		batch.FacesThreads.resize(nunWorkThreads);
+		batch.MicroFacesThreads.resize(nunWorkThreads);
+		batch.VerticesThreads.resize(nunWorkThreads);
+		batch.NumVerticesThreads.resize(nunWorkThreads);
+		batch.TilesQueueSize = 0;
+		batch.Sequence = 0;
+	}
 }
 
 Rasterizer::~Rasterizer(void)
 {
+	WaitBatches(mIssuedBatches);
 }
 
 void Rasterizer::OnBindFrameBuffer( const shared_ptr<FrameBuffer>& fb )
@@ -143,7 +188,8 @@ void Rasterizer::OnBindFrameBuffer( const shared_ptr<FrameBuffer>& fb )
 		uint32_t width = fb->mWidth;
 		uint32_t height = fb->mHeight;
 
-		if ( !mCurrFrameBuffer || (width != mCurrFrameBuffer->mWidth && height != mCurrFrameBuffer->mHeight) )
+		// tile grid covers bound frame buffer exactly, rebuild it if either dimension differs
+		if ( !mCurrFrameBuffer || width != mCurrFrameBuffer->GetWidth() || height != mCurrFrameBuffer->GetHeight() )
 		{
 			// init render target tiles
 			uint32_t extraPixelsX = width % TileSize;
@@ -153,43 +199,47 @@ void Rasterizer::OnBindFrameBuffer( const shared_ptr<FrameBuffer>& fb )
 
 			const uint32_t NumWorkThreads = GetNumWorkThreads();
 
-			mTiles.resize(numTileX*numTileY);
-			mTilesQueue.resize(numTileX * numTileY);
+			// tiles in flight are going to be reallocated
+			WaitBatches(mIssuedBatches);
 
-			for (uint32_t y = 0; y < numTileY; ++y)
+			for (RasterBatch& batch : mBatches)
 			{
-				bool extraY = ((y == numTileY-1) && extraPixelsY);
-				for (uint32_t x = 0; x < numTileX; ++x)
+				batch.Tiles.resize(numTileX*numTileY);
+				batch.TilesQueue.resize(numTileX * numTileY);
+
+				for (uint32_t y = 0; y < numTileY; ++y)
 				{
-					bool extraX = ((y == numTileX-1) && extraPixelsY);
+					bool extraY = ((y == numTileY-1) && extraPixelsY);
+					for (uint32_t x = 0; x < numTileX; ++x)
+					{
+						bool extraX = ((x == numTileX-1) && extraPixelsX);
 
-					uint32_t index = y*numTileX + x;
-					mTiles[index].X = x * TileSize;
-					mTiles[index].Y = y * TileSize;
-					mTiles[index].Width = extraX ? extraPixelsX : TileSize;
-					mTiles[index].Height = extraY ? extraPixelsY : TileSize;
+						Tile& tile = batch.Tiles[y*numTileX + x];
+						tile.X = x * TileSize;
+						tile.Y = y * TileSize;
+						tile.Width = extraX ? extraPixelsX : TileSize;
+						tile.Height = extraY ? extraPixelsY : TileSize;
 
-					mTiles[index].TriQueue.resize( NumWorkThreads );
-					mTiles[index].TriQueueSize.resize(NumWorkThreads);
-					for (uint32_t i = 0; i < NumWorkThreads; ++i)
-					{
-						mTiles[index].TriQueueSize[i]  = 0;
-						mTiles[index].TriQueue[i].resize(MaxBinQueueSize / NumWorkThreads);
+						tile.TriQueue.resize( NumWorkThreads );
+						tile.TriQueueSize.resize(NumWorkThreads);
+						for (uint32_t i = 0; i < NumWorkThreads; ++i)
+						{
+							tile.TriQueueSize[i]  = 0;
+							tile.TriQueue[i].resize(MaxBinQueueSize / NumWorkThreads);
+						}
 					}
 				}
 			}
 
 			mNumTileX = numTileX;
 			mNumTileY = numTileY;
+			UpdateTileRanks();
 		}
 
 		mCurrFrameBuffer = fb;	
 
-		const Viewport& viewport = mCurrFrameBuffer->GetViewport();
-		MinClipX = (float)viewport.Left;
-		MaxClipX = (float)viewport.Left + viewport.Width;
-		MinClipY = (float)viewport.Top;
-		MaxClipY = (float)viewport.Top + viewport.Height;
+		if (mOverdrawEnable)
+			AllocateOverdrawMap();
 	}
 }
 
@@ -201,6 +251,7 @@ const VS_Output& Rasterizer::FetchVertex( uint32_t index, uint32_t threadIdx )
 	{		
 		cacheItem.Index = index;
 		cacheItem.Vertex = mDevice.FetchVertex(index);
+		mFrontCounters[threadIdx].Stats.VSInvocations++;
 	} 
 
 	return cacheItem.Vertex;
@@ -216,7 +267,7 @@ void Rasterizer::ProjectVertex( VS_Output* vertex )
 	vertex->Position *= invW;
 
 	// viewport transform
-	vertex->Position = vertex->Position * mDevice.mCurrentFrameBuffer->GetViewportMatrix();	
+	vertex->Position = vertex->Position * mViewportMatrix;	
 
 	/** 
 	 * After Projection transform, W is eaqual Z in view space.
@@ -229,10 +280,16 @@ void Rasterizer::ProjectVertex( VS_Output* vertex )
 
 bool Rasterizer::BackFaceCulling( const VS_Output& v0, const VS_Output& v1, const VS_Output& v2, bool* oriented)
 {
-	const float signedArea = (v1.Position.X()- v0.Position.X()) * (v2.Position.Y() - v0.Position.Y()) -
-		(v1.Position.Y() - v0.Position.Y()) * (v2.Position.X()- v0.Position.X());
+	const float4& p0 = v0.Position;
+	const float4& p1 = v1.Position;
+	const float4& p2 = v2.Position;
+
+	// det(x, y, w) has the sign of projected area, viewport transform flips y so positive means CCW on screen
+	const float det = p0.X() * (p1.Y() * p2.W() - p2.Y() * p1.W()) -
+		p0.Y() * (p1.X() * p2.W() - p2.X() * p1.W()) +
+		p0.W() * (p1.X() * p2.Y() - p2.X() * p1.Y());
 	
-	bool ccw = (signedArea <= 0.0f);
+	bool ccw = (det >= 0.0f);
 
 	if (oriented)	*oriented = ccw;
 
@@ -260,6 +317,23 @@ bool Rasterizer::BackFaceCulling( const VS_Output& v0, const VS_Output& v1, cons
 	return false;
 }
 
+bool Rasterizer::FrustumCulling( const VS_Output& v0, const VS_Output& v1, const VS_Output& v2 )
+{
+	const float4& p0 = v0.Position;
+	const float4& p1 = v1.Position;
+	const float4& p2 = v2.Position;
+
+	// trivial reject, all vertices outside the same frustum plane
+	if (p0.X() < -p0.W() && p1.X() < -p1.W() && p2.X() < -p2.W()) return true;
+	if (p0.X() >  p0.W() && p1.X() >  p1.W() && p2.X() >  p2.W()) return true;
+	if (p0.Y() < -p0.W() && p1.Y() < -p1.W() && p2.Y() < -p2.W()) return true;
+	if (p0.Y() >  p0.W() && p1.Y() >  p1.W() && p2.Y() >  p2.W()) return true;
+	if (p0.Z() < 0.0f && p1.Z() < 0.0f && p2.Z() < 0.0f) return true;
+	if (p0.Z() > p0.W() && p1.Z() > p1.W() && p2.Z() > p2.W()) return true;
+
+	return false;
+}
+
 uint32_t Rasterizer::ClipTriangle( VS_Output* clipped, const VS_Output& v0, const VS_Output& v1, const VS_Output& v2 )
 {
 	size_t srcStage = 0;
@@ -274,7 +348,8 @@ uint32_t Rasterizer::ClipTriangle( VS_Output* clipped, const VS_Output& v0, cons
 	pClipVertices[0][2] = &v2;
 	numClippedVertices[srcStage] = 3;
 
-	for (size_t iPlane = 0; iPlane < mClipPlanes.size(); ++iPlane)
+	// scanline rasterizer clips x and y while walking spans, only near and far plane needed
+	for (size_t iPlane = 0; iPlane < 2; ++iPlane)
 	{
 		numClippedVertices[destStage] = 0;
 
@@ -344,40 +419,35 @@ uint32_t Rasterizer::ClipTriangle( VS_Output* clipped, const VS_Output& v0, cons
 
 void Rasterizer::Draw( PrimitiveType primitiveType, uint32_t primitiveCount )
 {
-	pool& theadPool = GlobalThreadPool();
-	uint32_t numWorkThreads = GetNumWorkThreads();
+	PROFILE_SCOPE("Draw Scanline");
+
+	JobSystem& jobSystem = GlobalJobSystem();
+
+	// scanline path shades synchronously, after all tiled draws
+	WaitBatches(mIssuedBatches);
+	mDevice.CaptureShadingState(&mScanlineState);
+	mShadingState = &mScanlineState;
+
+	// samples are only written by tiled draws, stencil is only tested by them
+	ASSERT(!IsMultisampled(mScanlineState));
 
 	// after frustum clip, one triangle can generate maximum 5 vertices
 	mClippedVertices.resize(primitiveCount * 5);
 	mClippedFaces.resize(primitiveCount);
 
-	std::atomic<uint32_t> workingPackage(0);
-
 	//mProfiler.StartTimer("Vertex Process");
 	
 	//input assembly, vertex shading, culling/clipping
-	for (size_t i = 0; i < numWorkThreads - 1; ++i)
-	{
-		theadPool.schedule(std::bind(&Rasterizer::SetupGeometry, this, std::ref(mClippedVertices), std::ref(mClippedFaces), 
-			std::ref(workingPackage), primitiveCount));
-	}
-	// schedule current thread
-	SetupGeometry(std::ref(mClippedVertices), std::ref(mClippedFaces), std::ref(workingPackage), primitiveCount);
-	theadPool.wait();
+	jobSystem.ParallelFor(0, primitiveCount, SetupGeometryPackageSize, std::bind(&Rasterizer::SetupGeometry, this, 
+		std::ref(mClippedVertices), std::ref(mClippedFaces), std::placeholders::_1, std::placeholders::_2));
 	
 	//mProfiler.EndTimer("Vertex Process");
 	//auto elapsedTime = mProfiler.GetElapsedTime("Vertex Process");
 
 	//mProfiler.StartTimer("Rasterizer Process");
 
-	workingPackage = 0;
-	for (size_t i = 0; i < numWorkThreads - 1; ++i)
-	{
-		theadPool.schedule(std::bind(&Rasterizer::RasterizeFaces, this, std::ref(mClippedFaces), std::ref(workingPackage), mClippedFaces.size()));
-	}
-	// schedule current thread
-	RasterizeFaces(std::ref(mClippedFaces), std::ref(workingPackage), mClippedFaces.size());
-	theadPool.wait();
+	jobSystem.ParallelFor(0, (uint32_t)mClippedFaces.size(), SetupGeometryPackageSize, std::bind(&Rasterizer::RasterizeFaces, this, 
+		std::ref(mClippedFaces), std::placeholders::_1, std::placeholders::_2));
 
 	// ܼ򵥵ö̹߳դΪҪдbackbufferFragmentͻͬ⣬ȼ򵥵ʹõ߳
 	/*for (uint32_t i = 0; i < mClippedFaces.size(); ++i)
@@ -395,104 +465,86 @@ void Rasterizer::Draw( PrimitiveType primitiveType, uint32_t primitiveCount )
 	//auto elapsedTimeR = mProfiler.GetElapsedTime("Rasterizer Process");
 }
 
-void Rasterizer::SetupGeometry( std::vector<VS_Output>& outVertices, std::vector<RasterFace>& outFaces, std::atomic<uint32_t>& workingPackage, uint32_t primitiveCount )
+void Rasterizer::SetupGeometry( std::vector<VS_Output>& outVertices, std::vector<RasterFace>& outFaces, uint32_t start, uint32_t end )
 {
-	uint32_t numPackages = (primitiveCount + SetupGeometryPackageSize - 1) / SetupGeometryPackageSize;
-	uint32_t localWorkingPackage  = workingPackage ++;
-
 	//LRUCache<uint32_t, VS_Output, VertexCacheSize> vertexCache(std::bind(&RenderDevice::FetchVertex, &mDevice, std::placeholders::_1));
 	
-	DirectMapCache<uint32_t, VS_Output, VertexCacheSize> vertexCache(std::bind(&RenderDevice::FetchVertex, &mDevice, std::placeholders::_1));
+	PipelineStatistics& stats = mFrontCounters[JobSystem::GetWorkerIndex()].Stats;
+	stats.IAPrimitives += end - start;
+	stats.IAVertices += (end - start) * 3;
+
+	DirectMapCache<uint32_t, VS_Output, VertexCacheSize> vertexCache([this, &stats](uint32_t index) -> VS_Output {
+		stats.VSInvocations++;
+		return mDevice.FetchVertex(index); });
 
-	while (localWorkingPackage < numPackages)
+	for (uint32_t iPrim = start; iPrim < end; ++iPrim)
 	{
-		const uint32_t start = localWorkingPackage * SetupGeometryPackageSize;
-		const uint32_t end = (std::min)(primitiveCount, start + SetupGeometryPackageSize);
+		const uint32_t baseVertex = iPrim * 4;
+		const uint32_t baseFace = iPrim;
 
-		for (uint32_t iPrim = start; iPrim < end; ++iPrim)
+		// fetch vertices
+		const VS_Output* pVSOutputs[3];
+		uint32_t iVertex;
+		for (iVertex = 0; iVertex < 3; ++ iVertex)
+		{		
+			const uint32_t index = mDevice.FetchIndex(iPrim * 3 + iVertex); 
+			const VS_Output& v = vertexCache(index);
+			pVSOutputs[iVertex] = &v;
+		}
+
+		// cull in clip space before clipping, most culled triangles only cost a determinant
+		if( FrustumCulling( *pVSOutputs[0], *pVSOutputs[1], *pVSOutputs[2] ) ||
+			BackFaceCulling( *pVSOutputs[0], *pVSOutputs[1], *pVSOutputs[2] ) )
 		{
-			const uint32_t baseVertex = iPrim * 4;
-			const uint32_t baseFace = iPrim;
-
-			// fetch vertices
-			const VS_Output* pVSOutputs[3];
-			uint32_t iVertex;
-			for (iVertex = 0; iVertex < 3; ++ iVertex)
-			{		
-				const uint32_t index = mDevice.FetchIndex(iPrim * 3 + iVertex); 
-				const VS_Output& v = vertexCache(index);
-				pVSOutputs[iVertex] = &v;
-			}
+			stats.CulledPrimitives++;
+			outFaces[baseFace].TriCount = 0;
+			continue;
+		}
 
-			// frustum cull and clip
-			uint32_t numCliped = ClipTriangle(&outVertices[baseVertex], *pVSOutputs[0], *pVSOutputs[1], *pVSOutputs[2]);
-			ASSERT(numCliped <= 5);
+		stats.CInvocations++;
+		if (ComputeClipCode(pVSOutputs[0]->Position) | ComputeClipCode(pVSOutputs[1]->Position) | ComputeClipCode(pVSOutputs[2]->Position))
+			stats.ClippedPrimitives++;
 
-			if (numCliped < 3)
-			{
-				// culled, no triangle
-				outFaces[baseFace].TriCount = 0;
-				return;
-			}
-			
-			// Project the first three vertices for culling
-			for (iVertex = 0; iVertex < 3; ++ iVertex)
-				ProjectVertex( &outVertices[baseVertex + iVertex] );
-
-			// We do not have to check for culling for each sub-polygon of the triangle, as they
-			// are all in the same plane. If the first polygon is culled then all other polygons
-			// would be culled, too.
-			if( BackFaceCulling( outVertices[baseVertex+0], outVertices[baseVertex+1], outVertices[baseVertex+2] ) )
-			{
-				// back face culled
-				outFaces[baseFace].TriCount = 0;
-				continue;
-			}
+		// clip
+		uint32_t numCliped = ClipTriangle(&outVertices[baseVertex], *pVSOutputs[0], *pVSOutputs[1], *pVSOutputs[2]);
+		ASSERT(numCliped <= 5);
 
-			// Project the remaining vertices
-			for( iVertex = 3; iVertex < numCliped; ++iVertex )
-				ProjectVertex( &outVertices[baseVertex + iVertex] );
+		if (numCliped < 3)
+		{
+			// culled, no triangle
+			outFaces[baseFace].TriCount = 0;
+			continue;
+		}
 
-			// if out clip vertices is less than 3, no triangle, or generate  (numCliped - 2) triangles
-			const uint32_t triCount = (numCliped < 3) ? 0 : (numCliped - 2);
-			outFaces[baseFace].TriCount = triCount;
+		for( iVertex = 0; iVertex < numCliped; ++iVertex )
+			ProjectVertex( &outVertices[baseVertex + iVertex] );
 
-			for(uint32_t iTri = 0; iTri < triCount; ++iTri)
-			{
-				outFaces[baseFace].Indices[iTri * 3 + 0] = baseVertex + iTri * 3 + 0;
-				outFaces[baseFace].Indices[iTri * 3 + 1] = baseVertex + iTri * 3 + 1;
-				outFaces[baseFace].Indices[iTri * 3 + 2] = baseVertex + iTri * 3 + 2;
-			}
-		}
+		// if out clip vertices is less than 3, no triangle, or generate  (numCliped - 2) triangles
+		const uint32_t triCount = (numCliped < 3) ? 0 : (numCliped - 2);
+		outFaces[baseFace].TriCount = triCount;
+		stats.CPrimitives += triCount;
 
-		localWorkingPackage = workingPackage++;
+		for(uint32_t iTri = 0; iTri < triCount; ++iTri)
+		{
+			outFaces[baseFace].Indices[iTri * 3 + 0] = baseVertex + iTri * 3 + 0;
+			outFaces[baseFace].Indices[iTri * 3 + 1] = baseVertex + iTri * 3 + 1;
+			outFaces[baseFace].Indices[iTri * 3 + 2] = baseVertex + iTri * 3 + 2;
+		}
 	}
 }
 
-void Rasterizer::RasterizeFaces( std::vector<RasterFace>& faces, std::atomic<uint32_t>& workingPackage, uint32_t faceCount )
+void Rasterizer::RasterizeFaces( std::vector<RasterFace>& faces, uint32_t start, uint32_t end )
 {
-	uint32_t numPackages = (faceCount + SetupGeometryPackageSize - 1) / SetupGeometryPackageSize;
-	uint32_t localWorkingPackage  = workingPackage ++;
-
-	while (localWorkingPackage < numPackages)
+	for (uint32_t i = start; i < end; ++i)
 	{
-		const uint32_t start = localWorkingPackage * SetupGeometryPackageSize;
-		const uint32_t end = (std::min)(faceCount, start + SetupGeometryPackageSize);
-		
-		for (uint32_t i = start; i < end; ++i)
+		for (uint32_t iFace = 0; iFace < mClippedFaces[i].TriCount; ++iFace)
 		{
-			for (uint32_t iFace = 0; iFace < mClippedFaces[i].TriCount; ++iFace)
-			{
-				const VS_Output& v0 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 0]];
-				const VS_Output& v1 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 1]];
-				const VS_Output& v2 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 2]];
-				RasterizeTriangle(v0, v1, v2);
-			}		
-		}
-
-		localWorkingPackage = workingPackage++;
-
-	};
+			const VS_Output& v0 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 0]];
+			const VS_Output& v1 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 1]];
+			const VS_Output& v2 = mClippedVertices[mClippedFaces[i].Indices[iFace * 3 + 2]];
+			RasterizeTriangle(v0, v1, v2);
+		}		
+	}
 }
 
 void Rasterizer::RasterizeTriangle( const VS_Output& vsOut0, const VS_Output& vsOut1, const VS_Output& vsOut2 )
@@ -872,14 +924,19 @@ void Rasterizer::RasterizeTriangle_Top( float X1, float Y1, float X2, float Y2,
 
 void Rasterizer::RasterizeScanline(int32_t xStart, int32_t xEnd, int32_t Y, VS_Output* pBaseVertex, const VS_Output* pDdx)
 {
-#define DEPTH_TEST(condition) if((condition)) break; else continue;
+#define DEPTH_TEST(condition) if((condition)) break; else { stats.DepthKilledPixels++; continue; }
 
 	float destDepth, srcDepth;
 
+	// scanlines of different triangles may overlap, overdraw counts of this path are approximate
+	PipelineStatistics& stats = mPixelCounters[JobSystem::GetWorkerIndex()].Stats;
+	if (xEnd > xStart)
+		stats.PSInvocations += xEnd - xStart;
+
 	for (int32_t X = xStart; X < xEnd; ++X, VS_Output_Add(pBaseVertex, pBaseVertex, pDdx, mCurrVSOutputCount))
 	{
 		// read back buffer pixel
-		mDevice.mCurrentFrameBuffer->ReadPixel(X, Y, NULL, &destDepth);
+		mShadingState->FrameBuffer->ReadPixel(X, Y, NULL, &destDepth);
 
 		// Get depth of current pixel
 		srcDepth = pBaseVertex->Position.Z();
@@ -890,17 +947,22 @@ void Rasterizer::RasterizeScanline(int32_t xStart, int32_t xEnd, int32_t Y, VS_O
 
 		// Execute the pixel shader
 		//m_TriangleInfo.iCurPixelX = i_iX;
+		if (mOverdrawMap)
+			mOverdrawMap[Y * mOverdrawPitch + X]++;
+
 		PS_Output PSOutput;
-		if( !mDevice.mPixelShaderStage->GetPixelShader()->Execute(&PSInput, &PSOutput, &srcDepth ))
+		if( !mShadingState->PixelShader->Execute(&PSInput, &PSOutput, &srcDepth ))
 		{
 			// kill this pixel
+			stats.PSKilledPixels++;
 			continue;
 		}
 
 		// Perform depth-test
-		switch( mDevice.DepthStencilState.DepthFunc )
+		srcDepth = QuantizeDepth(*mShadingState->FrameBuffer, srcDepth);
+		switch( mShadingState->DepthStencilState.DepthFunc )
 		{
-		case CF_AlwaysFail: continue;
+		case CF_AlwaysFail: stats.DepthKilledPixels++; continue;
 		case CF_Equal: DEPTH_TEST(fabsf( srcDepth - destDepth ) < FLT_EPSILON);
 		case CF_NotEqual: DEPTH_TEST(fabsf( srcDepth - destDepth ) >= FLT_EPSILON);
 		case CF_Less: DEPTH_TEST(srcDepth < destDepth);
@@ -910,8 +972,7 @@ void Rasterizer::RasterizeScanline(int32_t xStart, int32_t xEnd, int32_t Y, VS_O
 		case CF_AlwaysPass: break;
 		}
 
-		mDevice.mCurrentFrameBuffer->WritePixel(X, Y, &PSOutput,
-			mDevice.DepthStencilState.DepthWriteMask ? &srcDepth : NULL);
+		mShadingState->FrameBuffer->WritePixel(X, Y, &PSOutput, mShadingState->DepthStencilState.DepthWriteMask ? &srcDepth : NULL, *mShadingState);
 	}
 
 #undef DEPTH_TEST
@@ -924,10 +985,45 @@ void Rasterizer::PreDraw()
 
 	mCurrFrameBuffer = mDevice.GetCurrentFrameBuffer();
 
-	mTilesQueueSize = 0;
+	// viewport and clip rect of this draw
+	const Viewport& viewport = mDevice.GetDrawViewport();
+	mViewportMatrix = CreateViewportMatrixD3D((float)viewport.Left, (float)viewport.Top, (float)viewport.Width, (float)viewport.Height);
+
+	const int32_t fbWidth = (int32_t)mCurrFrameBuffer->mWidth;
+	const int32_t fbHeight = (int32_t)mCurrFrameBuffer->mHeight;
+
+	mClipMinX = Max(viewport.Left, 0);
+	mClipMinY = Max(viewport.Top, 0);
+	mClipMaxX = Min(viewport.Left + viewport.Width, fbWidth);
+	mClipMaxY = Min(viewport.Top + viewport.Height, fbHeight);
+
+	if (mDevice.RasterizerState.ScissorEnable)
+	{
+		const ScissorRect& scissor = mDevice.GetDrawScissorRect();
+		mClipMinX = Max(mClipMinX, scissor.Left);
+		mClipMinY = Max(mClipMinY, scissor.Top);
+		mClipMaxX = Min(mClipMaxX, scissor.Right);
+		mClipMaxY = Min(mClipMaxY, scissor.Bottom);
+	}
 
-	for (auto& threadVertexSize : mNumVerticesThreads)
-		threadVertexSize = 0;
+	mInnerTileMinX = (mClipMinX + TileSize - 1) >> TileSizeShift;
+	mInnerTileMinY = (mClipMinY + TileSize - 1) >> TileSizeShift;
+	mInnerTileMaxX = (mClipMaxX == fbWidth) ? (mNumTileX - 1) : ((mClipMaxX >> TileSizeShift) - 1);
+	mInnerTileMaxY = (mClipMaxY == fbHeight) ? (mNumTileY - 1) : ((mClipMaxY >> TileSizeShift) - 1);
+
+	// guard band in clip space, x <= gx * w, y <= gy * w
+	const float guardBandX = 1.0f + 2.0f * GuardBandSize / (float)Max(viewport.Width, 1);
+	const float guardBandY = 1.0f + 2.0f * GuardBandSize / (float)Max(viewport.Height, 1);
+	mClipPlanes[2] = float4(1, 0, 0, guardBandX);
+	mClipPlanes[3] = float4(-1, 0, 0, guardBandX);
+	mClipPlanes[4] = float4(0, 1, 0, guardBandY);
+	mClipPlanes[5] = float4(0, -1, 0, guardBandY);
+
+	// scanline rasterizer clip
+	MinClipX = (float)mClipMinX;
+	MaxClipX = (float)mClipMaxX;
+	MinClipY = (float)mClipMinY;
+	MaxClipY = (float)mClipMaxY;
 
 	// reset each thread's vertex cache
 	for (auto& threadVertexCache : mVertexCaches)
@@ -944,12 +1040,48 @@ void Rasterizer::PostDraw()
 
 }
 
+uint32_t Rasterizer::ComputeClipCode( const float4& position ) const
+{
+	uint32_t code = 0;
+	for (uint32_t iPlane = 0; iPlane < NumClipPlanes; ++iPlane)
+	{
+		if (Dot(mClipPlanes[iPlane], position) < 0.0f)
+			code |= (1UL << iPlane);
+	}
+	return code;
+}
+
 void Rasterizer::ClipTriangleTiled(  VS_Output* vertices, uint32_t threadIdx )
 {
+	// cull in clip space before clipping, most culled triangles only cost a determinant
+	bool ccw = false;
+	if( FrustumCulling( vertices[0], vertices[1], vertices[2] ) ||
+		BackFaceCulling( vertices[0], vertices[1], vertices[2], &ccw ) )
+	{
+		mFrontCounters[threadIdx].Stats.CulledPrimitives++;
+		return;
+	}
+
+	mFrontCounters[threadIdx].Stats.CInvocations++;
+
+	const uint32_t code0 = ComputeClipCode(vertices[0].Position);
+	const uint32_t code1 = ComputeClipCode(vertices[1].Position);
+	const uint32_t code2 = ComputeClipCode(vertices[2].Position);
+
+	// all vertices outside the same plane, cull out
+	if (code0 & code1 & code2)
+		return;
+
+	// only clip against planes crossed by triangle, triangle inside guard band is trivially accepted
+	const uint32_t clipMask = code0 | code1 | code2;
+	if (clipMask)
+		mFrontCounters[threadIdx].Stats.ClippedPrimitives++;
+
 	size_t srcStage = 0;
 	size_t destStage = 1;
 
-	uint8_t clipVertices[2][5];
+	// one more slot for wrap over
+	uint8_t clipVertices[2][MaxClipVertices + 1];
 	clipVertices[srcStage][0] = 0;
 	clipVertices[srcStage][1] = 1; 
 	clipVertices[srcStage][2] = 2;
@@ -965,6 +1097,9 @@ void Rasterizer::ClipTriangleTiled(  VS_Output* vertices, uint32_t threadIdx )
 
 	for (size_t iPlane = 0; iPlane < mClipPlanes.size(); ++iPlane)
 	{
+		if ( (clipMask & (1UL << iPlane)) == 0 )
+			continue;
+
 		numClippedVertices[destStage] = 0;
 
 		uint8_t idxPrev = clipVertices[srcStage][0];
@@ -1016,43 +1151,38 @@ void Rasterizer::ClipTriangleTiled(  VS_Output* vertices, uint32_t threadIdx )
 	}
 
 	const uint32_t resultNumVertices = numClippedVertices[srcStage];
-	ASSERT(resultNumVertices <= 5);
+	ASSERT(resultNumVertices <= MaxClipVertices);
 
 
-	// Project the first three vertices for culling
-	ProjectVertex( &vertices[clipVertices[srcStage][0]] );
-	ProjectVertex( &vertices[clipVertices[srcStage][1]] );
-	ProjectVertex( &vertices[clipVertices[srcStage][2]] );
+	// Sub-polygons lie in the same plane as the original triangle, so they keep its orientation
+	for(uint32_t i = 0; i < resultNumVertices; ++i )
+		ProjectVertex( &vertices[clipVertices[srcStage][i]] );
 
 
-	// We do not have to check for culling for each sub-polygon of the triangle, as they
-	// are all in the same plane. If the first polygon is culled then all other polygons
-	// would be culled, too.
-	bool ccw = false;
-	if( BackFaceCulling( vertices[clipVertices[srcStage][0]], vertices[clipVertices[srcStage][1]], vertices[clipVertices[srcStage][2]], &ccw))
-	{
-		// back face culled
-		return;
-	}
-
-	// Project the remaining vertices
-	for(uint32_t i = 3; i < resultNumVertices; ++i )
-		ProjectVertex( &vertices[clipVertices[srcStage][i]] );
+	mFrontCounters[threadIdx].Stats.CPrimitives += resultNumVertices - 2;
 
+	const bool frontFace = (ccw == mDevice.RasterizerState.FrontCounterClockwise);
 
 	// binning
 	for( uint32_t i = 2; i < resultNumVertices; i++ )
 	{
 		if (!ccw)
-			Binning(vertices[clipVertices[srcStage][0]], vertices[clipVertices[srcStage][i]], vertices[clipVertices[srcStage][i-1]], threadIdx);
+			Binning(vertices[clipVertices[srcStage][0]], vertices[clipVertices[srcStage][i]], vertices[clipVertices[srcStage][i-1]], frontFace, threadIdx);
 		else
-			Binning(vertices[clipVertices[srcStage][0]], vertices[clipVertices[srcStage][i-1]], vertices[clipVertices[srcStage][i]], threadIdx);
+			Binning(vertices[clipVertices[srcStage][0]], vertices[clipVertices[srcStage][i-1]], vertices[clipVertices[srcStage][i]], frontFace, threadIdx);
 	}
 }
 
 void Rasterizer::SetupGeometryTiled( std::vector<VS_Output>& outVertices, std::vector<RasterFaceTiled>& outFaces, uint32_t theadIdx, ThreadPackage package )
 {
-	VS_Output clippedVertices[7]; // 7 enough ???
+	PROFILE_SCOPE("Vertex Process + Binning");
+
+	// each clipped plane adds at most two new vertices
+	VS_Output clippedVertices[3 + 2 * NumClipPlanes];
+
+	PipelineStatistics& stats = mFrontCounters[theadIdx].Stats;
+	stats.IAPrimitives += package.End - package.Start;
+	stats.IAVertices += (package.End - package.Start) * 3;
 
 	for (uint32_t iPrim = package.Start; iPrim < package.End; ++iPrim)
 	{
@@ -1072,14 +1202,122 @@ void Rasterizer::SetupGeometryTiled( std::vector<VS_Output>& outVertices, std::v
 	}
 }
 
-void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Output& V3, uint32_t threadIdx )
+void Rasterizer::SetupMeshletCulling( const float44& worldViewProj )
+{
+	// clip space x, y, z and w of object space point p are dot((p, 1), column)
+	float4 columns[4];
+	for (int32_t j = 0; j < 4; ++j)
+		columns[j] = float4(worldViewProj(0, j), worldViewProj(1, j), worldViewProj(2, j), worldViewProj(3, j));
+
+	// -w < x < w, -w < y < w, 0 < z < w, normalized so sphere radius can be compared
+	float4* planes = mMeshletCulling.Planes;
+	planes[0] = columns[3] + columns[0];
+	planes[1] = columns[3] - columns[0];
+	planes[2] = columns[3] + columns[1];
+	planes[3] = columns[3] - columns[1];
+	planes[4] = columns[2];
+	planes[5] = columns[3] - columns[2];
+
+	for (int32_t i = 0; i < 6; ++i)
+	{
+		const float length = Length(float3(planes[i].X(), planes[i].Y(), planes[i].Z()));
+		if (length > 0.0f)
+			planes[i] = planes[i] / length;
+	}
+
+	mMeshletCulling.ConeSign = 0.0f;
+
+	const CullMode cullMode = mDevice.RasterizerState.PolygonCullMode;
+	if (cullMode == CM_None)
+		return;
+
+	// eye is the point whose clip space x, y and w are zero, there is none for orthographic projection
+	const float3 n0(columns[0].X(), columns[0].Y(), columns[0].Z());
+	const float3 n1(columns[1].X(), columns[1].Y(), columns[1].Z());
+	const float3 n2(columns[3].X(), columns[3].Y(), columns[3].Z());
+
+	const float denom = Dot(n0, Cross(n1, n2));
+	if (fabsf(denom) < 1e-12f)
+		return;
+
+	mMeshletCulling.Eye = (Cross(n1, n2) * columns[0].W() + Cross(n2, n0) * columns[1].W() + Cross(n0, n1) * columns[3].W()) / -denom;
+
+	// cross(v1 - v0, v2 - v0) faces eye for clockwise front faces unless transform mirrors
+	float frontSign = (MatrixDeterminant(worldViewProj) > 0.0f) ? 1.0f : -1.0f;
+	if (mDevice.RasterizerState.FrontCounterClockwise)
+		frontSign = -frontSign;
+
+	mMeshletCulling.ConeSign = (cullMode == CM_Back) ? frontSign : -frontSign;
+}
+
+bool Rasterizer::CullMeshlet( const Meshlet& meshlet ) const
+{
+	for (int32_t i = 0; i < 6; ++i)
+	{
+		const float4& plane = mMeshletCulling.Planes[i];
+		if (plane.X() * meshlet.Center.X() + plane.Y() * meshlet.Center.Y() + plane.Z() * meshlet.Center.Z() + plane.W() < -meshlet.Radius)
+			return true;
+	}
+
+	if (mMeshletCulling.ConeSign == 0.0f)
+		return false;
+
+	// all faces of cluster are culled faces
+	const float3 view = meshlet.Center - mMeshletCulling.Eye;
+	return Dot(view, meshlet.ConeAxis) * mMeshletCulling.ConeSign >= meshlet.ConeCutoff * Length(view) + meshlet.Radius;
+}
+
+void Rasterizer::SetupMeshletsTiled( const MeshletBuffer& meshlets, uint32_t threadIdx, ThreadPackage package )
+{
+	PROFILE_SCOPE("Meshlet Process + Binning");
+
+	// cluster vertices are shaded once, no post transform cache needed
+	VS_Output shadedVertices[MaxMeshletVertices];
+
+	// each clipped plane adds at most two new vertices
+	VS_Output clippedVertices[3 + 2 * NumClipPlanes];
+
+	PipelineStatistics& stats = mFrontCounters[threadIdx].Stats;
+
+	for (uint32_t iMeshlet = package.Start; iMeshlet < package.End; ++iMeshlet)
+	{
+		const Meshlet& meshlet = meshlets.Meshlets[iMeshlet];
+
+		stats.IAPrimitives += meshlet.TriangleCount;
+		stats.IAVertices += meshlet.TriangleCount * 3;
+
+		if (CullMeshlet(meshlet))
+		{
+			stats.CulledPrimitives += meshlet.TriangleCount;
+			continue;
+		}
+
+		const uint32_t* vertices = &meshlets.Vertices[meshlet.VertexOffset];
+		for (uint32_t iVertex = 0; iVertex < meshlet.VertexCount; ++iVertex)
+			shadedVertices[iVertex] = mDevice.FetchVertex(vertices[iVertex]);
+		stats.VSInvocations += meshlet.VertexCount;
+
+		const uint8_t* triangles = &meshlets.Triangles[meshlet.TriangleOffset * 3];
+		for (uint32_t iTri = 0; iTri < meshlet.TriangleCount; ++iTri)
+		{
+			for (uint32_t iVertex = 0; iVertex < 3; ++iVertex)
+				memcpy(&clippedVertices[iVertex], &shadedVertices[triangles[iTri * 3 + iVertex]], sizeof(VS_Output));
+
+			ClipTriangleTiled(clippedVertices, threadIdx);
+		}
+	}
+}
+
+void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Output& V3, bool frontFace, uint32_t threadIdx )
 {
-	uint32_t baseIdx = mNumVerticesThreads[threadIdx];
+	RasterBatch& batch = *mFrontEndBatch;
+
+	uint32_t baseIdx = batch.NumVerticesThreads[threadIdx];
 	uint32_t faceIdx = baseIdx / 3;
 
-	RasterFaceTiled& face = mFacesThreads[threadIdx][faceIdx];
+	RasterFaceTiled& face = batch.FacesThreads[threadIdx][faceIdx];
 
-	// 28.4 fixed-point coordinates
+	// 28.4 fixed-point coordinates, guard band keeps them in 32 bits
 	const int32_t X1 = iround(16.0f * V1.Position.X());
 	const int32_t X2 = iround(16.0f * V2.Position.X());
 	const int32_t X3 = iround(16.0f * V3.Position.X());
@@ -1088,27 +1326,19 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 	const int32_t Y2 = iround(16.0f * V2.Position.Y());
 	const int32_t Y3 = iround(16.0f * V3.Position.Y());
 
-	// Deltas
-	const int32_t DX12 = X1 - X2;
-	const int32_t DX23 = X2 - X3;
-	const int32_t DX31 = X3 - X1;
-
-	const int32_t DY12 = Y1 - Y2;
-	const int32_t DY23 = Y2 - Y3;
-	const int32_t DY31 = Y3 - Y1;
+	// Deltas, edge functions need 64 bits products
+	const int64_t DX12 = X1 - X2;
+	const int64_t DX23 = X2 - X3;
+	const int64_t DX31 = X3 - X1;
 
-	// Fixed-point deltas
-	const int32_t FDX12 = DX12 << 4;
-	const int32_t FDX23 = DX23 << 4;
-	const int32_t FDX31 = DX31 << 4;
-	const int32_t FDY12 = DY12 << 4;
-	const int32_t FDY23 = DY23 << 4;
-	const int32_t FDY31 = DY31 << 4;
+	const int64_t DY12 = Y1 - Y2;
+	const int64_t DY23 = Y2 - Y3;
+	const int64_t DY31 = Y3 - Y1;
 
 	// Half-edge constants
-	int32_t C1 = DY12 * X1 - DX12 * Y1;
-	int32_t C2 = DY23 * X2 - DX23 * Y2;
-	int32_t C3 = DY31 * X3 - DX31 * Y3;
+	int64_t C1 = DY12 * X1 - DX12 * Y1;
+	int64_t C2 = DY23 * X2 - DX23 * Y2;
+	int64_t C3 = DY31 * X3 - DX31 * Y3;
 
 	// Correct for fill convention
 	if(DY12 < 0 || (DY12 == 0 && DX12 > 0)) C1++;
@@ -1120,12 +1350,32 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 
 	face.X[0] = X1; face.X[1] = X2; face.X[2] = X3;
 	face.Y[0] = Y1; face.Y[1] = Y2; face.Y[2] = Y3;
+	face.FrontFace = frontFace;
 
-	// Compute bounding box, fixed point
-	face.MinX = (Min(X1, Min(X2, X3)));
-	face.MaxX = (Max(X1, Max(X2, X3)));
-	face.MinY = (Min(Y1, Min(Y2, Y3)));
-	face.MaxY = (Max(Y1, Max(Y2, Y3)));
+	// Compute bounding box restricted to clip rect, fixed point, grown by samples around pixel centers
+	const int32_t extent = GetSampleExtent(batch.State);
+	face.MinX = Max(Min(X1, Min(X2, X3)) - extent, mClipMinX << 4);
+	face.MaxX = Min(Max(X1, Max(X2, X3)) + extent, (mClipMaxX << 4) - 1);
+	face.MinY = Max(Min(Y1, Min(Y2, Y3)) - extent, mClipMinY << 4);
+	face.MaxY = Min(Max(Y1, Max(Y2, Y3)) + extent, (mClipMaxY << 4) - 1);
+
+	// Triangle is totally outside viewport or scissor rect
+	if (face.MinX > face.MaxX || face.MinY > face.MaxY)
+		return;
+
+	// Degenerate triangle
+	if (DX12 * DY31 - DY12 * DX31 == 0)
+		return;
+
+	// Pixel bounding box [min, max), pixel sample is at integer position
+	const int32_t pixelMinX = (face.MinX + 0xF) >> 4;
+	const int32_t pixelMaxX = (face.MaxX + 0xF) >> 4;
+	const int32_t pixelMinY = (face.MinY + 0xF) >> 4;
+	const int32_t pixelMaxY = (face.MaxY + 0xF) >> 4;
+
+	// Sliver between pixel samples, snapped bounding box is empty so no pixel is covered
+	if (pixelMinX >= pixelMaxX || pixelMinY >= pixelMaxY)
+		return;
 
 	// Compute tile bounding box
 	const int32_t minTileX = Max(face.MinX >> ( 4 + TileSizeShift), 0);
@@ -1136,8 +1386,44 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 	if ((maxTileX == minTileX) && (maxTileY == minTileY))
 	{
 		// Small primitive
-		Tile& tile = mTiles[minTileY * mNumTileX + minTileX];
-		tile.TriQueue[threadIdx][tile.TriQueueSize[threadIdx]++] = faceIdx << 1;
+		Tile& tile = batch.Tiles[minTileY * mNumTileX + minTileX];
+
+		const int32_t width = pixelMaxX - pixelMinX;
+		const int32_t height = pixelMaxY - pixelMinY;
+
+		/**
+		 * Micro path covers pixel centers only. Eligibility uses the unclipped bounding box, a
+		 * large triangle whose visible part is small has edge functions too large for 32 bits.
+		 */
+		const int32_t extentX = ((Max(X1, Max(X2, X3)) + 0xF) >> 4) - ((Min(X1, Min(X2, X3)) + 0xF) >> 4);
+		const int32_t extentY = ((Max(Y1, Max(Y2, Y3)) + 0xF) >> 4) - ((Min(Y1, Min(Y2, Y3)) + 0xF) >> 4);
+
+		if (extentX <= MicroTriangleSize && extentY <= MicroTriangleSize && !IsMultisampled(batch.State))
+		{
+			// Micro primitive, edge functions within its bounding box fit 32 bits
+			RasterFaceMicro& micro = batch.MicroFacesThreads[threadIdx][faceIdx];
+			micro.X = (int16_t)pixelMinX;
+			micro.Y = (int16_t)pixelMinY;
+			micro.Width = (uint8_t)width;
+			micro.Height = (uint8_t)height;
+
+			const int64_t originX = pixelMinX << 4;
+			const int64_t originY = pixelMinY << 4;
+			micro.E[0] = (int32_t)(C1 + DX12 * originY - DY12 * originX);
+			micro.E[1] = (int32_t)(C2 + DX23 * originY - DY23 * originX);
+			micro.E[2] = (int32_t)(C3 + DX31 * originY - DY31 * originX);
+
+			// deltas can be negative, scale to fixed point instead of shifting
+			micro.StepX[0] = (int32_t)(-DY12 * (1 << 4)); micro.StepY[0] = (int32_t)(DX12 * (1 << 4));
+			micro.StepX[1] = (int32_t)(-DY23 * (1 << 4)); micro.StepY[1] = (int32_t)(DX23 * (1 << 4));
+			micro.StepX[2] = (int32_t)(-DY31 * (1 << 4)); micro.StepY[2] = (int32_t)(DX31 * (1 << 4));
+
+			tile.TriQueue[threadIdx][tile.TriQueueSize[threadIdx]++] = (faceIdx << TileTriShift) | TileTriMicro;
+		}
+		else
+		{
+			tile.TriQueue[threadIdx][tile.TriQueueSize[threadIdx]++] = faceIdx << TileTriShift;
+		}
 	}
 	else
 	{
@@ -1145,11 +1431,11 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 		{
 			for (int32_t x = minTileX; x <= maxTileX; ++x)
 			{
-				// Corners of block, fixed point
-				int32_t x0 = (x << TileSizeShift) << 4;
-				int32_t x1 = (((x + 1) << TileSizeShift) - 1) << 4;
-				int32_t y0 = (y << TileSizeShift) << 4;
-				int32_t y1 = (((y + 1) << TileSizeShift) - 1) << 4;
+				// Corners of block, fixed point, outermost samples of multisampled pixels
+				int64_t x0 = ((x << TileSizeShift) << 4) - extent;
+				int64_t x1 = ((((x + 1) << TileSizeShift) - 1) << 4) + extent;
+				int64_t y0 = ((y << TileSizeShift) << 4) - extent;
+				int64_t y1 = ((((y + 1) << TileSizeShift) - 1) << 4) + extent;
 
 				// Evaluate half-space functions
 				bool a00 = C1 + DX12 * y0 - DY12 * x0 > 0;
@@ -1174,25 +1460,27 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 				if(a == 0x0 || b == 0x0 || c == 0x0) 
 					continue;
 
-				// Test if we can trivially accept the entire tile
-				uint32_t accept = ( a != 0xF || b != 0xF || c != 0xF ) ? 0 : 1;
+				// Test if we can trivially accept the entire tile, tile must also be inside clip rect
+				uint32_t accept = ( a != 0xF || b != 0xF || c != 0xF ) ? 0 : TileTriAccept;
+				if (!InRange(x, mInnerTileMinX, mInnerTileMaxX) || !InRange(y, mInnerTileMinY, mInnerTileMaxY))
+					accept = 0;
 	
-				Tile& tile = mTiles[y * mNumTileX + x];
-				tile.TriQueue[threadIdx][tile.TriQueueSize[threadIdx]++] = (faceIdx << 1) | accept;  // least is a flag for partial or accept bit
+				Tile& tile = batch.Tiles[y * mNumTileX + x];
+				tile.TriQueue[threadIdx][tile.TriQueueSize[threadIdx]++] = (faceIdx << TileTriShift) | accept;
 			}
 		}
 	}
 
-	VS_Output* vsOut0 = &mVerticesThreads[threadIdx][baseIdx];
-	VS_Output* vsOut1 = &mVerticesThreads[threadIdx][baseIdx+1];
-	VS_Output* vsOut2 = &mVerticesThreads[threadIdx][baseIdx+2];
+	VS_Output* vsOut0 = &batch.VerticesThreads[threadIdx][baseIdx];
+	VS_Output* vsOut1 = &batch.VerticesThreads[threadIdx][baseIdx+1];
+	VS_Output* vsOut2 = &batch.VerticesThreads[threadIdx][baseIdx+2];
 
 	VS_Output_Copy(vsOut0, &V1, mCurrVSOutputCount);
 	VS_Output_Copy(vsOut1, &V2, mCurrVSOutputCount);
 	VS_Output_Copy(vsOut2, &V3, mCurrVSOutputCount);
 
 	face.V[0] = vsOut0; face.V[1] = vsOut1; face.V[2] = vsOut2;
-	mNumVerticesThreads[threadIdx] += 3;
+	batch.NumVerticesThreads[threadIdx] += 3;
 
 	/** 
 	 * Compute difference of attributes and store in face. When rasterize tiles,
@@ -1205,15 +1493,54 @@ void Rasterizer::Binning( const VS_Output& V1, const VS_Output& V2, const VS_Out
 	const float area = vsOutput01.Position.X() * vsOutput02.Position.Y() - vsOutput02.Position.X() * vsOutput01.Position.Y();
 	const float invArea = 1.0f / area;
 
-	VS_Output ddxAttrib, ddyAttrib;
 	VS_Output_Difference(&face.ddxVarying, &face.ddyVarying, &vsOutput01, &vsOutput02, invArea, mCurrVSOutputCount);	
 }
 
+Rasterizer::RasterBatch& Rasterizer::BeginBatch( const TilePassFunc& tilePass )
+{
+	RasterBatch& batch = mBatches[mIssuedBatches % NumRasterBatches];
+
+	// batch is reused, its tiles must be shaded
+	if (mIssuedBatches >= NumRasterBatches)
+		WaitBatches(mIssuedBatches - NumRasterBatches + 1);
+
+	// tiles may be shaded after application changes device state for later draws
+	mDevice.CaptureShadingState(&batch.State);
+	batch.Sequence = ++mIssuedBatches;
+	mFrontEndBatch = &batch;
+
+	// tile job queue is rebuilt for each batch
+	batch.TilesQueueSize = 0;
+	batch.TilePass = tilePass;
+	batch.Order = mTileOrder;
+
+	// tile pass interpolates nothing, bound vertex shader may be of another draw or none at all
+	if (tilePass)
+	{
+		batch.State.VSOutputCount = 0;
+		batch.State.VaryingMask = 0;
+	}
+
+	return batch;
+}
+
+void Rasterizer::AllocateThreadBuffers( RasterBatch& batch, uint32_t threadIdx, uint32_t primitiveCount )
+{
+	batch.NumVerticesThreads[threadIdx] = 0;
+
+	// after clip, one triangle can generate maximum (MaxClipVertices - 2) triangle faces, binning keeps 3 vertices per face
+	batch.VerticesThreads[threadIdx].resize(primitiveCount * 3 * (MaxClipVertices - 2));
+	batch.FacesThreads[threadIdx].resize(primitiveCount * (MaxClipVertices - 2));
+	batch.MicroFacesThreads[threadIdx].resize(primitiveCount * (MaxClipVertices - 2));
+}
+
 void Rasterizer::DrawTiled( PrimitiveType primitiveType, uint32_t primitiveCount )
 {
-	pool& theadPool = GlobalThreadPool();
+	JobSystem& jobSystem = GlobalJobSystem();
 	uint32_t numWorkThreads = GetNumWorkThreads();
 
+	RasterBatch& batch = BeginBatch();
+
 	// calculate package size for each thread
 	uint32_t primitivesPerThread = primitiveCount / numWorkThreads;
 	uint32_t extraPrimitives = primitiveCount % numWorkThreads;
@@ -1244,376 +1571,571 @@ void Rasterizer::DrawTiled( PrimitiveType primitiveType, uint32_t primitiveCount
 	}
 
 	// allocate each thread's vertex and face buffer
+	for (idx = 0; idx < numWorkThreads; ++idx)
+		AllocateThreadBuffers(batch, idx, mThreadPackage[idx].End - mThreadPackage[idx].Start);
+
+	const int64_t geometryStart = Profiler::Now();
+	
+	// one job per package, package index selects vertex and face buffer
+	Job* setupJob = jobSystem.CreateJob();
 	for (idx = 0; idx < numWorkThreads; ++idx)
 	{
-		mNumVerticesThreads[idx] = 0;
+		jobSystem.Run(jobSystem.CreateChildJob(setupJob, std::bind(&Rasterizer::SetupGeometryTiled, this, std::ref(batch.VerticesThreads[idx]), 
+			std::ref(batch.FacesThreads[idx]), idx, mThreadPackage[idx])));
+	}
+	jobSystem.Run(setupJob);
+	jobSystem.Wait(setupJob);  // Synchronization
+	
+	const int64_t geometryEnd = Profiler::Now();
+	PROFILE_RECORD("Geometry", geometryStart, geometryEnd);
+	mStats.GeometryTime += (geometryEnd - geometryStart) / 1000;
+
+	ShadeBatch(batch);
+}
 
-		const uint32_t primCount = (mThreadPackage[idx].End - mThreadPackage[idx].Start);
+void Rasterizer::DrawMeshletsTiled( const MeshletBuffer& meshlets, uint32_t first, uint32_t count, const float44& worldViewProj )
+{
+	JobSystem& jobSystem = GlobalJobSystem();
+	const uint32_t numWorkThreads = GetNumWorkThreads();
 
-		// after frustum clip, one triangle can generate maximum 5 vertices, maximum 3 triangle faces
-		mVerticesThreads[idx].resize(primCount * 5);
-		mFacesThreads[idx].resize(primCount * 3);
+	RasterBatch& batch = BeginBatch();
+
+	SetupMeshletCulling(worldViewProj);
+
+	// packages of whole clusters with about the same triangle count
+	const Meshlet& lastMeshlet = meshlets.Meshlets[first + count - 1];
+	const uint32_t firstTriangle = meshlets.Meshlets[first].TriangleOffset;
+	const uint32_t numTriangles = lastMeshlet.TriangleOffset + lastMeshlet.TriangleCount - firstTriangle;
+
+	uint32_t iMeshlet = first;
+	for (uint32_t idx = 0; idx < numWorkThreads; ++idx)
+	{
+		const uint32_t triangleEnd = firstTriangle + static_cast<uint32_t>(uint64_t(numTriangles) * (idx + 1) / numWorkThreads);
+
+		mThreadPackage[idx].Start = iMeshlet;
+		while (iMeshlet < first + count && meshlets.Meshlets[iMeshlet].TriangleOffset < triangleEnd)
+			++iMeshlet;
+		mThreadPackage[idx].End = iMeshlet;
+
+		uint32_t primCount = 0;
+		for (uint32_t i = mThreadPackage[idx].Start; i < mThreadPackage[idx].End; ++i)
+			primCount += meshlets.Meshlets[i].TriangleCount;
+
+		AllocateThreadBuffers(batch, idx, primCount);
 	}
 
-	// profiler
-	mProfiler.StartTimer("Vertex Process + Binning");
-	
-	for (idx = 0; idx < numWorkThreads - 1; ++idx)
+	const int64_t geometryStart = Profiler::Now();
+
+	Job* setupJob = jobSystem.CreateJob();
+	for (uint32_t idx = 0; idx < numWorkThreads; ++idx)
 	{
-		//SetupGeometryTiled(mVerticesThreads[idx], mFacesThreads[idx], idx, mThreadPackage[idx]);
-		theadPool.schedule(std::bind(&Rasterizer::SetupGeometryTiled, this, std::ref(mVerticesThreads[idx]), 
-			std::ref(mFacesThreads[idx]), idx, mThreadPackage[idx]));
+		jobSystem.Run(jobSystem.CreateChildJob(setupJob, std::bind(&Rasterizer::SetupMeshletsTiled, this, std::cref(meshlets), 
+			idx, mThreadPackage[idx])));
 	}
-	SetupGeometryTiled(mVerticesThreads[idx], mFacesThreads[idx], idx, mThreadPackage[idx]);
-	theadPool.wait();  // Synchronization
-	
-	mProfiler.EndTimer("Vertex Process + Binning");
-	auto elapsedTimeVB = mProfiler.GetElapsedTime("Vertex Process + Binning");
+	jobSystem.Run(setupJob);
+	jobSystem.Wait(setupJob);
+
+	const int64_t geometryEnd = Profiler::Now();
+	PROFILE_RECORD("Geometry", geometryStart, geometryEnd);
+	mStats.GeometryTime += (geometryEnd - geometryStart) / 1000;
 
+	ShadeBatch(batch);
+}
 
-	mProfiler.StartTimer("Build Tiles Job Queue");
-	// build non-empty tile job queue
+void Rasterizer::DrawTilePass( const TilePassFunc& func )
+{
+	// tile pass accesses render targets, a multisampled frame buffer's draws write its samples
+	ASSERT(mCurrFrameBuffer->GetSampleCount() == 1);
+	if (mCurrFrameBuffer->GetSampleCount() > 1)
+		return;
+
+	RasterBatch& batch = BeginBatch(func);
+	ShadeBatch(batch);
+}
+
+void Rasterizer::ResolveFrameBuffer()
+{
+	if (!mCurrFrameBuffer || mCurrFrameBuffer->GetSampleCount() == 1 || !mCurrFrameBuffer->mResolvePending)
+		return;
+
+	mCurrFrameBuffer->mResolvePending = false;
+
+	RasterBatch& batch = BeginBatch([](FrameBuffer& frameBuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+		frameBuffer.ResolveTile(x, y, width, height);
+	});
+	ShadeBatch(batch);
+}
+
+void Rasterizer::ShadeBatch( RasterBatch& batch )
+{
+	JobSystem& jobSystem = GlobalJobSystem();
+	const uint32_t numWorkThreads = GetNumWorkThreads();
+
+	// draw writes samples only, render targets are resolved later
+	if (!batch.TilePass && IsMultisampled(batch.State))
+		batch.State.FrameBuffer->mResolvePending = true;
+
+	const int64_t tileQueueStart = Profiler::Now();
+
+	// build non-empty tile job queue, estimate tile cost from binned triangle kinds
 	for (int32_t y = 0; y < mNumTileY; ++y)
 	{
 		for (int32_t x = 0; x < mNumTileX; ++x)
 		{
 			const int32_t tileIdx = y * mNumTileX + x;
+			Tile& tile = batch.Tiles[tileIdx];
+
+			tile.Cost = 0;
 			for (uint32_t i = 0; i < numWorkThreads; ++i)
 			{
-				if (mTiles[tileIdx].TriQueueSize[i] > 0)
+				for (uint32_t iTri = 0; iTri < tile.TriQueueSize[i]; ++iTri)
 				{
-					mTilesQueue[mTilesQueueSize++] = tileIdx;
-					break;
+					const uint32_t flags = tile.TriQueue[i][iTri];
+					if (flags & TileTriMicro)
+						tile.Cost += TileCostMicro;
+					else if (flags & TileTriAccept)
+						tile.Cost += TileCostAccept;
+					else
+						tile.Cost += TileCostPartial;
 				}
 			}	
+
+			// tile pass covers every tile
+			if (tile.Cost > 0 || batch.TilePass)
+				batch.TilesQueue[batch.TilesQueueSize++] = tileIdx;
+		}
+	}
+
+	if (batch.Order == TO_Cost)
+	{
+		// heaviest tiles first, so expensive tiles don't end up at the tail of one thread
+		std::sort(batch.TilesQueue.begin(), batch.TilesQueue.begin() + batch.TilesQueueSize, [&batch](uint32_t a, uint32_t b) {
+			return batch.Tiles[a].Cost > batch.Tiles[b].Cost; });
+	}
+	else if (batch.Order != TO_RowMajor)
+	{
+		// queue is built in row major order
+		const std::vector<uint32_t>& ranks = mTileRanks;
+		std::sort(batch.TilesQueue.begin(), batch.TilesQueue.begin() + batch.TilesQueueSize, [&ranks](uint32_t a, uint32_t b) {
+			return ranks[a] < ranks[b]; });
+	}
+	const int64_t tileQueueEnd = Profiler::Now();
+	PROFILE_RECORD("Build Tile Queue", tileQueueStart, tileQueueEnd);
+	mStats.TileQueueTime += (tileQueueEnd - tileQueueStart) / 1000;
+
+	mStats.NumDraws++;
+	mStats.NumTiles += batch.TilesQueueSize;
+
+	// tiles of a draw are shaded after previous draw, rasterize jobs are not waited here,
+	// so the front end of next draw overlaps them
+	WaitBatches(batch.Sequence - 1);
+
+	mShadingState = &batch.State;
+	batch.TileBusyTime.assign(jobSystem.GetNumWorkers(), 0);
+
+	if (batch.TilesQueueSize == 0)
+	{
+		CompleteBatch(batch.Sequence);
+		return;
+	}
+
+	// Rasterize each tile in tile job queue, every job fetches one tile at a time in queue order
+	mNextTile.store(0);
+	mPendingTileJobs.store(numWorkThreads);
+
+	if (batch.Order == TO_Affinity)
+	{
+		// job i starts with i-th contiguous part of the curve
+		for (uint32_t idx = 0; idx < numWorkThreads; ++idx)
+		{
+			const uint32_t begin = static_cast<uint32_t>(uint64_t(batch.TilesQueueSize) * idx / numWorkThreads);
+			const uint32_t end = static_cast<uint32_t>(uint64_t(batch.TilesQueueSize) * (idx + 1) / numWorkThreads);
+			mTileRanges[idx].Range.store(PackTileRange(begin, end));
 		}
 	}
-	mProfiler.EndTimer("Build Tiles Job Queue");
-	auto elapsedTimeBT = mProfiler.GetElapsedTime("Build Tiles Job Queue");
 
-	mProfiler.StartTimer("RasterizeTiles");
+	Job* rasterizeJob = jobSystem.CreateJob();
+	for (uint32_t idx = 0; idx < numWorkThreads; ++idx)
+	{
+		jobSystem.Run(jobSystem.CreateChildJob(rasterizeJob, std::bind(&Rasterizer::RasterizeTiles, this, std::ref(batch), idx)));
+	}
+	jobSystem.Run(rasterizeJob);
+}
+
+void Rasterizer::WaitBatches( uint64_t numBatches )
+{
+	GlobalJobSystem().WaitUntil([this, numBatches]() { return mCompletedBatches.load() >= numBatches; });
+}
 
-	// Rasterize each tile in tile job queue
-	std::atomic<uint32_t> workingPackage(0);
-	for (size_t i = 0; i < numWorkThreads - 1; ++i)
+void Rasterizer::WaitFrameBuffer( const FrameBuffer* fb )
+{
+	for (const RasterBatch& batch : mBatches)
 	{
-		theadPool.schedule(std::bind(&Rasterizer::RasterizeTiles, this, std::ref(mTilesQueue), std::ref(workingPackage), mTilesQueueSize));
+		if (batch.Sequence > mCompletedBatches.load() && batch.State.FrameBuffer.get() == fb)
+			WaitBatches(batch.Sequence);
 	}
-	RasterizeTiles(mTilesQueue, workingPackage, mTilesQueueSize);
-	theadPool.wait();  // Synchronization
+}
 
-	mProfiler.EndTimer("RasterizeTiles");
-	auto elapsedTimeRT = mProfiler.GetElapsedTime("RasterizeTiles");
+RasterizerStats Rasterizer::GetStats() const
+{
+	RasterizerStats stats = mStats;
+	stats.ShadeTime = mShadeTime.load();
+	return stats;
 }
 
-void Rasterizer::RasterizeTiles(std::vector<uint32_t>& tilesQueue, std::atomic<uint32_t>& workingPackage, uint32_t numTiles)
+void Rasterizer::ResetStats()
 {
-	uint32_t numPackages = (numTiles + RasterizeTilePackageSize - 1) / RasterizeTilePackageSize;
-	uint32_t localWorkingPackage  = workingPackage ++;
+	mStats.NumDraws = mStats.NumPredicatedDraws = mStats.NumCulledDraws = mStats.NumTiles = 0;
+	mStats.GeometryTime = mStats.TileQueueTime = mStats.ShadeTime = 0;
+	mShadeTime.store(0);
+}
 
-	const uint32_t numWorkThreads = GetNumWorkThreads();
+PipelineStatistics Rasterizer::SumStatistics( const std::vector<ThreadStatistics>& counters ) const
+{
+	PipelineStatistics sum;
+	for (const ThreadStatistics& counter : counters)
+		sum += counter.Stats;
+	return sum;
+}
+
+void Rasterizer::CompleteBatch( uint64_t sequence )
+{
+	// completion is published under the lock, so queries begun or ended concurrently are not missed
+	std::lock_guard<std::mutex> lock(mQueryMutex);
 
-	while (localWorkingPackage < numPackages)
+	if (!mPendingQueries.empty())
 	{
-		const uint32_t start = localWorkingPackage * SetupGeometryPackageSize;
-		const uint32_t end = (std::min)(numTiles, start + SetupGeometryPackageSize);
-		for (uint32_t iTile = start; iTile < end; ++iTile)
-		{
-			Tile& tile = mTiles[tilesQueue[iTile]];
+		const PipelineStatistics pixelStats = SumStatistics(mPixelCounters);
 
-			int32_t tileX = tile.X << 4; // fixed point
-			int32_t tileY = tile.Y << 4; // fixed point
-			int32_t tileWidth = tile.Width << 4; // fixed point
-			int32_t tileHeight = tile.Height << 4; // fixed point
+		for (size_t i = 0; i < mPendingQueries.size(); )
+		{
+			Query& query = *mPendingQueries[i];
 
-			for (uint32_t iThread = 0; iThread < numWorkThreads; ++iThread)
+			if (!query.mPixelBegun && query.mBeginBatch == sequence)
 			{
-				auto tris = tile.TriQueueSize[iThread];
-				for (uint32_t iTri = 0; iTri < tile.TriQueueSize[iThread]; ++iTri)
-				{
-					uint32_t faceIdx = tile.TriQueue[iThread][iTri];
-					uint32_t accept = faceIdx & 0x1;
-					faceIdx = faceIdx >> 1; 
+				query.mBegin += pixelStats;
+				query.mPixelBegun = true;
+			}
 
-					RasterFaceTiled& face = mFacesThreads[iThread][faceIdx];
-					
-					if (accept)
-					{
-						DrawPixels(face, tile.X, tile.Y, tile.X + tile.Width, tile.Y + tile.Height);
-					}
-					else
-					{
-						DrawPartialTile(face, tileX, tileY, tileWidth, tileHeight);
-					}
-				}
+			if (!query.mActive && query.mEndBatch == sequence)
+			{
+				query.mEnd += pixelStats;
+				query.mPixelEnded = true;
 
-				tile.TriQueueSize[iThread] = 0;
+				mPendingQueries[i] = mPendingQueries.back();
+				mPendingQueries.pop_back();
 			}
-
+			else
+				++i;
 		}
-
-		localWorkingPackage  = workingPackage ++;
 	}
+
+	mCompletedBatches.store(sequence);
 }
 
-void Rasterizer::DrawPartialTile(const RasterFaceTiled& face, int32_t tileX, int32_t tileY, int32_t tileWidth, int32_t tileHeight)
+void Rasterizer::BeginQuery( const shared_ptr<Query>& query )
 {
-	const VS_Output* V1 = face.V[0];
-	const VS_Output* V2 = face.V[1];
-	const VS_Output* V3 = face.V[2];
-
-	// 28.4 fixed-point coordinates
-	const int32_t X1 = face.X[0];
-	const int32_t X2 = face.X[1];
-	const int32_t X3 = face.X[2];
-
-	const int32_t Y1 = face.Y[0];
-	const int32_t Y2 = face.Y[1];
-	const int32_t Y3 = face.Y[2];
-
-	// Deltas
-	const int32_t DX12 = X1 - X2;
-	const int32_t DX23 = X2 - X3;
-	const int32_t DX31 = X3 - X1;
-
-	const int32_t DY12 = Y1 - Y2;
-	const int32_t DY23 = Y2 - Y3;
-	const int32_t DY31 = Y3 - Y1;
-
-	// Fixed-point deltas
-	const int32_t FDX12 = DX12 << 4;
-	const int32_t FDX23 = DX23 << 4;
-	const int32_t FDX31 = DX31 << 4;
-	const int32_t FDY12 = DY12 << 4;
-	const int32_t FDY23 = DY23 << 4;
-	const int32_t FDY31 = DY31 << 4;
-
-#ifdef USE_SIMD
-	const __m128i OffsetDY12 = _mm_set_epi32(FDY12 * 3, FDY12 * 2, FDY12 * 1, 0);
-	const __m128i OffsetDY23 = _mm_set_epi32(FDY12 * 3, FDY12 * 2, FDY12 * 1, 0);
-	const __m128i OffsetDY31 = _mm_set_epi32(FDY31 * 3, FDY31 * 2, FDY31 * 1, 0);
-#endif
+	// front end counters only change during draw calls of this thread
+	const PipelineStatistics frontStats = SumStatistics(mFrontCounters);
 
-	// Half-edge constants
-	const int32_t C1 = face.C1;
-	const int32_t C2 = face.C2;
-	const int32_t C3 = face.C3;
+	std::lock_guard<std::mutex> lock(mQueryMutex);
+	ASSERT(!query->mActive);
 
-	// Compute bounding box
-	int32_t minX = (Max(face.MinX, tileX) + 0xF) >> 4;
-	int32_t maxX = (Min(face.MaxX, tileX + tileWidth) + 0xF) >> 4;
-	int32_t minY = (Max(face.MinY, tileY) + 0xF) >> 4;
-	int32_t maxY = (Min(face.MaxY, tileY + tileHeight) + 0xF) >> 4;
+	// query may be reissued before its last result is available
+	auto it = std::find(mPendingQueries.begin(), mPendingQueries.end(), query);
+	if (it != mPendingQueries.end())
+		mPendingQueries.erase(it);
 
-	// Block size, standard 8x8 (must be power of two)
-	const int BlockSize = 8;
+	query->mActive = true;
+	query->mBeginBatch = mIssuedBatches;
+	query->mPixelBegun = query->mPixelEnded = false;
+	query->mBegin = frontStats;
+	query->mEnd = PipelineStatistics();
 
-	// Start in corner of 8x8 block
-	minX &= ~(BlockSize - 1);
-	minY &= ~(BlockSize - 1);
+	if (mCompletedBatches.load() >= query->mBeginBatch)
+	{
+		query->mBegin += SumStatistics(mPixelCounters);
+		query->mPixelBegun = true;
+	}
+	else
+		mPendingQueries.push_back(query);
+}
 
-    const VS_Output* pBaseVertex = face.V[0];
+void Rasterizer::EndQuery( const shared_ptr<Query>& query )
+{
+	const PipelineStatistics frontStats = SumStatistics(mFrontCounters);
 
-	for (int32_t y = minY; y < maxY; y += BlockSize)
-	{
-		for (int32_t x = minX; x < maxX; x += BlockSize)
-		{
-			// Corners of block
-			int32_t x0 = x << 4;
-			int32_t x1 = (x + BlockSize - 1) << 4;
-			int32_t y0 = y << 4;
-			int32_t y1 = (y + BlockSize - 1) << 4;
-
-			// Evaluate half-space functions
-			bool a00 = C1 + DX12 * y0 - DY12 * x0 > 0;
-			bool a10 = C1 + DX12 * y0 - DY12 * x1 > 0;
-			bool a01 = C1 + DX12 * y1 - DY12 * x0 > 0;
-			bool a11 = C1 + DX12 * y1 - DY12 * x1 > 0;
-			int32_t a = (a00 << 0) | (a10 << 1) | (a01 << 2) | (a11 << 3);
-
-			bool b00 = C2 + DX23 * y0 - DY23 * x0 > 0;
-			bool b10 = C2 + DX23 * y0 - DY23 * x1 > 0;
-			bool b01 = C2 + DX23 * y1 - DY23 * x0 > 0;
-			bool b11 = C2 + DX23 * y1 - DY23 * x1 > 0;
-			int32_t b = (b00 << 0) | (b10 << 1) | (b01 << 2) | (b11 << 3);
-
-			bool c00 = C3 + DX31 * y0 - DY31 * x0 > 0;
-			bool c10 = C3 + DX31 * y0 - DY31 * x1 > 0;
-			bool c01 = C3 + DX31 * y1 - DY31 * x0 > 0;
-			bool c11 = C3 + DX31 * y1 - DY31 * x1 > 0;
-			int32_t c = (c00 << 0) | (c10 << 1) | (c01 << 2) | (c11 << 3);
-
-			// Skip block when outside an edge
-			if(a == 0x0 || b == 0x0 || c == 0x0) continue;
-			
-			// Accept whole block when totally covered
-			if( a == 0xF && b == 0xF && c == 0xF )
-			{
-				// draw whole block
-				DrawPixels(face, x, y, Min(x+BlockSize, maxX), Min(y+BlockSize, maxY));
-			}
-			else
-			{
-				int32_t CY1 = C1 + DX12 * y0 - DY12 * x0;
-				int32_t CY2 = C2 + DX23 * y0 - DY23 * x0;
-				int32_t CY3 = C3 + DX31 * y0 - DY31 * x0;
+	std::lock_guard<std::mutex> lock(mQueryMutex);
+	ASSERT(query->mActive);
 
-				for(int32_t iy = y; iy < Min(y + BlockSize, maxY); iy++)
-				{
-#ifdef USE_SIMD
-					// ǰ4
-					__m128i CX1 = _mm_sub_epi32(_mm_set1_epi32(CY1), OffsetDY12);
-					__m128i CX2 = _mm_sub_epi32(_mm_set1_epi32(CY2), OffsetDY12);
-					__m128i CX3 = _mm_sub_epi32(_mm_set1_epi32(CY3), OffsetDY12);
+	query->mActive = false;
+	query->mEndBatch = mIssuedBatches;
+	query->mEnd = frontStats;
 
-					__m128i CX1Mask = _mm_cmpgt_epi32(CX1, _mm_setzero_si128());
-					__m128i CX2Mask = _mm_cmpgt_epi32(CX2, _mm_setzero_si128());
-					__m128i CX3Mask = _mm_cmpgt_epi32(CX3, _mm_setzero_si128());
+	if (mCompletedBatches.load() >= query->mEndBatch)
+	{
+		// begin batch is not later than end batch, so its pixel counters are sampled
+		query->mEnd += SumStatistics(mPixelCounters);
+		query->mPixelEnded = true;
 
-					__m128i CXMaskComp = _mm_and_si128( CX1Mask, _mm_and_si128( CX2Mask, CX3Mask ) );
+		auto it = std::find(mPendingQueries.begin(), mPendingQueries.end(), query);
+		if (it != mPendingQueries.end())
+			mPendingQueries.erase(it);
+	}
+	else if (std::find(mPendingQueries.begin(), mPendingQueries.end(), query) == mPendingQueries.end())
+		mPendingQueries.push_back(query);
+}
 
-					// Generate a 4-bit mask from the composite 128-bit mask 
-					int32_t mask = _mm_movemask_ps(_mm_castsi128_ps(CXMaskComp));				
-					
-					if (mask)
-					{
-						DrawMaskedPixels(face, mask, x, Min(x+4, maxX), iy);
-					}
+bool Rasterizer::GetQueryData( const shared_ptr<Query>& query, PipelineStatistics* oData, bool wait )
+{
+	if (wait && !query->mActive)
+		WaitBatches(query->mEndBatch);
 
+	std::lock_guard<std::mutex> lock(mQueryMutex);
+	if (query->mActive || !query->mPixelEnded)
+		return false;
 
-					// 4
-					CX1 = _mm_sub_epi32(CX1, OffsetDY12);
-					CX2 = _mm_sub_epi32(CX2, OffsetDY12);
-					CX3 = _mm_sub_epi32(CX3, OffsetDY12);
+	*oData = query->mEnd;
+	*oData -= query->mBegin;
+	return true;
+}
 
-					CX1Mask = _mm_cmpgt_epi32(CX1, _mm_setzero_si128());
-					CX2Mask = _mm_cmpgt_epi32(CX2, _mm_setzero_si128());
-					CX3Mask = _mm_cmpgt_epi32(CX3, _mm_setzero_si128());
+void Rasterizer::AllocateOverdrawMap()
+{
+	const uint32_t width = mCurrFrameBuffer ? mCurrFrameBuffer->GetWidth() : 0;
+	const uint32_t height = mCurrFrameBuffer ? mCurrFrameBuffer->GetHeight() : 0;
 
-					CXMaskComp = _mm_and_si128( CX1Mask, _mm_and_si128( CX2Mask, CX3Mask ) );
+	// keep counts unless frame buffer grows
+	if (width > mOverdrawPitch || height > mOverdrawHeight)
+	{
+		WaitBatches(mIssuedBatches);
 
-					mask = _mm_movemask_ps(_mm_castsi128_ps(CXMaskComp));		
-					if (mask)
-					{
-						x+=4;
-						DrawMaskedPixels(face, mask, x, Min(x+4, maxX), iy);
-					}
-#else
-					int32_t CX1 = CY1;
-					int32_t CX2 = CY2;
-					int32_t CX3 = CY3;
+		mOverdrawPitch = (std::max)(width, mOverdrawPitch);
+		mOverdrawHeight = (std::max)(height, mOverdrawHeight);
+		mOverdrawCounts.assign(mOverdrawPitch * mOverdrawHeight, 0);
+	}
 
-					for(int32_t ix = x; ix < Min(x + BlockSize, maxX); ix++)
-					{
-						if(CX1 > 0 && CX2 > 0 && CX3 > 0)
-						{
-							VS_Output vsOutput;
-							float fOffsetX = ix - pBaseVertex->Position.X();
-							float fOffsetY = iy - pBaseVertex->Position.Y();
-							VS_Output_BaryCentric(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, fOffsetX, fOffsetY, mCurrVSOutputCount);
-						
-							DrawPixel(ix, iy, vsOutput);
-						}
+	mOverdrawMap = mOverdrawCounts.empty() ? nullptr : &mOverdrawCounts[0];
+}
 
-						CX1 -= FDY12;
-						CX2 -= FDY23;
-						CX3 -= FDY31;
-					}
-#endif 
+void Rasterizer::SetOverdrawMapEnable( bool enable )
+{
+	// tiles in flight may write the map
+	WaitBatches(mIssuedBatches);
 
-					CY1 += FDX12;
-					CY2 += FDX23;
-					CY3 += FDX31;
-				}
-			}
-		}
+	mOverdrawEnable = enable;
+	if (enable)
+	{
+		AllocateOverdrawMap();
+	}
+	else
+	{
+		mOverdrawMap = nullptr;
+		mOverdrawPitch = mOverdrawHeight = 0;
+		mOverdrawCounts.clear();
 	}
 }
 
-void Rasterizer::DrawPixels(const RasterFaceTiled& face, int32_t xStart, int32_t yStart, int32_t xEnd, int32_t yEnd)
+void Rasterizer::ResolveOverdrawMap( const shared_ptr<Texture2D>& target )
 {
-	const VS_Output* pBaseVertex = face.V[0];
-	
-	for (int32_t iY = yStart; iY < yEnd; ++iY)
+	WaitBatches(mIssuedBatches);
+
+	if (!mOverdrawMap)
+		return;
+
+	if (target)
 	{
-		for (int32_t iX = xStart; iX < xEnd; ++iX)
-		{
-			float fOffsetX = (float)iX - pBaseVertex->Position.X();
-			float fOffsetY = (float)iY - pBaseVertex->Position.Y();
+		ASSERT(target->GetTextureFormat() == PF_A32B32G32R32F);
+
+		// black, blue, cyan, green, yellow, red, then white for 6 and more shaded pixels
+		static const float HeatColors[][3] = {
+			{ 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }, { 1, 1, 1 } };
+		const uint32_t maxHeat = sizeof(HeatColors) / sizeof(HeatColors[0]) - 1;
+
+		const uint32_t width = (std::min)(target->GetWidth(0), mOverdrawPitch);
+		const uint32_t height = (std::min)(target->GetHeight(0), mOverdrawHeight);
 
-			VS_Output VSOutput;
-			VS_Output_BaryCentric(&VSOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, fOffsetX, fOffsetY, mCurrVSOutputCount);
+		void* pData;
+		uint32_t pitch;
+		target->Map2D(0, TMA_Write_Only, 0, 0, width, height, pData, pitch);
 
-			DrawPixel(iX, iY, VSOutput);
+		for (uint32_t y = 0; y < height; ++y)
+		{
+			float* pColor = (float*)((uint8_t*)pData + y * pitch);
+			for (uint32_t x = 0; x < width; ++x, pColor += 4)
+			{
+				const float* heat = HeatColors[(std::min)(mOverdrawMap[y * mOverdrawPitch + x], maxHeat)];
+				pColor[0] = heat[0];
+				pColor[1] = heat[1];
+				pColor[2] = heat[2];
+				pColor[3] = 1.0f;
+			}
 		}
+
+		target->Unmap2D(0);
 	}
+
+	std::fill(mOverdrawCounts.begin(), mOverdrawCounts.end(), 0);
 }
 
-void Rasterizer::DrawMaskedPixels( const RasterFaceTiled& face, int32_t mask, int32_t xStart, int32_t xEnd, int32_t iY )
+const std::vector<long long>& Rasterizer::GetTileBusyTime() const
 {
-	const VS_Output* pBaseVertex = face.V[0];
+	static const std::vector<long long> noBusyTime;
 
-	VS_Output vsOutput;
-	float fOffsetX, fOffsetY = iY - pBaseVertex->Position.Y();
+	const uint64_t completed = mCompletedBatches.load();
+	if (completed == 0)
+		return noBusyTime;
 
-	static const int32_t bits[4] = {0x1, 0x2, 0x4, 0x8};
+	return mBatches[(completed - 1) % NumRasterBatches].TileBusyTime;
+}
 
-	for (int32_t iX= xStart; iX < xEnd; ++iX)
+bool Rasterizer::FetchTile( const RasterBatch& batch, uint32_t jobIdx, uint32_t* oTile )
+{
+	if (batch.Order != TO_Affinity)
+	{
+		*oTile = mNextTile++;
+		return *oTile < batch.TilesQueueSize;
+	}
+
+	const uint32_t numJobs = GetNumWorkThreads();
+
+	// own range from its begin
+	std::atomic<uint64_t>& own = mTileRanges[jobIdx].Range;
+	uint64_t range = own.load();
+	while (uint32_t(range) < uint32_t(range >> 32))
 	{
-		if (mask & bits[iX]) 
+		if (own.compare_exchange_weak(range, range + 1))
 		{
-			fOffsetX = iX - pBaseVertex->Position.X();
+			*oTile = uint32_t(range);
+			return true;
+		}
+	}
 
-			VS_Output_BaryCentric(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, fOffsetX, fOffsetY, mCurrVSOutputCount);
-			DrawPixel(iX, iY, vsOutput);
+	// other ranges from their end, away from tiles their owner shades next
+	for (uint32_t i = 1; i < numJobs; ++i)
+	{
+		std::atomic<uint64_t>& victim = mTileRanges[(jobIdx + i) % numJobs].Range;
+		range = victim.load();
+		while (uint32_t(range) < uint32_t(range >> 32))
+		{
+			const uint32_t end = uint32_t(range >> 32) - 1;
+			if (victim.compare_exchange_weak(range, PackTileRange(uint32_t(range), end)))
+			{
+				*oTile = end;
+				return true;
+			}
 		}
 	}
+
+	return false;
 }
 
-void Rasterizer::DrawPixel( uint32_t iX, uint32_t iY, const VS_Output& vsOutput )
+void Rasterizer::UpdateTileRanks()
 {
-#define DEPTH_TEST(condition) if((condition)) break; else return;
-
-	float srcDepth, destDepth;
+	uint32_t n = 1;
+	while (n < static_cast<uint32_t>(std::max(mNumTileX, mNumTileY)))
+		n *= 2;
 
-	// read back buffer pixel
-	mDevice.mCurrentFrameBuffer->ReadPixel(iX, iY, NULL, &destDepth);
+	mTileRanks.resize(mNumTileX * mNumTileY);
+	for (int32_t y = 0; y < mNumTileY; ++y)
+	{
+		for (int32_t x = 0; x < mNumTileX; ++x)
+		{
+			uint32_t& rank = mTileRanks[y * mNumTileX + x];
+			switch (mTileOrder)
+			{
+			case TO_Morton: rank = MortonIndex(x, y); break;
+			case TO_Hilbert:
+			case TO_Affinity: rank = HilbertIndex(n, x, y); break;
+			default: rank = y * mNumTileX + x; break;
+			}
+		}
+	}
+}
 
-	// Get depth of current pixel
-	srcDepth = vsOutput.Position.Z();
+void Rasterizer::SetTileOrder( TileOrder order )
+{
+	// ranks are only read by the issuing thread when it builds tile queues
+	mTileOrder = order;
+	UpdateTileRanks();
+}
 
-	VS_Output PSInput;
-	float curPixelInvW = 1.0f / vsOutput.Position.W();
-	VS_Output_Mul( &PSInput, &vsOutput, curPixelInvW, mCurrVSOutputCount );
+void Rasterizer::SetTexelCacheSimulationEnable( bool enable )
+{
+	// tiles in flight may sample
+	WaitBatches(mIssuedBatches);
 
-	// Execute the pixel shader
-	//m_TriangleInfo.iCurPixelX = i_iX;
-	PS_Output PSOutput;
-	if( !mDevice.mPixelShaderStage->GetPixelShader()->Execute(&PSInput, &PSOutput, &srcDepth ))
+	mTexelCacheEnable = enable;
+	if (enable)
 	{
-		// kill this pixel
-		return;
+		TexelCache empty;
+		memset(&empty, 0, sizeof(empty));
+		mTexelCaches.assign(GetNumWorkThreads(), empty);
 	}
-
-	// Perform depth-test
-	switch( mDevice.DepthStencilState.DepthFunc )
+	else
 	{
-	case CF_AlwaysFail: return;
-	case CF_Equal: DEPTH_TEST(fabsf( srcDepth - destDepth ) < FLT_EPSILON);
-	case CF_NotEqual: DEPTH_TEST(fabsf( srcDepth - destDepth ) >= FLT_EPSILON);
-	case CF_Less: DEPTH_TEST(srcDepth < destDepth);
-	case CF_LessEqual: DEPTH_TEST(srcDepth <= destDepth);
-	case CF_GreaterEqual: DEPTH_TEST(srcDepth >= destDepth);
-	case CF_Greater: DEPTH_TEST(srcDepth > destDepth);
-	case CF_AlwaysPass: break;
+		mTexelCaches.clear();
 	}
+}
 
-	mDevice.mCurrentFrameBuffer->WritePixel(iX, iY, &PSOutput,
-		mDevice.DepthStencilState.DepthWriteMask ? &srcDepth : NULL);
+void Rasterizer::CountTexelFetch( const void* address )
+{
+	const uint32_t worker = JobSystem::GetWorkerIndex();
+	mPixelCounters[worker].Stats.TexelFetches++;
 
-#undef DEPTH_TEST
+	// tags are line + 1 so that 0 marks an empty way
+	const uint64_t line = reinterpret_cast<uintptr_t>(address) >> TexelCacheLineShift;
+	const uint64_t tag = line + 1;
+	uint64_t* ways = mTexelCaches[worker].Tags[line & (TexelCacheSets - 1)];
+
+	uint32_t way = 0;
+	while (way < TexelCacheWays - 1 && ways[way] != tag)
+		++way;
+
+	// miss evicts least recently used way
+	if (ways[way] != tag)
+		mPixelCounters[worker].Stats.TexelCacheMisses++;
+
+	for (; way > 0; --way)
+		ways[way] = ways[way - 1];
+	ways[0] = tag;
 }
 
+void Rasterizer::RasterizeTiles(RasterBatch& batch, uint32_t jobIdx)
+{
+	const int64_t startTime = Profiler::Now();
+
+	// pixel shader samples textures captured with this draw
+	RenderDevice::BindShadingState(&batch.State);
+
+	uint32_t iTile;
+	while (FetchTile(batch, jobIdx, &iTile))
+	{
+		Tile& tile = batch.Tiles[batch.TilesQueue[iTile]];
+
+		if (batch.TilePass)
+		{
+			batch.TilePass(*batch.State.FrameBuffer, tile.X, tile.Y, tile.Width, tile.Height);
+			continue;
+		}
+
+		if (batch.State.Pipeline)
+			batch.State.Pipeline->RasterizeTile(*this, batch, tile);
+		else
+			RasterizeTile<VirtualPixelShading>(batch, tile);
+	}
+
+	RenderDevice::BindShadingState(nullptr);
 
+	// more than one job may run on the same worker
+	const int64_t endTime = Profiler::Now();
+	PROFILE_RECORD("Rasterize Tiles", startTime, endTime);
 
+	const long long busyTime = (endTime - startTime) / 1000;
+	batch.TileBusyTime[JobSystem::GetWorkerIndex()] += busyTime;
+	mShadeTime.fetch_add(busyTime);
 
+	// last job of this batch
+	if (mPendingTileJobs.fetch_sub(1) == 1)
+		CompleteBatch(batch.Sequence);
+}
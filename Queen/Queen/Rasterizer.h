@@ -4,7 +4,14 @@
 #include "GraphicCommon.h"
 #include "RenderStage.h"
 #include "Shader.h"
+#include "RenderDevice.h"
 #include "Profiler.h"
+#include "Meshlet.h"
+#include <Matrix.hpp>
+#include <atomic>
+#include <mutex>
+
+using RxLib::float44;
 
 // primitive count per package used in set up geometry
 #define SetupGeometryPackageSize 64
@@ -12,7 +19,14 @@
 // primitive count per package used in binning
 #define BinningPackageSize 64
 
-#define RasterizeTilePackageSize 16
+// relative raster cost of a binned triangle, used to order tile job queue heaviest first
+#define TileCostMicro 1
+#define TileCostPartial 4
+#define TileCostAccept 8
+
+// tiled draws whose front end output can be alive at the same time, the next draw bins
+// while tiles of the previous draw are shaded
+#define NumRasterBatches 2
 
 // vertex cache size
 #define VertexCacheSize 16
@@ -20,8 +34,40 @@
 #define TileSize 64
 #define TileSizeShift 6
 
+// triangles whose pixel bounding box fits in MicroTriangleSize^2 take the micro triangle path
+#define MicroTriangleSize 8
+
+// low bits of tile queue entry, face index is stored above them
+#define TileTriAccept 0x1
+#define TileTriMicro  0x2
+#define TileTriShift  2
+
+// furthest sample of 4x rotated grid from pixel center, 1/16 pixel
+#define MaxSampleOffset 6
+
+// simulated per worker texel cache, 64 sets of 8 ways of 64 byte lines is 32KB
+#define TexelCacheLineShift 6
+#define TexelCacheSets 64
+#define TexelCacheWays 8
+
+// near, far and four guard band planes
+#define NumClipPlanes 6
+
+// clipped polygon has at most one more vertex for each clip plane
+#define MaxClipVertices (3 + NumClipPlanes)
+
+/**
+ * Guard band extent in pixels beyond each viewport edge. Triangles inside it are
+ * rasterized without x/y clipping, 28.4 fixed point positions still fit 32 bits.
+ */
+#define GuardBandSize 8192
+
 class Rasterizer : public RenderStage
 {
+	// pipelines instantiate tile loops for their shader types
+	friend class ShaderPipeline;
+	template <typename VS, typename PS> friend class Pipeline;
+
 public:
 	typedef std::function<const VS_Output&(uint32_t)> VertexFetchFunc;
 	typedef std::function<uint32_t(uint32_t)> IndexFetchFunc;
@@ -33,6 +79,9 @@ public:
 
 		vector<vector<uint32_t> > TriQueue;
 		vector<uint32_t> TriQueueSize;
+
+		// estimated raster cost of binned triangles, set when tile job queue is built
+		uint32_t Cost;
 	};
 
 	struct RasterFace
@@ -50,10 +99,28 @@ public:
 		// fixed point position
 		int32_t X[3], Y[3];
 
-		// half space constant
-		int32_t C1, C2, C3;
+		// half space constant, 64 bits so guard band sized triangles don't overflow
+		int64_t C1, C2, C3;
 
 		int32_t MinX, MinY, MaxX, MaxY;
+
+		// selects front or back stencil state
+		bool FrontFace;
+	};
+
+	/**
+	 * Compact setup record of micro triangle, edge functions are relative to bounding box
+	 * origin so they fit 32 bits and coverage of whole box is one SIMD pass.
+	 */
+	struct RasterFaceMicro
+	{
+		// edge functions at bounding box origin and per pixel steps
+		int32_t E[3];
+		int32_t StepX[3], StepY[3];
+
+		// pixel bounding box
+		int16_t X, Y;
+		uint8_t Width, Height;
 	};
 
 	struct ThreadPackage
@@ -67,17 +134,129 @@ public:
 		VS_Output Vertex;
 	};
 
+	/**
+	 * Object space frustum planes and eye of current meshlet draw. Cone culling is disabled
+	 * when ConeSign is 0, otherwise ConeSign * ConeAxis points away from eye for culled faces.
+	 */
+	struct MeshletCulling
+	{
+		float4 Planes[6];
+		float3 Eye;
+		float ConeSign;
+	};
+
+	// counters of one thread, padded so threads don't share cache lines
+	struct ThreadStatistics
+	{
+		PipelineStatistics Stats;
+		char Padding[64];
+	};
+
+	// line tags of each set, most recently used first, 0 is an empty way
+	struct TexelCache
+	{
+		uint64_t Tags[TexelCacheSets][TexelCacheWays];
+	};
+
+	/**
+	 * Tile queue range [begin, end) of one tile job with TO_Affinity, begin in the low 32 bits.
+	 * Owner takes tiles from the begin, other jobs from the end, both with one CAS.
+	 */
+	struct TileRange
+	{
+		std::atomic<uint64_t> Range;
+		char Padding[64];
+	};
+
+	/**
+	 * Front end output of one tiled draw and the device state its tiles are shaded with.
+	 */
+	struct RasterBatch
+	{
+		// each thread keep a local clipped vertex buffer
+		std::vector< std::vector<VS_Output> > VerticesThreads;	
+		std::vector<uint32_t> NumVerticesThreads;
+
+		// each thread keep a local clipped faces buffer
+		std::vector< std::vector<RasterFaceTiled> > FacesThreads;		
+
+		// micro triangle setup records, same index as FacesThreads
+		std::vector< std::vector<RasterFaceMicro> > MicroFacesThreads;
+
+		std::vector<Tile> Tiles;
+
+		// non-empty tile job queue, sorted by tile cost
+		std::vector<uint32_t> TilesQueue;
+		uint32_t TilesQueueSize;
+
+		// per worker busy time of RasterizeTiles
+		std::vector<long long> TileBusyTime;
+
+		ShadingState State;
+
+		// set if batch is a tile pass, which runs it on every tile instead of rasterizing
+		TilePassFunc TilePass;
+
+		// order of tile job queue
+		TileOrder Order;
+
+		// batches are numbered from 1 in issue order
+		uint64_t Sequence;
+	};
+
 public:
 	Rasterizer(RenderDevice& device);
 	~Rasterizer(void);
 
 	void Draw(PrimitiveType primitiveType, uint32_t primitiveCount);
 	void DrawTiled(PrimitiveType primitiveType, uint32_t primitiveCount);
+
+	// clusters [first, first + count) culled against worldViewProj, each cluster's vertices are shaded once
+	void DrawMeshletsTiled(const MeshletBuffer& meshlets, uint32_t first, uint32_t count, const float44& worldViewProj);
+
+	// batch of no geometry running func on each tile of bound frame buffer
+	void DrawTilePass(const TilePassFunc& func);
+
+	// resolve tile pass on bound frame buffer if it is multisampled and tiled draws wrote samples since last resolve
+	void ResolveFrameBuffer();
 	void PreDraw();
 	void PostDraw();
 
 	void OnBindFrameBuffer(const shared_ptr<FrameBuffer>& fb);
 
+	// microseconds each worker spent rasterizing tiles in last shaded tiled draw, indexed by worker
+	const std::vector<long long>& GetTileBusyTime() const;
+
+	/**
+	 * DrawTiled returns before tiles of the draw are shaded. Tiles of a draw are shaded after
+	 * all earlier draws, so waiting for the number of issued draws waits for all of them.
+	 */
+	uint64_t GetIssuedBatches() const	{ return mIssuedBatches; }
+	uint64_t GetCompletedBatches() const	{ return mCompletedBatches.load(); }
+	void WaitBatches(uint64_t numBatches);
+
+	// wait for draws still shading into frame buffer
+	void WaitFrameBuffer(const FrameBuffer* fb);
+
+	RasterizerStats GetStats() const;
+	void ResetStats();
+
+	void BeginQuery(const shared_ptr<Query>& query);
+	void EndQuery(const shared_ptr<Query>& query);
+	bool GetQueryData(const shared_ptr<Query>& query, PipelineStatistics* oData, bool wait);
+
+	void SetOverdrawMapEnable(bool enable);
+	void ResolveOverdrawMap(const shared_ptr<Texture2D>& target);
+
+	void SetTileOrder(TileOrder order);
+	TileOrder GetTileOrder() const		{ return mTileOrder; }
+
+	void SetTexelCacheSimulationEnable(bool enable);
+	bool IsTexelCacheSimulated() const	{ return mTexelCacheEnable; }
+
+	// count texel read by sampling in worker's pixel counters, looked up in worker's texel cache
+	void CountTexelFetch(const void* address);
+
 private:
 
 	void ProjectVertex(VS_Output* vertex);
@@ -85,6 +264,9 @@ private:
 	const VS_Output& FetchVertex(uint32_t index, uint32_t threadIdx);
 
 	uint32_t ClipTriangle(VS_Output* clipped, const VS_Output& v0, const VS_Output& v1, const VS_Output& v2);
+
+	// bit i is set if position is outside clip plane i
+	uint32_t ComputeClipCode(const float4& position) const;
 	
 	void RasterizeTriangle(const VS_Output& vsOut0, const VS_Output& vsOut1, const VS_Output& vsOut2);
 
@@ -98,29 +280,138 @@ private:
 
 	void RasterizeScanline(int32_t xStart, int32_t xEnd, int32_t Y, VS_Output* baseVertex, const VS_Output* ddx);
  
+	/**
+	 * Both tests work on homogeneous clip space positions before clipping and projection.
+	 * Orientation comes from the determinant of (x, y, w), which is valid for triangles crossing w = 0.
+	 */
 	bool BackFaceCulling(const VS_Output& v0, const VS_Output& v1, const VS_Output& v2, bool* oriented = nullptr);
+	bool FrustumCulling(const VS_Output& v0, const VS_Output& v1, const VS_Output& v2);
 
-	void SetupGeometry(std::vector<VS_Output>& outVertices, std::vector<RasterFace>& outFaces, 
-		std::atomic<uint32_t>& workPackage, uint32_t primitiveCount);
+	// set up primitives [start, end)
+	void SetupGeometry(std::vector<VS_Output>& outVertices, std::vector<RasterFace>& outFaces, uint32_t start, uint32_t end);
 	
-	void RasterizeFaces(std::vector<RasterFace>& faces, std::atomic<uint32_t>& workPackage, uint32_t faceCount);
+	void RasterizeFaces(std::vector<RasterFace>& faces, uint32_t start, uint32_t end);
 
 	void ClipTriangleTiled(VS_Output* vertices, uint32_t threadIdx);
 
 	void SetupGeometryTiled(std::vector<VS_Output>& outVertices, std::vector<RasterFaceTiled>& outFaces, uint32_t theadIdx, ThreadPackage package);
 
-	void Binning(const VS_Output& V0, const VS_Output& V1, const VS_Output& V2, uint32_t threadIdx);
+	// set up clusters [package.Start, package.End)
+	void SetupMeshletsTiled(const MeshletBuffer& meshlets, uint32_t threadIdx, ThreadPackage package);
+
+	void SetupMeshletCulling(const float44& worldViewProj);
+	bool CullMeshlet(const Meshlet& meshlet) const;
+
+	// wait until batch slot is free and capture device state for a new tiled draw, or a tile pass if tilePass is set
+	RasterBatch& BeginBatch(const TilePassFunc& tilePass = nullptr);
+
+	void AllocateThreadBuffers(RasterBatch& batch, uint32_t threadIdx, uint32_t primitiveCount);
+
+	// build tile job queue of binned batch and start shading it
+	void ShadeBatch(RasterBatch& batch);
+
+	void Binning(const VS_Output& V0, const VS_Output& V1, const VS_Output& V2, bool frontFace, uint32_t threadIdx);
+
+	// fetch tiles one by one from tile job queue until it is empty, jobIdx selects TO_Affinity range
+	void RasterizeTiles(RasterBatch& batch, uint32_t jobIdx);
+
+	// next tile queue entry of job, false if all tiles are taken
+	bool FetchTile(const RasterBatch& batch, uint32_t jobIdx, uint32_t* oTile);
+
+	// rank of each tile in curve order of mTileOrder, for current tile grid
+	void UpdateTileRanks();
+
+	/**
+	 * Tile loops below are templates on the pixel shading policy, VirtualPixelShading or
+	 * StaticPixelShading<PS> of Pipeline.h, and are defined in RasterizerTile.inl.
+	 */
 
-	void RasterizeTiles(std::vector<uint32_t>& tilesQueue, std::atomic<uint32_t>& workingPackage, uint32_t numTiles);
+	// binned triangles of tile
+	template <typename Shading>
+	void RasterizeTile(RasterBatch& batch, Tile& tile);
 
 	// the whole tile is inside an triagnle
+	template <typename Shading>
 	void DrawPartialTile(const RasterFaceTiled& face, int32_t tileX, int32_t tileY, int32_t tileWidth, int32_t tileHeight);
 
+	template <typename Shading>
 	void DrawPixels(const RasterFaceTiled& face, int32_t xStart, int32_t yStart, int32_t xEnd, int32_t yEnd);
 
-	void DrawMaskedPixels(const RasterFaceTiled& face, int32_t mask, int32_t xStart, int32_t xEnd, int32_t iY);
+	// invW holds 1/w of the 4 pixels from xStart, stepped along the row by the caller
+	template <typename Shading>
+	void DrawMaskedPixels(const RasterFaceTiled& face, int32_t mask, int32_t xStart, int32_t xEnd, int32_t iY, const __m128& invW);
+
+	template <typename Shading>
+	void DrawMicroTriangle(const RasterFaceTiled& face, const RasterFaceMicro& micro);
+
+	/**
+	 * Stencil is tested before the pixel is shaded, depth after since shaders may write it.
+	 * Varyings of vsOutput are still divided by w, they are multiplied by w of the pixel
+	 * only if the pixel is shaded.
+	 */
+	template <typename Shading>
+	void DrawPixel(const RasterFaceTiled& face, uint32_t iX, uint32_t iY, const VS_Output& vsOutput, float w);
+
+	/**
+	 * Partially covered block of a multisampled frame buffer, the edge functions of all samples
+	 * of a pixel are evaluated in one SIMD register. Edges in bit 0, 1, 2 of wholeEdges cover the block.
+	 */
+	template <typename Shading>
+	void DrawMultisampleBlock(const RasterFaceTiled& face, uint32_t wholeEdges, int32_t xStart, int32_t yStart, int32_t xEnd, int32_t yEnd);
+
+	// shade pixel once and write samples in coverage that pass stencil and depth test
+	template <typename Shading>
+	void DrawPixelSamples(const RasterFaceTiled& face, uint32_t iX, uint32_t iY, uint32_t coverage, const VS_Output& vsOutput, float w);
+
+	static void VS_Output_Mul(VS_Output* out, const VS_Output* in, float val, uint32_t numAttri);
+	static void VS_Output_BaryCentric(VS_Output* out, const VS_Output* base, const VS_Output* ddx, const VS_Output* ddy,
+		float offsetX, float offsetY, uint32_t numAttri);
+
+	// position and varyings in varyingMask at offset from base, varyings stay divided by w
+	static void VS_Output_BaryCentricMasked(VS_Output* out, const VS_Output* base, const VS_Output* ddx, const VS_Output* ddy,
+		float offsetX, float offsetY, uint32_t varyingMask);
+
+	// pixel shader input of interpolated vertex, only varyings in varyingMask are written
+	static void VS_Output_PerspectiveDivide(PS_Input* out, const VS_Output* in, float w, uint32_t varyingMask);
+
+	// 1/w of face at pixel, linear in screen space
+	static float InvWAt(const RasterFaceTiled& face, float x, float y);
+
+	// SSE reciprocal refined with one Newton-Raphson step, close to full float precision
+	static __m128 ReciprocalNR(const __m128& x);
+	static float ReciprocalNR(float x);
+
+	// sample position in 1/16 pixel relative to pixel center
+	typedef int32_t SamplePosition[2];
+
+	static bool IsMultisampled(const ShadingState& state);
+
+	// all samples are at pixel center when multisampling is disabled
+	static const SamplePosition* GetSamplePositions(const ShadingState& state);
 
-	void DrawPixel(uint32_t iX, uint32_t iY, const VS_Output& vsOutput);
+	// how far samples of a pixel reach beyond its center, 1/16 pixel
+	static int32_t GetSampleExtent(const ShadingState& state);
+
+	static bool IsStencilTested(const ShadingState& state);
+	static bool DepthTest(CompareFunction func, float srcDepth, float destDepth);
+
+	// depth as stored in target, a surface drawn again then tests equal to itself
+	static float QuantizeDepth(const FrameBuffer& frameBuffer, float depth);
+
+	// reference and stencil value are masked with read mask, like D3D10
+	static bool StencilTest(const DepthStencilState& state, bool frontFace, uint32_t ref, uint32_t stencil);
+
+	// apply operation to 8 bit stencil, bits outside write mask are kept
+	static void StencilUpdate(StencilOperation op, uint16_t writeMask, uint32_t ref, uint8_t* pStencil);
+
+	// sum of per thread counters
+	PipelineStatistics SumStatistics(const std::vector<ThreadStatistics>& counters) const;
+
+	// sample pixel counters for pending queries, then mark batch complete
+	void CompleteBatch(uint64_t sequence);
+
+	// overdraw map covers frame buffer bound
+	void AllocateOverdrawMap();
 	
 
 private:
@@ -128,27 +419,66 @@ private:
 	// dispatch primitive count to each thread
 	std::vector<ThreadPackage> mThreadPackage;
 
-	// each thread keep a local clipped vertex buffer
-	std::vector< std::vector<VS_Output> > mVerticesThreads;	
-	std::vector<uint32_t> mNumVerticesThreads;
-
-	// each thread keep a local clipped faces buffer
-	std::vector< std::vector<RasterFaceTiled> > mFacesThreads;		
-
 	// each thread keep a vertex cache
 	std::vector< std::array<VertexCacheElement, VertexCacheSize> > mVertexCaches;
 
-	// non-empty tile job queue
-	std::vector<uint32_t> mTilesQueue;
-	uint32_t mTilesQueueSize;
+	std::array<RasterBatch, NumRasterBatches> mBatches;
+
+	// batch binned by current DrawTiled
+	RasterBatch* mFrontEndBatch;
+
+	// state pixels are shaded with, tiles of one batch are shaded at a time
+	const ShadingState* mShadingState;
+	ShadingState mScanlineState;
+
+	// tile cursor and remaining tile jobs of batch being shaded
+	std::atomic<uint32_t> mNextTile;
+	std::atomic<uint32_t> mPendingTileJobs;
+
+	// queue ranges of tile jobs if batch being shaded has TO_Affinity order, one per job
+	std::unique_ptr<TileRange[]> mTileRanges;
+
+	TileOrder mTileOrder;
+	std::vector<uint32_t> mTileRanks;
+
+	// indexed by worker
+	std::vector<TexelCache> mTexelCaches;
+	bool mTexelCacheEnable;
+
+	uint64_t mIssuedBatches;
+	std::atomic<uint64_t> mCompletedBatches;
+
+	// ShadeTime is accumulated by tile jobs in mShadeTime
+	RasterizerStats mStats;
+	std::atomic<long long> mShadeTime;
+
+	/**
+	 * Front end counters are indexed by thread package or worker and are only written while
+	 * the issuing thread waits for the front end. Pixel counters are indexed by worker, they
+	 * are stable when a batch completes since batches are shaded in order.
+	 */
+	std::vector<ThreadStatistics> mFrontCounters;
+	std::vector<ThreadStatistics> mPixelCounters;
+
+	// queries whose pixel counters wait for a batch to complete
+	std::mutex mQueryMutex;
+	std::vector< shared_ptr<Query> > mPendingQueries;
+
+	// pixel shader invocations per pixel, null when disabled
+	std::vector<uint32_t> mOverdrawCounts;
+	uint32_t* mOverdrawMap;
+	uint32_t mOverdrawPitch, mOverdrawHeight;
+	bool mOverdrawEnable;
 
 	int32_t mNumTileX, mNumTileY;
-	std::vector<Tile> mTiles;
 	
 	std::vector<VS_Output> mClippedVertices;
 	std::vector<RasterFace> mClippedFaces;
 
-	std::array<float4, 2> mClipPlanes;
+	MeshletCulling mMeshletCulling;
+
+	// near, far plane and guard band planes, guard band is updated every draw
+	std::array<float4, NumClipPlanes> mClipPlanes;
 
 	// current vertex shader output register count, set every draw
 	uint32_t mCurrVSOutputCount;
@@ -156,12 +486,20 @@ private:
 	// set every draw
 	shared_ptr<FrameBuffer> mCurrFrameBuffer;
 
+	// viewport transform of current draw, selected by RenderDevice::ViewportIndex
+	float44 mViewportMatrix;
+
+	// pixel clip rect of current draw [min, max), viewport intersect scissor rect
+	int32_t mClipMinX, mClipMinY, mClipMaxX, mClipMaxY;
+
+	// tiles totally inside clip rect, only these can be trivially accepted
+	int32_t mInnerTileMinX, mInnerTileMinY, mInnerTileMaxX, mInnerTileMaxY;
+
 private:
 	float MinClipX, MaxClipX, MinClipY, MaxClipY; 
-
-	Profiler mProfiler;
 };
 
+#include "RasterizerTile.inl"
 
 #endif // Rasterizer_h__
 
@@ -0,0 +1,754 @@
+/**
+ * Tile loops of tiled draws, templates on the pixel shading policy of Pipeline.h. They are
+ * defined in this header so loops instantiated for a shader type are compiled where the
+ * shader type is known. Included by Rasterizer.h only.
+ */
+
+#include "threadpool.h"
+#include <cfloat>
+
+inline void Rasterizer::VS_Output_Mul(VS_Output* out, const VS_Output* in, float val, uint32_t numAttri)
+{
+	out->Position = in->Position * val;
+	for (uint32_t i = 0; i < numAttri; ++i)
+	{
+		out->ShaderOutputs[i]  = in->ShaderOutputs[i] * val;
+	}
+}
+
+inline void Rasterizer::VS_Output_BaryCentric(VS_Output* out, const VS_Output* base, const VS_Output* ddx, const VS_Output* ddy,
+												 float offsetX, float offsetY, uint32_t numAttri)
+{
+	out->Position = base->Position + ddx->Position * offsetX + ddy->Position * offsetY;
+	for (uint32_t i = 0; i < numAttri; ++i)
+	{
+		out->ShaderOutputs[i]  = base->ShaderOutputs[i] + ddx->ShaderOutputs[i] * offsetX + ddy->ShaderOutputs[i] * offsetY;
+	}
+}
+
+inline void Rasterizer::VS_Output_BaryCentricMasked(VS_Output* out, const VS_Output* base, const VS_Output* ddx, const VS_Output* ddy,
+													   float offsetX, float offsetY, uint32_t varyingMask)
+{
+	out->Position = base->Position + ddx->Position * offsetX + ddy->Position * offsetY;
+	for (uint32_t i = 0; (varyingMask >> i) != 0; ++i)
+	{
+		if (varyingMask & (1UL << i))
+			out->ShaderOutputs[i]  = base->ShaderOutputs[i] + ddx->ShaderOutputs[i] * offsetX + ddy->ShaderOutputs[i] * offsetY;
+	}
+}
+
+inline void Rasterizer::VS_Output_PerspectiveDivide(PS_Input* out, const VS_Output* in, float w, uint32_t varyingMask)
+{
+	out->Position = in->Position * w;
+	for (uint32_t i = 0; (varyingMask >> i) != 0; ++i)
+	{
+		if (varyingMask & (1UL << i))
+			out->ShaderOutputs[i]  = in->ShaderOutputs[i] * w;
+	}
+}
+
+inline float Rasterizer::InvWAt(const RasterFaceTiled& face, float x, float y)
+{
+	const VS_Output* pBaseVertex = face.V[0];
+	return pBaseVertex->Position.W() + face.ddxVarying.Position.W() * (x - pBaseVertex->Position.X()) +
+		face.ddyVarying.Position.W() * (y - pBaseVertex->Position.Y());
+}
+
+inline __m128 Rasterizer::ReciprocalNR(const __m128& x)
+{
+	// rcpps has 12 bits, r * (2 - x * r) doubles them
+	const __m128 r = _mm_rcp_ps(x);
+	return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, r)));
+}
+
+inline float Rasterizer::ReciprocalNR(float x)
+{
+	const __m128 v = _mm_set_ss(x);
+	const __m128 r = _mm_rcp_ss(v);
+	return _mm_cvtss_f32(_mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(2.0f), _mm_mul_ss(v, r))));
+}
+
+inline bool Rasterizer::IsMultisampled(const ShadingState& state)
+{
+	return state.FrameBuffer->GetSampleCount() > 1;
+}
+
+inline const Rasterizer::SamplePosition* Rasterizer::GetSamplePositions(const ShadingState& state)
+{
+	// in 1/16 pixel relative to pixel center, 4x rotated grid
+	static const SamplePosition RotatedGridSamples[MultisampleCount] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+	static const SamplePosition CenterSamples[MultisampleCount] = { { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 } };
+
+	return state.MultisampleEnable ? RotatedGridSamples : CenterSamples;
+}
+
+inline int32_t Rasterizer::GetSampleExtent(const ShadingState& state)
+{
+	return (IsMultisampled(state) && state.MultisampleEnable) ? MaxSampleOffset : 0;
+}
+
+inline bool Rasterizer::IsStencilTested(const ShadingState& state)
+{
+	return state.DepthStencilState.StencilEnable && state.FrameBuffer->GetStencilBits() > 0;
+}
+
+inline bool Rasterizer::DepthTest(CompareFunction func, float srcDepth, float destDepth)
+{
+	switch (func)
+	{
+	case CF_AlwaysFail: return false;
+	case CF_Equal: return fabsf(srcDepth - destDepth) < FLT_EPSILON;
+	case CF_NotEqual: return fabsf(srcDepth - destDepth) >= FLT_EPSILON;
+	case CF_Less: return srcDepth < destDepth;
+	case CF_LessEqual: return srcDepth <= destDepth;
+	case CF_GreaterEqual: return srcDepth >= destDepth;
+	case CF_Greater: return srcDepth > destDepth;
+	default: return true;
+	}
+}
+
+inline float Rasterizer::QuantizeDepth(const FrameBuffer& frameBuffer, float depth)
+{
+	return (frameBuffer.GetDepthBits() == 24) ? DecodeDepth24(EncodeDepth24(depth)) : depth;
+}
+
+inline bool Rasterizer::StencilTest(const DepthStencilState& state, bool frontFace, uint32_t ref, uint32_t stencil)
+{
+	ref &= state.StencilReadMask;
+	stencil &= state.StencilReadMask;
+
+	switch (frontFace ? state.FrontStencilFunc : state.BackStencilFunc)
+	{
+	case CF_AlwaysFail: return false;
+	case CF_Equal: return ref == stencil;
+	case CF_NotEqual: return ref != stencil;
+	case CF_Less: return ref < stencil;
+	case CF_LessEqual: return ref <= stencil;
+	case CF_GreaterEqual: return ref >= stencil;
+	case CF_Greater: return ref > stencil;
+	default: return true;
+	}
+}
+
+inline void Rasterizer::StencilUpdate(StencilOperation op, uint16_t writeMask, uint32_t ref, uint8_t* pStencil)
+{
+	const uint32_t stencil = *pStencil;
+
+	uint32_t result;
+	switch (op)
+	{
+	case SOP_Zero: result = 0; break;
+	case SOP_Replace: result = ref; break;
+	case SOP_Incr: result = (stencil == 0xFF) ? stencil : stencil + 1; break;
+	case SOP_Decr: result = (stencil == 0) ? stencil : stencil - 1; break;
+	case SOP_Invert: result = ~stencil; break;
+	case SOP_Incr_Wrap: result = stencil + 1; break;
+	case SOP_Decr_Wrap: result = stencil - 1; break;
+	default: return;
+	}
+
+	*pStencil = static_cast<uint8_t>((stencil & ~writeMask) | (result & writeMask));
+}
+
+template <typename Shading>
+void Rasterizer::RasterizeTile( RasterBatch& batch, Tile& tile )
+{
+	const uint32_t numWorkThreads = GetNumWorkThreads();
+
+	int32_t tileX = tile.X << 4; // fixed point
+	int32_t tileY = tile.Y << 4; // fixed point
+	int32_t tileWidth = tile.Width << 4; // fixed point
+	int32_t tileHeight = tile.Height << 4; // fixed point
+
+	for (uint32_t iThread = 0; iThread < numWorkThreads; ++iThread)
+	{
+		for (uint32_t iTri = 0; iTri < tile.TriQueueSize[iThread]; ++iTri)
+		{
+			uint32_t faceIdx = tile.TriQueue[iThread][iTri];
+			uint32_t flags = faceIdx & (TileTriAccept | TileTriMicro);
+			faceIdx = faceIdx >> TileTriShift; 
+
+			RasterFaceTiled& face = batch.FacesThreads[iThread][faceIdx];
+			
+			if (flags & TileTriMicro)
+			{
+				DrawMicroTriangle<Shading>(face, batch.MicroFacesThreads[iThread][faceIdx]);
+			}
+			else if (flags & TileTriAccept)
+			{
+				DrawPixels<Shading>(face, tile.X, tile.Y, tile.X + tile.Width, tile.Y + tile.Height);
+			}
+			else
+			{
+				DrawPartialTile<Shading>(face, tileX, tileY, tileWidth, tileHeight);
+			}
+		}
+
+		tile.TriQueueSize[iThread] = 0;
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawPartialTile(const RasterFaceTiled& face, int32_t tileX, int32_t tileY, int32_t tileWidth, int32_t tileHeight)
+{
+	// 28.4 fixed-point coordinates
+	const int32_t X1 = face.X[0];
+	const int32_t X2 = face.X[1];
+	const int32_t X3 = face.X[2];
+
+	const int32_t Y1 = face.Y[0];
+	const int32_t Y2 = face.Y[1];
+	const int32_t Y3 = face.Y[2];
+
+	// Deltas
+	const int64_t DX12 = X1 - X2;
+	const int64_t DX23 = X2 - X3;
+	const int64_t DX31 = X3 - X1;
+
+	const int64_t DY12 = Y1 - Y2;
+	const int64_t DY23 = Y2 - Y3;
+	const int64_t DY31 = Y3 - Y1;
+
+	// Fixed-point deltas, deltas can be negative so scale instead of shift
+	const int64_t FDX12 = DX12 * (1 << 4);
+	const int64_t FDX23 = DX23 * (1 << 4);
+	const int64_t FDX31 = DX31 * (1 << 4);
+	const int64_t FDY12 = DY12 * (1 << 4);
+	const int64_t FDY23 = DY23 * (1 << 4);
+	const int64_t FDY31 = DY31 * (1 << 4);
+
+#ifdef USE_SIMD
+	const __m128i OffsetDY12 = _mm_set_epi32((int32_t)FDY12 * 3, (int32_t)FDY12 * 2, (int32_t)FDY12 * 1, 0);
+	const __m128i OffsetDY23 = _mm_set_epi32((int32_t)FDY23 * 3, (int32_t)FDY23 * 2, (int32_t)FDY23 * 1, 0);
+	const __m128i OffsetDY31 = _mm_set_epi32((int32_t)FDY31 * 3, (int32_t)FDY31 * 2, (int32_t)FDY31 * 1, 0);
+#endif
+
+	// Half-edge constants
+	const int64_t C1 = face.C1;
+	const int64_t C2 = face.C2;
+	const int64_t C3 = face.C3;
+
+	// block tests use outermost samples of multisampled pixels
+	const int64_t extent = GetSampleExtent(*mShadingState);
+	const bool multisampled = IsMultisampled(*mShadingState);
+
+	// Compute bounding box
+	int32_t minX = ((std::max)(face.MinX, tileX) + 0xF) >> 4;
+	int32_t maxX = ((std::min)(face.MaxX, tileX + tileWidth) + 0xF) >> 4;
+	int32_t minY = ((std::max)(face.MinY, tileY) + 0xF) >> 4;
+	int32_t maxY = ((std::min)(face.MaxY, tileY + tileHeight) + 0xF) >> 4;
+
+	// Block size, standard 8x8 (must be power of two)
+	const int BlockSize = 8;
+
+	// First pixel inside clip rect, blocks may start before it
+	const int32_t startX = minX;
+	const int32_t startY = minY;
+
+	// Start in corner of 8x8 block
+	minX &= ~(BlockSize - 1);
+	minY &= ~(BlockSize - 1);
+
+    const VS_Output* pBaseVertex = face.V[0];
+
+	// 1/w is stepped along rows, 4 pixels at a time in the SIMD loop
+	const float ddxInvW = face.ddxVarying.Position.W();
+#ifdef USE_SIMD
+	const __m128 ddxInvWLanes = _mm_set_ps(ddxInvW * 3, ddxInvW * 2, ddxInvW, 0);
+	const __m128 ddxInvW4 = _mm_set1_ps(ddxInvW * 4);
+#endif
+
+	for (int32_t y = minY; y < maxY; y += BlockSize)
+	{
+		for (int32_t x = minX; x < maxX; x += BlockSize)
+		{
+			// Corners of block
+			int64_t x0 = (x << 4) - extent;
+			int64_t x1 = ((x + BlockSize - 1) << 4) + extent;
+			int64_t y0 = (y << 4) - extent;
+			int64_t y1 = ((y + BlockSize - 1) << 4) + extent;
+
+			// Evaluate half-space functions
+			bool a00 = C1 + DX12 * y0 - DY12 * x0 > 0;
+			bool a10 = C1 + DX12 * y0 - DY12 * x1 > 0;
+			bool a01 = C1 + DX12 * y1 - DY12 * x0 > 0;
+			bool a11 = C1 + DX12 * y1 - DY12 * x1 > 0;
+			int32_t a = (a00 << 0) | (a10 << 1) | (a01 << 2) | (a11 << 3);
+
+			bool b00 = C2 + DX23 * y0 - DY23 * x0 > 0;
+			bool b10 = C2 + DX23 * y0 - DY23 * x1 > 0;
+			bool b01 = C2 + DX23 * y1 - DY23 * x0 > 0;
+			bool b11 = C2 + DX23 * y1 - DY23 * x1 > 0;
+			int32_t b = (b00 << 0) | (b10 << 1) | (b01 << 2) | (b11 << 3);
+
+			bool c00 = C3 + DX31 * y0 - DY31 * x0 > 0;
+			bool c10 = C3 + DX31 * y0 - DY31 * x1 > 0;
+			bool c01 = C3 + DX31 * y1 - DY31 * x0 > 0;
+			bool c11 = C3 + DX31 * y1 - DY31 * x1 > 0;
+			int32_t c = (c00 << 0) | (c10 << 1) | (c01 << 2) | (c11 << 3);
+
+			// Skip block when outside an edge
+			if(a == 0x0 || b == 0x0 || c == 0x0) continue;
+			
+			// Accept whole block when totally covered
+			if( a == 0xF && b == 0xF && c == 0xF )
+			{
+				// draw whole block
+				DrawPixels<Shading>(face, (std::max)(x, startX), (std::max)(y, startY), (std::min)(x+BlockSize, maxX), (std::min)(y+BlockSize, maxY));
+			}
+			else if (multisampled)
+			{
+				const uint32_t wholeEdges = (a == 0xF ? 0x1 : 0) | (b == 0xF ? 0x2 : 0) | (c == 0xF ? 0x4 : 0);
+				DrawMultisampleBlock<Shading>(face, wholeEdges, (std::max)(x, startX), (std::max)(y, startY), (std::min)(x+BlockSize, maxX), (std::min)(y+BlockSize, maxY));
+			}
+			else
+			{
+				const int32_t blockStartX = (std::max)(x, startX);
+				const int32_t blockStartY = (std::max)(y, startY);
+
+				int64_t CY1 = C1 + DX12 * (blockStartY << 4) - DY12 * (blockStartX << 4);
+				int64_t CY2 = C2 + DX23 * (blockStartY << 4) - DY23 * (blockStartX << 4);
+				int64_t CY3 = C3 + DX31 * (blockStartY << 4) - DY31 * (blockStartX << 4);
+
+#ifdef USE_SIMD
+				/**
+				 * Edges covering the whole block are positive everywhere in it, use constant 1 for them.
+				 * Other edges cross the block, their values inside block fit 32 bits.
+				 */
+				const __m128i StepX1 = (a == 0xF) ? _mm_setzero_si128() : OffsetDY12;
+				const __m128i StepX2 = (b == 0xF) ? _mm_setzero_si128() : OffsetDY23;
+				const __m128i StepX3 = (c == 0xF) ? _mm_setzero_si128() : OffsetDY31;
+#endif
+
+				for(int32_t iy = blockStartY; iy < (std::min)(y + BlockSize, maxY); iy++)
+				{
+#ifdef USE_SIMD
+					const int32_t xEnd = (std::min)(x + BlockSize, maxX);
+
+					int32_t EX1 = (a == 0xF) ? 1 : (int32_t)CY1;
+					int32_t EX2 = (b == 0xF) ? 1 : (int32_t)CY2;
+					int32_t EX3 = (c == 0xF) ? 1 : (int32_t)CY3;
+
+					__m128 invW = _mm_add_ps(_mm_set1_ps(InvWAt(face, (float)blockStartX, (float)iy)), ddxInvWLanes);
+
+					// 4 pixels each time
+					for (int32_t ix = blockStartX; ix < xEnd; ix += 4)
+					{
+						__m128i CX1 = _mm_sub_epi32(_mm_set1_epi32(EX1), StepX1);
+						__m128i CX2 = _mm_sub_epi32(_mm_set1_epi32(EX2), StepX2);
+						__m128i CX3 = _mm_sub_epi32(_mm_set1_epi32(EX3), StepX3);
+
+						__m128i CX1Mask = _mm_cmpgt_epi32(CX1, _mm_setzero_si128());
+						__m128i CX2Mask = _mm_cmpgt_epi32(CX2, _mm_setzero_si128());
+						__m128i CX3Mask = _mm_cmpgt_epi32(CX3, _mm_setzero_si128());
+
+						__m128i CXMaskComp = _mm_and_si128( CX1Mask, _mm_and_si128( CX2Mask, CX3Mask ) );
+
+						// Generate a 4-bit mask from the composite 128-bit mask 
+						int32_t mask = _mm_movemask_ps(_mm_castsi128_ps(CXMaskComp));				
+
+						if (mask)
+						{
+							DrawMaskedPixels<Shading>(face, mask, ix, (std::min)(ix+4, xEnd), iy, invW);
+						}
+
+						invW = _mm_add_ps(invW, ddxInvW4);
+
+						if (a != 0xF) EX1 -= (int32_t)FDY12 * 4;
+						if (b != 0xF) EX2 -= (int32_t)FDY23 * 4;
+						if (c != 0xF) EX3 -= (int32_t)FDY31 * 4;
+					}
+#else
+					int64_t CX1 = CY1;
+					int64_t CX2 = CY2;
+					int64_t CX3 = CY3;
+
+					float invW = InvWAt(face, (float)blockStartX, (float)iy);
+
+					for(int32_t ix = blockStartX; ix < (std::min)(x + BlockSize, maxX); ix++)
+					{
+						if(CX1 > 0 && CX2 > 0 && CX3 > 0)
+						{
+							VS_Output vsOutput;
+							float fOffsetX = ix - pBaseVertex->Position.X();
+							float fOffsetY = iy - pBaseVertex->Position.Y();
+							VS_Output_BaryCentricMasked(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, fOffsetX, fOffsetY, mShadingState->VaryingMask);
+						
+							DrawPixel<Shading>(face, ix, iy, vsOutput, ReciprocalNR(invW));
+						}
+
+						CX1 -= FDY12;
+						CX2 -= FDY23;
+						CX3 -= FDY31;
+						invW += ddxInvW;
+					}
+#endif 
+
+					CY1 += FDX12;
+					CY2 += FDX23;
+					CY3 += FDX31;
+				}
+			}
+		}
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawPixels(const RasterFaceTiled& face, int32_t xStart, int32_t yStart, int32_t xEnd, int32_t yEnd)
+{
+	const VS_Output* pBaseVertex = face.V[0];
+	const bool multisampled = IsMultisampled(*mShadingState);
+	const uint32_t varyingMask = mShadingState->VaryingMask;
+
+	// w of 4 pixels from one reciprocal, 1/w is stepped along the row
+	const float ddxInvW = face.ddxVarying.Position.W();
+	const __m128 ddxInvWLanes = _mm_set_ps(ddxInvW * 3, ddxInvW * 2, ddxInvW, 0);
+	const __m128 ddxInvW4 = _mm_set1_ps(ddxInvW * 4);
+	
+	for (int32_t iY = yStart; iY < yEnd; ++iY)
+	{
+		const float fOffsetY = (float)iY - pBaseVertex->Position.Y();
+		__m128 invW = _mm_add_ps(_mm_set1_ps(InvWAt(face, (float)xStart, (float)iY)), ddxInvWLanes);
+
+		for (int32_t iX = xStart; iX < xEnd; iX += 4)
+		{
+			float w[4];
+			_mm_storeu_ps(w, ReciprocalNR(invW));
+			invW = _mm_add_ps(invW, ddxInvW4);
+
+			const int32_t groupEnd = (std::min)(iX + 4, xEnd);
+			for (int32_t i = iX; i < groupEnd; ++i)
+			{
+				VS_Output VSOutput;
+				VS_Output_BaryCentricMasked(&VSOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, (float)i - pBaseVertex->Position.X(), fOffsetY, varyingMask);
+
+				// block tests used outermost samples, so all samples are covered
+				if (multisampled)
+					DrawPixelSamples<Shading>(face, i, iY, (1UL << MultisampleCount) - 1, VSOutput, w[i - iX]);
+				else
+					DrawPixel<Shading>(face, i, iY, VSOutput, w[i - iX]);
+			}
+		}
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawMultisampleBlock( const RasterFaceTiled& face, uint32_t wholeEdges, int32_t xStart, int32_t yStart, int32_t xEnd, int32_t yEnd )
+{
+	const __m128i Zero = _mm_setzero_si128();
+	const int32_t (*samples)[2] = GetSamplePositions(*mShadingState);
+
+	const int64_t DX[3] = { face.X[0] - face.X[1], face.X[1] - face.X[2], face.X[2] - face.X[0] };
+	const int64_t DY[3] = { face.Y[0] - face.Y[1], face.Y[1] - face.Y[2], face.Y[2] - face.Y[0] };
+	const int64_t C[3] = { face.C1, face.C2, face.C3 };
+
+	// edge functions at the samples of first pixel in row, one sample per lane
+	__m128i rowE[3], stepX[3], stepY[3];
+	for (int32_t i = 0; i < 3; ++i)
+	{
+		// edge covers whole block, it is positive at every sample
+		if (wholeEdges & (1UL << i))
+		{
+			rowE[i] = _mm_set1_epi32(1);
+			stepX[i] = stepY[i] = Zero;
+			continue;
+		}
+
+		// edge crosses block, its values inside block fit 32 bits
+		const int64_t E = C[i] + DX[i] * (yStart << 4) - DY[i] * (xStart << 4);
+		rowE[i] = _mm_set_epi32((int32_t)(E + DX[i] * samples[3][1] - DY[i] * samples[3][0]), (int32_t)(E + DX[i] * samples[2][1] - DY[i] * samples[2][0]),
+			(int32_t)(E + DX[i] * samples[1][1] - DY[i] * samples[1][0]), (int32_t)(E + DX[i] * samples[0][1] - DY[i] * samples[0][0]));
+		stepX[i] = _mm_set1_epi32((int32_t)(-DY[i] * (1 << 4)));
+		stepY[i] = _mm_set1_epi32((int32_t)(DX[i] * (1 << 4)));
+	}
+
+	const VS_Output* pBaseVertex = face.V[0];
+
+	for (int32_t iY = yStart; iY < yEnd; ++iY)
+	{
+		__m128i E0 = rowE[0], E1 = rowE[1], E2 = rowE[2];
+		const float fOffsetY = iY - pBaseVertex->Position.Y();
+		float invW = InvWAt(face, (float)xStart, (float)iY);
+
+		for (int32_t iX = xStart; iX < xEnd; ++iX)
+		{
+			const __m128i inside = _mm_and_si128( _mm_cmpgt_epi32(E0, Zero), 
+				_mm_and_si128(_mm_cmpgt_epi32(E1, Zero), _mm_cmpgt_epi32(E2, Zero)) );
+			const uint32_t coverage = _mm_movemask_ps(_mm_castsi128_ps(inside));
+
+			// pixel is shaded at its center even if the center is outside
+			if (coverage)
+			{
+				VS_Output vsOutput;
+				VS_Output_BaryCentricMasked(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, iX - pBaseVertex->Position.X(), fOffsetY, mShadingState->VaryingMask);
+				DrawPixelSamples<Shading>(face, iX, iY, coverage, vsOutput, ReciprocalNR(invW));
+			}
+
+			invW += face.ddxVarying.Position.W();
+			E0 = _mm_add_epi32(E0, stepX[0]);
+			E1 = _mm_add_epi32(E1, stepX[1]);
+			E2 = _mm_add_epi32(E2, stepX[2]);
+		}
+
+		rowE[0] = _mm_add_epi32(rowE[0], stepY[0]);
+		rowE[1] = _mm_add_epi32(rowE[1], stepY[1]);
+		rowE[2] = _mm_add_epi32(rowE[2], stepY[2]);
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawMaskedPixels( const RasterFaceTiled& face, int32_t mask, int32_t xStart, int32_t xEnd, int32_t iY, const __m128& invW )
+{
+	const VS_Output* pBaseVertex = face.V[0];
+
+	VS_Output vsOutput;
+	float fOffsetX, fOffsetY = iY - pBaseVertex->Position.Y();
+
+	static const int32_t bits[4] = {0x1, 0x2, 0x4, 0x8};
+
+	float w[4];
+	_mm_storeu_ps(w, ReciprocalNR(invW));
+
+	for (int32_t iX= xStart; iX < xEnd; ++iX)
+	{
+		if (mask & bits[iX - xStart]) 
+		{
+			fOffsetX = iX - pBaseVertex->Position.X();
+
+			VS_Output_BaryCentricMasked(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, fOffsetX, fOffsetY, mShadingState->VaryingMask);
+			DrawPixel<Shading>(face, iX, iY, vsOutput, w[iX - xStart]);
+		}
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawMicroTriangle( const RasterFaceTiled& face, const RasterFaceMicro& micro )
+{
+	const __m128i Zero = _mm_setzero_si128();
+
+	// edge functions of first 4 pixels in row, per row step
+	__m128i rowE[3], stepY[3], stepX4[3];
+	for (int32_t i = 0; i < 3; ++i)
+	{
+		rowE[i] = _mm_add_epi32(_mm_set1_epi32(micro.E[i]), _mm_set_epi32(micro.StepX[i] * 3, micro.StepX[i] * 2, micro.StepX[i], 0));
+		stepY[i] = _mm_set1_epi32(micro.StepY[i]);
+		stepX4[i] = _mm_set1_epi32(micro.StepX[i] * 4);
+	}
+
+	// coverage of whole bounding box, MicroTriangleSize bits per row
+	uint64_t coverage = 0;
+	const uint32_t rowMask = (1UL << micro.Width) - 1;
+
+	for (uint32_t row = 0; row < micro.Height; ++row)
+	{
+		__m128i inside = _mm_and_si128( _mm_cmpgt_epi32(rowE[0], Zero), 
+			_mm_and_si128(_mm_cmpgt_epi32(rowE[1], Zero), _mm_cmpgt_epi32(rowE[2], Zero)) );
+		uint32_t bits = _mm_movemask_ps(_mm_castsi128_ps(inside));
+
+		if (micro.Width > 4)
+		{
+			__m128i E0 = _mm_add_epi32(rowE[0], stepX4[0]);
+			__m128i E1 = _mm_add_epi32(rowE[1], stepX4[1]);
+			__m128i E2 = _mm_add_epi32(rowE[2], stepX4[2]);
+
+			inside = _mm_and_si128( _mm_cmpgt_epi32(E0, Zero), 
+				_mm_and_si128(_mm_cmpgt_epi32(E1, Zero), _mm_cmpgt_epi32(E2, Zero)) );
+			bits |= _mm_movemask_ps(_mm_castsi128_ps(inside)) << 4;
+		}
+
+		coverage |= (uint64_t)(bits & rowMask) << (row * MicroTriangleSize);
+
+		rowE[0] = _mm_add_epi32(rowE[0], stepY[0]);
+		rowE[1] = _mm_add_epi32(rowE[1], stepY[1]);
+		rowE[2] = _mm_add_epi32(rowE[2], stepY[2]);
+	}
+
+	if (!coverage)
+		return;
+
+	const VS_Output* pBaseVertex = face.V[0];
+
+	for (uint32_t row = 0; row < micro.Height; ++row)
+	{
+		const uint32_t bits = (uint32_t)(coverage >> (row * MicroTriangleSize)) & rowMask;
+		if (!bits)
+			continue;
+
+		const int32_t iY = micro.Y + row;
+		const float fOffsetY = iY - pBaseVertex->Position.Y();
+		float invW = InvWAt(face, (float)micro.X, (float)iY);
+
+		for (uint32_t col = 0; col < micro.Width; ++col, invW += face.ddxVarying.Position.W())
+		{
+			if (bits & (1UL << col))
+			{
+				const int32_t iX = micro.X + col;
+
+				VS_Output vsOutput;
+				VS_Output_BaryCentricMasked(&vsOutput, pBaseVertex, &face.ddxVarying, &face.ddyVarying, iX - pBaseVertex->Position.X(), fOffsetY, mShadingState->VaryingMask);
+				DrawPixel<Shading>(face, iX, iY, vsOutput, ReciprocalNR(invW));
+			}
+		}
+	}
+}
+
+template <typename Shading>
+void Rasterizer::DrawPixel( const RasterFaceTiled& face, uint32_t iX, uint32_t iY, const VS_Output& vsOutput, float w )
+{
+	PipelineStatistics& stats = mPixelCounters[JobSystem::GetWorkerIndex()].Stats;
+	FrameBuffer& frameBuffer = *mShadingState->FrameBuffer;
+	const DepthStencilState& depthStencil = mShadingState->DepthStencilState;
+
+	// pixels failing stencil test are never shaded
+	uint8_t* pStencil = NULL;
+	if (IsStencilTested(*mShadingState))
+	{
+		pStencil = frameBuffer.GetStencil(iX, iY);
+		if (!StencilTest(depthStencil, face.FrontFace, mShadingState->StencilRef, *pStencil))
+		{
+			StencilUpdate(face.FrontFace ? depthStencil.FrontStencilFailOp : depthStencil.BackStencilFailOp, depthStencil.StencilWriteMask, mShadingState->StencilRef, pStencil);
+			stats.StencilKilledPixels++;
+			return;
+		}
+	}
+
+	// tiles have one owner, overdraw map needs no synchronization
+	stats.PSInvocations++;
+	if (mOverdrawMap)
+		mOverdrawMap[iY * mOverdrawPitch + iX]++;
+
+	float srcDepth, destDepth;
+
+	// read back buffer pixel
+	frameBuffer.ReadPixel(iX, iY, NULL, &destDepth);
+
+	// Get depth of current pixel
+	srcDepth = vsOutput.Position.Z();
+
+	PS_Input PSInput;
+	VS_Output_PerspectiveDivide( &PSInput, &vsOutput, w, mShadingState->VaryingMask );
+
+	// Execute the pixel shader
+	//m_TriangleInfo.iCurPixelX = i_iX;
+	PS_Output PSOutput;
+	if( !Shading::Execute(*mShadingState->PixelShader, &PSInput, &PSOutput, &srcDepth))
+	{
+		// kill this pixel
+		stats.PSKilledPixels++;
+		return;
+	}
+
+	// Perform depth-test
+	srcDepth = QuantizeDepth(frameBuffer, srcDepth);
+	if (!DepthTest(depthStencil.DepthFunc, srcDepth, destDepth))
+	{
+		if (pStencil)
+			StencilUpdate(face.FrontFace ? depthStencil.FrontStencilDepthFailOp : depthStencil.BackStencilDepthFailOp, depthStencil.StencilWriteMask, mShadingState->StencilRef, pStencil);
+
+		stats.DepthKilledPixels++;
+		return;
+	}
+
+	if (pStencil)
+		StencilUpdate(face.FrontFace ? depthStencil.FrontStencilPassOp : depthStencil.BackStencilPassOp, depthStencil.StencilWriteMask, mShadingState->StencilRef, pStencil);
+
+	frameBuffer.WritePixel(iX, iY, &PSOutput, depthStencil.DepthWriteMask ? &srcDepth : NULL, *mShadingState);
+}
+
+template <typename Shading>
+void Rasterizer::DrawPixelSamples( const RasterFaceTiled& face, uint32_t iX, uint32_t iY, uint32_t coverage, const VS_Output& vsOutput, float w )
+{
+	PipelineStatistics& stats = mPixelCounters[JobSystem::GetWorkerIndex()].Stats;
+	FrameBuffer& frameBuffer = *mShadingState->FrameBuffer;
+	const DepthStencilState& depthStencil = mShadingState->DepthStencilState;
+
+	// samples failing stencil test leave coverage, pixel isn't shaded if none is left
+	uint8_t* pStencils = NULL;
+	if (IsStencilTested(*mShadingState))
+	{
+		pStencils = frameBuffer.GetSampleStencils(iX, iY);
+		const StencilOperation failOp = face.FrontFace ? depthStencil.FrontStencilFailOp : depthStencil.BackStencilFailOp;
+
+		for (uint32_t s = 0; s < MultisampleCount; ++s)
+		{
+			if ((coverage & (1UL << s)) && !StencilTest(depthStencil, face.FrontFace, mShadingState->StencilRef, pStencils[s]))
+			{
+				StencilUpdate(failOp, depthStencil.StencilWriteMask, mShadingState->StencilRef, &pStencils[s]);
+				coverage &= ~(1UL << s);
+			}
+		}
+
+		if (!coverage)
+		{
+			stats.StencilKilledPixels++;
+			return;
+		}
+	}
+
+	stats.PSInvocations++;
+	if (mOverdrawMap)
+		mOverdrawMap[iY * mOverdrawPitch + iX]++;
+
+	float srcDepth = vsOutput.Position.Z();
+
+	PS_Input PSInput;
+	VS_Output_PerspectiveDivide( &PSInput, &vsOutput, w, mShadingState->VaryingMask );
+
+	PS_Output PSOutput;
+	if( !Shading::Execute(*mShadingState->PixelShader, &PSInput, &PSOutput, &srcDepth))
+	{
+		stats.PSKilledPixels++;
+		return;
+	}
+
+	// depth of each sample from depth plane through shaded depth
+	const int32_t (*samples)[2] = GetSamplePositions(*mShadingState);
+	const float ddxDepth = face.ddxVarying.Position.Z() * (1.0f / 16.0f);
+	const float ddyDepth = face.ddyVarying.Position.Z() * (1.0f / 16.0f);
+
+	const __m128 srcDepths = _mm_add_ps(_mm_set1_ps(srcDepth), _mm_set_ps(
+		ddxDepth * samples[3][0] + ddyDepth * samples[3][1], ddxDepth * samples[2][0] + ddyDepth * samples[2][1],
+		ddxDepth * samples[1][0] + ddyDepth * samples[1][1], ddxDepth * samples[0][0] + ddyDepth * samples[0][1]));
+
+	// test all samples at once
+	const __m128 destDepths = _mm_loadu_ps(frameBuffer.GetSampleDepths(iX, iY));
+	const __m128 depthDiff = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(srcDepths, destDepths));
+
+	__m128 pass;
+	switch( depthStencil.DepthFunc )
+	{
+	case CF_AlwaysFail: pass = _mm_setzero_ps(); break;
+	case CF_Equal: pass = _mm_cmplt_ps(depthDiff, _mm_set1_ps(FLT_EPSILON)); break;
+	case CF_NotEqual: pass = _mm_cmpge_ps(depthDiff, _mm_set1_ps(FLT_EPSILON)); break;
+	case CF_Less: pass = _mm_cmplt_ps(srcDepths, destDepths); break;
+	case CF_LessEqual: pass = _mm_cmple_ps(srcDepths, destDepths); break;
+	case CF_GreaterEqual: pass = _mm_cmpge_ps(srcDepths, destDepths); break;
+	case CF_Greater: pass = _mm_cmpgt_ps(srcDepths, destDepths); break;
+	default: pass = _mm_castsi128_ps(_mm_set1_epi32(-1)); break;
+	}
+
+	const uint32_t mask = coverage & _mm_movemask_ps(pass);
+
+	if (pStencils)
+	{
+		const StencilOperation depthFailOp = face.FrontFace ? depthStencil.FrontStencilDepthFailOp : depthStencil.BackStencilDepthFailOp;
+		const StencilOperation passOp = face.FrontFace ? depthStencil.FrontStencilPassOp : depthStencil.BackStencilPassOp;
+
+		for (uint32_t s = 0; s < MultisampleCount; ++s)
+		{
+			if (coverage & (1UL << s))
+				StencilUpdate((mask & (1UL << s)) ? passOp : depthFailOp, depthStencil.StencilWriteMask, mShadingState->StencilRef, &pStencils[s]);
+		}
+	}
+
+	if (!mask)
+	{
+		stats.DepthKilledPixels++;
+		return;
+	}
+
+	float depths[MultisampleCount];
+	_mm_storeu_ps(depths, srcDepths);
+
+	frameBuffer.WriteSamples(iX, iY, mask, &PSOutput, depthStencil.DepthWriteMask ? depths : NULL, *mShadingState);
+}
@@ -3,27 +3,62 @@
 #include "Texture.h"
 #include "VertexDeclaration.h"
 #include "Rasterizer.h"
+#include "Pipeline.h"
 #include "GraphicsBuffer.h"
 #include "Shader.h"
 #include "pfm.h"
+#include "threadpool.h"
+#include "Profiler.h"
+
+namespace {
+
+// shading state bound to current tile job, null when shading with device state
+RX_THREAD_LOCAL const ShadingState* tlsShadingState = nullptr;
+
+shared_ptr<FrameBuffer> CreateScreenFrameBuffer(uint32_t width, uint32_t height, uint32_t sampleCount, PixelFormat depthFormat)
+{
+	shared_ptr<FrameBuffer> screenFrameBuffer = std::make_shared<FrameBuffer>(width, height, sampleCount);
+
+	// single sampled textures hold resolved color and depth, frame buffer keeps samples
+	shared_ptr<Texture2D> color0(new Texture2D(PF_A32B32G32R32F, width, height, 0, 1, 0, 0, NULL));
+	screenFrameBuffer->Attach(ATT_Color0, color0);
+
+	shared_ptr<Texture2D> depth(new Texture2D(depthFormat, width, height, 0, 1, 0, 0, NULL));
+	screenFrameBuffer->Attach(ATT_DepthStencil, depth);
+
+	return screenFrameBuffer;
+}
+
+// one job per row of tiles
+void ParallelResolveColor(const uint8_t* src, uint32_t srcPitch, uint32_t* dst, uint32_t width, uint32_t height, const ColorResolveDesc& desc)
+{
+	const uint32_t numTileRows = (height + TileSize - 1) >> TileSizeShift;
+
+	GlobalJobSystem().ParallelFor(0, numTileRows, 1, [=, &desc](uint32_t begin, uint32_t end) {
+		const uint32_t startY = begin << TileSizeShift;
+		const uint32_t endY = (std::min)(end << TileSizeShift, height);
+		ResolveColorSRGB8(src + startY * srcPitch, srcPitch, dst + startY * width, width * 4, width, endY - startY, desc);
+	});
+}
+
+}
 
 RenderDevice::RenderDevice(void)
-	: mUseIndex(false), mStartIndexLoc(0), mBaseVertexLoc(0)
+	: mUseIndex(false), mStartIndexLoc(0), mBaseVertexLoc(0), StencilRef(0), ViewportIndex(0), mNumViewports(0), mNumScissorRects(0),
+	  mFramesInFlight(1), mFrameIndex(0), mPresentIndex(0), mNumPredicatedDraws(0), mNumCulledDraws(0), mPendingScreenshotWrites(0)
 {
 	mVertexShaderStage = new VertexShaderStage(*this);
 	mPixelShaderStage = new PixelShaderStage(*this);
 	mRasterizerStage = new Rasterizer(*this);
 
-	mScreenFrameBuffer = std::make_shared<FrameBuffer>(500, 500);
+	// other frame contexts get screen frame buffers when more frames are in flight
+	for (uint32_t i = 0; i < MaxFramesInFlight; ++i)
+		mFrames[i].Fence = 0;
 
-	shared_ptr<Texture2D> color0(new Texture2D(PF_A32B32G32R32F, 500, 500, 0, 1, 0, 0, NULL));
-	mScreenFrameBuffer->Attach(ATT_Color0, color0);
-
-	shared_ptr<Texture2D> depth(new Texture2D(PF_Depth32, 500, 500, 0, 1, 0, 0, NULL));
-	mScreenFrameBuffer->Attach(ATT_DepthStencil, depth);
+	mFrames[0].ScreenFrameBuffer = CreateScreenFrameBuffer(500, 500, 1, PF_Depth32);
 
 	// bind screen frame buffer 
-	BindFrameBuffer(mScreenFrameBuffer);
+	BindFrameBuffer(mFrames[0].ScreenFrameBuffer);
 
 	// todo 
 	TextureFetch::Init();
@@ -32,6 +67,8 @@ RenderDevice::RenderDevice(void)
 
 RenderDevice::~RenderDevice(void)
 {
+	// tile jobs may still reference device state
+	Flush();
 }
 
 void RenderDevice::SetVertexStream( uint32_t streamSlot, const shared_ptr<GraphicsBuffer>& vertexBuffer, uint32_t offset, uint32_t stride )
@@ -114,6 +151,9 @@ void RenderDevice::Draw( PrimitiveType primitiveType, uint32_t vertexCount, uint
 	ASSERT(primitiveType == PT_Triangle_List);
 	uint32_t primitive = vertexCount / 3;
 
+	if (IsPredicatedOff() || IsBoundCulled())
+		return;
+
 	// set up vertice data
 	mUseIndex = false;
 
@@ -126,6 +166,9 @@ void RenderDevice::DrawIndexed( PrimitiveType primitiveType, uint32_t indexCount
 {
 	ASSERT(primitiveType == PT_Triangle_List);
 
+	if (IsPredicatedOff() || IsBoundCulled())
+		return;
+
 	mUseIndex = true;
 	mStartIndexLoc = startIndexLocation;
 	mBaseVertexLoc = baseVertexLocation;
@@ -136,8 +179,8 @@ void RenderDevice::DrawIndexed( PrimitiveType primitiveType, uint32_t indexCount
 	uint32_t numBatch = 0;
 	while (currIndex + MaxVertexBufferSize < indexCount)
 	{
-		//mRasterizerStage->DrawTiled(primitiveType, MaxVertexBufferSize / 3);
-		mRasterizerStage->Draw(primitiveType, MaxVertexBufferSize / 3);
+		mRasterizerStage->DrawTiled(primitiveType, MaxVertexBufferSize / 3);
+		//mRasterizerStage->Draw(primitiveType, MaxVertexBufferSize / 3);
 		mStartIndexLoc += MaxVertexBufferSize;
 		currIndex += MaxVertexBufferSize;
 		numBatch++;
@@ -145,8 +188,8 @@ void RenderDevice::DrawIndexed( PrimitiveType primitiveType, uint32_t indexCount
 
 	if (currIndex < indexCount)
 	{
-		//mRasterizerStage->DrawTiled(primitiveType, (indexCount - currIndex) / 3);
-		mRasterizerStage->Draw(primitiveType, (indexCount - currIndex) / 3);
+		mRasterizerStage->DrawTiled(primitiveType, (indexCount - currIndex) / 3);
+		//mRasterizerStage->Draw(primitiveType, (indexCount - currIndex) / 3);
 		numBatch++;
 	}
 
@@ -154,6 +197,80 @@ void RenderDevice::DrawIndexed( PrimitiveType primitiveType, uint32_t indexCount
 }
 
 
+void RenderDevice::DrawMeshlets( const shared_ptr<MeshletBuffer>& meshlets, const float44& worldViewProj )
+{
+	if (meshlets->Meshlets.empty() || IsPredicatedOff() || IsBoundCulled())
+		return;
+
+	// cluster vertex lists index vertex stream directly
+	mUseIndex = false;
+	mBaseVertexLoc = 0;
+
+	mRasterizerStage->PreDraw();
+
+	// same bin queue limit as DrawIndexed, clusters are not split
+	const uint32_t numMeshlets = static_cast<uint32_t>(meshlets->Meshlets.size());
+	uint32_t first = 0;
+	while (first < numMeshlets)
+	{
+		uint32_t count = 0, numTriangles = 0;
+		while (first + count < numMeshlets && numTriangles + meshlets->Meshlets[first + count].TriangleCount <= MaxVertexBufferSize / 3)
+			numTriangles += meshlets->Meshlets[first + count++].TriangleCount;
+
+		mRasterizerStage->DrawMeshletsTiled(*meshlets, first, count, worldViewProj);
+		first += count;
+	}
+
+	mRasterizerStage->PostDraw();
+}
+
+void RenderDevice::SetPipeline( const shared_ptr<ShaderPipeline>& pipeline )
+{
+	mVertexShaderStage->SetVertexShader(pipeline->GetVertexShader());
+	mPixelShaderStage->SetPixelShader(pipeline->GetPixelShader());
+	mPipeline = pipeline;
+}
+
+void RenderDevice::DrawTilePass( const TilePassFunc& func )
+{
+	mRasterizerStage->DrawTilePass(func);
+}
+
+uint32_t RenderDevice::SelectLod( const MeshLodChain& chain, const float44& worldViewProj, uint32_t currentLod, float maxErrorPixels ) const
+{
+	const uint32_t numLods = static_cast<uint32_t>(chain.Lods.size());
+	ASSERT(numLods > 0);
+
+	currentLod = (std::min)(currentLod, numLods - 1);
+
+	// clip w and y grow by length of their matrix columns per object space unit
+	const float wScale = Length(float3(worldViewProj(0, 3), worldViewProj(1, 3), worldViewProj(2, 3)));
+	const float yScale = Length(float3(worldViewProj(0, 1), worldViewProj(1, 1), worldViewProj(2, 1)));
+
+	const float4 center = float4(chain.Center.X(), chain.Center.Y(), chain.Center.Z(), 1.0f) * worldViewProj;
+	const float nearestW = center.W() - chain.Radius * wScale;
+
+	// viewer inside bounding sphere
+	if (nearestW <= 0.0f)
+		return 0;
+
+	const float pixelsPerUnit = yScale / nearestW * GetDrawViewport().Height * 0.5f;
+	const float maxError = maxErrorPixels / pixelsPerUnit;
+
+	if (chain.Lods[currentLod].Error > maxError)
+	{
+		while (currentLod > 0 && chain.Lods[currentLod].Error > maxError)
+			currentLod--;
+	}
+	else
+	{
+		while (currentLod + 1 < numLods && chain.Lods[currentLod + 1].Error <= maxError * (1.0f - LodHysteresis))
+			currentLod++;
+	}
+
+	return currentLod;
+}
+
 VS_Output RenderDevice::FetchVertex( uint32_t index )
 {
 	VS_Input vertexInput;
@@ -180,10 +297,20 @@ void RenderDevice::BindFrameBuffer( const shared_ptr<FrameBuffer>& fb )
 {
 	if( mCurrentFrameBuffer && (fb != mCurrentFrameBuffer) )
 	{	
+		// render targets of unbound frame buffer may be read as textures
+		mRasterizerStage->ResolveFrameBuffer();
 		mCurrentFrameBuffer->OnUnbind();	
 	}
 
 	mCurrentFrameBuffer = fb; 
+
+	// default viewport and scissor rect cover the whole frame buffer
+	const Viewport& viewport = fb->GetViewport();
+	ScissorRect rect = { viewport.Left, viewport.Top, viewport.Left + viewport.Width, viewport.Top + viewport.Height };
+	SetViewports(1, &viewport);
+	SetScissorRects(1, &rect);
+	ViewportIndex = 0;
+
 	mRasterizerStage->OnBindFrameBuffer(fb);
 
 	if(mCurrentFrameBuffer->IsDirty())
@@ -192,36 +319,431 @@ void RenderDevice::BindFrameBuffer( const shared_ptr<FrameBuffer>& fb )
 	}
 }
 
+void RenderDevice::SetViewports( uint32_t numViewports, const Viewport* viewports )
+{
+	ASSERT(numViewports <= MaxViewports);
+
+	mNumViewports = numViewports;
+	for (uint32_t i = 0; i < numViewports; ++i)
+		mViewports[i] = viewports[i];
+}
+
+void RenderDevice::SetScissorRects( uint32_t numRects, const ScissorRect* rects )
+{
+	ASSERT(numRects <= MaxViewports);
+
+	mNumScissorRects = numRects;
+	for (uint32_t i = 0; i < numRects; ++i)
+		mScissorRects[i] = rects[i];
+}
+
+const Viewport& RenderDevice::GetDrawViewport() const
+{
+	ASSERT(ViewportIndex < mNumViewports);
+	return mViewports[(ViewportIndex < mNumViewports) ? ViewportIndex : 0];
+}
+
+const ScissorRect& RenderDevice::GetDrawScissorRect() const
+{
+	ASSERT(ViewportIndex < mNumScissorRects);
+	return mScissorRects[(ViewportIndex < mNumScissorRects) ? ViewportIndex : 0];
+}
+
+void RenderDevice::SetFramesInFlight( uint32_t numFrames )
+{
+	ASSERT(numFrames >= 1 && numFrames <= MaxFramesInFlight);
+
+	// frame contexts are remapped, unpresented frames are dropped
+	Flush();
+
+	const shared_ptr<FrameBuffer>& screenFrameBuffer = mFrames[0].ScreenFrameBuffer;
+	for (uint32_t i = 1; i < numFrames; ++i)
+	{
+		if (!mFrames[i].ScreenFrameBuffer)
+			mFrames[i].ScreenFrameBuffer = CreateScreenFrameBuffer(screenFrameBuffer->GetWidth(), screenFrameBuffer->GetHeight(), screenFrameBuffer->GetSampleCount(),
+				screenFrameBuffer->GetRenderTarget(ATT_DepthStencil)->GetTextureFormat());
+	}
+
+	mFramesInFlight = numFrames;
+	mFrameIndex = mPresentIndex = 0;
+}
+
+void RenderDevice::BeginFrame()
+{
+	PROFILE_NEXT_FRAME();
+
+	FrameContext& frame = mFrames[mFrameIndex % mFramesInFlight];
+
+	// frame context is reused, drop its last frame if application didn't present it
+	if (mFrameIndex - mPresentIndex >= mFramesInFlight)
+	{
+		mRasterizerStage->WaitBatches(frame.Fence);
+		mPresentIndex++;
+	}
+
+	// screen frame buffer of this frame context is drawn again, take its screenshots first
+	for (const Screenshot& screenshot : mScreenshots)
+	{
+		if (screenshot.Target == frame.ScreenFrameBuffer)
+			mRasterizerStage->WaitBatches(screenshot.Fence);
+	}
+	CaptureScreenshots();
+
+	bool screenBound = false;
+	for (uint32_t i = 0; i < mFramesInFlight; ++i)
+		screenBound = screenBound || (mCurrentFrameBuffer == mFrames[i].ScreenFrameBuffer);
+
+	// screen frame buffers have the same size, keep viewports and scissor rects
+	if (screenBound && mCurrentFrameBuffer != frame.ScreenFrameBuffer)
+	{
+		mRasterizerStage->ResolveFrameBuffer();
+		mCurrentFrameBuffer->OnUnbind();
+		mCurrentFrameBuffer = frame.ScreenFrameBuffer;
+
+		mRasterizerStage->OnBindFrameBuffer(mCurrentFrameBuffer);
+
+		if(mCurrentFrameBuffer->IsDirty())
+		{
+			mCurrentFrameBuffer->OnBind();
+		}
+	}
+}
+
+void RenderDevice::EndFrame()
+{
+	// multisampled frame buffer is resolved once per frame, before it is presented
+	mRasterizerStage->ResolveFrameBuffer();
+
+	mFrames[mFrameIndex % mFramesInFlight].Fence = mRasterizerStage->GetIssuedBatches();
+	mFrameIndex++;
+}
+
+shared_ptr<FrameBuffer> RenderDevice::AcquirePresentFrame()
+{
+	if (mFrameIndex - mPresentIndex < mFramesInFlight)
+	{
+		CaptureScreenshots();
+		return nullptr;
+	}
+
+	PROFILE_SCOPE("Wait Present Frame");
+
+	FrameContext& frame = mFrames[mPresentIndex % mFramesInFlight];
+	mRasterizerStage->WaitBatches(frame.Fence);
+	mPresentIndex++;
+
+	CaptureScreenshots();
+
+	return frame.ScreenFrameBuffer;
+}
+
+void RenderDevice::Flush()
+{
+	mRasterizerStage->WaitBatches(mRasterizerStage->GetIssuedBatches());
+
+	CaptureScreenshots();
+	GlobalJobSystem().WaitUntil([this]() { return mPendingScreenshotWrites.load() == 0; });
+}
+
+void RenderDevice::WaitFrameBuffer( const FrameBuffer* fb )
+{
+	mRasterizerStage->WaitFrameBuffer(fb);
+}
+
+void RenderDevice::BindShadingState( const ShadingState* state )
+{
+	tlsShadingState = state;
+}
+
+void RenderDevice::CaptureShadingState( ShadingState* oState ) const
+{
+	oState->FrameBuffer = mCurrentFrameBuffer;
+	// constants of bound shader may change before tiles of this draw are shaded
+	const shared_ptr<PixelShader>& pixelShader = mPixelShaderStage->GetPixelShader();
+	oState->PixelShader = pixelShader ? pixelShader->Clone() : pixelShader;
+	oState->Pipeline = mPipeline;
+	oState->DepthStencilState = DepthStencilState;
+	oState->BlendState = BlendState;
+	oState->BlendFactor = CurrentBlendFactor;
+
+	for (uint32_t i = 0; i < MaxRenderTarget; ++i)
+		oState->BlendFuncs[i] = FrameBuffer::GetBlendFunc(BlendState.RenderTarget[i]);
+	oState->ColorWrite = mCurrentFrameBuffer->GetColorWriteFunc(BlendState);
+	oState->StencilRef = StencilRef;
+
+	for (uint32_t i = 0; i < MaxTextureUnits; ++i)
+	{
+		oState->SampleStates[i] = SampleStates[i];
+		oState->TextureUnits[i] = TextureUnits[i];
+	}
+
+	// mask is 32 bits, shift must stay below that
+	oState->VSOutputCount = (std::min)(mVertexShaderStage->VSOutputCount, uint32_t(MaxVSOutput));
+	oState->VaryingMask = (oState->VSOutputCount >= 32) ? ~0U : (1U << oState->VSOutputCount) - 1;
+	if (oState->PixelShader)
+		oState->VaryingMask &= oState->PixelShader->GetInputMask();
+	oState->MultisampleEnable = RasterizerState.MultisampleEnable;
+}
+
+const std::vector<long long>& RenderDevice::GetTileBusyTime() const
+{
+	return mRasterizerStage->GetTileBusyTime();
+}
+
+RasterizerStats RenderDevice::GetRasterizerStats() const
+{
+	RasterizerStats stats = mRasterizerStage->GetStats();
+	stats.NumPredicatedDraws = mNumPredicatedDraws;
+	stats.NumCulledDraws = mNumCulledDraws;
+	return stats;
+}
+
+void RenderDevice::ResetRasterizerStats()
+{
+	mRasterizerStage->ResetStats();
+	mNumPredicatedDraws = mNumCulledDraws = 0;
+}
+
+void RenderDevice::BeginQuery( const shared_ptr<Query>& query )
+{
+	mRasterizerStage->BeginQuery(query);
+}
+
+void RenderDevice::EndQuery( const shared_ptr<Query>& query )
+{
+	mRasterizerStage->EndQuery(query);
+}
+
+bool RenderDevice::GetQueryData( const shared_ptr<Query>& query, PipelineStatistics* oData, bool wait )
+{
+	return mRasterizerStage->GetQueryData(query, oData, wait);
+}
+
+bool RenderDevice::GetQueryData( const shared_ptr<Query>& query, uint64_t* oSamplesPassed, bool wait )
+{
+	ASSERT(query->GetType() == QT_Occlusion);
+
+	PipelineStatistics stats;
+	if (!mRasterizerStage->GetQueryData(query, &stats, wait))
+		return false;
+
+	*oSamplesPassed = stats.GetSamplesPassed();
+	return true;
+}
+
+void RenderDevice::SetPredication( const shared_ptr<Query>& predicate )
+{
+	ASSERT(!predicate || predicate->GetType() == QT_Occlusion);
+	mPredicate = predicate;
+}
+
+bool RenderDevice::IsPredicatedOff()
+{
+	uint64_t samplesPassed;
+	if (!mPredicate || !GetQueryData(mPredicate, &samplesPassed, false) || samplesPassed > 0)
+		return false;
+
+	mNumPredicatedDraws++;
+	return true;
+}
+
+void RenderDevice::SetDrawBound( const BoundingBoxf& bound, const float44& worldViewProj )
+{
+	mDrawBound = bound;
+	mDrawBoundTransform = worldViewProj;
+}
+
+bool RenderDevice::IsBoundCulled()
+{
+	if (!mDrawBound.Defined)
+		return false;
+
+	// planes all corners are outside of: -w < x, x < w, -w < y, y < w, 0 < z, z < w
+	uint32_t outside = 0x3F;
+	for (uint32_t i = 0; i < 8 && outside; ++i)
+	{
+		const float4 corner((i & 1) ? mDrawBound.Max.X() : mDrawBound.Min.X(), (i & 2) ? mDrawBound.Max.Y() : mDrawBound.Min.Y(),
+			(i & 4) ? mDrawBound.Max.Z() : mDrawBound.Min.Z(), 1.0f);
+		const float4 clip = corner * mDrawBoundTransform;
+
+		uint32_t code = 0;
+		if (clip.X() < -clip.W())	code |= 0x01;
+		if (clip.X() > clip.W())	code |= 0x02;
+		if (clip.Y() < -clip.W())	code |= 0x04;
+		if (clip.Y() > clip.W())	code |= 0x08;
+		if (clip.Z() < 0.0f)		code |= 0x10;
+		if (clip.Z() > clip.W())	code |= 0x20;
+
+		outside &= code;
+	}
+
+	if (!outside)
+		return false;
+
+	mNumCulledDraws++;
+	return true;
+}
+
+void RenderDevice::SetOverdrawMapEnable( bool enable )
+{
+	mRasterizerStage->SetOverdrawMapEnable(enable);
+}
+
+void RenderDevice::ResolveOverdrawMap( const shared_ptr<Texture2D>& target )
+{
+	mRasterizerStage->ResolveOverdrawMap(target);
+}
+
+void RenderDevice::SetTileOrder( TileOrder order )
+{
+	mRasterizerStage->SetTileOrder(order);
+}
+
+TileOrder RenderDevice::GetTileOrder() const
+{
+	return mRasterizerStage->GetTileOrder();
+}
+
+void RenderDevice::SetTexelCacheSimulationEnable( bool enable )
+{
+	mRasterizerStage->SetTexelCacheSimulationEnable(enable);
+}
+
+void RenderDevice::ResizeScreen( uint32_t width, uint32_t height, uint32_t sampleCount, PixelFormat depthFormat )
+{
+	Flush();
+
+	for (uint32_t i = 0; i < MaxFramesInFlight; ++i)
+	{
+		mFrames[i].ScreenFrameBuffer = (i < mFramesInFlight) ? CreateScreenFrameBuffer(width, height, sampleCount, depthFormat) : nullptr;
+		mFrames[i].Fence = 0;
+	}
+
+	mFrameIndex = mPresentIndex = 0;
+
+	BindFrameBuffer(mFrames[0].ScreenFrameBuffer);
+}
+
 void RenderDevice::SaveScreenToPfm( const String& filename )
 {
-	auto texture = mCurrentFrameBuffer->GetRenderTarget(ATT_Color0);
-	uint32_t width = texture->GetWidth(0);
-	uint32_t height = texture->GetWidth(0);
+	Screenshot screenshot;
+	screenshot.Target = mCurrentFrameBuffer;
+	screenshot.Filename = filename;
+	screenshot.Float = true;
+
+	// screenshot reads render target, resolve samples of draws issued so far
+	mRasterizerStage->ResolveFrameBuffer();
+	screenshot.Fence = mRasterizerStage->GetIssuedBatches();
+	mScreenshots.push_back(screenshot);
+
+	// frame buffer may already be shaded
+	CaptureScreenshots();
+}
 
-	void* pData;
-	uint32_t pitch;
-	
-	texture->Map2D(0, TMA_Read_Only, 0, 0, width, height, pData, pitch);
+void RenderDevice::SaveScreenToPpm( const String& filename )
+{
+	Screenshot screenshot;
+	screenshot.Target = mCurrentFrameBuffer;
+	screenshot.Filename = filename;
+	screenshot.Float = false;
 
-	float* pColor = (float*)pData;
-	std::vector<float> pfmData(width * height * 3);
-	float* pColorPfm = &pfmData[0];
+	mRasterizerStage->ResolveFrameBuffer();
+	screenshot.Fence = mRasterizerStage->GetIssuedBatches();
+	mScreenshots.push_back(screenshot);
+
+	CaptureScreenshots();
+}
 
-	for (uint32_t y = 0; y < height; ++y)
+void RenderDevice::CaptureScreenshots()
+{
+	const uint64_t completed = mRasterizerStage->GetCompletedBatches();
+	JobSystem& jobSystem = GlobalJobSystem();
+
+	for (size_t i = 0; i < mScreenshots.size(); )
 	{
-		for (uint32_t x = 0; x < width; ++x)
+		if (mScreenshots[i].Fence > completed)
 		{
-			uint32_t invY = (height-y-1);
-			pfmData[ invY * width * 3 + x*3 + 0] = pColor[0];
-			pfmData[invY * width * 3 + x*3 + 1] = pColor[1];
-			pfmData[invY * width * 3 + x*3 + 2] = pColor[2];
+			++i;
+			continue;
+		}
 
-			pColor += 4;
+		PROFILE_SCOPE("Capture Screenshot");
 
+		const Screenshot screenshot = mScreenshots[i];
+		mScreenshots.erase(mScreenshots.begin() + i);
+
+		const shared_ptr<Texture2D>& texture = screenshot.Target->GetRenderTarget(ATT_Color0);
+		const uint32_t width = texture->GetWidth(0);
+		const uint32_t height = texture->GetHeight(0);
+		const String filename = screenshot.Filename;
+
+		void* pData;
+		uint32_t pitch;
+		texture->Map2D(0, TMA_Read_Only, 0, 0, width, height, pData, pitch);
+		const uint8_t* pColor = static_cast<const uint8_t*>(pData);
+
+		// write job owns a copy, frame buffer may be drawn again once this returns
+		mPendingScreenshotWrites.fetch_add(1);
+
+		if (screenshot.Float)
+		{
+			shared_ptr<std::vector<float> > pixels = std::make_shared<std::vector<float> >(width * height * 3);
+			float* pPixels = &(*pixels)[0];
+
+			// pfm rows are bottom up
+			const uint32_t numTileRows = (height + TileSize - 1) >> TileSizeShift;
+			jobSystem.ParallelFor(0, numTileRows, 1, [=](uint32_t begin, uint32_t end) {
+				for (uint32_t y = begin << TileSizeShift; y < (std::min)(end << TileSizeShift, height); ++y)
+				{
+					const float* pSrc = reinterpret_cast<const float*>(pColor + y * pitch);
+					float* pDst = pPixels + (height - y - 1) * width * 3;
+					for (uint32_t x = 0; x < width; ++x, pSrc += 4, pDst += 3)
+					{
+						pDst[0] = pSrc[0];
+						pDst[1] = pSrc[1];
+						pDst[2] = pSrc[2];
+					}
+				}
+			});
+
+			jobSystem.Run(jobSystem.CreateJob([=]() {
+				WritePfm(filename.c_str(), width, height, 3, &(*pixels)[0]);
+				mPendingScreenshotWrites.fetch_sub(1);
+			}));
+		}
+		else
+		{
+			shared_ptr<std::vector<uint32_t> > pixels = std::make_shared<std::vector<uint32_t> >(width * height);
+			ParallelResolveColor(pColor, pitch, &(*pixels)[0], width, height, mColorResolve);
+
+			jobSystem.Run(jobSystem.CreateJob([=]() {
+				WritePpm(filename.c_str(), width, height, reinterpret_cast<const unsigned char*>(&(*pixels)[0]));
+				mPendingScreenshotWrites.fetch_sub(1);
+			}));
 		}
+
+		texture->Unmap2D(0);
 	}
+}
+
+const uint32_t* RenderDevice::ResolveColor( const FrameBuffer& fb )
+{
+	PROFILE_SCOPE("Resolve Color");
+
+	const shared_ptr<Texture2D>& texture = fb.GetRenderTarget(ATT_Color0);
+	const uint32_t width = texture->GetWidth(0);
+	const uint32_t height = texture->GetHeight(0);
+
+	void* pData;
+	uint32_t pitch;
+	texture->Map2D(0, TMA_Read_Only, 0, 0, width, height, pData, pitch);
+
+	mResolvedColor.resize(width * height);
+	ParallelResolveColor(static_cast<const uint8_t*>(pData), pitch, &mResolvedColor[0], width, height, mColorResolve);
+
+	texture->Unmap2D(0);
 
-	WritePfm(filename.c_str(), width, height, 3, &pfmData[0]);
+	return &mResolvedColor[0];
 }
 
 
@@ -232,22 +754,43 @@ ColorRGBA test(int32_t, int32_t)
 
 ColorRGBA RenderDevice::Sample( uint32_t texUint, uint32_t samplerUnit, float U, float V, float W )
 {
-	ASSERT(TextureUnits[texUint]->GetTextureType() == TT_Texture2D);
+	// tile jobs sample textures captured with their draw
+	const ShadingState* state = tlsShadingState;
+	const shared_ptr<Texture>& texture = state ? state->TextureUnits[texUint] : TextureUnits[texUint];
+	const SamplerState& samplerState = state ? state->SampleStates[samplerUnit] : SampleStates[samplerUnit];
 
-	const shared_ptr<Texture>& texture = TextureUnits[texUint];
-	const SamplerState& samplerState = SampleStates[samplerUnit];
+	ASSERT(texture->GetTextureType() == TT_Texture2D);
 
 	const uint32_t width = texture->GetWidth(0);
 	const uint32_t height = texture->GetHeight(0);
 
+	// fetch directly from texture storage, which may be tiled
 	void* pData;
 	uint32_t pitch;
-	texture->Map2D(0, TMA_Read_Only, 0, 0, 0, 0, pData, pitch);
+	texture->MapStorage2D(0, pData, pitch);
+
+	TextureFetch::ReadPixelFunc readPixel = TextureFetch::GetReadPixelFunc(texture->GetTextureFormat(), texture->GetTextureLayout());
+
+	if (mRasterizerStage->IsTexelCacheSimulated())
+	{
+		Rasterizer* rasterizer = mRasterizerStage;
+		const uint32_t texelSize = PixelFormatUtils::GetNumElemBytes(texture->GetTextureFormat());
+		const TextureLayout layout = texture->GetTextureLayout();
+
+		return samplerState.Sample(U, V, (int32_t)width, (int32_t)height, [=](int32_t x, int32_t y) -> ColorRGBA
+		{
+			rasterizer->CountTexelFetch(TextureFetch::GetTexelAddress(x, y, pData, pitch, texelSize, layout));
+
+			ColorRGBA retVal;
+			readPixel(x, y, retVal, pData, pitch);
+			return retVal;
+		} );
+	}
 
 	return samplerState.Sample(U, V, (int32_t)width, (int32_t)height, [=](int32_t x, int32_t y) -> ColorRGBA
 	{ 
 		ColorRGBA retVal;
-		TextureFetch::ReadPixelFuncs[texture->GetTextureFormat()](x, y, retVal, pData, pitch);
+		readPixel(x, y, retVal, pData, pitch);
 		return retVal;
 	} );
 }
@@ -3,19 +3,108 @@
 
 #include "Prerequisite.h"
 #include "GraphicCommon.h"
+#include "PixelFormat.h"
 #include "RenderState.h"
+#include "FrameBuffer.h"
 #include "SampleState.h"
 #include "Shader.h"
+#include "Query.h"
+#include "Meshlet.h"
+#include "MeshLod.h"
+#include "ColorResolve.h"
+#include <Matrix.hpp>
+#include <BoundingBox.hpp>
 
 #define MaxTextureUnits 8
 #define MaxVertexStreams 8
+#define MaxViewports 16
 #define MaxVertexBufferSize 18000
 #define MaxVertexBufferClip (MaxVertexBufferSize * 5)
 #define MaxBinQueueSize     MaxVertexBufferClip
 
+// upper limit of RenderDevice::SetFramesInFlight
+#define MaxFramesInFlight 3
+
 using namespace RxLib;
 
 class Rasterizer;
+class ShaderPipeline;
+
+/**
+ * Work of RenderDevice::DrawTilePass on one raster tile, rect in pixels. Runs on a worker
+ * thread, render targets are read and written in place through FrameBuffer::GetTargetData.
+ */
+typedef std::function<void(FrameBuffer& frameBuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height)> TilePassFunc;
+
+/**
+ * Device state read when pixels are shaded. Tiled draws capture it when issued, because
+ * their tiles may still be shaded after the application has set state for later draws.
+ */
+struct ShadingState
+{
+	// members are named after their types, which are qualified for GCC
+	shared_ptr< ::FrameBuffer> FrameBuffer;
+	shared_ptr< ::PixelShader> PixelShader;
+
+	// null if shaders were set alone, tiles then call the pixel shader through its vtable
+	shared_ptr<ShaderPipeline> Pipeline;
+
+	::DepthStencilState DepthStencilState;
+	::BlendState BlendState;
+	ColorRGBA BlendFactor;
+	uint32_t StencilRef;
+
+	// blend function of each render target of BlendState
+	::FrameBuffer::BlendFunc BlendFuncs[MaxRenderTarget];
+
+	// color write of FrameBuffer for BlendState
+	::FrameBuffer::ColorWriteFunc ColorWrite;
+
+	SamplerState SampleStates[MaxTextureUnits];
+	shared_ptr<Texture> TextureUnits[MaxTextureUnits];
+
+	// vertex shader output register count
+	uint32_t VSOutputCount;
+
+	// vertex shader outputs read by pixel shader, bit per register
+	uint32_t VaryingMask;
+
+	// samples of multisampled frame buffer are at pixel center when disabled
+	bool MultisampleEnable;
+};
+
+/**
+ * Accumulated tiled draw timings in microseconds. Geometry and tile queue are measured on the
+ * thread issuing draws, shading is summed over all workers.
+ */
+struct RasterizerStats
+{
+	uint64_t NumDraws;
+	uint64_t NumPredicatedDraws;	// draws skipped by occlusion predicate
+	uint64_t NumCulledDraws;		// draws whose bound is outside view frustum
+	uint64_t NumTiles;		// non-empty tiles shaded
+
+	long long GeometryTime;		// vertex processing, clipping and binning
+	long long TileQueueTime;	// tile cost estimation and sort
+	long long ShadeTime;		// tile rasterization and pixel shading
+};
+
+/**
+ * Order tile jobs of a tiled draw fetch its tiles in. Curve orders keep tiles shaded one after
+ * another next to each other on screen, so they sample nearby texels.
+ */
+enum TileOrder
+{
+	// heaviest estimated tile first
+	TO_Cost,
+	TO_RowMajor,
+	TO_Morton,
+	TO_Hilbert,
+
+	// Hilbert order split into one contiguous range per tile job, a job whose range is done
+	// takes tiles from the end of other ranges
+	TO_Affinity
+};
 
 class RenderDevice
 {
@@ -32,21 +121,181 @@ public:
 	void SetVertexStream(uint32_t streamSlot,  const shared_ptr<GraphicsBuffer>& vertexBuffer, uint32_t offset, uint32_t stride );
 	void SetInputLayout(const shared_ptr<VertexDeclaration>& decl);
 
-	void SetVertexShader(const shared_ptr<VertexShader>& vs) { mVertexShaderStage->SetVertexShader(vs); }
-	void SetPixelShader(const shared_ptr<PixelShader>& ps) { mPixelShaderStage->SetPixelShader(ps); }
+	// setting a shader alone unbinds the pipeline
+	void SetVertexShader(const shared_ptr<VertexShader>& vs) { mVertexShaderStage->SetVertexShader(vs); mPipeline = nullptr; }
+	void SetPixelShader(const shared_ptr<PixelShader>& ps) { mPixelShaderStage->SetPixelShader(ps); mPipeline = nullptr; }
+
+	/**
+	 * Bind both shaders of pipeline. Tiled draws then shade pixels in tile loops instantiated
+	 * for its pixel shader type, see Pipeline.h. Vertices are still shaded through the vtable.
+	 */
+	void SetPipeline(const shared_ptr<ShaderPipeline>& pipeline);
+	const shared_ptr<ShaderPipeline>& GetPipeline() const		{ return mPipeline; }
 
 	void Draw(PrimitiveType primitiveType, uint32_t vertexCount, uint32_t startVertexLocation);
 	void DrawIndexed(PrimitiveType primitiveType, uint32_t indexCount, uint32_t startIndexLocation, int32_t baseVertexLocation);
+
+	/**
+	 * Draw triangle list clustered by RenderFactory::CreateMeshlets. Clusters outside the frustum
+	 * of worldViewProj, or whose faces are all culled by RasterizerState, are skipped before
+	 * their vertices are shaded.
+	 */
+	void DrawMeshlets(const shared_ptr<MeshletBuffer>& meshlets, const float44& worldViewProj);
+
+	/**
+	 * Run func on each raster tile of bound frame buffer, ordered after earlier draws like a
+	 * tiled draw and returning before it runs. Tiles run in parallel, a screen space pass such
+	 * as deferred lighting reads each tile of its inputs once while they are cache resident.
+	 * Whatever func captures must stay valid until the pass is done. Not for multisampled
+	 * frame buffers, the pass is skipped on them.
+	 */
+	void DrawTilePass(const TilePassFunc& func);
+
+	/**
+	 * Coarsest LOD of chain whose error projects to at most maxErrorPixels in the current
+	 * viewport, measured at the nearest point of the bounding sphere. Pass the LOD selected
+	 * last frame as currentLod, a coarser LOD is only taken once its error is LodHysteresis
+	 * below the limit, so a mesh at the threshold distance doesn't switch every frame.
+	 */
+	uint32_t SelectLod(const MeshLodChain& chain, const float44& worldViewProj, uint32_t currentLod, float maxErrorPixels = 1.0f) const;
 	
 	const shared_ptr<FrameBuffer>& GetCurrentFrameBuffer() const	{ return mCurrentFrameBuffer; } 
 	void BindFrameBuffer(const shared_ptr<FrameBuffer>& fb);
 
-	// Debug save screen
+	/**
+	 * Draw calls use the viewport and scissor rect selected by ViewportIndex. Binding
+	 * a frame buffer resets them to one viewport covering the whole frame buffer.
+	 */
+	void SetViewports(uint32_t numViewports, const Viewport* viewports);
+	void SetScissorRects(uint32_t numRects, const ScissorRect* rects);
+
+	const Viewport& GetViewport(uint32_t index) const		{ return mViewports[index]; }
+	const ScissorRect& GetScissorRect(uint32_t index) const	{ return mScissorRects[index]; }
+
+	// viewport and scissor rect of draw calls, index 0 is used if ViewportIndex is out of range
+	const Viewport& GetDrawViewport() const;
+	const ScissorRect& GetDrawScissorRect() const;
+
+	/**
+	 * Frames are pipelined: geometry and binning of a frame run while tiles of the previous
+	 * frame are still shaded. Each frame in flight renders into its own screen frame buffer.
+	 * Draws return before their tiles are shaded whatever the frame count, with 1 frame in
+	 * flight BeginFrame waits for the previous frame. Each draw shades with a clone of the
+	 * pixel shader, texture contents must not change while draws using them are in flight.
+	 */
+	void SetFramesInFlight(uint32_t numFrames);
+	uint32_t GetFramesInFlight() const		{ return mFramesInFlight; }
+
+	// BeginFrame binds screen frame buffer of next frame context if a screen frame buffer is bound
+	void BeginFrame();
+	void EndFrame();
+
+	/**
+	 * Return screen frame buffer of oldest unpresented frame once its shading is done, return
+	 * null if fewer frames than frames in flight limit are pending.
+	 */
+	shared_ptr<FrameBuffer> AcquirePresentFrame();
+
+	// wait until all issued draws are shaded
+	void Flush();
+
+	// wait until draws in flight stop writing frame buffer
+	void WaitFrameBuffer(const FrameBuffer* fb);
+
+	// tile jobs bind captured state of their draw, so Sample reads textures of that draw
+	static void BindShadingState(const ShadingState* state);
+	void CaptureShadingState(ShadingState* oState) const;
+
+	/**
+	 * Screenshot of current frame buffer with draws issued so far. It is copied once those
+	 * draws are shaded, checked by BeginFrame, AcquirePresentFrame and Flush, and written
+	 * by a job, so the render loop doesn't wait. Don't draw to the frame buffer again before
+	 * next BeginFrame. Pfm keeps float color, ppm is resolved to 8 bit sRGB.
+	 */
 	void SaveScreenToPfm(const String& filename);
+	void SaveScreenToPpm(const String& filename);
+
+	// exposure and tone map of 8 bit resolves
+	void SetColorResolve(const ColorResolveDesc& desc)	{ mColorResolve = desc; }
+	const ColorResolveDesc& GetColorResolve() const		{ return mColorResolve; }
+
+	/**
+	 * Resolve color target of a shaded frame buffer to 8 bit sRGB RGBA, rows of tiles are
+	 * resolved by parallel jobs. Pixels are valid until next resolve, pitch is width * 4.
+	 */
+	const uint32_t* ResolveColor(const FrameBuffer& fb);
+
+	// per worker tile rasterization time of last tiled draw in microseconds
+	const std::vector<long long>& GetTileBusyTime() const;
+
+	// shade time of draws in flight is added when their tiles finish, Flush before reading for exact totals
+	RasterizerStats GetRasterizerStats() const;
+	void ResetRasterizerStats();
+
+	/**
+	 * Queries count draws issued between begin and end. GetQueryData returns false while
+	 * pixels of those draws are still shading, wait blocks until they are done.
+	 */
+	void BeginQuery(const shared_ptr<Query>& query);
+	void EndQuery(const shared_ptr<Query>& query);
+	bool GetQueryData(const shared_ptr<Query>& query, PipelineStatistics* oData, bool wait = false);
+
+	// QT_Occlusion result
+	bool GetQueryData(const shared_ptr<Query>& query, uint64_t* oSamplesPassed, bool wait = false);
+
+	/**
+	 * Draw calls are skipped while result of predicate occlusion query is available and zero.
+	 * Draws whose predicate is still shading are not skipped, so predicate with a query of a
+	 * frame which is already shaded. Null predicate disables predication.
+	 */
+	void SetPredication(const shared_ptr<Query>& predicate);
+
+	/**
+	 * Object space bound of following draws and the matrix transforming it to clip space,
+	 * usually World * View * Projection. Draws whose bound is outside the view frustum are
+	 * skipped before any vertex is shaded. An undefined bound disables the test.
+	 */
+	void SetDrawBound(const BoundingBoxf& bound, const float44& worldViewProj);
+
+	/**
+	 * Overdraw map counts pixel shader invocations per pixel of the bound frame buffer.
+	 * Resolve writes it as heat colors to a PF_A32B32G32R32F texture and restarts counting,
+	 * a null target only restarts counting.
+	 */
+	void SetOverdrawMapEnable(bool enable);
+	void ResolveOverdrawMap(const shared_ptr<Texture2D>& target);
+
+	// applies to draws issued after it, TO_Cost by default
+	void SetTileOrder(TileOrder order);
+	TileOrder GetTileOrder() const;
+
+	/**
+	 * Each worker runs texels read by Sample through a simulated 32KB 8 way LRU cache of 64
+	 * byte lines, counted in PipelineStatistics TexelFetches and TexelCacheMisses. Slows
+	 * sampling down, meant for comparing tile orders and texture layouts.
+	 */
+	void SetTexelCacheSimulationEnable(bool enable);
+
+	/**
+	 * Recreate screen frame buffers of all frame contexts and bind the first one, viewports
+	 * are reset. Unpresented frames are dropped. Screen is multisampled with sampleCount of
+	 * MultisampleCount, enable RasterizerState.MultisampleEnable to use the sample pattern.
+	 * PF_Depth24Stencil8 depth format gives the screen a stencil buffer.
+	 */
+	void ResizeScreen(uint32_t width, uint32_t height, uint32_t sampleCount = 1, PixelFormat depthFormat = PF_Depth32);
 
 private:
 	void SetInputLayout();
 
+	// predicate query is done and no sample passed
+	bool IsPredicatedOff();
+
+	// draw bound is outside one frustum plane
+	bool IsBoundCulled();
+
+	// copy screenshots whose draws are shaded and start their write jobs
+	void CaptureScreenshots();
+
 	/**
 	 *  Vertex format  Vertex Stream ȡ
 	 */
@@ -59,11 +308,17 @@ private:
 	ColorRGBA Sample(uint32_t texUint, uint32_t samplerUnit, float U, float V, float W);
 
 public:
-	RasterizerState RasterizerState;
-	DepthStencilState DepthStencilState;
-	BlendState BlendState;
+	::RasterizerState RasterizerState;
+	::DepthStencilState DepthStencilState;
+	::BlendState BlendState;
 	ColorRGBA CurrentBlendFactor;
 
+	// reference value of stencil test and SOP_Replace
+	uint32_t StencilRef;
+
+	// index of viewport and scissor rect used by draw calls
+	uint32_t ViewportIndex;
+
 	SamplerState SampleStates[MaxTextureUnits];
 	shared_ptr<Texture> TextureUnits[MaxTextureUnits];
 
@@ -86,7 +341,51 @@ private:
 	shared_ptr<VertexDeclaration> mVertexDecl;
 
 	shared_ptr<FrameBuffer> mCurrentFrameBuffer;
-	shared_ptr<FrameBuffer> mScreenFrameBuffer;
+
+	shared_ptr<Query> mPredicate;
+	uint64_t mNumPredicatedDraws;
+
+	shared_ptr<ShaderPipeline> mPipeline;
+
+	BoundingBoxf mDrawBound;
+	float44 mDrawBoundTransform;
+	uint64_t mNumCulledDraws;
+
+	struct FrameContext
+	{
+		shared_ptr<FrameBuffer> ScreenFrameBuffer;
+
+		// frame is shaded when rasterizer has completed this many tiled draws
+		uint64_t Fence;
+	};
+
+	FrameContext mFrames[MaxFramesInFlight];
+
+	struct Screenshot
+	{
+		shared_ptr<FrameBuffer> Target;
+		String Filename;
+
+		// pfm or 8 bit ppm
+		bool Float;
+
+		// taken when rasterizer has completed this many tiled draws
+		uint64_t Fence;
+	};
+
+	std::vector<Screenshot> mScreenshots;
+	std::atomic<uint32_t> mPendingScreenshotWrites;
+
+	ColorResolveDesc mColorResolve;
+	std::vector<uint32_t> mResolvedColor;
+	uint32_t mFramesInFlight;
+
+	// frames begun and frames presented
+	uint64_t mFrameIndex, mPresentIndex;
+
+	Viewport mViewports[MaxViewports];
+	ScissorRect mScissorRects[MaxViewports];
+	uint32_t mNumViewports, mNumScissorRects;
 
 	VertexShaderStage* mVertexShaderStage;
 	PixelShaderStage* mPixelShaderStage;
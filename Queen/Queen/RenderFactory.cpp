@@ -2,9 +2,12 @@
 #include "GraphicsBuffer.h"
 #include "PixelFormat.h"
 #include "Texture.h"
+#include <BoundingBox.hpp>
 #include <nvImage.h>
 //#include <GL/GL.h>
 
+using namespace RxLib;
+
 namespace {
 
 	PixelFormat UnMapping( GLint internalformat, GLenum format, GLenum type )
@@ -319,15 +322,58 @@ namespace {
 		}
 	}
 
+	inline void StoreAverage(float sum, uint8_t& out)	{ out = static_cast<uint8_t>(sum * 0.25f + 0.5f); }
+	inline void StoreAverage(float sum, float& out)		{ out = sum * 0.25f; }
+
+	// 2x2 box filter of src into next mip level, odd edges clamp
+	template <typename T>
+	void DownsampleLevel(const T* src, uint32_t srcWidth, uint32_t srcHeight, T* dst, uint32_t numComponents)
+	{
+		const uint32_t dstWidth = (std::max)(1U, srcWidth / 2);
+		const uint32_t dstHeight = (std::max)(1U, srcHeight / 2);
+
+		for (uint32_t y = 0; y < dstHeight; ++y)
+		{
+			const uint32_t y0 = (std::min)(y * 2, srcHeight - 1);
+			const uint32_t y1 = (std::min)(y * 2 + 1, srcHeight - 1);
+
+			for (uint32_t x = 0; x < dstWidth; ++x)
+			{
+				const uint32_t x0 = (std::min)(x * 2, srcWidth - 1);
+				const uint32_t x1 = (std::min)(x * 2 + 1, srcWidth - 1);
+
+				for (uint32_t c = 0; c < numComponents; ++c)
+				{
+					const float sum = float(src[(y0 * srcWidth + x0) * numComponents + c]) + float(src[(y0 * srcWidth + x1) * numComponents + c]) +
+						float(src[(y1 * srcWidth + x0) * numComponents + c]) + float(src[(y1 * srcWidth + x1) * numComponents + c]);
+
+					StoreAverage(sum, dst[(y * dstWidth + x) * numComponents + c]);
+				}
+			}
+		}
+	}
+
 }
 
 RenderFactory::RenderFactory(void)
+	: mLoaderThread(nullptr), mQuitLoader(false)
 {
 }
 
 
 RenderFactory::~RenderFactory(void)
 {
+	if (mLoaderThread)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mLoadMutex);
+			mQuitLoader = true;
+			mLoadSignal.notify_one();
+		}
+
+		mLoaderThread->join();
+		delete mLoaderThread;
+	}
 }
 
 shared_ptr<GraphicsBuffer> RenderFactory::CreateVertexBuffer( ElementInitData* initData )
@@ -365,16 +411,258 @@ shared_ptr<VertexDeclaration> RenderFactory::CreateVertexDeclaration( VertexElem
 	return std::make_shared<VertexDeclaration>(elems, count);
 }
 
-shared_ptr<Texture> RenderFactory::CreateTextureFromFile( const std::string& texFileName )
+bool RenderFactory::CreateMeshFromCache( const std::string& cacheFile, const std::string& sourceFile, CachedMesh* oMesh )
+{
+	shared_ptr<MappedFile> file;
+	const MeshCacheHeader* header;
+	if (!OpenMeshCache(cacheFile, sourceFile, &file, &header))
+		return false;
+
+	oMesh->NumVertices = header->NumVertices;
+	oMesh->NumIndices = header->NumIndices;
+	oMesh->VertexStride = header->VertexStride;
+	oMesh->NormalOffset = header->NormalOffset;
+	oMesh->TexCoordOffset = header->TexCoordOffset;
+	oMesh->Bound = BoundingBoxf(float3(header->BoundMin[0], header->BoundMin[1], header->BoundMin[2]),
+		float3(header->BoundMax[0], header->BoundMax[1], header->BoundMax[2]));
+
+	oMesh->VertexBuffer = std::make_shared<GraphicsBuffer>(file, header->VertexDataOffset, header->NumVertices * header->VertexStride);
+	oMesh->IndexBuffer = std::make_shared<GraphicsBuffer>(file, header->IndexDataOffset, header->NumIndices * static_cast<uint32_t>(sizeof(uint32_t)));
+
+	return true;
+}
+
+shared_ptr<Query> RenderFactory::CreateQuery( QueryType type )
+{
+	return std::make_shared<Query>(type);
+}
+
+shared_ptr<MeshletBuffer> RenderFactory::CreateMeshlets( const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices )
+{
+	shared_ptr<MeshletBuffer> retVal = std::make_shared<MeshletBuffer>();
+	retVal->NumTriangles = numIndices / 3;
+
+	// cluster local index of each vertex, only valid for vertices of current cluster
+	std::vector<uint8_t> localIndex(numVertices);
+	std::vector<bool> inMeshlet(numVertices, false);
+
+	Meshlet meshlet;
+	meshlet.VertexOffset = meshlet.TriangleOffset = 0;
+	meshlet.VertexCount = meshlet.TriangleCount = 0;
+
+	std::function<void()> finishMeshlet = [&]() {
+		if (meshlet.TriangleCount == 0)
+			return;
+
+		const uint32_t* vertices = &retVal->Vertices[meshlet.VertexOffset];
+		const uint8_t* triangles = &retVal->Triangles[meshlet.TriangleOffset * 3];
+
+		// bounding sphere around box center
+		BoundingBoxf box;
+		for (uint32_t i = 0; i < meshlet.VertexCount; ++i)
+			box.Merge(positions[vertices[i]]);
+
+		meshlet.Center = box.Center();
+		meshlet.Radius = 0.0f;
+		for (uint32_t i = 0; i < meshlet.VertexCount; ++i)
+			meshlet.Radius = (std::max)(meshlet.Radius, Length(positions[vertices[i]] - meshlet.Center));
+
+		// cone axis is average normal, cutoff is sine of largest angle between axis and a normal
+		std::vector<float3> normals(meshlet.TriangleCount);
+		float3 axis(0, 0, 0);
+		for (uint32_t i = 0; i < meshlet.TriangleCount; ++i)
+		{
+			const float3& p0 = positions[vertices[triangles[i * 3 + 0]]];
+			const float3& p1 = positions[vertices[triangles[i * 3 + 1]]];
+			const float3& p2 = positions[vertices[triangles[i * 3 + 2]]];
+
+			const float3 normal = Cross(p1 - p0, p2 - p0);
+			const float area = Length(normal);
+			normals[i] = (area > 0.0f) ? normal / area : float3(0, 0, 0);
+			axis += normals[i];
+		}
+
+		const float axisLength = Length(axis);
+		meshlet.ConeAxis = (axisLength > 0.0f) ? axis / axisLength : float3(0, 0, 0);
+		meshlet.ConeCutoff = 2.0f;
+
+		if (axisLength > 0.0f)
+		{
+			float minDot = 1.0f;
+			for (uint32_t i = 0; i < meshlet.TriangleCount; ++i)
+				minDot = (std::min)(minDot, Dot(normals[i], meshlet.ConeAxis));
+
+			// degenerate triangles have no normal, cone over more than a hemisphere never culls
+			if (minDot > 0.0f)
+				meshlet.ConeCutoff = sqrtf(1.0f - minDot * minDot);
+		}
+
+		for (uint32_t i = 0; i < meshlet.VertexCount; ++i)
+			inMeshlet[vertices[i]] = false;
+
+		retVal->Meshlets.push_back(meshlet);
+
+		meshlet.VertexOffset = static_cast<uint32_t>(retVal->Vertices.size());
+		meshlet.TriangleOffset += meshlet.TriangleCount;
+		meshlet.VertexCount = meshlet.TriangleCount = 0;
+	};
+
+	for (uint32_t iTri = 0; iTri < retVal->NumTriangles; ++iTri)
+	{
+		const uint32_t* tri = &indices[iTri * 3];
+
+		uint32_t newVertices = 0;
+		for (uint32_t k = 0; k < 3; ++k)
+			if (!inMeshlet[tri[k]] && (k < 1 || tri[k] != tri[0]) && (k < 2 || tri[k] != tri[1]))
+				newVertices++;
+
+		if (meshlet.VertexCount + newVertices > MaxMeshletVertices || meshlet.TriangleCount == MaxMeshletTriangles)
+			finishMeshlet();
+
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			const uint32_t index = tri[k];
+			if (!inMeshlet[index])
+			{
+				inMeshlet[index] = true;
+				localIndex[index] = static_cast<uint8_t>(meshlet.VertexCount++);
+				retVal->Vertices.push_back(index);
+			}
+
+			retVal->Triangles.push_back(localIndex[index]);
+		}
+
+		meshlet.TriangleCount++;
+	}
+
+	finishMeshlet();
+
+	return retVal;
+}
+
+shared_ptr<MeshLodChain> RenderFactory::CreateLodChain( const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices, float reduction )
+{
+	ASSERT(numIndices > 0 && reduction > 0.0f && reduction < 1.0f);
+
+	shared_ptr<MeshLodChain> retVal = std::make_shared<MeshLodChain>();
+
+	BoundingBoxf bound;
+	for (uint32_t i = 0; i < numIndices; ++i)
+		bound.Merge(positions[indices[i]]);
+
+	retVal->Center = bound.Center();
+	retVal->Radius = 0.0f;
+	for (uint32_t i = 0; i < numIndices; ++i)
+		retVal->Radius = (std::max)(retVal->Radius, Length(positions[indices[i]] - retVal->Center));
+
+	auto addLod = [&](const uint32_t* lodIndices, uint32_t lodNumIndices, float error) {
+		ElementInitData initData;
+		initData.pData = lodIndices;
+		initData.RowPitch = lodNumIndices * sizeof(uint32_t);
+		initData.SlicePitch = 0;
+
+		MeshLod lod;
+		lod.IndexBuffer = CreateIndexBuffer(&initData);
+		lod.NumIndices = lodNumIndices;
+		lod.Error = error;
+		retVal->Lods.push_back(lod);
+	};
+
+	addLod(indices, numIndices, 0.0f);
+
+	// simplify from LOD 0 each time, so error of each LOD is measured against original surface
+	uint32_t prevNumIndices = numIndices;
+	while (retVal->Lods.size() < MaxMeshLods)
+	{
+		const uint32_t targetIndexCount = static_cast<uint32_t>(prevNumIndices * reduction) / 3 * 3;
+		if (targetIndexCount < 3)
+			break;
+
+		float error;
+		std::vector<uint32_t> simplified = SimplifyMesh(indices, numIndices, positions, numVertices, targetIndexCount, &error);
+
+		// stalled on locked vertices, a LOD saving less than a tenth is not worth switching to
+		if (simplified.empty() || simplified.size() * 10 > prevNumIndices * 9)
+			break;
+
+		addLod(&simplified[0], static_cast<uint32_t>(simplified.size()), (std::max)(error, retVal->Lods.back().Error));
+		prevNumIndices = static_cast<uint32_t>(simplified.size());
+	}
+
+	return retVal;
+}
+
+shared_ptr<Texture> RenderFactory::CreateTextureFromFile( const std::string& texFileName, uint32_t accessHint )
+{
+	shared_ptr<Texture> retVal = LoadTexture(texFileName, accessHint, true);
+	ASSERT(retVal);
+
+	return retVal;
+}
+
+shared_ptr<AsyncResource<Texture> > RenderFactory::CreateTextureFromFileAsync( const std::string& texFileName, uint32_t accessHint )
+{
+	// loader thread is joined before factory is destroyed
+	return LoadAsync<Texture>(std::bind(&RenderFactory::LoadTexture, this, texFileName, accessHint, true), GetPlaceholderTexture());
+}
+
+void RenderFactory::QueueLoad( const std::function<void()>& load )
+{
+	std::lock_guard<std::mutex> lock(mLoadMutex);
+
+	mLoadQueue.push_back(load);
+	if (!mLoaderThread)
+		mLoaderThread = new std::thread(std::bind(&RenderFactory::LoaderThread, this));
+
+	mLoadSignal.notify_one();
+}
+
+void RenderFactory::LoaderThread()
+{
+	std::unique_lock<std::mutex> lock(mLoadMutex);
+
+	for (;;)
+	{
+		while (!mQuitLoader && mLoadQueue.empty())
+			mLoadSignal.wait(lock);
+
+		if (mLoadQueue.empty())
+			break;
+
+		std::function<void()> load = mLoadQueue.front();
+		mLoadQueue.pop_front();
+
+		lock.unlock();
+		load();
+		lock.lock();
+	}
+}
+
+const shared_ptr<Texture>& RenderFactory::GetPlaceholderTexture()
+{
+	if (!mPlaceholderTexture)
+	{
+		const uint8_t grey[3] = { 128, 128, 128 };
+
+		ElementInitData initData;
+		initData.pData = grey;
+		initData.RowPitch = sizeof(grey);
+		initData.SlicePitch = 0;
+
+		mPlaceholderTexture = std::make_shared<Texture2D>(PF_R8G8B8, 1, 1, 1, 1, 0, EAH_GPU_Read, &initData);
+	}
+
+	return mPlaceholderTexture;
+}
+
+shared_ptr<Texture> RenderFactory::LoadTexture( const std::string& texFileName, uint32_t accessHint, bool generateMips )
 {
 	TextureType type;
 
 	nv::Image image;
 
 	if (!image.loadImageFromFile(texFileName.c_str()))
-	{
-		ASSERT(false);
-	}
+		return nullptr;
 
 	int32_t numMipmaps = image.getMipLevels();
 	int32_t imageWidth = image.getWidth();
@@ -439,7 +727,53 @@ shared_ptr<Texture> RenderFactory::CreateTextureFromFile( const std::string& tex
 		}
 	}
 
-	return std::make_shared<Texture2D>(format, imageWidth, imageHeight, numMipmaps,  1, 0, 0, &imageData[0]);
+	// box filtered mip chain of single level image, for 8 bit and float components
+	const uint32_t texelSize = PixelFormatUtils::GetNumElemBytes(format);
+	const uint32_t numComponents = PixelFormatUtils::GetComponentCount(format);
+	const PixelComponentType componentType = PixelFormatUtils::GetComponentType(format);
+
+	const bool byteComponents = (componentType == PCT_Byte && texelSize == numComponents);
+	const bool floatComponents = (componentType == PCT_Float32 && texelSize == numComponents * sizeof(float));
+
+	std::vector< std::vector<uint8_t> > mipData;
+	if (generateMips && numMipmaps == 1 && !isCubeMap && !isCompressed && (byteComponents || floatComponents))
+	{
+		uint32_t numLevels = 1;
+		while ((imageWidth >> numLevels) > 0 || (imageHeight >> numLevels) > 0)
+			numLevels++;
+
+		// levels are referenced by imageData, so mipData must not reallocate
+		mipData.resize(numLevels - 1);
+
+		uint32_t width = imageWidth, height = imageHeight;
+		for (uint32_t level = 1; level < numLevels; ++level)
+		{
+			const uint32_t mipWidth = (std::max)(1U, width / 2);
+			const uint32_t mipHeight = (std::max)(1U, height / 2);
+
+			mipData[level - 1].resize(mipWidth * mipHeight * texelSize);
+			const void* src = imageData.back().pData;
+			void* dst = &mipData[level - 1][0];
+
+			if (byteComponents)
+				DownsampleLevel((const uint8_t*)src, width, height, (uint8_t*)dst, numComponents);
+			else
+				DownsampleLevel((const float*)src, width, height, (float*)dst, numComponents);
+
+			ElementInitData levelData;
+			levelData.pData = dst;
+			levelData.RowPitch = mipWidth * mipHeight * texelSize;
+			levelData.SlicePitch = 0;
+			imageData.push_back(levelData);
+
+			width = mipWidth;
+			height = mipHeight;
+		}
+
+		numMipmaps = static_cast<int32_t>(imageData.size());
+	}
+
+	return std::make_shared<Texture2D>(format, imageWidth, imageHeight, numMipmaps,  1, 0, accessHint, &imageData[0]);
 
 
 	/*switch(type)
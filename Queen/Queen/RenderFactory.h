@@ -5,6 +5,15 @@
 #include "GraphicCommon.h"
 #include "VertexDeclaration.h"
 #include "PixelFormat.h"
+#include "Query.h"
+#include "Meshlet.h"
+#include "MeshLod.h"
+#include "MeshCache.h"
+#include "AsyncResource.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 class RenderFactory
 {
@@ -24,7 +33,76 @@ public:
 	shared_ptr<GraphicsBuffer> CreateVertexBuffer(ElementInitData* initData);
 	shared_ptr<GraphicsBuffer> CreateIndexBuffer(ElementInitData* initData);
 
-	shared_ptr<Texture> CreateTextureFromFile(const std::string&  file);
+	/**
+	 * Textures loaded from file are read-only, so they are stored tiled by default.
+	 */
+	shared_ptr<Texture> CreateTextureFromFile(const std::string&  file, uint32_t accessHint = EAH_GPU_Read | EAH_Tiled);
+
+	/**
+	 * Decode, build box filtered mips for single level images and create texture on the loader
+	 * thread. Handle returns GetPlaceholderTexture() until it is loaded.
+	 */
+	shared_ptr<AsyncResource<Texture> > CreateTextureFromFileAsync(const std::string& file, uint32_t accessHint = EAH_GPU_Read | EAH_Tiled);
+
+	// 1x1 grey texture bound while textures load
+	const shared_ptr<Texture>& GetPlaceholderTexture();
+
+	/**
+	 * Run load on the loader thread, e.g. to load a model. Loads run one at a time in request
+	 * order and never on job system workers, so a long decode can't stall a frame's tiles.
+	 */
+	template <typename T>
+	shared_ptr<AsyncResource<T> > LoadAsync(const std::function<shared_ptr<T>()>& load, const shared_ptr<T>& placeholder)
+	{
+		shared_ptr<AsyncResource<T> > retVal = std::make_shared<AsyncResource<T> >(placeholder);
+
+		QueueLoad([=]() { retVal->Complete(load()); });
+
+		return retVal;
+	}
+
+	/**
+	 * Vertex and index buffers over file mapping of a cache written by WriteMeshCache, nothing
+	 * is copied. Fails if the cache is missing or older than sourceFile, so caller rebuilds it.
+	 */
+	bool CreateMeshFromCache(const std::string& cacheFile, const std::string& sourceFile, CachedMesh* oMesh);
+
+	shared_ptr<Query> CreateQuery(QueryType type);
+
+	/**
+	 * Split triangle list into clusters in index order, so index buffers optimized for vertex
+	 * locality give compact clusters. Positions are indexed by the triangle list.
+	 */
+	shared_ptr<MeshletBuffer> CreateMeshlets(const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices);
+
+	/**
+	 * Build LOD chain of triangle list, each LOD keeps about reduction of triangles of the
+	 * previous one. Chain ends once simplification stalls on locked borders and seams.
+	 */
+	shared_ptr<MeshLodChain> CreateLodChain(const uint32_t* indices, uint32_t numIndices, const float3* positions, uint32_t numVertices,
+		float reduction = 0.5f);
+
+private:
+	// null if file can't be loaded
+	shared_ptr<Texture> LoadTexture(const std::string& file, uint32_t accessHint, bool generateMips);
+
+	// starts loader thread on first load
+	void QueueLoad(const std::function<void()>& load);
+	void LoaderThread();
+
+private:
+	RenderFactory(const RenderFactory&);
+	RenderFactory& operator= (const RenderFactory&);
+
+private:
+	shared_ptr<Texture> mPlaceholderTexture;
+
+	// pending loads, loader thread finishes them before factory is destroyed
+	std::thread* mLoaderThread;
+	std::deque< std::function<void()> > mLoadQueue;
+	std::mutex mLoadMutex;
+	std::condition_variable mLoadSignal;
+	bool mQuitLoader;
 };
 
 void ExportToPfm(const std::string& filename, uint32_t width, uint32_t height, PixelFormat format, void* data);
@@ -2,6 +2,7 @@
 
 #include <Math.hpp>
 #include <Vector.hpp>
+#include <algorithm>
 
 using namespace RxLib;
 
@@ -59,8 +60,8 @@ public:
 	template<typename Texel>
 	static ColorRGBA Sample(const Texel& texel, int32_t width, int32_t height, float U, uint32_t addressU, float V, uint32_t addressV)
 	{
-		uint32_t texelX = gAddressFuncs[addressU](U, width) * (size - 1);
-		uint32_t texelY = gAddressFuncs[addressV](V, height) * (size - 1);
+		uint32_t texelX = (uint32_t)(gAddressFuncs[addressU](U) * (width - 1));
+		uint32_t texelY = (uint32_t)(gAddressFuncs[addressV](V) * (height - 1));
 
 		return texel(texelX, texelY); 
 	}
@@ -95,8 +96,11 @@ private:
 		value = gAddressFuncs[addressMode](value)* size;
 		
 		low = (int32_t)floor(value);
-		up = low + 1;
 		decimal = value - low;
+
+		// the mapped coord may reach 1.0, keep both texels inside the texture
+		low = (std::min)(low, size - 1);
+		up = (addressMode == TAM_Wrap) ? (low + 1) % size : (std::min)(low + 1, size - 1);
 	}
 };
 
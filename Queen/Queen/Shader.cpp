@@ -66,7 +66,7 @@ PixelShader::~PixelShader()
 }
 
 VertexShaderStage::VertexShaderStage( RenderDevice& device )
-	: RenderStage(device)
+	: RenderStage(device), VSOutputCount(0)
 {
 
 }
@@ -53,8 +53,8 @@ protected:
 	ColorRGBA Sample(uint32_t texUint, uint32_t samplerUnit, float U, float V);
 	ColorRGBA Sample(uint32_t texUint, uint32_t samplerUnit, float U, float V, float W);
 
-	VertexShaderStage* VertexShaderStage();
-	PixelShaderStage* PixelShaderStage();
+	::VertexShaderStage* VertexShaderStage();
+	::PixelShaderStage* PixelShaderStage();
 
 protected:
 	RenderDevice* mDevice;
@@ -79,6 +79,18 @@ public:
 	 * return false if discard current pixel
 	 */
 	virtual bool Execute(const VS_Output* input, PS_Output* output, float* pDepthIO) = 0;
+
+	/**
+	 * Varying registers read by Execute, bit i for ShaderOutputs[i]. Rasterizer only interpolates
+	 * these and multiplies them by w, other input registers are undefined.
+	 */
+	virtual uint32_t GetInputMask() const	{ return ~0U; }
+
+	/**
+	 * Copy of shader and its constants, taken when a draw is issued. Tiles of the draw execute
+	 * the copy, so constants may change for later draws while earlier ones are still shaded.
+	 */
+	virtual shared_ptr<PixelShader> Clone() const = 0;
 };
 
 class VertexShaderStage : public RenderStage
@@ -4,19 +4,49 @@
 
 namespace {
 
-template<uint32_t format>
+#define TextureTileMask (TextureTileSize - 1)
+
+template<uint32_t layout>
+struct TexelAddress
+{
+	static uint8_t* Get(int32_t x, int32_t y, void* pData, uint32_t pitch, uint32_t texelSize);
+};
+
+template<>
+struct TexelAddress<TL_Linear>
+{
+	static uint8_t* Get(int32_t x, int32_t y, void* pData, uint32_t pitch, uint32_t texelSize)
+	{
+		return (uint8_t*)pData + y * pitch + x * texelSize;
+	}
+};
+
+template<>
+struct TexelAddress<TL_Tiled>
+{
+	// pitch is the size of a row of tiles
+	static uint8_t* Get(int32_t x, int32_t y, void* pData, uint32_t pitch, uint32_t texelSize)
+	{
+		const int32_t tileOffset = ((x >> TextureTileSizeShift) << (2 * TextureTileSizeShift)) +
+			((y & TextureTileMask) << TextureTileSizeShift) + (x & TextureTileMask);
+
+		return (uint8_t*)pData + (y >> TextureTileSizeShift) * pitch + tileOffset * texelSize;
+	}
+};
+
+template<uint32_t format, uint32_t layout = TL_Linear>
 struct PixelUpdater
 {
 	static ColorRGBA ReadPixel(int32_t x, int32_t y, void* pData, uint32_t pitch);
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch);
 };
 
-template<>
-struct PixelUpdater<PF_X8R8G8B8>
+template<uint32_t layout>
+struct PixelUpdater<PF_X8R8G8B8, layout>
 {
 	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_X8R8G8B8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 4);
 
 		float inv256 = 1.0f / 255.0f;
 
@@ -28,7 +58,7 @@ struct PixelUpdater<PF_X8R8G8B8>
 
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_X8R8G8B8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 4);
 
 		pColor[0] = uint8_t(pixel.B * 255);
 		pColor[1] = uint8_t(pixel.G * 255);
@@ -37,12 +67,16 @@ struct PixelUpdater<PF_X8R8G8B8>
 	}
 };
 
-template<>
-struct PixelUpdater<PF_B8G8R8>
+// same byte layout as X8R8G8B8, whose reader already keeps the alpha byte
+template<uint32_t layout>
+struct PixelUpdater<PF_A8R8G8B8, layout> : public PixelUpdater<PF_X8R8G8B8, layout> { };
+
+template<uint32_t layout>
+struct PixelUpdater<PF_B8G8R8, layout>
 {
 	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_B8G8R8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 3);
 
 		float inv256 = 1.0f / 255.0f;
 
@@ -54,7 +88,7 @@ struct PixelUpdater<PF_B8G8R8>
 
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_X8R8G8B8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 3);
 
 		pColor[0] = uint8_t(pixel.R * 255);
 		pColor[1] = uint8_t(pixel.G * 255);
@@ -62,12 +96,12 @@ struct PixelUpdater<PF_B8G8R8>
 	}
 };
 
-template<>
-struct PixelUpdater<PF_R8G8B8>
+template<uint32_t layout>
+struct PixelUpdater<PF_R8G8B8, layout>
 {
 	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_B8G8R8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 3);
 
 		float inv256 = 1.0f / 255.0f;
 
@@ -79,7 +113,7 @@ struct PixelUpdater<PF_R8G8B8>
 
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		uint8_t* pColor = (uint8_t*)pData + y * pitch + x * PixelFormatUtils::GetNumElemBytes(PF_X8R8G8B8);
+		uint8_t* pColor = TexelAddress<layout>::Get(x, y, pData, pitch, 3);
 
 		pColor[0] = uint8_t(pixel.B * 255);
 		pColor[1] = uint8_t(pixel.G * 255);
@@ -88,12 +122,12 @@ struct PixelUpdater<PF_R8G8B8>
 };
 
 
-template<>
-struct PixelUpdater<PF_A32B32G32R32F>
+template<uint32_t layout>
+struct PixelUpdater<PF_A32B32G32R32F, layout>
 {
 	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		float* pColor = (float*)((uint8_t*)pData + y * pitch + x * 16);
+		float* pColor = (float*)TexelAddress<layout>::Get(x, y, pData, pitch, 16);
 
 		pixel.R = pColor[0];
 		pixel.G = pColor[1];
@@ -103,7 +137,7 @@ struct PixelUpdater<PF_A32B32G32R32F>
 
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		float* pColor = (float*)((uint8_t*)pData + y * pitch + x * 16);
+		float* pColor = (float*)TexelAddress<layout>::Get(x, y, pData, pitch, 16);
 
 		pColor[0] = pixel.R;
 		pColor[1] = pixel.G;
@@ -112,26 +146,82 @@ struct PixelUpdater<PF_A32B32G32R32F>
 	}
 };
 
-template<>
-struct PixelUpdater<PF_Depth32>
+template<uint32_t layout>
+struct PixelUpdater<PF_Depth32, layout>
 {
 	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		float* pDepth = (float*)((uint8_t*)pData + y * pitch + x * 4);
+		float* pDepth = (float*)TexelAddress<layout>::Get(x, y, pData, pitch, 4);
 		pixel.R = pDepth[0];
 	}
 
 	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
 	{
-		float* pDepth = (float*)((uint8_t*)pData + y * pitch + x * 4);
+		float* pDepth = (float*)TexelAddress<layout>::Get(x, y, pData, pitch, 4);
 		pDepth[0] = pixel.R;
 	}
 };
 
+template<uint32_t layout>
+struct PixelUpdater<PF_Depth24Stencil8, layout>
+{
+	static void ReadPixel(int32_t x, int32_t y, ColorRGBA& pixel, void* pData, uint32_t pitch)
+	{
+		const uint32_t texel = *(uint32_t*)TexelAddress<layout>::Get(x, y, pData, pitch, 4);
+		pixel.R = DecodeDepth24(texel);
+		pixel.G = static_cast<float>(texel >> StencilShift);
+	}
+
+	static void WritePixel(int32_t x, int32_t y, const ColorRGBA& pixel, void* pData, uint32_t pitch)
+	{
+		uint32_t* pTexel = (uint32_t*)TexelAddress<layout>::Get(x, y, pData, pitch, 4);
+		*pTexel = EncodeDepth24(pixel.R) | (static_cast<uint32_t>(pixel.G) << StencilShift);
+	}
+};
+
+inline uint32_t RoundUpToTile(uint32_t value)
+{
+	return (value + TextureTileMask) & ~TextureTileMask;
+}
+
+/**
+ * Convert row-major texels to TL_Tiled layout, one tile row (TextureTileSize texels) each copy.
+ */
+void TileTexels(uint8_t* pTiled, const uint8_t* pLinear, uint32_t width, uint32_t height, uint32_t texelSize)
+{
+	const uint32_t tilePitch = RoundUpToTile(width) * TextureTileSize * texelSize;
+
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		for (uint32_t x = 0; x < width; x += TextureTileSize)
+		{
+			const uint32_t count = (std::min)(width - x, (uint32_t)TextureTileSize);
+			uint8_t* pDest = TexelAddress<TL_Tiled>::Get(x, y, pTiled, tilePitch, texelSize);
+			memcpy(pDest, pLinear + (y * width + x) * texelSize, count * texelSize);
+		}
+	}
+}
+
+void UntileTexels(uint8_t* pLinear, const uint8_t* pTiled, uint32_t width, uint32_t height, uint32_t texelSize)
+{
+	const uint32_t tilePitch = RoundUpToTile(width) * TextureTileSize * texelSize;
+
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		for (uint32_t x = 0; x < width; x += TextureTileSize)
+		{
+			const uint32_t count = (std::min)(width - x, (uint32_t)TextureTileSize);
+			const uint8_t* pSrc = TexelAddress<TL_Tiled>::Get(x, y, (void*)pTiled, tilePitch, texelSize);
+			memcpy(pLinear + (y * width + x) * texelSize, pSrc, count * texelSize);
+		}
+	}
+}
+
 }
 
 Texture::Texture( TextureType type, PixelFormat format, uint32_t numMipMaps, uint32_t sampleCount, uint32_t sampleQuality, uint32_t accessHint )
-	: mType(type), mFormat(format), mMipMaps(numMipMaps), mSampleCount(sampleCount), mSampleQuality(sampleQuality), mAccessHint(accessHint)
+	: mType(type), mFormat(format), mMipMaps(numMipMaps), mSampleCount(sampleCount), mSampleQuality(sampleQuality), mAccessHint(accessHint),
+	  mLayout(TL_Linear)
 {
 	ASSERT(sampleCount <= 1);
 }
@@ -143,58 +233,63 @@ Texture::~Texture(void)
 
 uint32_t Texture::GetWidth( uint32_t level ) const
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 uint32_t Texture::GetHeight( uint32_t level ) const
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 uint32_t Texture::GetDepth( uint32_t level ) const
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 
 void Texture::Map1D( uint32_t level, TextureMapAccess tma, uint32_t xOffset, uint32_t width, void*& data )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::Map2D(  uint32_t level, TextureMapAccess tma, uint32_t xOffset, uint32_t yOffset, uint32_t width, uint32_t height, void*& data, uint32_t& rowPitch )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
+}
+
+void Texture::MapStorage2D( uint32_t level, void*& data, uint32_t& pitch )
+{
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::Map3D(  uint32_t level, TextureMapAccess tma, uint32_t xOffset, uint32_t yOffset, uint32_t zOffset, uint32_t width, uint32_t height, uint32_t depth, void*& data, uint32_t& rowPitch, uint32_t& slicePitch )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::MapCube(  CubeMapFace face, uint32_t level, TextureMapAccess tma, uint32_t xOffset, uint32_t yOffset, uint32_t width, uint32_t height, void*& data, uint32_t& rowPitch )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::Unmap1D( uint32_t level )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::Unmap2D( uint32_t level )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::Unmap3D( uint32_t level )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 void Texture::UnmapCube(CubeMapFace face, uint32_t level )
 {
-	throw std::exception("Shouldn't be here");
+	throw std::runtime_error("Shouldn't be here");
 }
 
 //--------------------------------------------------------------------------------------------
@@ -219,6 +314,14 @@ Texture2D::Texture2D(PixelFormat format, uint32_t width, uint32_t height, uint32
 		}
 	} 
 
+	// only read-only textures can be tiled, render targets are always linear
+	const uint32_t writeHint = EAH_CPU_Write | EAH_GPU_Write;
+	if ((accessHint & EAH_Tiled) && !(accessHint & writeHint) && !PixelFormatUtils::IsCompressed(mFormat))
+	{
+		mLayout = TL_Tiled;
+		mStagingData.resize(mMipMaps);
+	}
+
 	uint32_t texelSize = PixelFormatUtils::GetNumElemBytes(mFormat);
 	mTextureData.resize(mMipMaps);
 
@@ -238,6 +341,17 @@ Texture2D::Texture2D(PixelFormat format, uint32_t width, uint32_t height, uint32
 			// not support compressed format
 			ASSERT(false);
 		}
+		else if (mLayout == TL_Tiled)
+		{
+			uint32_t storageSize = RoundUpToTile(levelWidth) * RoundUpToTile(levelHeight) * texelSize;
+			mTextureData[level].resize(storageSize);
+
+			// convert to tiled layout once, at creation time
+			if (initData)
+			{
+				TileTexels(&mTextureData[level][0], (const uint8_t*)initData[level].pData, levelWidth, levelHeight, texelSize);
+			}
+		}
 		else
 		{
 			uint32_t imageSize = levelWidth * levelHeight * texelSize;
@@ -279,6 +393,14 @@ void Texture2D::Map2D(uint32_t level, TextureMapAccess tma, uint32_t xOffset, ui
 	rowPitch = mWidths[level] * texelSize; 
 	uint8_t* p = &mTextureData[level][0];
 
+	if (mLayout == TL_Tiled)
+	{
+		// untile into staging copy, so caller always see row-major texels
+		mStagingData[level].resize(mWidths[level] * mHeights[level] * texelSize);
+		p = &mStagingData[level][0];
+		UntileTexels(p, &mTextureData[level][0], mWidths[level], mHeights[level], texelSize);
+	}
+
 	int blockSize = 0;
 	if (PixelFormatUtils::IsCompressed(mFormat))
 	{
@@ -291,9 +413,35 @@ void Texture2D::Map2D(uint32_t level, TextureMapAccess tma, uint32_t xOffset, ui
 	}	
 }
 
+void Texture2D::MapStorage2D( uint32_t level, void*& data, uint32_t& pitch )
+{
+	uint32_t texelSize = PixelFormatUtils::GetNumElemBytes(mFormat);
+
+	data = &mTextureData[level][0];
+
+	if (mLayout == TL_Tiled)
+	{
+		pitch = RoundUpToTile(mWidths[level]) * TextureTileSize * texelSize;
+	}
+	else
+	{
+		pitch = mWidths[level] * texelSize;
+	}
+}
+
 void Texture2D::Unmap2D( uint32_t level )
 {
+	if (mLayout == TL_Tiled && !mStagingData[level].empty())
+	{
+		// write back modified texels
+		if (mTextureMapAccess != TMA_Read_Only)
+		{
+			uint32_t texelSize = PixelFormatUtils::GetNumElemBytes(mFormat);
+			TileTexels(&mTextureData[level][0], &mStagingData[level][0], mWidths[level], mHeights[level], texelSize);
+		}
 
+		std::vector<uint8_t>().swap(mStagingData[level]);
+	}
 }
 
 Texture2D::~Texture2D()
@@ -305,21 +453,41 @@ Texture2D::~Texture2D()
 //----------------------------------------------------------------------------------------
 TextureFetch::ReadPixelFunc TextureFetch::ReadPixelFuncs[PF_Count]; 
 TextureFetch::WritePixelFunc TextureFetch::WritePixelFuncs[PF_Count]; 
+TextureFetch::ReadPixelFunc TextureFetch::TiledReadPixelFuncs[PF_Count]; 
 
 void TextureFetch::Init()
 {
 	ReadPixelFuncs[PF_Depth32] = &PixelUpdater<PF_Depth32>::ReadPixel;
 	WritePixelFuncs[PF_Depth32] = &PixelUpdater<PF_Depth32>::WritePixel;
 
+	ReadPixelFuncs[PF_Depth24Stencil8] = &PixelUpdater<PF_Depth24Stencil8>::ReadPixel;
+	WritePixelFuncs[PF_Depth24Stencil8] = &PixelUpdater<PF_Depth24Stencil8>::WritePixel;
+
 	ReadPixelFuncs[PF_A32B32G32R32F] = &PixelUpdater<PF_A32B32G32R32F>::ReadPixel;
 	WritePixelFuncs[PF_A32B32G32R32F] = &PixelUpdater<PF_A32B32G32R32F>::WritePixel;
 
 	ReadPixelFuncs[PF_X8R8G8B8] = &PixelUpdater<PF_X8R8G8B8>::ReadPixel;
 	WritePixelFuncs[PF_X8R8G8B8] = &PixelUpdater<PF_X8R8G8B8>::WritePixel;
 
+	ReadPixelFuncs[PF_A8R8G8B8] = &PixelUpdater<PF_A8R8G8B8>::ReadPixel;
+	WritePixelFuncs[PF_A8R8G8B8] = &PixelUpdater<PF_A8R8G8B8>::WritePixel;
+
 	ReadPixelFuncs[PF_B8G8R8] = &PixelUpdater<PF_B8G8R8>::ReadPixel;
 	WritePixelFuncs[PF_B8G8R8] = &PixelUpdater<PF_B8G8R8>::WritePixel;
 
 	ReadPixelFuncs[PF_R8G8B8] = &PixelUpdater<PF_R8G8B8>::ReadPixel;
 	WritePixelFuncs[PF_R8G8B8] = &PixelUpdater<PF_R8G8B8>::WritePixel;	
+
+	TiledReadPixelFuncs[PF_Depth32] = &PixelUpdater<PF_Depth32, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_Depth24Stencil8] = &PixelUpdater<PF_Depth24Stencil8, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_A32B32G32R32F] = &PixelUpdater<PF_A32B32G32R32F, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_X8R8G8B8] = &PixelUpdater<PF_X8R8G8B8, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_A8R8G8B8] = &PixelUpdater<PF_A8R8G8B8, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_B8G8R8] = &PixelUpdater<PF_B8G8R8, TL_Tiled>::ReadPixel;
+	TiledReadPixelFuncs[PF_R8G8B8] = &PixelUpdater<PF_R8G8B8, TL_Tiled>::ReadPixel;
+}
+
+const void* TextureFetch::GetTexelAddress( int32_t x, int32_t y, void* pData, uint32_t pitch, uint32_t texelSize, TextureLayout layout )
+{
+	return (layout == TL_Tiled) ? TexelAddress<TL_Tiled>::Get(x, y, pData, pitch, texelSize) : TexelAddress<TL_Linear>::Get(x, y, pData, pitch, texelSize);
 }
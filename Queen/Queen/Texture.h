@@ -8,6 +8,29 @@
 
 using RxLib::ColorRGBA;
 
+// texel tile size of TL_Tiled layout (must be power of two)
+#define TextureTileSize 4
+#define TextureTileSizeShift 2
+
+/**
+ * PF_Depth24Stencil8 texel, 24 bit unorm depth in low bits and stencil in high byte. Pixel
+ * funcs of the format read and write depth as R and stencil as G.
+ */
+#define Depth24Mask 0xFFFFFF
+#define StencilShift 24
+
+inline uint32_t EncodeDepth24(float depth)
+{
+	const float clamped = (depth < 0.0f) ? 0.0f : ((depth > 1.0f) ? 1.0f : depth);
+	// float product rounds near 1, double keeps encode and decode exact inverses
+	return static_cast<uint32_t>(clamped * double(Depth24Mask) + 0.5);
+}
+
+inline float DecodeDepth24(uint32_t texel)
+{
+	return static_cast<float>((texel & Depth24Mask) * (1.0 / Depth24Mask));
+}
+
 class Texture
 {
 public:
@@ -18,6 +41,7 @@ public:
 	uint32_t GetSampleQuality() const		{ return mSampleQuality; }
 	PixelFormat GetTextureFormat() const		{ return mFormat; }
 	TextureType GetTextureType() const          { return mType; }
+	TextureLayout GetTextureLayout() const      { return mLayout; }
 
 	virtual uint32_t GetWidth(uint32_t level) const;
 	virtual uint32_t GetHeight(uint32_t level) const;
@@ -39,6 +63,12 @@ public:
 		uint32_t xOffset, uint32_t yOffset, uint32_t width, uint32_t height,
 		void*& data, uint32_t& rowPitch);
 
+	/**
+	 * Map the internal texel storage as it is, which is tiled for TL_Tiled textures.
+	 * Only used by fetch functions, which know how to address the layout.
+	 */
+	virtual void MapStorage2D(uint32_t level, void*& data, uint32_t& pitch);
+
 	virtual void Unmap1D(uint32_t level);
 	virtual void Unmap2D(uint32_t level);
 	virtual void Unmap3D(uint32_t level);
@@ -52,6 +82,7 @@ protected:
 	uint32_t mAccessHint;
 	PixelFormat mFormat;
 	TextureType mType;
+	TextureLayout mLayout;
 
 	TextureMapAccess mTextureMapAccess;
 };
@@ -71,12 +102,17 @@ public:
 		uint32_t xOffset, uint32_t yOffset, uint32_t width, uint32_t height,
 		void*& data, uint32_t& rowPitch);
 
+	virtual void MapStorage2D(uint32_t level, void*& data, uint32_t& pitch);
+
 	virtual void Unmap2D(uint32_t level);
 
 private:
 	std::vector<uint32_t> mWidths;
 	std::vector<uint32_t> mHeights;
 
+	// untiled copy of tiled texture, used by Map2D
+	std::vector<std::vector<uint8_t> > mStagingData;
+
 };
 
 
@@ -90,9 +126,20 @@ public:
 
 	static void Init();
 
+	static ReadPixelFunc GetReadPixelFunc(PixelFormat fmt, TextureLayout layout)
+	{
+		return (layout == TL_Tiled) ? TiledReadPixelFuncs[fmt] : ReadPixelFuncs[fmt];
+	}
+
 	static ReadPixelFunc ReadPixelFuncs[PF_Count]; 
 	static WritePixelFunc WritePixelFuncs[PF_Count]; 
 
+	// read texel from TL_Tiled storage, pitch is the size of a row of tiles
+	static ReadPixelFunc TiledReadPixelFuncs[PF_Count]; 
+
+	// address of texel in storage of layout
+	static const void* GetTexelAddress(int32_t x, int32_t y, void* pData, uint32_t pitch, uint32_t texelSize, TextureLayout layout);
+
 };
 
 
@@ -53,7 +53,7 @@ uint32_t GetTypeSize( VertexElementFormat etype )
 		return sizeof(bool)*4;
 	}
 
-	throw std::exception("Vertex Format Error");
+	throw std::runtime_error("Vertex Format Error");
 }
 
 uint16_t GetTypeCount( VertexElementFormat etype )
@@ -85,7 +85,7 @@ uint16_t GetTypeCount( VertexElementFormat etype )
 		return 4;
 	}
 
-	throw std::exception("VertexElement::GetTypeCount");
+	throw std::runtime_error("VertexElement::GetTypeCount");
 }
 
 
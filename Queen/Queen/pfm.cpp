@@ -2,6 +2,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(_MSC_VER)
+#include <errno.h>
+
+typedef int errno_t;
+
+static errno_t fopen_s(FILE** f, const char* fn, const char* mode)
+{
+	*f=fopen(fn,mode);
+	return *f ? 0 : errno;
+}
+
+#define fprintf_s fprintf
+#define fread_s(buffer, bufferSize, elementSize, count, f) fread(buffer, elementSize, count, f)
+#endif
+
 int ReadPfm(const char *fn, int &resX, int &resY, float*& data)
 {
 	FILE* f;
@@ -9,7 +24,12 @@ int ReadPfm(const char *fn, int &resX, int &resY, float*& data)
 	if(err!=0) return -1;
 	char indicator[16];
 	float d;
-	if(fscanf_s(f,"%s\n",indicator,16)!=1||fscanf_s(f,"%d %d\n %f\n",&resX,&resY,&d)!=3||resX<=0||resY<=0)
+#if defined(_MSC_VER)
+	bool headerRead=fscanf_s(f,"%s\n",indicator,16)==1&&fscanf_s(f,"%d %d\n %f\n",&resX,&resY,&d)==3;
+#else
+	bool headerRead=fscanf(f,"%15s\n",indicator)==1&&fscanf(f,"%d %d\n %f\n",&resX,&resY,&d)==3;
+#endif
+	if(!headerRead||resX<=0||resY<=0)
 	{
 		fclose(f);
 		return -2;
@@ -69,6 +89,34 @@ int WritePfm(const char *fn, int resX, int resY, int channels, const float* data
 	return 0;
 }
 
+int WritePpm(const char *fn, int resX, int resY, const unsigned char* rgba)
+{
+	FILE* f;
+	errno_t err=fopen_s(&f,fn,"wb");
+	if(err!=0) return -1;
+	fprintf_s(f,"P6\n%d %d\n255\n",resX,resY);
+	unsigned char* row=new unsigned char[resX*3];
+	int written=0;
+	for(int y=0;y<resY;++y)
+	{
+		for(int x=0;x<resX;++x)
+		{
+			row[x*3+0]=rgba[(y*resX+x)*4+0];
+			row[x*3+1]=rgba[(y*resX+x)*4+1];
+			row[x*3+2]=rgba[(y*resX+x)*4+2];
+		}
+		written+=fwrite(row,3,resX,f);
+	}
+	delete[] row;
+	if(written!=resX*resY)
+	{
+		fclose(f);
+		return -3;
+	}
+	fclose(f);
+	return 0;
+}
+
 int WritePfm3D(const char *fn, int resX, int resY, int resZ, int tiles, int channels, const float* data, float* buffer/*=NULL*/)
 {
 	bool allocated=false;
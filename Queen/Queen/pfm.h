@@ -3,6 +3,8 @@
 
 int ReadPfm(const char *fn, int &resX, int &resY, float*& data);
 int WritePfm(const char *fn, int resX, int resY, int channels, const float* data);
+// 8 bit binary ppm from rows of RGBA pixels, alpha is dropped
+int WritePpm(const char *fn, int resX, int resY, const unsigned char* rgba);
 int WritePfm3D(const char *fn, int resX, int resY, int resZ, int tiles, int channels, const float* data, float* buffer=0);
 
 #endif
\ No newline at end of file
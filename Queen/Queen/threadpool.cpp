@@ -1,7 +0,0 @@
-#include "threadpool.h"
-
-boost::threadpool& GlobalThreadPool()
-{
-	static boost::threadpool tp(boost::thread::hardware_concurrency());
-	return tp;
-}
\ No newline at end of file
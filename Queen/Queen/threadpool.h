@@ -1,33 +1,19 @@
 #ifndef threadpool_h__
 #define threadpool_h__
 
-#include <boost/threadpool.hpp>
+#include <JobSystem.h>
 
-using namespace boost::threadpool;
+using RxLib::Job;
+using RxLib::JobSystem;
 
-inline pool& GlobalThreadPool()
+inline JobSystem& GlobalJobSystem()
 {
-	static pool tp(boost::thread::hardware_concurrency()-1);
-	return tp;
+	return JobSystem::Instance();
 }
 
 inline uint32_t GetNumWorkThreads()
 {
-	return boost::thread::hardware_concurrency();
-}
-
-template <typename Func>
-inline void ScheduleAndJoin(pool& tp, Func func)
-{
-	for (size_t i = 0; i < tp.size(); ++i)
-	{
-		tp.schedule(func);
-	}
-	
-	// run on current thread 
-	func();
-
-	tp.wait();
+	return JobSystem::Instance().GetNumWorkers();
 }
 
 #endif // threadpool_h__
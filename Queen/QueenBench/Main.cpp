@@ -0,0 +1,1039 @@
+#include "Prerequisite.h"
+#include "Context.h"
+#include "RenderDevice.h"
+#include "RenderFactory.h"
+#include "FrameBuffer.h"
+#include "GraphicsBuffer.h"
+#include "Texture.h"
+#include "Shader.h"
+#include "Pipeline.h"
+#include "DeferredLighting.h"
+#include "threadpool.h"
+#include "Profiler.h"
+#include "pfm.h"
+
+#include <MathUtil.hpp>
+#include <chrono>
+#include <iomanip>
+
+/**
+ * Headless benchmark, renders a scene description into offscreen screen frame buffers
+ * without window or OpenGL and prints timings of each rasterizer stage.
+ *
+ * QueenBench [-scene file] [-width w] [-height h] [-threads n] [-frames n] [-warmup n]
+ *            [-inflight n] [-o prefix] [-trace file] [-overdraw file] [-occlusion 0|1] [-boundcull 0|1]
+ *            [-meshlets 0|1] [-lod pixels] [-msaa 0|1] [-tileorder cost|row|morton|hilbert|affinity] [-texcache 0|1]
+ *            [-pipeline 0|1] [-deferred lights]
+ *
+ * -o writes every frame to <prefix>NNNN.pfm, frames are copied once shaded and written by jobs.
+ * -trace writes profile markers of measured frames as chrome://tracing JSON.
+ * -overdraw writes pixel shader invocations per pixel of last frame as heat map pfm.
+ * -occlusion draws bounding box of each mesh in an occlusion query after the scene, a mesh
+ *  is predicated on the query of its box issued frames-in-flight frames earlier.
+ * -boundcull 0 disables skipping meshes whose bound is outside the view frustum.
+ * -meshlets 1 draws meshes as clusters with cluster frustum and normal cone culling.
+ * -lod draws the coarsest LOD of each mesh whose error projects to at most pixels, 0 draws
+ *  full detail. LODs apply to indexed draws, not to meshlets.
+ * -msaa 1 renders to a 4x multisampled screen, pixels are shaded once and resolved once per frame.
+ * -tileorder selects the order tiles of a draw are shaded in, see TileOrder.
+ * -texcache 1 counts texel fetches missing a simulated per worker texel cache, run it with
+ *  different tile orders to compare their texture locality.
+ * -pipeline 1 binds scene shaders as Pipeline, tiles are shaded in loops instantiated for
+ *  the bench pixel shader instead of calling it through its vtable.
+ * -deferred draws meshes into a G-buffer sharing color and depth of the screen, then lights
+ *  it with DrawDeferredLighting and the given number of point lights spread over the scene.
+ *  Lights overlap, so tiles touched by more than MaxTileLights are shaded in several passes.
+ *  Not supported with -msaa.
+ */
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+namespace {
+
+class BenchVertexShader : public VertexShader
+{
+public:
+
+	void Bind()
+	{
+		DeclareVarying(InterpolationModifier::Linear, float4, oPosW, 0);
+		DeclareVarying(InterpolationModifier::Linear, float4, oNormal, 1);
+		DeclareVarying(InterpolationModifier::Linear, float2, oTex, 2);
+	}
+
+	void Execute(const VS_Input* input, VS_Output* output)
+	{
+		DefineAttribute(float4, iPos, 0);
+		DefineAttribute(float4, iNormal, 1);
+		DefineAttribute(float2, iTex, 2);
+
+		DefineVaryingOutput(float4, oPosW, 0);
+		DefineVaryingOutput(float4, oNormal, 1);
+		DefineVaryingOutput(float2, oTex, 2);
+
+		oPosW = iPos * World;
+		oNormal = float4(iNormal.X(), iNormal.Y(), iNormal.Z(), 0.0) * World;
+		oTex = iTex;
+
+		output->Position = oPosW * ViewProj;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 3;
+	}
+
+public:
+	float44 World;
+	float44 ViewProj;
+};
+
+class BenchPixelShader : public PixelShader
+{
+public:
+	BenchPixelShader(bool textured) : Textured(textured) {}
+
+	DefineTexture(0, DiffuseTex);
+	DefineSampler(0, LinearSampler);
+
+	bool Execute(const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		DefineVaryingInput(float3, iPosW, 0);
+		DefineVaryingInput(float3, iNormal, 1);
+		DefineVaryingInput(float2, iTex, 2);
+
+		float3 L = Normalize(LightPos - iPosW);
+		float3 N = Normalize(iNormal);
+		float NdotL = (std::max)(Dot(N, L), 0.0f);
+
+		ColorRGBA diffuse = Textured ? Sample(DiffuseTex, LinearSampler, iTex.X(), iTex.Y()) : ColorRGBA::White;
+
+		output->Color[0] = Saturate(diffuse * (0.1f + NdotL));
+		output->Color[0].A = 1.0f;
+
+		return true;
+	}
+
+	uint32_t GetInputMask() const
+	{
+		// texture coordinate is only read by textured meshes
+		return Textured ? 0x7 : 0x3;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 1;
+	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<BenchPixelShader>(*this);
+	}
+
+public:
+	float3 LightPos;
+
+	// constant while frames are in flight, textured and untextured meshes use different shaders
+	const bool Textured;
+};
+
+/**
+ * G-buffer layout of ShadeDeferredTile: albedo, view space normal and position. Color0 is
+ * written black, lighting overwrites it.
+ */
+class GBufferPixelShader : public PixelShader
+{
+public:
+	GBufferPixelShader(bool textured) : Textured(textured) {}
+
+	DefineTexture(0, DiffuseTex);
+	DefineSampler(0, LinearSampler);
+
+	bool Execute(const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		DefineVaryingInput(float3, iPosW, 0);
+		DefineVaryingInput(float3, iNormal, 1);
+		DefineVaryingInput(float2, iTex, 2);
+
+		const float3 posV = Transform(iPosW, View);
+		const float3 normalV = Normalize(TransformNormal(iNormal, View));
+
+		output->Color[0] = ColorRGBA(0.0f, 0.0f, 0.0f, 1.0f);
+		output->Color[1] = Textured ? Sample(DiffuseTex, LinearSampler, iTex.X(), iTex.Y()) : ColorRGBA::White;
+		output->Color[2] = ColorRGBA(normalV.X(), normalV.Y(), normalV.Z(), 1.0f);
+		output->Color[3] = ColorRGBA(posV.X(), posV.Y(), posV.Z(), 1.0f);
+
+		return true;
+	}
+
+	uint32_t GetInputMask() const
+	{
+		return Textured ? 0x7 : 0x3;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 4;
+	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<GBufferPixelShader>(*this);
+	}
+
+public:
+	float44 View;
+
+	const bool Textured;
+};
+
+// occlusion proxies only write depth test results
+class ProxyPixelShader : public PixelShader
+{
+public:
+	bool Execute(const VS_Output* input, PS_Output* output, float* pDepthIO)
+	{
+		output->Color[0] = ColorRGBA::White;
+		return true;
+	}
+
+	uint32_t GetInputMask() const
+	{
+		return 0;
+	}
+
+	uint32_t GetOutputCount() const
+	{
+		return 1;
+	}
+
+	shared_ptr<PixelShader> Clone() const
+	{
+		return std::make_shared<ProxyPixelShader>(*this);
+	}
+};
+
+struct BenchVertex
+{
+	float3 Pos;
+	float3 Normal;
+	float2 Tex;
+};
+
+struct BenchMesh
+{
+	shared_ptr<GraphicsBuffer> VertexBuffer;
+	shared_ptr<GraphicsBuffer> IndexBuffer;
+	uint32_t NumIndices;
+
+	// same triangles as index buffer, clustered
+	shared_ptr<MeshletBuffer> Meshlets;
+
+	// simplified index buffers sharing vertex buffer, LOD drawn last frame
+	shared_ptr<MeshLodChain> Lods;
+	uint32_t CurrentLod;
+
+	float44 World;
+	shared_ptr<Texture> DiffuseTexture;
+	CullMode PolygonCullMode;
+
+	// object space bound tested against frustum, world space bound of occlusion proxy
+	BoundingBoxf Bound;
+	BoundingBoxf WorldBound;
+
+	// world space bounding box drawn in occlusion queries, one query per frame in flight
+	shared_ptr<GraphicsBuffer> ProxyVertexBuffer;
+	shared_ptr<Query> OcclusionQueries[MaxFramesInFlight];
+};
+
+struct CameraKey
+{
+	float3 Eye;
+	float3 Target;
+};
+
+struct BenchScene
+{
+	std::vector<BenchMesh> Meshes;
+	shared_ptr<GraphicsBuffer> ProxyIndexBuffer;
+	std::vector<CameraKey> CameraPath;
+	float FovY;
+};
+
+struct BenchOptions
+{
+	BenchOptions()
+		: SceneFile("../../Media/BenchScene.txt"), Width(1280), Height(720), NumThreads(0),
+		  NumFrames(100), NumWarmupFrames(5), FramesInFlight(2), OcclusionCulling(false), BoundCulling(true), Meshlets(false), LodPixels(0), Msaa(false),
+		  TileOrdering(TO_Cost), TexelCache(false), StaticPipeline(false), NumLights(0) {}
+
+	std::string SceneFile;
+	uint32_t Width, Height;
+	uint32_t NumThreads;	// 0 uses hardware concurrency
+	uint32_t NumFrames, NumWarmupFrames;
+	uint32_t FramesInFlight;
+	std::string OutputPrefix;
+	std::string TraceFile;
+	std::string OverdrawFile;
+	bool OcclusionCulling;
+	bool BoundCulling;
+	bool Meshlets;
+	float LodPixels;
+	bool Msaa;
+	TileOrder TileOrdering;
+	bool TexelCache;
+	bool StaticPipeline;
+	uint32_t NumLights;		// deferred lighting if not 0
+};
+
+// tile order named on command line, false if name is unknown
+bool ParseTileOrder(const std::string& name, TileOrder* oOrder)
+{
+	static const char* names[] = { "cost", "row", "morton", "hilbert", "affinity" };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+	{
+		if (name == names[i])
+		{
+			*oOrder = static_cast<TileOrder>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * .md layout written by MeshExporter: index count, vertex count, has tangent flag, indices,
+ * then positions, normals, texcoords and tangents each stored as one array.
+ */
+bool LoadMesh(RenderFactory& factory, const std::string& filename, BenchMesh* oMesh)
+{
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file)
+		return false;
+
+	int32_t numIndices, numVertices, hasTangent;
+	file.read((char*)&numIndices, sizeof(int32_t));
+	file.read((char*)&numVertices, sizeof(int32_t));
+	file.read((char*)&hasTangent, sizeof(int32_t));
+
+	if (!file || numIndices <= 0 || numVertices <= 0)
+		return false;
+
+	std::vector<uint32_t> indices(numIndices);
+	std::vector<float3> positions(numVertices), normals(numVertices);
+	std::vector<float2> texcoords(numVertices);
+
+	file.read((char*)&indices[0], sizeof(uint32_t) * numIndices);
+	file.read((char*)&positions[0], sizeof(float3) * numVertices);
+	file.read((char*)&normals[0], sizeof(float3) * numVertices);
+	file.read((char*)&texcoords[0], sizeof(float2) * numVertices);
+
+	if (!file)
+		return false;
+
+	std::vector<BenchVertex> vertices(numVertices);
+	for (int32_t i = 0; i < numVertices; ++i)
+	{
+		vertices[i].Pos = positions[i];
+		vertices[i].Normal = normals[i];
+		vertices[i].Tex = texcoords[i];
+
+		oMesh->Bound.Merge(positions[i]);
+	}
+
+	ElementInitData initData;
+	initData.pData = &vertices[0];
+	initData.RowPitch = static_cast<uint32_t>(sizeof(BenchVertex) * vertices.size());
+	oMesh->VertexBuffer = factory.CreateVertexBuffer(&initData);
+
+	initData.pData = &indices[0];
+	initData.RowPitch = static_cast<uint32_t>(sizeof(uint32_t) * indices.size());
+	oMesh->IndexBuffer = factory.CreateIndexBuffer(&initData);
+
+	oMesh->NumIndices = static_cast<uint32_t>(numIndices);
+	oMesh->Meshlets = factory.CreateMeshlets(&indices[0], numIndices, &positions[0], numVertices);
+	oMesh->Lods = factory.CreateLodChain(&indices[0], numIndices, &positions[0], numVertices);
+	oMesh->CurrentLod = 0;
+
+	return true;
+}
+
+// world space bound of mesh and its bounding box vertices
+void CreateOcclusionProxy(RenderFactory& factory, BenchMesh* oMesh)
+{
+	oMesh->WorldBound = Transform(oMesh->Bound, oMesh->World);
+
+	const float3& boundMin = oMesh->WorldBound.Min;
+	const float3& boundMax = oMesh->WorldBound.Max;
+
+	// corner i takes max x if bit 0 is set, max y for bit 1, max z for bit 2
+	BenchVertex vertices[8];
+	for (int32_t i = 0; i < 8; ++i)
+	{
+		vertices[i].Pos = float3((i & 1) ? boundMax.X() : boundMin.X(), (i & 2) ? boundMax.Y() : boundMin.Y(),
+			(i & 4) ? boundMax.Z() : boundMin.Z());
+		vertices[i].Normal = float3(0, 0, 0);
+		vertices[i].Tex = float2(0, 0);
+	}
+
+	ElementInitData initData;
+	initData.pData = vertices;
+	initData.RowPitch = sizeof(vertices);
+	oMesh->ProxyVertexBuffer = factory.CreateVertexBuffer(&initData);
+
+	for (uint32_t i = 0; i < MaxFramesInFlight; ++i)
+		oMesh->OcclusionQueries[i] = factory.CreateQuery(QT_Occlusion);
+}
+
+bool LoadScene(RenderFactory& factory, const std::string& filename, BenchScene* oScene)
+{
+	std::ifstream file(filename.c_str());
+	if (!file)
+	{
+		std::cerr << "Can't open scene " << filename << std::endl;
+		return false;
+	}
+
+	// texture and cull mode apply to following meshes
+	int32_t texture = -1;
+	CullMode cullMode = CM_Back;
+
+	// textures decode on the loader thread while meshes load, meshes get them once all are loaded
+	std::vector< std::pair<shared_ptr<AsyncResource<Texture> >, std::string> > textures;
+	std::vector<int32_t> meshTextures;
+
+	oScene->FovY = 60.0f;
+
+	std::string line;
+	for (uint32_t lineNumber = 1; std::getline(file, line); ++lineNumber)
+	{
+		std::istringstream ss(line);
+
+		std::string command;
+		if (!(ss >> command) || command[0] == '#')
+			continue;
+
+		bool valid = true;
+		if (command == "mesh")
+		{
+			std::string meshFile;
+			float scale;
+			float3 trans;
+			valid = !!(ss >> meshFile >> scale >> trans.X() >> trans.Y() >> trans.Z());
+
+			BenchMesh mesh;
+			if (valid && !LoadMesh(factory, meshFile, &mesh))
+			{
+				std::cerr << "Can't load mesh " << meshFile << std::endl;
+				return false;
+			}
+
+			const float44 scaling = CreateScaling(scale, scale, scale);
+			float44 translation = CreateTranslation(trans);
+			mesh.World = scaling * translation;
+			mesh.PolygonCullMode = cullMode;
+
+			if (valid)
+				CreateOcclusionProxy(factory, &mesh);
+
+			oScene->Meshes.push_back(mesh);
+			meshTextures.push_back(texture);
+		}
+		else if (command == "texture")
+		{
+			std::string textureFile;
+			valid = !!(ss >> textureFile);
+
+			if (valid && textureFile == "none")
+			{
+				texture = -1;
+			}
+			else if (valid)
+			{
+				texture = static_cast<int32_t>(textures.size());
+				textures.push_back(std::make_pair(factory.CreateTextureFromFileAsync(textureFile), textureFile));
+			}
+		}
+		else if (command == "cull")
+		{
+			std::string mode;
+			valid = !!(ss >> mode);
+
+			if (mode == "none")			cullMode = CM_None;
+			else if (mode == "front")	cullMode = CM_Front;
+			else if (mode == "back")	cullMode = CM_Back;
+			else valid = false;
+		}
+		else if (command == "fov")
+		{
+			valid = !!(ss >> oScene->FovY);
+		}
+		else if (command == "camera")
+		{
+			CameraKey key;
+			valid = !!(ss >> key.Eye.X() >> key.Eye.Y() >> key.Eye.Z() >> key.Target.X() >> key.Target.Y() >> key.Target.Z());
+			oScene->CameraPath.push_back(key);
+		}
+		else
+		{
+			valid = false;
+		}
+
+		if (!valid)
+		{
+			std::cerr << filename << "(" << lineNumber << "): invalid line: " << line << std::endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		textures[i].first->Wait();
+		if (textures[i].first->GetState() == AsyncResource<Texture>::AS_Failed)
+		{
+			std::cerr << "Can't load texture " << textures[i].second << std::endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < oScene->Meshes.size(); ++i)
+	{
+		if (meshTextures[i] >= 0)
+			oScene->Meshes[i].DiffuseTexture = textures[meshTextures[i]].first->Get();
+	}
+
+	// box faces of proxies, drawn without culling so winding doesn't matter
+	static const uint32_t proxyIndices[36] =
+	{
+		0, 2, 1, 1, 2, 3,	4, 5, 6, 5, 7, 6,
+		0, 1, 4, 1, 5, 4,	2, 6, 3, 3, 6, 7,
+		0, 4, 2, 2, 4, 6,	1, 3, 5, 3, 7, 5
+	};
+
+	ElementInitData initData;
+	initData.pData = proxyIndices;
+	initData.RowPitch = sizeof(proxyIndices);
+	oScene->ProxyIndexBuffer = factory.CreateIndexBuffer(&initData);
+
+	if (oScene->CameraPath.empty())
+	{
+		std::cerr << filename << ": no camera key" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// camera of frame, frames are spread evenly along path keys
+CameraKey EvaluateCameraPath(const std::vector<CameraKey>& path, uint32_t frame, uint32_t numFrames)
+{
+	if (path.size() == 1 || numFrames <= 1)
+		return path.front();
+
+	const float t = float(frame) / float(numFrames - 1) * float(path.size() - 1);
+	const uint32_t key = (std::min)(static_cast<uint32_t>(t), static_cast<uint32_t>(path.size() - 2));
+	const float s = t - float(key);
+
+	CameraKey camera;
+	camera.Eye = path[key].Eye + (path[key+1].Eye - path[key].Eye) * s;
+	camera.Target = path[key].Target + (path[key+1].Target - path[key].Target) * s;
+	return camera;
+}
+
+bool ParseOptions(int argc, char** argv, BenchOptions* oOptions)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value of " << arg << std::endl;
+			return false;
+		}
+
+		const char* value = argv[++i];
+
+		if (arg == "-scene")			oOptions->SceneFile = value;
+		else if (arg == "-width")		oOptions->Width = atoi(value);
+		else if (arg == "-height")		oOptions->Height = atoi(value);
+		else if (arg == "-threads")		oOptions->NumThreads = atoi(value);
+		else if (arg == "-frames")		oOptions->NumFrames = atoi(value);
+		else if (arg == "-warmup")		oOptions->NumWarmupFrames = atoi(value);
+		else if (arg == "-inflight")	oOptions->FramesInFlight = atoi(value);
+		else if (arg == "-o")			oOptions->OutputPrefix = value;
+		else if (arg == "-trace")		oOptions->TraceFile = value;
+		else if (arg == "-overdraw")	oOptions->OverdrawFile = value;
+		else if (arg == "-occlusion")	oOptions->OcclusionCulling = atoi(value) != 0;
+		else if (arg == "-boundcull")	oOptions->BoundCulling = atoi(value) != 0;
+		else if (arg == "-meshlets")	oOptions->Meshlets = atoi(value) != 0;
+		else if (arg == "-lod")			oOptions->LodPixels = static_cast<float>(atof(value));
+		else if (arg == "-msaa")		oOptions->Msaa = atoi(value) != 0;
+		else if (arg == "-texcache")	oOptions->TexelCache = atoi(value) != 0;
+		else if (arg == "-pipeline")	oOptions->StaticPipeline = atoi(value) != 0;
+		else if (arg == "-deferred")	oOptions->NumLights = atoi(value);
+		else if (arg == "-tileorder")
+		{
+			if (!ParseTileOrder(value, &oOptions->TileOrdering))
+			{
+				std::cerr << "Unknown tile order " << value << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (oOptions->Width == 0 || oOptions->Height == 0 || oOptions->NumFrames == 0 ||
+		oOptions->FramesInFlight < 1 || oOptions->FramesInFlight > MaxFramesInFlight)
+	{
+		std::cerr << "Invalid option value" << std::endl;
+		return false;
+	}
+
+	// tile passes skip multisampled frame buffers
+	if (oOptions->NumLights > 0 && oOptions->Msaa)
+	{
+		std::cerr << "-deferred doesn't support -msaa" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+void PrintStage(const char* name, long long totalTime, uint32_t numFrames)
+{
+	std::cout << "  " << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(3)
+		<< std::setw(10) << totalTime / 1000.0 / numFrames << " ms/frame" << std::endl;
+}
+
+void PrintCounter(const char* name, uint64_t count, uint32_t numFrames)
+{
+	std::cout << "  " << std::left << std::setw(20) << name << std::right << std::setw(12) << count / numFrames << " /frame" << std::endl;
+}
+
+/**
+ * Lights on a golden angle spiral over the scene bound, each reaching across about half of
+ * it, so a tile is touched by most of them. Colors are scaled so their sum stays moderate.
+ */
+std::vector<PointLight> CreateBenchLights(const BenchScene& scene, uint32_t numLights)
+{
+	BoundingBoxf bound;
+	for (const BenchMesh& mesh : scene.Meshes)
+	{
+		bound.Merge(mesh.WorldBound.Min);
+		bound.Merge(mesh.WorldBound.Max);
+	}
+
+	const float3 center = bound.Center();
+	const float3 extent = bound.Max - bound.Min;
+	const float radius = 0.5f * (std::max)(extent.X(), extent.Z());
+
+	std::vector<PointLight> lights(numLights);
+	for (uint32_t i = 0; i < numLights; ++i)
+	{
+		const float r = radius * sqrtf((i + 0.5f) / numLights);
+		const float angle = i * 2.39996323f;
+
+		lights[i].Position = float3(center.X() + r * cosf(angle), bound.Max.Y() + 0.1f * radius, center.Z() + r * sinf(angle));
+		lights[i].Range = radius;
+		lights[i].Color = ColorRGBA(float(i % 3 == 0), float(i % 3 == 1), float(i % 3 == 2), 1.0f) * (6.0f / numLights) +
+			ColorRGBA(1.0f, 1.0f, 1.0f, 0.0f) * (2.0f / numLights);
+	}
+
+	return lights;
+}
+
+// G-buffer sharing color and depth targets of screen frame buffer, so lighting writes the screen
+shared_ptr<FrameBuffer> CreateGBuffer(const FrameBuffer& screen)
+{
+	const uint32_t width = screen.GetWidth();
+	const uint32_t height = screen.GetHeight();
+
+	shared_ptr<FrameBuffer> gbuffer = std::make_shared<FrameBuffer>(width, height);
+	gbuffer->Attach(ATT_Color0, screen.GetRenderTarget(ATT_Color0));
+	for (uint32_t i = 1; i < 4; ++i)
+		gbuffer->Attach(static_cast<Attachment>(ATT_Color0 + i), shared_ptr<Texture2D>(new Texture2D(PF_A32B32G32R32F, width, height, 0, 1, 0, 0, NULL)));
+	gbuffer->Attach(ATT_DepthStencil, screen.GetRenderTarget(ATT_DepthStencil));
+
+	return gbuffer;
+}
+
+// Clear only clears Color0, pixels no mesh covers must have normal w 0 to stay unlit
+void ClearGBufferNormals(FrameBuffer& gbuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	for (uint32_t iY = y; iY < y + height; ++iY)
+	{
+		float* pNormal = reinterpret_cast<float*>(static_cast<uint8_t*>(gbuffer.GetTargetData(ATT_Color2)) + iY * gbuffer.GetTargetPitch(ATT_Color2)) + x * 4;
+		for (uint32_t iX = 0; iX < width; ++iX, pNormal += 4)
+			pNormal[3] = 0.0f;
+	}
+}
+
+bool WriteOverdrawPfm(RenderDevice& device, uint32_t width, uint32_t height, const std::string& filename)
+{
+	shared_ptr<Texture2D> heatMap(new Texture2D(PF_A32B32G32R32F, width, height, 0, 1, 0, 0, NULL));
+	device.ResolveOverdrawMap(heatMap);
+
+	void* pData;
+	uint32_t pitch;
+	heatMap->Map2D(0, TMA_Read_Only, 0, 0, width, height, pData, pitch);
+
+	// pfm rows go bottom up
+	std::vector<float> pfmData(width * height * 3);
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		const float* pColor = (const float*)((const uint8_t*)pData + y * pitch);
+		float* pColorPfm = &pfmData[(height - y - 1) * width * 3];
+		for (uint32_t x = 0; x < width; ++x, pColor += 4, pColorPfm += 3)
+		{
+			pColorPfm[0] = pColor[0];
+			pColorPfm[1] = pColor[1];
+			pColorPfm[2] = pColor[2];
+		}
+	}
+
+	heatMap->Unmap2D(0);
+
+	return WritePfm(filename.c_str(), width, height, 3, &pfmData[0]) == 0;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!ParseOptions(argc, argv, &options))
+		return 1;
+
+	// worker count is fixed when job system is created by render device
+	JobSystem::SetNumWorkers(options.NumThreads);
+
+	Context::Initialize();
+
+	RenderDevice* renderDevice = new RenderDevice;
+	RenderFactory* renderFactory = new RenderFactory;
+
+	Context::GetSingleton().SetRenderDevice(renderDevice);
+	Context::GetSingleton().SetRenderFactory(renderFactory);
+
+	renderDevice->SetFramesInFlight(options.FramesInFlight);
+	renderDevice->ResizeScreen(options.Width, options.Height, options.Msaa ? MultisampleCount : 1);
+	renderDevice->RasterizerState.MultisampleEnable = options.Msaa;
+	renderDevice->SetTileOrder(options.TileOrdering);
+	renderDevice->SetTexelCacheSimulationEnable(options.TexelCache);
+
+	BenchScene scene;
+	if (!LoadScene(*renderFactory, options.SceneFile, &scene))
+	{
+		SAFE_DELETE(renderDevice);
+		SAFE_DELETE(renderFactory);
+		Context::Finalize();
+		return 1;
+	}
+
+	VertexElement ve[3] =
+	{
+		VertexElement(0, 0, VEF_Float3, VEU_Position, 0),
+		VertexElement(0, 12, VEF_Float3, VEU_Normal, 0),
+		VertexElement(0, 24, VEF_Float2, VEU_TextureCoordinate, 0),
+	};
+	shared_ptr<VertexDeclaration> vertexDecl = renderFactory->CreateVertexDeclaration(ve, 3);
+
+	shared_ptr<BenchVertexShader> vertexShader = std::make_shared<BenchVertexShader>();
+	shared_ptr<BenchPixelShader> pixelShaders[2] =
+	{
+		std::make_shared<BenchPixelShader>(false),
+		std::make_shared<BenchPixelShader>(true)
+	};
+	pixelShaders[0]->LightPos = pixelShaders[1]->LightPos = float3(5, 10, -5);
+
+	typedef Pipeline<BenchVertexShader, BenchPixelShader> BenchPipeline;
+	shared_ptr<BenchPipeline> pipelines[2] =
+	{
+		std::make_shared<BenchPipeline>(vertexShader, pixelShaders[0]),
+		std::make_shared<BenchPipeline>(vertexShader, pixelShaders[1])
+	};
+	shared_ptr<ProxyPixelShader> proxyPixelShader = std::make_shared<ProxyPixelShader>();
+
+	// deferred path draws G-buffers with these instead of pixelShaders and pipelines
+	shared_ptr<GBufferPixelShader> gbufferShaders[2] =
+	{
+		std::make_shared<GBufferPixelShader>(false),
+		std::make_shared<GBufferPixelShader>(true)
+	};
+
+	typedef Pipeline<BenchVertexShader, GBufferPixelShader> GBufferPipeline;
+	shared_ptr<GBufferPipeline> gbufferPipelines[2] =
+	{
+		std::make_shared<GBufferPipeline>(vertexShader, gbufferShaders[0]),
+		std::make_shared<GBufferPipeline>(vertexShader, gbufferShaders[1])
+	};
+
+	const bool deferred = (options.NumLights > 0);
+	const std::vector<PointLight> lights = CreateBenchLights(scene, options.NumLights);
+	const ColorRGBA ambient(0.1f, 0.1f, 0.1f, 1.0f);
+
+	// one G-buffer per screen frame buffer, so frames in flight don't share one
+	std::map<const FrameBuffer*, shared_ptr<FrameBuffer> > gbuffers;
+
+	float44 projection = CreatePerspectiveFovLH<float>(ToRadian(scene.FovY),
+		float(options.Width) / float(options.Height), 0.1f, 100.0f);
+
+	renderDevice->SampleStates[0].AddressU = TAM_Wrap;
+	renderDevice->SampleStates[0].AddressV = TAM_Wrap;
+	renderDevice->SampleStates[0].BindStage = ST_Pixel;
+	renderDevice->SampleStates[0].Filter = TF_Min_Mag_Linear_Mip_Point;
+
+	std::cout << "QueenBench: " << options.Width << "x" << options.Height << ", " << GetNumWorkThreads() << " threads, "
+		<< options.FramesInFlight << " frames in flight, " << scene.Meshes.size() << " meshes, "
+		<< options.NumFrames << " frames";
+	if (deferred)
+		std::cout << ", deferred with " << options.NumLights << " lights";
+	std::cout << std::endl;
+
+	const uint32_t totalFrames = options.NumWarmupFrames + options.NumFrames;
+
+	std::vector<long long> frameTimes;
+	long long clearTime = 0, submitTime = 0;
+
+	shared_ptr<Query> statsQuery = renderFactory->CreateQuery(QT_PipelineStatistics);
+
+	if (!options.OverdrawFile.empty())
+		renderDevice->SetOverdrawMapEnable(true);
+
+	high_resolution_clock::time_point benchStart;
+	for (uint32_t frame = 0; frame < totalFrames; ++frame)
+	{
+		// measured frames start with an idle rasterizer
+		if (frame == options.NumWarmupFrames)
+		{
+			renderDevice->Flush();
+			renderDevice->ResetRasterizerStats();
+			Profiler::Reset();
+			renderDevice->BeginQuery(statsQuery);
+			benchStart = high_resolution_clock::now();
+		}
+
+		// overdraw map keeps last frame only, restarting it waits for earlier frames
+		if (!options.OverdrawFile.empty() && frame == totalFrames - 1)
+			renderDevice->ResolveOverdrawMap(nullptr);
+
+		const bool measured = (frame >= options.NumWarmupFrames);
+		const uint32_t pathFrame = measured ? frame - options.NumWarmupFrames : 0;
+		const CameraKey camera = EvaluateCameraPath(scene.CameraPath, pathFrame, options.NumFrames);
+
+		const auto frameStart = high_resolution_clock::now();
+
+		renderDevice->BeginFrame();
+
+		const shared_ptr<FrameBuffer> screenFrameBuffer = renderDevice->GetCurrentFrameBuffer();
+		if (deferred)
+		{
+			shared_ptr<FrameBuffer>& gbuffer = gbuffers[screenFrameBuffer.get()];
+			if (!gbuffer)
+				gbuffer = CreateGBuffer(*screenFrameBuffer);
+
+			renderDevice->BindFrameBuffer(gbuffer);
+		}
+
+		// G-buffer shares color0 and depth with screen, so this clears the screen too
+		renderDevice->GetCurrentFrameBuffer()->Clear(CF_Color | CF_Depth, ColorRGBA(0.2f, 0.2f, 0.2f, 1.0f), 1.0f, 0);
+		if (deferred)
+			renderDevice->DrawTilePass(&ClearGBufferNormals);
+
+		const auto clearEnd = high_resolution_clock::now();
+
+		const float44 view = CreateLookAtMatrixLH(camera.Eye, camera.Target, float3(0, 1, 0));
+		vertexShader->ViewProj = view * projection;
+		gbufferShaders[0]->View = gbufferShaders[1]->View = view;
+		renderDevice->SetVertexShader(vertexShader);
+		renderDevice->SetInputLayout(vertexDecl);
+
+		// query of this slot was issued frames in flight ago, its frame is already shaded
+		const uint32_t querySlot = frame % options.FramesInFlight;
+
+		for (BenchMesh& mesh : scene.Meshes)
+		{
+			if (options.OcclusionCulling)
+			{
+				// bounding box is clipped by near plane when eye is inside it
+				const bool eyeInside = (mesh.WorldBound.Contains(camera.Eye) == CT_Contains);
+				renderDevice->SetPredication(eyeInside ? nullptr : mesh.OcclusionQueries[querySlot]);
+			}
+
+			if (options.BoundCulling)
+				renderDevice->SetDrawBound(mesh.Bound, mesh.World * vertexShader->ViewProj);
+
+			vertexShader->World = mesh.World;
+			renderDevice->RasterizerState.PolygonCullMode = mesh.PolygonCullMode;
+
+			renderDevice->SetVertexStream(0, mesh.VertexBuffer, 0, sizeof(BenchVertex));
+
+			const uint32_t shaderIndex = mesh.DiffuseTexture ? 1 : 0;
+			if (options.StaticPipeline && deferred)
+				renderDevice->SetPipeline(gbufferPipelines[shaderIndex]);
+			else if (options.StaticPipeline)
+				renderDevice->SetPipeline(pipelines[shaderIndex]);
+			else if (deferred)
+				renderDevice->SetPixelShader(gbufferShaders[shaderIndex]);
+			else
+				renderDevice->SetPixelShader(pixelShaders[shaderIndex]);
+			renderDevice->TextureUnits[0] = mesh.DiffuseTexture;
+
+			if (options.Meshlets)
+			{
+				renderDevice->SetIndexBuffer(mesh.IndexBuffer, IBT_Bit32, 0);
+				renderDevice->DrawMeshlets(mesh.Meshlets, mesh.World * vertexShader->ViewProj);
+			}
+			else if (options.LodPixels > 0.0f)
+			{
+				mesh.CurrentLod = renderDevice->SelectLod(*mesh.Lods, mesh.World * vertexShader->ViewProj, mesh.CurrentLod, options.LodPixels);
+
+				const MeshLod& lod = mesh.Lods->Lods[mesh.CurrentLod];
+				renderDevice->SetIndexBuffer(lod.IndexBuffer, IBT_Bit32, 0);
+				renderDevice->DrawIndexed(PT_Triangle_List, lod.NumIndices, 0, 0);
+			}
+			else
+			{
+				renderDevice->SetIndexBuffer(mesh.IndexBuffer, IBT_Bit32, 0);
+				renderDevice->DrawIndexed(PT_Triangle_List, mesh.NumIndices, 0, 0);
+			}
+		}
+
+		if (deferred)
+		{
+			// lights are in view space like the G-buffer
+			std::vector<PointLight> viewLights = lights;
+			for (PointLight& light : viewLights)
+				light.Position = Transform(light.Position, view);
+
+			DrawDeferredLighting(*renderDevice, viewLights, ambient);
+
+			// frame ends on screen frame buffer, BeginFrame only moves on to next one then
+			renderDevice->BindFrameBuffer(screenFrameBuffer);
+		}
+
+		if (options.OcclusionCulling)
+		{
+			// proxies are tested against depth of whole scene, results predicate later frames
+			renderDevice->SetPredication(nullptr);
+			renderDevice->SetDrawBound(BoundingBoxf(), float44::Identity());
+
+			renderDevice->BlendState.RenderTarget[0].ColorWriteMask = 0;
+			renderDevice->DepthStencilState.DepthWriteMask = false;
+			renderDevice->RasterizerState.PolygonCullMode = CM_None;
+			renderDevice->SetPixelShader(proxyPixelShader);
+			renderDevice->TextureUnits[0] = nullptr;
+			renderDevice->SetIndexBuffer(scene.ProxyIndexBuffer, IBT_Bit32, 0);
+			vertexShader->World = float44::Identity();
+
+			for (const BenchMesh& mesh : scene.Meshes)
+			{
+				renderDevice->SetVertexStream(0, mesh.ProxyVertexBuffer, 0, sizeof(BenchVertex));
+
+				renderDevice->BeginQuery(mesh.OcclusionQueries[querySlot]);
+				renderDevice->DrawIndexed(PT_Triangle_List, 36, 0, 0);
+				renderDevice->EndQuery(mesh.OcclusionQueries[querySlot]);
+			}
+
+			renderDevice->BlendState.RenderTarget[0].ColorWriteMask = CWM_All;
+			renderDevice->DepthStencilState.DepthWriteMask = true;
+		}
+
+		renderDevice->EndFrame();
+
+		const auto submitEnd = high_resolution_clock::now();
+
+		if (!options.OutputPrefix.empty() && measured)
+		{
+			std::ostringstream filename;
+			filename << options.OutputPrefix << std::setw(4) << std::setfill('0') << pathFrame << ".pfm";
+			renderDevice->SaveScreenToPfm(filename.str());
+		}
+
+		// no window to present to, acquiring retires the oldest frame
+		renderDevice->AcquirePresentFrame();
+
+		if (measured)
+		{
+			frameTimes.push_back(duration_cast<microseconds>(high_resolution_clock::now() - frameStart).count());
+			clearTime += duration_cast<microseconds>(clearEnd - frameStart).count();
+			submitTime += duration_cast<microseconds>(submitEnd - clearEnd).count();
+		}
+	}
+
+	renderDevice->EndQuery(statsQuery);
+	renderDevice->Flush();
+	const long long benchTime = duration_cast<microseconds>(high_resolution_clock::now() - benchStart).count();
+
+	PipelineStatistics pipelineStats;
+	renderDevice->GetQueryData(statsQuery, &pipelineStats, true);
+
+	const RasterizerStats stats = renderDevice->GetRasterizerStats();
+	const uint32_t numFrames = options.NumFrames;
+
+	std::sort(frameTimes.begin(), frameTimes.end());
+
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "Frames: " << numFrames << " in " << benchTime / 1000.0 << " ms, "
+		<< numFrames * 1000000.0 / benchTime << " fps" << std::endl;
+	std::cout << "Frame time (ms): min " << frameTimes.front() / 1000.0 << ", median " << frameTimes[frameTimes.size() / 2] / 1000.0
+		<< ", max " << frameTimes.back() / 1000.0 << std::endl;
+	std::cout << "Per frame: " << stats.NumDraws / numFrames << " tiled draws, " << stats.NumTiles / numFrames << " tiles, "
+		<< stats.NumPredicatedDraws / double(numFrames) << " draws predicated off, "
+		<< stats.NumCulledDraws / double(numFrames) << " draws frustum culled" << std::endl;
+
+	std::cout << "Issuing thread:" << std::endl;
+	PrintStage("Clear", clearTime, numFrames);
+	PrintStage("Submit", submitTime, numFrames);
+	PrintStage(" Geometry", stats.GeometryTime, numFrames);
+	PrintStage(" Tile queue", stats.TileQueueTime, numFrames);
+
+	std::cout << "Workers:" << std::endl;
+	PrintStage("Shade (sum)", stats.ShadeTime, numFrames);
+	PrintStage("Shade (avg)", stats.ShadeTime / GetNumWorkThreads(), numFrames);
+
+	std::cout << "Pipeline statistics:" << std::endl;
+	PrintCounter("IA vertices", pipelineStats.IAVertices, numFrames);
+	PrintCounter("VS invocations", pipelineStats.VSInvocations, numFrames);
+	PrintCounter("Vertex cache hits", pipelineStats.GetVertexCacheHits(), numFrames);
+	PrintCounter("IA primitives", pipelineStats.IAPrimitives, numFrames);
+	PrintCounter("Culled primitives", pipelineStats.CulledPrimitives, numFrames);
+	PrintCounter("Clipped primitives", pipelineStats.ClippedPrimitives, numFrames);
+	PrintCounter("Rasterized triangles", pipelineStats.CPrimitives, numFrames);
+	PrintCounter("PS invocations", pipelineStats.PSInvocations, numFrames);
+	PrintCounter("PS killed", pipelineStats.PSKilledPixels, numFrames);
+	PrintCounter("Depth killed", pipelineStats.DepthKilledPixels, numFrames);
+	PrintCounter("Stencil killed", pipelineStats.StencilKilledPixels, numFrames);
+
+	if (options.TexelCache)
+	{
+		PrintCounter("Texel fetches", pipelineStats.TexelFetches, numFrames);
+		PrintCounter("Texel cache misses", pipelineStats.TexelCacheMisses, numFrames);
+		std::cout << "  Texel cache miss rate " << std::setprecision(2)
+			<< 100.0 * pipelineStats.TexelCacheMisses / (std::max)(pipelineStats.TexelFetches, uint64_t(1)) << "%" << std::endl;
+	}
+
+	if (!options.OverdrawFile.empty() && !WriteOverdrawPfm(*renderDevice, options.Width, options.Height, options.OverdrawFile))
+		std::cerr << "Can't write overdraw map " << options.OverdrawFile << std::endl;
+
+#if QUEEN_PROFILE
+	std::cout << std::endl;
+	Profiler::PrintSummary(std::cout);
+
+	if (!options.TraceFile.empty() && !Profiler::ExportChromeTrace(options.TraceFile))
+		std::cerr << "Can't write trace " << options.TraceFile << std::endl;
+#endif
+
+	SAFE_DELETE(renderDevice);
+	SAFE_DELETE(renderFactory);
+
+	Context::Finalize();
+
+	return 0;
+}
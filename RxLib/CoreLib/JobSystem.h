@@ -0,0 +1,453 @@
+#ifndef JobSystem_h__
+#define JobSystem_h__
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+	#define RX_THREAD_LOCAL __declspec(thread)
+#else
+	#define RX_THREAD_LOCAL __thread
+#endif
+
+namespace RxLib {
+
+/**
+ * A unit of work. A job is finished when its function and all its children have run,
+ * UnfinishedJobs counts itself plus unfinished children.
+ */
+class Job
+{
+	friend class JobSystem;
+
+public:
+	Job() : Parent(nullptr), UnfinishedJobs(0) {}
+
+	bool IsFinished() const { return UnfinishedJobs.load() <= 0; }
+
+private:
+	Job(const Job&);
+	Job& operator=(const Job&);
+
+private:
+	std::function<void()> Function;
+	Job* Parent;
+	std::atomic<int32_t> UnfinishedJobs;
+};
+
+/**
+ * Chase-Lev work stealing deque with fixed capacity. Owner thread pushes and pops
+ * at bottom, other threads steal from top.
+ */
+class WorkStealingQueue
+{
+public:
+	enum { Capacity = 4096, Mask = Capacity - 1 };
+
+public:
+	WorkStealingQueue() : mTop(0), mBottom(0)
+	{
+		for (int32_t i = 0; i < Capacity; ++i)
+			mJobs[i].store(nullptr, std::memory_order_relaxed);
+	}
+
+	// owner only, return false if queue is full
+	bool Push(Job* job)
+	{
+		const int64_t b = mBottom.load(std::memory_order_relaxed);
+		const int64_t t = mTop.load(std::memory_order_acquire);
+		if (b - t >= Capacity)
+			return false;
+
+		mJobs[b & Mask].store(job, std::memory_order_relaxed);
+		mBottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	// owner only
+	Job* Pop()
+	{
+		const int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+		mBottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = mTop.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// empty
+			mBottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		Job* job = mJobs[b & Mask].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// last job, race against thieves
+			if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				job = nullptr;
+			mBottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		return job;
+	}
+
+	// any thread
+	Job* Steal()
+	{
+		int64_t t = mTop.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const int64_t b = mBottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return nullptr;
+
+		Job* job = mJobs[t & Mask].load(std::memory_order_relaxed);
+		if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+
+		return job;
+	}
+
+private:
+	std::atomic<int64_t> mTop;
+	char mPad[64];	// keep top and bottom on different cache lines
+	std::atomic<int64_t> mBottom;
+	std::atomic<Job*> mJobs[Capacity];
+};
+
+/**
+ * Work stealing job system. The thread which first calls Instance() becomes worker 0,
+ * hardware_concurrency()-1 background workers are created unless SetNumWorkers was called
+ * before. Waiting threads help executing jobs, idle workers spin for a while and then sleep.
+ */
+class JobSystem
+{
+public:
+	/**
+	 * Jobs allocated per worker before its ring wraps. A job allocated on a wrapped ring waits
+	 * for the job it replaces to finish, so one thread must not keep more jobs of one
+	 * unfinished root alive than this, the root would never finish.
+	 */
+	enum { MaxJobsPerWorker = 4096 };
+
+	// chunks of one ParallelFor, leaves the rest of the ring to jobs allocated around it
+	enum { MaxParallelForChunks = MaxJobsPerWorker / 4 };
+
+	// idle rounds before worker yields and sleeps
+	enum { SpinCount = 1024, YieldCount = 64 };
+
+public:
+	static JobSystem& Instance()
+	{
+		static JobSystem jobSystem;
+		return jobSystem;
+	}
+
+	// include calling thread, only takes effect before first Instance() call, 0 uses hardware concurrency
+	static void SetNumWorkers(uint32_t numWorkers) { RequestedWorkers() = numWorkers; }
+
+	// include calling thread
+	uint32_t GetNumWorkers() const { return static_cast<uint32_t>(mWorkers.size()); }
+
+	// index of current worker thread, [0, GetNumWorkers())
+	static uint32_t GetWorkerIndex() { return WorkerIndex(); }
+
+	Job* CreateJob(const std::function<void()>& func = std::function<void()>())
+	{
+		Job* job = AllocateJob();
+		job->Function = func;
+		job->Parent = nullptr;
+		job->UnfinishedJobs.store(1);
+		return job;
+	}
+
+	Job* CreateChildJob(Job* parent, const std::function<void()>& func)
+	{
+		parent->UnfinishedJobs.fetch_add(1);
+
+		Job* job = AllocateJob();
+		job->Function = func;
+		job->Parent = parent;
+		job->UnfinishedJobs.store(1);
+		return job;
+	}
+
+	void Run(Job* job)
+	{
+		if (!mWorkers[WorkerIndex()]->Queue.Push(job))
+		{
+			// queue is full, run it now
+			Execute(job);
+			return;
+		}
+
+		mSignal.fetch_add(1);
+		if (mNumSleeping.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(mSleepMutex);
+			mWakeup.notify_all();
+		}
+	}
+
+	// execute other jobs until job is finished
+	void Wait(const Job* job)
+	{
+		WaitUntil(std::bind(&Job::IsFinished, job));
+	}
+
+	// execute other jobs until done() returns true, for completion signaled outside of a job
+	template <typename Predicate>
+	void WaitUntil(const Predicate& done)
+	{
+		const uint32_t index = WorkerIndex();
+		while (!done())
+		{
+			Job* next = GetJob(index);
+			if (next)
+				Execute(next);
+			else
+				_mm_pause();
+		}
+	}
+
+	/**
+	 * Split [begin, end) into grainSize chunks and run func(start, end) on each chunk in parallel,
+	 * return when all chunks are done. Grain size grows if there would be more than
+	 * MaxParallelForChunks chunks.
+	 */
+	template <typename Function>
+	void ParallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const Function& func)
+	{
+		assert(grainSize > 0);
+
+		if (end <= begin)
+			return;
+
+		const uint32_t count = end - begin;
+		if ((count - 1) / grainSize >= MaxParallelForChunks)
+			grainSize = (count - 1) / MaxParallelForChunks + 1;
+
+		Job* root = CreateJob();
+		for (uint32_t start = begin; start < end; start = (end - start > grainSize) ? start + grainSize : end)
+		{
+			const uint32_t chunkEnd = (end - start > grainSize) ? start + grainSize : end;
+			Run(CreateChildJob(root, std::bind(func, start, chunkEnd)));
+		}
+
+		Run(root);
+		Wait(root);
+	}
+
+private:
+	struct Worker
+	{
+		Worker() : NumAllocated(0), RandomState(0) {}
+
+		WorkStealingQueue Queue;
+
+		// ring of jobs allocated by this worker
+		Job JobPool[MaxJobsPerWorker];
+		uint32_t NumAllocated;
+
+		uint32_t RandomState;
+	};
+
+private:
+	JobSystem() : mQuit(false), mSignal(0), mNumSleeping(0)
+	{
+		uint32_t numWorkers = RequestedWorkers();
+		if (numWorkers == 0)
+			numWorkers = std::thread::hardware_concurrency();
+		if (numWorkers == 0)
+			numWorkers = 1;
+
+		for (uint32_t i = 0; i < numWorkers; ++i)
+		{
+			mWorkers.push_back(new Worker);
+			mWorkers[i]->RandomState = i * 2654435761UL + 1;
+		}
+
+		// calling thread is worker 0
+		WorkerIndexStorage() = 0;
+
+		for (uint32_t i = 1; i < numWorkers; ++i)
+			mThreads.push_back(new std::thread(std::bind(&JobSystem::WorkerThread, this, i)));
+	}
+
+	~JobSystem()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mSleepMutex);
+			mQuit = true;
+			mWakeup.notify_all();
+		}
+
+		for (size_t i = 0; i < mThreads.size(); ++i)
+		{
+			mThreads[i]->join();
+			delete mThreads[i];
+		}
+
+		for (size_t i = 0; i < mWorkers.size(); ++i)
+			delete mWorkers[i];
+	}
+
+	JobSystem(const JobSystem&);
+	JobSystem& operator=(const JobSystem&);
+
+	static uint32_t& RequestedWorkers()
+	{
+		static uint32_t numWorkers = 0;
+		return numWorkers;
+	}
+
+	static uint32_t& WorkerIndexStorage()
+	{
+		static RX_THREAD_LOCAL uint32_t index = UINT32_MAX;
+		return index;
+	}
+
+	static uint32_t WorkerIndex()
+	{
+		const uint32_t index = WorkerIndexStorage();
+		assert(index != UINT32_MAX && "Job system used from a thread which is not a worker");
+		return index;
+	}
+
+	Job* AllocateJob()
+	{
+		const uint32_t index = WorkerIndex();
+		Worker& worker = *mWorkers[index];
+
+		Job* job = &worker.JobPool[(worker.NumAllocated++) & (MaxJobsPerWorker - 1)];
+
+		// ring wrapped onto a job still in flight, help until it is done
+		while (!job->IsFinished())
+		{
+			Job* next = GetJob(index);
+			if (next)
+				Execute(next);
+			else
+				_mm_pause();
+		}
+
+		return job;
+	}
+
+	Job* GetJob(uint32_t index)
+	{
+		Job* job = mWorkers[index]->Queue.Pop();
+		if (job)
+			return job;
+
+		const uint32_t numWorkers = GetNumWorkers();
+		if (numWorkers == 1)
+			return nullptr;
+
+		// steal from other workers, start at a random victim
+		uint32_t& state = mWorkers[index]->RandomState;
+		state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+
+		for (uint32_t i = 0; i < numWorkers; ++i)
+		{
+			const uint32_t victim = (state + i) % numWorkers;
+			if (victim == index)
+				continue;
+
+			job = mWorkers[victim]->Queue.Steal();
+			if (job)
+				return job;
+		}
+
+		return nullptr;
+	}
+
+	void Execute(Job* job)
+	{
+		if (job->Function)
+			job->Function();
+
+		Finish(job);
+	}
+
+	void Finish(Job* job)
+	{
+		// release the function's captured state before job may be reused
+		if (job->UnfinishedJobs.load() == 1)
+			job->Function = nullptr;
+
+		Job* parent = job->Parent;
+		if (job->UnfinishedJobs.fetch_sub(1) == 1 && parent)
+			Finish(parent);
+	}
+
+	void WorkerThread(uint32_t index)
+	{
+		WorkerIndexStorage() = index;
+
+		uint32_t idleRounds = 0;
+		while (!mQuit)
+		{
+			Job* job = GetJob(index);
+			if (job)
+			{
+				Execute(job);
+				idleRounds = 0;
+				continue;
+			}
+
+			++idleRounds;
+			if (idleRounds < SpinCount)
+			{
+				_mm_pause();
+			}
+			else if (idleRounds < SpinCount + YieldCount)
+			{
+				std::this_thread::yield();
+			}
+			else
+			{
+				// check queues again after reading signal, so Run between them is not missed
+				const uint32_t signal = mSignal.load();
+				job = GetJob(index);
+				if (job)
+				{
+					Execute(job);
+					idleRounds = 0;
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock(mSleepMutex);
+				mNumSleeping.fetch_add(1);
+				while (!mQuit && mSignal.load() == signal)
+					mWakeup.wait(lock);
+				mNumSleeping.fetch_sub(1);
+
+				idleRounds = 0;
+			}
+		}
+	}
+
+private:
+	std::vector<Worker*> mWorkers;
+	std::vector<std::thread*> mThreads;
+
+	// sleeping workers wake up when signal changes
+	std::mutex mSleepMutex;
+	std::condition_variable mWakeup;
+	std::atomic<bool> mQuit;
+	std::atomic<uint32_t> mSignal;
+	std::atomic<uint32_t> mNumSleeping;
+};
+
+}
+
+#endif // JobSystem_h__
@@ -171,7 +171,7 @@ public:
 template<typename Real>
 BoundingSphere<Real> Merge(const BoundingSphere<Real>& sphere1, const BoundingSphere<Real>& sphere2 )
 {
-	BoundingSphere sphere;
+	BoundingSphere<Real> sphere;
 	Vector<Real,3> difference = sphere2.Center - sphere1.Center;
 
 	Real length = difference.Length();
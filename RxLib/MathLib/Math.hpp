@@ -2,6 +2,8 @@
 #define Math_h__
 
 #include <cmath>
+#include <cfloat>
+#include <limits>
 #include <memory>
 #include <cassert>
 
@@ -9,14 +11,36 @@
 #include <pmmintrin.h>  // SSE3 including
 #endif
 
+#ifdef _MSC_VER
+
 #define ALIGNED_16  __declspec(align(16))
 #define ALIGNED_4   __declspec(align(4))
 
 #define isnan(f) _isnan(f)
 #define isinf(f) (!_finite((f)))
 
+#define RX_HEADER_CONSTANT
+
+#else
+
+#define ALIGNED_16  __attribute__((aligned(16)))
+#define ALIGNED_4   __attribute__((aligned(4)))
+
+// C99 macro, conflicts with Math<Real>::INFINITY
+#undef INFINITY
+
+// constants below are defined in this header, weak so units including it link together
+#define RX_HEADER_CONSTANT __attribute__((weak))
+
+#endif
+
 namespace RxLib {
 
+#ifndef _MSC_VER
+using std::isnan;
+using std::isinf;
+#endif
+
 enum ContainmentType 
 {
 	CT_Disjoint,
@@ -85,34 +109,34 @@ typedef Math<float> Mathf;
 
 
 //------------------------------------------------------------------------
-template<> const float Math<float>::EPSILON = FLT_EPSILON;
-template<> const float Math<float>::ZERO_TOLERANCE = 1e-06f;
-template<> const float Math<float>::MAX_REAL = FLT_MAX;
-template<> const float Math<float>::INFINITY = std::numeric_limits<float>::infinity();
-template<> const float Math<float>::PI = (float)(4.0*atan(1.0));
-template<> const float Math<float>::TWO_PI = 2.0f*Math<float>::PI;
-template<> const float Math<float>::HALF_PI = 0.5f*Math<float>::PI;
-template<> const float Math<float>::INV_PI = 1.0f/Math<float>::PI;
-template<> const float Math<float>::INV_TWO_PI = 1.0f/Math<float>::TWO_PI;
-template<> const float Math<float>::FOUR_PI = 4.0f*Math<float>::PI;
-template<> const float Math<float>::INV_FOUR_PI = 1.0f/Math<float>::FOUR_PI;
-template<> const float Math<float>::DEG_TO_RAD = Math<float>::PI/180.0f;
-template<> const float Math<float>::RAD_TO_DEG = 180.0f/Math<float>::PI;
-
-
-template<> const double Math<double>::EPSILON = DBL_EPSILON;
-template<> const double Math<double>::ZERO_TOLERANCE = 1e-08;
-template<> const double Math<double>::MAX_REAL = DBL_MAX;
-template<> const double Math<double>::INFINITY = std::numeric_limits<double>::infinity();
-template<> const double Math<double>::PI = 4.0*atan(1.0);
-template<> const double Math<double>::TWO_PI = 2.0*Math<double>::PI;
-template<> const double Math<double>::HALF_PI = 0.5*Math<double>::PI;
-template<> const double Math<double>::INV_PI = 1.0/Math<double>::PI;
-template<> const double Math<double>::INV_TWO_PI = 1.0/Math<double>::TWO_PI;
-template<> const double Math<double>::FOUR_PI = 4.0f*Math<double>::PI;
-template<> const double Math<double>::INV_FOUR_PI = 1.0f/Math<double>::FOUR_PI;
-template<> const double Math<double>::DEG_TO_RAD = Math<double>::PI/180.0;
-template<> const double Math<double>::RAD_TO_DEG = 180.0/Math<double>::PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::EPSILON = FLT_EPSILON;
+template<> RX_HEADER_CONSTANT const float Math<float>::ZERO_TOLERANCE = 1e-06f;
+template<> RX_HEADER_CONSTANT const float Math<float>::MAX_REAL = FLT_MAX;
+template<> RX_HEADER_CONSTANT const float Math<float>::INFINITY = std::numeric_limits<float>::infinity();
+template<> RX_HEADER_CONSTANT const float Math<float>::PI = (float)(4.0*atan(1.0));
+template<> RX_HEADER_CONSTANT const float Math<float>::TWO_PI = 2.0f*Math<float>::PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::HALF_PI = 0.5f*Math<float>::PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::INV_PI = 1.0f/Math<float>::PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::INV_TWO_PI = 1.0f/Math<float>::TWO_PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::FOUR_PI = 4.0f*Math<float>::PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::INV_FOUR_PI = 1.0f/Math<float>::FOUR_PI;
+template<> RX_HEADER_CONSTANT const float Math<float>::DEG_TO_RAD = Math<float>::PI/180.0f;
+template<> RX_HEADER_CONSTANT const float Math<float>::RAD_TO_DEG = 180.0f/Math<float>::PI;
+
+
+template<> RX_HEADER_CONSTANT const double Math<double>::EPSILON = DBL_EPSILON;
+template<> RX_HEADER_CONSTANT const double Math<double>::ZERO_TOLERANCE = 1e-08;
+template<> RX_HEADER_CONSTANT const double Math<double>::MAX_REAL = DBL_MAX;
+template<> RX_HEADER_CONSTANT const double Math<double>::INFINITY = std::numeric_limits<double>::infinity();
+template<> RX_HEADER_CONSTANT const double Math<double>::PI = 4.0*atan(1.0);
+template<> RX_HEADER_CONSTANT const double Math<double>::TWO_PI = 2.0*Math<double>::PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::HALF_PI = 0.5*Math<double>::PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::INV_PI = 1.0/Math<double>::PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::INV_TWO_PI = 1.0/Math<double>::TWO_PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::FOUR_PI = 4.0f*Math<double>::PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::INV_FOUR_PI = 1.0f/Math<double>::FOUR_PI;
+template<> RX_HEADER_CONSTANT const double Math<double>::DEG_TO_RAD = Math<double>::PI/180.0;
+template<> RX_HEADER_CONSTANT const double Math<double>::RAD_TO_DEG = 180.0/Math<double>::PI;
 
 }
 
@@ -525,7 +525,7 @@ void CoordinateSystem( const Vector<Real, 3>& v1, Vector<Real, 3>* v2, Vector<Re
 template<typename Real>
 BoundingBox<Real> FromSphere( const BoundingSphere<Real>& sphere )
 {
-	BoundingBox box;
+	BoundingBox<Real> box;
 	box.Min = Vector<Real, 3>( sphere.Center.X() - sphere.Radius, sphere.Center.Y() - sphere.Radius, sphere.Center.Z() - sphere.Radius );
 	box.Max = Vector<Real, 3>( sphere.Center.X() + sphere.Radius, sphere.Center.Y() + sphere.Radius, sphere.Center.Z() + sphere.Radius );
 	return box;
@@ -2,6 +2,7 @@
 #define _Matrix__H
 
 #include "Vector.hpp"
+#include <cstring>
 
 namespace RxLib {
 
@@ -391,6 +392,16 @@ public:
 		memset(Elements, 0, sizeof(Elements));
 	}
 
+	// return an identity matrix
+	inline static const Matrix4& Identity()
+	{
+		static Matrix4<float> out(1.0f, 0.0f, 0.0f, 0.0f,
+			0.0f, 1.0f, 0.0f, 0.0f,
+			0.0f, 0.0f, 1.0f, 0.0f,
+			0.0f, 0.0f, 0.0f, 1.0f);
+		return out;
+	}
+
 	// member access
 	inline const float* operator() () const							{ return Elements; }
 	inline float* operator() ()										{ return Elements; }
@@ -751,8 +762,9 @@ Real MatrixDeterminant(const Matrix4<Real>& mat)
 template<>
 inline Matrix4<float> operator* (const Matrix4<float>& M1, Matrix4<float>& M2)
 {
+	// sse_mul_ps computes in2 * in1 for row-major matrices, same order as the generic M1 * M2
 	Matrix4<float> result;
-	sse_mul_ps(M1.SSEData, M2.SSEData, result.SSEData);
+	sse_mul_ps(M2.SSEData, M1.SSEData, result.SSEData);
 	return result;
 }
 
@@ -770,7 +782,7 @@ inline Vector<float, 4> operator* (const Matrix4<float>& mat, const Vector<float
 
 // ԷֲSSE
 template<>
-float MatrixDeterminant(const Matrix4<float>& mat)
+inline float MatrixDeterminant(const Matrix4<float>& mat)
 {
 	float result;
 	_mm_store_ss(&result, sse_det_ps(mat.SSEData));
@@ -787,7 +799,7 @@ float MatrixDeterminant(const Matrix4<float>& mat)
 //}
 
 template<>
-Matrix4<float> MatrixInverse(const Matrix4<float>& mat)
+inline Matrix4<float> MatrixInverse(const Matrix4<float>& mat)
 {
 	Matrix4<float> result;
 	sse_inverse_ps(mat.SSEData, result.SSEData);
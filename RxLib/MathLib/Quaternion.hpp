@@ -35,7 +35,7 @@ public:
 		mTuple[3] = Real(0);
 	}
 
-	inline Real operator[] (int i) const { return mTuple[i] }
+	inline Real operator[] (int i) const { return mTuple[i]; }
 	inline Real& operator[] (int i)      { return mTuple[i]; }
 	inline Real W () const               { return mTuple[0]; }
 	inline Real& W ()                    { return mTuple[0]; }
@@ -176,7 +176,7 @@ public:
 
 	inline void Normalize()
 	{
-		Real mag = sqrt(quat[0]*quat[0]+quat[1]*quat[1]+quat[2]*quat[2]+quat[3]*quat[3]);
+		Real mag = sqrt(mTuple[0]*mTuple[0]+mTuple[1]*mTuple[1]+mTuple[2]*mTuple[2]+mTuple[3]*mTuple[3]);
 		Real oneOverMag = Real(1) / mag;	//ʱ0;
 		mTuple[0] *= oneOverMag;
 		mTuple[1] *= oneOverMag;
@@ -2,6 +2,7 @@
 #define _Vector__H
 
 #include "Math.hpp"
+#include <cstring>
 
 namespace RxLib {
 